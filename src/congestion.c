@@ -0,0 +1,279 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "congestion.h"
+#include "metrics.h"
+
+static int enabled = 0;
+static unsigned int bitrate, bitrate_min, bitrate_max;
+static void (*congestion_set_bitrate)(unsigned int bps);
+static unsigned long long last_decrease_ms, last_increase_ms, last_evaluate_ms;
+
+/* Reports are tracked per receiver (ssrc and address) */
+struct congestion_receiver_s
+{
+	unsigned int ssrc;
+	in_addr_t addr;
+	in_port_t port;
+	unsigned long long last_ms;	/* Last report, 0 = unused */
+	int rtt_min;			/* This receivers path minimum, -1 unknown */
+
+	/* Worst since the last evaluation */
+	int fresh;
+	unsigned int lost;
+	int rise_ms;			/* RTT over rtt_min, -1 unknown */
+	int rtt_ms;
+	unsigned int jitter90k;
+
+	/* Latest report */
+	unsigned int latest_lost;
+	int latest_rise_ms;
+};
+static struct congestion_receiver_s receivers[CONGESTION_RECEIVERS_MAX];
+
+static struct {
+	struct metric_s *bitrate;
+	struct metric_s *loss_pct;
+	struct metric_s *rtt_ms;
+	struct metric_s *jitter_us;
+	struct metric_s *decreases;
+	struct metric_s *increases;
+	struct metric_s *receivers;
+} cc_metrics;
+
+static unsigned long long congestion_now_ms()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000ULL) + (ts.tv_nsec / 1000000);
+}
+
+static void congestion_apply(unsigned int bps, char *reason, unsigned int fraction_lost, int rtt_ms,
+	unsigned int jitter90k)
+{
+	if (bps < bitrate_min)
+		bps = bitrate_min;
+	if (bps > bitrate_max)
+		bps = bitrate_max;
+	if (bps == bitrate)
+		return;
+
+	printf("congestion: %s (loss %d.%d%%, rtt %dms, jitter %dus), bitrate %u -> %u\n",
+		reason, (fraction_lost * 100) / 256, ((fraction_lost * 1000) / 256) % 10,
+		rtt_ms, (jitter90k * 100) / 9, bitrate, bps);
+
+	if (bps < bitrate)
+		metrics_add(cc_metrics.decreases, 1);
+	else
+		metrics_add(cc_metrics.increases, 1);
+
+	bitrate = bps;
+	metrics_set(cc_metrics.bitrate, bitrate);
+	congestion_set_bitrate(bitrate);
+}
+
+/* The receiver a report came from, or a slot for it */
+static struct congestion_receiver_s *congestion_receiver(unsigned int reporter, struct sockaddr_in *from,
+	unsigned long long now)
+{
+	struct congestion_receiver_s *oldest = &receivers[0];
+
+	for (int i = 0; i < CONGESTION_RECEIVERS_MAX; i++) {
+		struct congestion_receiver_s *r = &receivers[i];
+		if (r->last_ms && (r->ssrc == reporter) && (r->addr == from->sin_addr.s_addr) &&
+			(r->port == from->sin_port))
+			return r;
+		if (r->last_ms < oldest->last_ms)
+			oldest = r;
+	}
+
+	/* New, or one that went quiet is replaced */
+	memset(oldest, 0, sizeof(*oldest));
+	oldest->ssrc = reporter;
+	oldest->addr = from->sin_addr.s_addr;
+	oldest->port = from->sin_port;
+	oldest->rtt_min = -1;
+	oldest->rise_ms = -1;
+	oldest->latest_rise_ms = -1;
+
+	return oldest;
+}
+
+/* Act on the worst receiver of the interval. Decreases use only reports
+ * received during the interval, probing needs every receiver still
+ * reporting to be clean.
+ */
+static void congestion_evaluate(unsigned long long now)
+{
+	struct congestion_receiver_s *worst = NULL;
+	int clean = 1, active = 0;
+
+	for (int i = 0; i < CONGESTION_RECEIVERS_MAX; i++) {
+		struct congestion_receiver_s *r = &receivers[i];
+		if (!r->last_ms || (now - r->last_ms > CONGESTION_RECEIVER_TIMEOUT_MS))
+			continue;
+		active++;
+
+		if ((r->latest_lost > CONGESTION_LOSS_LOW) || (r->latest_rise_ms > CONGESTION_RTT_RISE_MS))
+			clean = 0;
+
+		if (!r->fresh)
+			continue;
+		if (!worst || (r->lost > worst->lost) ||
+			((r->lost == worst->lost) && (r->rise_ms > worst->rise_ms)))
+			worst = r;
+	}
+	metrics_set(cc_metrics.receivers, active);
+
+	if (worst) {
+		metrics_set(cc_metrics.loss_pct, (worst->lost * 100) / 256);
+		metrics_set(cc_metrics.jitter_us, (worst->jitter90k * 100) / 9);
+		if (worst->rtt_ms >= 0)
+			metrics_set(cc_metrics.rtt_ms, worst->rtt_ms);
+	}
+
+	/* Loss, back off by half the loss rate */
+	if (worst && (worst->lost > CONGESTION_LOSS_HIGH)) {
+		if (now - last_decrease_ms >= CONGESTION_DECREASE_HOLD_MS) {
+			last_decrease_ms = now;
+			congestion_apply(bitrate - ((unsigned long long)bitrate * worst->lost) / 512,
+				"loss", worst->lost, worst->rtt_ms, worst->jitter90k);
+		}
+	} else
+	/* Queues building somewhere on the path, back off before they drop */
+	if (worst && (worst->rise_ms > CONGESTION_RTT_RISE_MS)) {
+		if (now - last_decrease_ms >= CONGESTION_DECREASE_HOLD_MS) {
+			last_decrease_ms = now;
+			congestion_apply(bitrate - ((unsigned long long)bitrate * CONGESTION_RTT_DECREASE_PCT) / 100,
+				"rtt", worst->lost, worst->rtt_ms, worst->jitter90k);
+		}
+	} else
+	/* Clean, probe upwards at most once a second */
+	if (worst && clean &&
+		(now - last_decrease_ms >= CONGESTION_INCREASE_HOLD_MS) &&
+		(now - last_increase_ms >= 1000)) {
+		last_increase_ms = now;
+		congestion_apply(bitrate + ((unsigned long long)bitrate * CONGESTION_INCREASE_PCT) / 100,
+			"probe", worst->lost, worst->rtt_ms, worst->jitter90k);
+	}
+
+	for (int i = 0; i < CONGESTION_RECEIVERS_MAX; i++) {
+		receivers[i].fresh = 0;
+		receivers[i].lost = 0;
+		receivers[i].rise_ms = -1;
+	}
+	last_evaluate_ms = now;
+}
+
+void congestion_report(unsigned int reporter, struct sockaddr_in *from,
+	unsigned int fraction_lost, unsigned int jitter90k, int rtt_ms)
+{
+	if (!enabled)
+		return;
+
+	unsigned long long now = congestion_now_ms();
+	struct congestion_receiver_s *r = congestion_receiver(reporter, from, now);
+
+	/* Each receiver is measured against its own path, a distant receiver
+	 * isn't queueing just because it is further away than the others.
+	 */
+	int rise = -1;
+	if (rtt_ms >= 0) {
+		if ((r->rtt_min < 0) || (rtt_ms < r->rtt_min))
+			r->rtt_min = rtt_ms;
+		rise = rtt_ms - r->rtt_min;
+	}
+
+	r->last_ms = now;
+	r->latest_lost = fraction_lost;
+	r->latest_rise_ms = rise;
+	r->fresh = 1;
+	if (fraction_lost > r->lost)
+		r->lost = fraction_lost;
+	if (rise > r->rise_ms) {
+		r->rise_ms = rise;
+		r->rtt_ms = rtt_ms;
+	}
+	r->jitter90k = jitter90k;
+
+	if (now - last_evaluate_ms >= CONGESTION_INTERVAL_MS)
+		congestion_evaluate(now);
+}
+
+int congestion_enabled()
+{
+	return enabled;
+}
+
+int congestion_init(unsigned int start_bps, unsigned int min_bps, unsigned int max_bps,
+	void (*set_bitrate)(unsigned int bps))
+{
+	if ((min_bps == 0) || (max_bps < min_bps)) {
+		fprintf(stderr, "%s() invalid bitrate range %u - %u\n", __func__, min_bps, max_bps);
+		return -1;
+	}
+
+	bitrate_min = min_bps;
+	bitrate_max = max_bps;
+	bitrate = start_bps;
+	if (bitrate < bitrate_min)
+		bitrate = bitrate_min;
+	if (bitrate > bitrate_max)
+		bitrate = bitrate_max;
+	congestion_set_bitrate = set_bitrate;
+	memset(receivers, 0, sizeof(receivers));
+
+	/* Don't probe before the first reports have had their say */
+	last_decrease_ms = congestion_now_ms();
+	last_increase_ms = last_decrease_ms;
+	last_evaluate_ms = last_decrease_ms;
+
+	cc_metrics.bitrate = metrics_register("cc_bitrate", METRIC_GAUGE);
+	cc_metrics.loss_pct = metrics_register("cc_loss_pct", METRIC_GAUGE);
+	cc_metrics.rtt_ms = metrics_register("cc_rtt_ms", METRIC_GAUGE);
+	cc_metrics.jitter_us = metrics_register("cc_jitter_us", METRIC_GAUGE);
+	cc_metrics.decreases = metrics_register("cc_decreases", METRIC_COUNTER);
+	cc_metrics.increases = metrics_register("cc_increases", METRIC_COUNTER);
+	cc_metrics.receivers = metrics_register("cc_receivers", METRIC_GAUGE);
+	metrics_set(cc_metrics.bitrate, bitrate);
+
+	if (bitrate != start_bps)
+		congestion_set_bitrate(bitrate);
+
+	enabled = 1;
+	printf("Bitrate adaptation %u - %u bps, starting at %u\n", bitrate_min, bitrate_max, bitrate);
+
+	return 0;
+}
+
+void congestion_free()
+{
+	enabled = 0;
+}
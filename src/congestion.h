@@ -0,0 +1,60 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef CONGESTION_H
+#define CONGESTION_H
+
+#include <netinet/in.h>
+
+/* Loss and delay based bitrate adaptation, driven by RTCP receiver reports.
+ * The controller backs off when a receiver reports loss or a growing RTT,
+ * and probes back up slowly once the path has been clean for a while. With
+ * several receivers it follows the worst of them. New targets are handed to
+ * set_bitrate(), which may be called from the RTCP thread.
+ */
+
+#define CONGESTION_LOSS_HIGH		26	/* x / 256, ~10%, back off in proportion */
+#define CONGESTION_LOSS_LOW		5	/* ~2%, clean enough to probe upwards */
+#define CONGESTION_RTT_RISE_MS		50	/* RTT over the path minimum signals queueing */
+#define CONGESTION_DECREASE_HOLD_MS	500	/* Reports still reflect the old rate */
+#define CONGESTION_INCREASE_HOLD_MS	3000	/* Clean time needed after a decrease */
+#define CONGESTION_INCREASE_PCT		8
+#define CONGESTION_RTT_DECREASE_PCT	15
+#define CONGESTION_INTERVAL_MS		1000	/* Reports are gathered, then acted on */
+#define CONGESTION_RECEIVERS_MAX	32
+#define CONGESTION_RECEIVER_TIMEOUT_MS	10000	/* Silent receivers stop holding back probes */
+
+int  congestion_init(unsigned int start_bps, unsigned int min_bps, unsigned int max_bps,
+	void (*set_bitrate)(unsigned int bps));
+void congestion_free();
+int  congestion_enabled();
+
+/* A receiver report from ssrc reporter at address from. fraction_lost in
+ * 1/256ths, jitter in 90KHz units, rtt_ms -1 if unknown.
+ */
+void congestion_report(unsigned int reporter, struct sockaddr_in *from,
+	unsigned int fraction_lost, unsigned int jitter90k, int rtt_ms);
+
+#endif
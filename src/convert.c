@@ -0,0 +1,344 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include "convert.h"
+
+int frame_stats_alloc(struct frame_stats_s *st, unsigned int width, unsigned int height)
+{
+	memset(st, 0, sizeof(*st));
+
+	st->width = width;
+	st->height = height;
+	st->blocks_w = (width + FRAME_STATS_BLOCK - 1) / FRAME_STATS_BLOCK;
+	st->blocks_h = (height + FRAME_STATS_BLOCK - 1) / FRAME_STATS_BLOCK;
+
+	st->prev_luma = calloc(1, width * height);
+	st->block_sad = calloc(st->blocks_w * st->blocks_h, sizeof(unsigned int));
+	if ((!st->prev_luma) || (!st->block_sad)) {
+		frame_stats_free(st);
+		return -1;
+	}
+
+	return 0;
+}
+
+void frame_stats_free(struct frame_stats_s *st)
+{
+	free(st->prev_luma);
+	free(st->block_sad);
+	memset(st, 0, sizeof(*st));
+}
+
+static void stats_begin(struct frame_stats_s *st)
+{
+	memset(st->histogram, 0, sizeof(st->histogram));
+	memset(st->block_sad, 0, st->blocks_w * st->blocks_h * sizeof(unsigned int));
+	st->sad = 0;
+	st->blocks_changed = 0;
+	st->valid = 0;
+}
+
+static void stats_end(struct frame_stats_s *st, unsigned long long luma_sum)
+{
+	st->luma_mean = luma_sum / (st->width * st->height);
+
+	if (st->have_prev) {
+		for (unsigned int i = 0; i < st->blocks_w * st->blocks_h; i++) {
+			st->sad += st->block_sad[i];
+			if (st->block_sad[i] > FRAME_STATS_BLOCK_CHANGED)
+				st->blocks_changed++;
+		}
+	}
+
+	st->have_prev = 1;
+	st->valid = 1;
+}
+
+/* The histogram can't be vectorized, read the luma back from the
+ * source line (still in cache) rather than the destination, which
+ * may be uncached surface memory.
+ */
+static inline void stats_histogram(struct frame_stats_s *st, const unsigned char *p, int step, int count)
+{
+	for (int i = 0; i < count; i++) {
+		st->histogram[*p]++;
+		p += step;
+	}
+}
+
+/* Accumulate one luma sample, then replace the previous frame's sample with it */
+static inline void stats_luma1(struct frame_stats_s *st, unsigned char y, unsigned char *prev,
+	unsigned int *block, unsigned long long *sum)
+{
+	*sum += y;
+	if (st->have_prev)
+		*block += abs((int)y - (int)*prev);
+	*prev = y;
+}
+
+#if defined(__SSE2__)
+static inline __m128i yuy2_luma(__m128i a, __m128i b, __m128i mask)
+{
+	return _mm_packus_epi16(_mm_and_si128(a, mask), _mm_and_si128(b, mask));
+}
+
+static inline __m128i yuy2_chroma(__m128i a, __m128i b)
+{
+	return _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8));
+}
+
+/* 16 luma samples at a time, as above */
+static inline void stats_luma16(struct frame_stats_s *st, __m128i y, unsigned char *prev,
+	unsigned int *block, __m128i *sum)
+{
+	*sum = _mm_add_epi64(*sum, _mm_sad_epu8(y, _mm_setzero_si128()));
+	if (st->have_prev) {
+		__m128i s = _mm_sad_epu8(y, _mm_loadu_si128((__m128i *)prev));
+		*block += _mm_cvtsi128_si32(s) + _mm_cvtsi128_si32(_mm_srli_si128(s, 8));
+	}
+	_mm_storeu_si128((__m128i *)prev, y);
+}
+
+static inline unsigned long long sum_epi64(__m128i v)
+{
+	unsigned long long r[2];
+	_mm_storeu_si128((__m128i *)r, v);
+	return r[0] + r[1];
+}
+#endif
+
+/* Pointers into the analysis state for a given line */
+#define STATS_LINE(st, row, prev, blocks) \
+	if (st) { \
+		prev = (st)->prev_luma + ((row) * (st)->width); \
+		blocks = (st)->block_sad + (((row) / FRAME_STATS_BLOCK) * (st)->blocks_w); \
+	}
+
+void convert_yuy2_to_i420(const unsigned char *src, int src_stride,
+	unsigned char *dst_y, int y_stride,
+	unsigned char *dst_u, int u_stride,
+	unsigned char *dst_v, int v_stride,
+	int width, int height, struct frame_stats_s *st)
+{
+	unsigned long long sum = 0;
+#if defined(__SSE2__)
+	__m128i mask = _mm_set1_epi16(0x00ff);
+	__m128i vsum = _mm_setzero_si128();
+#endif
+
+	if (st)
+		stats_begin(st);
+
+	for (int row = 0; row < height; row += 2) {
+		const unsigned char *s0 = src + (row * src_stride);
+		const unsigned char *s1 = s0 + src_stride;
+		unsigned char *y0 = dst_y + (row * y_stride);
+		unsigned char *y1 = y0 + y_stride;
+		unsigned char *u = dst_u + ((row / 2) * u_stride);
+		unsigned char *v = dst_v + ((row / 2) * v_stride);
+		unsigned char *p0 = NULL, *p1 = NULL;
+		unsigned int *b0 = NULL, *b1 = NULL;
+		int x = 0;
+
+		STATS_LINE(st, row, p0, b0);
+		STATS_LINE(st, row + 1, p1, b1);
+
+#if defined(__SSE2__)
+		for (; x + 16 <= width; x += 16) {
+			__m128i a0 = _mm_loadu_si128((__m128i *)(s0 + (x * 2)));
+			__m128i c0 = _mm_loadu_si128((__m128i *)(s0 + (x * 2) + 16));
+			__m128i a1 = _mm_loadu_si128((__m128i *)(s1 + (x * 2)));
+			__m128i c1 = _mm_loadu_si128((__m128i *)(s1 + (x * 2) + 16));
+			__m128i l0 = yuy2_luma(a0, c0, mask);
+			__m128i l1 = yuy2_luma(a1, c1, mask);
+			__m128i uv = _mm_avg_epu8(yuy2_chroma(a0, c0), yuy2_chroma(a1, c1));
+
+			_mm_storeu_si128((__m128i *)(y0 + x), l0);
+			_mm_storeu_si128((__m128i *)(y1 + x), l1);
+			_mm_storel_epi64((__m128i *)(u + (x / 2)),
+				_mm_packus_epi16(_mm_and_si128(uv, mask), _mm_setzero_si128()));
+			_mm_storel_epi64((__m128i *)(v + (x / 2)),
+				_mm_packus_epi16(_mm_srli_epi16(uv, 8), _mm_setzero_si128()));
+
+			if (st) {
+				stats_luma16(st, l0, p0 + x, &b0[x / FRAME_STATS_BLOCK], &vsum);
+				stats_luma16(st, l1, p1 + x, &b1[x / FRAME_STATS_BLOCK], &vsum);
+			}
+		}
+#endif
+		for (; x < width; x += 2) {
+			const unsigned char *a = s0 + (x * 2);
+			const unsigned char *b = s1 + (x * 2);
+
+			y0[x + 0] = a[0];
+			y0[x + 1] = a[2];
+			y1[x + 0] = b[0];
+			y1[x + 1] = b[2];
+			u[x / 2] = (a[1] + b[1] + 1) >> 1;
+			v[x / 2] = (a[3] + b[3] + 1) >> 1;
+
+			if (st) {
+				unsigned int bi = x / FRAME_STATS_BLOCK;
+				stats_luma1(st, a[0], p0 + x + 0, &b0[bi], &sum);
+				stats_luma1(st, a[2], p0 + x + 1, &b0[bi], &sum);
+				stats_luma1(st, b[0], p1 + x + 0, &b1[bi], &sum);
+				stats_luma1(st, b[2], p1 + x + 1, &b1[bi], &sum);
+			}
+		}
+
+		if (st) {
+			stats_histogram(st, s0, 2, width);
+			stats_histogram(st, s1, 2, width);
+		}
+	}
+
+	if (st) {
+#if defined(__SSE2__)
+		sum += sum_epi64(vsum);
+#endif
+		stats_end(st, sum);
+	}
+}
+
+void convert_yuy2_to_nv12(const unsigned char *src, int src_stride,
+	unsigned char *dst_y, int y_stride,
+	unsigned char *dst_uv, int uv_stride,
+	int width, int height, struct frame_stats_s *st)
+{
+	unsigned long long sum = 0;
+#if defined(__SSE2__)
+	__m128i mask = _mm_set1_epi16(0x00ff);
+	__m128i vsum = _mm_setzero_si128();
+#endif
+
+	if (st)
+		stats_begin(st);
+
+	for (int row = 0; row < height; row += 2) {
+		const unsigned char *s0 = src + (row * src_stride);
+		const unsigned char *s1 = s0 + src_stride;
+		unsigned char *y0 = dst_y + (row * y_stride);
+		unsigned char *y1 = y0 + y_stride;
+		unsigned char *uv = dst_uv + ((row / 2) * uv_stride);
+		unsigned char *p0 = NULL, *p1 = NULL;
+		unsigned int *b0 = NULL, *b1 = NULL;
+		int x = 0;
+
+		STATS_LINE(st, row, p0, b0);
+		STATS_LINE(st, row + 1, p1, b1);
+
+#if defined(__SSE2__)
+		for (; x + 16 <= width; x += 16) {
+			__m128i a0 = _mm_loadu_si128((__m128i *)(s0 + (x * 2)));
+			__m128i c0 = _mm_loadu_si128((__m128i *)(s0 + (x * 2) + 16));
+			__m128i a1 = _mm_loadu_si128((__m128i *)(s1 + (x * 2)));
+			__m128i c1 = _mm_loadu_si128((__m128i *)(s1 + (x * 2) + 16));
+			__m128i l0 = yuy2_luma(a0, c0, mask);
+			__m128i l1 = yuy2_luma(a1, c1, mask);
+
+			_mm_storeu_si128((__m128i *)(y0 + x), l0);
+			_mm_storeu_si128((__m128i *)(y1 + x), l1);
+			_mm_storeu_si128((__m128i *)(uv + x),
+				_mm_avg_epu8(yuy2_chroma(a0, c0), yuy2_chroma(a1, c1)));
+
+			if (st) {
+				stats_luma16(st, l0, p0 + x, &b0[x / FRAME_STATS_BLOCK], &vsum);
+				stats_luma16(st, l1, p1 + x, &b1[x / FRAME_STATS_BLOCK], &vsum);
+			}
+		}
+#endif
+		for (; x < width; x += 2) {
+			const unsigned char *a = s0 + (x * 2);
+			const unsigned char *b = s1 + (x * 2);
+
+			y0[x + 0] = a[0];
+			y0[x + 1] = a[2];
+			y1[x + 0] = b[0];
+			y1[x + 1] = b[2];
+			uv[x + 0] = (a[1] + b[1] + 1) >> 1;
+			uv[x + 1] = (a[3] + b[3] + 1) >> 1;
+
+			if (st) {
+				unsigned int bi = x / FRAME_STATS_BLOCK;
+				stats_luma1(st, a[0], p0 + x + 0, &b0[bi], &sum);
+				stats_luma1(st, a[2], p0 + x + 1, &b0[bi], &sum);
+				stats_luma1(st, b[0], p1 + x + 0, &b1[bi], &sum);
+				stats_luma1(st, b[2], p1 + x + 1, &b1[bi], &sum);
+			}
+		}
+
+		if (st) {
+			stats_histogram(st, s0, 2, width);
+			stats_histogram(st, s1, 2, width);
+		}
+	}
+
+	if (st) {
+#if defined(__SSE2__)
+		sum += sum_epi64(vsum);
+#endif
+		stats_end(st, sum);
+	}
+}
+
+void convert_analyze_luma(const unsigned char *y, int y_stride,
+	int width, int height, struct frame_stats_s *st)
+{
+	unsigned long long sum = 0;
+#if defined(__SSE2__)
+	__m128i vsum = _mm_setzero_si128();
+#endif
+
+	stats_begin(st);
+
+	for (int row = 0; row < height; row++) {
+		const unsigned char *s = y + (row * y_stride);
+		unsigned char *p = NULL;
+		unsigned int *b = NULL;
+		int x = 0;
+
+		STATS_LINE(st, row, p, b);
+
+#if defined(__SSE2__)
+		for (; x + 16 <= width; x += 16)
+			stats_luma16(st, _mm_loadu_si128((__m128i *)(s + x)), p + x, &b[x / FRAME_STATS_BLOCK], &vsum);
+#endif
+		for (; x < width; x++)
+			stats_luma1(st, s[x], p + x, &b[x / FRAME_STATS_BLOCK], &sum);
+
+		stats_histogram(st, s, 1, width);
+	}
+
+#if defined(__SSE2__)
+	sum += sum_epi64(vsum);
+#endif
+	stats_end(st, sum);
+}
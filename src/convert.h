@@ -0,0 +1,78 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef CONVERT_H
+#define CONVERT_H
+
+/* Colorspace conversion kernels used by the software paths of the encoders.
+ * Each kernel can optionally accumulate per-frame statistics while the
+ * pixels are in registers, so analysis costs no extra pass over memory.
+ */
+
+#define FRAME_STATS_BLOCK		16
+/* Blocks whose SAD against the previous frame exceeds this are 'changed' */
+#define FRAME_STATS_BLOCK_CHANGED	(FRAME_STATS_BLOCK * FRAME_STATS_BLOCK * 4)
+
+struct frame_stats_s
+{
+	/* Analysis state, owned by the encoder core */
+	unsigned int width;
+	unsigned int height;
+	unsigned int blocks_w;
+	unsigned int blocks_h;
+	unsigned char *prev_luma;	/* width * height */
+	unsigned int *block_sad;	/* blocks_w * blocks_h */
+	int have_prev;
+
+	/* Results for the most recently converted frame, only meaningful when valid */
+	int valid;
+	unsigned int histogram[256];
+	unsigned int luma_mean;		/* 0-255 */
+	unsigned long long sad;		/* Luma SAD against the previous frame */
+	unsigned int blocks_changed;
+};
+
+int  frame_stats_alloc(struct frame_stats_s *st, unsigned int width, unsigned int height);
+void frame_stats_free(struct frame_stats_s *st);
+
+/* YUY2 to planar, chroma is averaged across each pair of lines.
+ * st may be NULL when no statistics are required.
+ */
+void convert_yuy2_to_i420(const unsigned char *src, int src_stride,
+	unsigned char *dst_y, int y_stride,
+	unsigned char *dst_u, int u_stride,
+	unsigned char *dst_v, int v_stride,
+	int width, int height, struct frame_stats_s *st);
+
+void convert_yuy2_to_nv12(const unsigned char *src, int src_stride,
+	unsigned char *dst_y, int y_stride,
+	unsigned char *dst_uv, int uv_stride,
+	int width, int height, struct frame_stats_s *st);
+
+/* Statistics only, for luma planes we don't convert ourselves. */
+void convert_analyze_luma(const unsigned char *y, int y_stride,
+	int width, int height, struct frame_stats_s *st);
+
+#endif
@@ -37,7 +37,8 @@
         exit(1);                                                        \
     }
 
-VAStatus csc_convert_rgbdata_to_yuv(struct csc_ctx_s *ctx, unsigned char *data, VASurfaceID yuv_surface_output)
+VAStatus csc_convert_rgbdata_to_yuv(struct csc_ctx_s *ctx, unsigned char *data, VASurfaceID yuv_surface_output,
+	struct encoder_params_s *params)
 {
 	VAProcPipelineParameterBuffer *pipeline_param;
 	VAStatus va_status;
@@ -53,6 +54,10 @@ VAStatus csc_convert_rgbdata_to_yuv(struct csc_ctx_s *ctx, unsigned char *data,
 
 		memcpy(pbuffer, data, image.width * 4 * image.height);
 
+		unsigned char *planes[] = { pbuffer };
+		unsigned int strides[] = { image.width * 4 };
+		encoder_frame_add_osd(params, EDF_BGRX, planes, strides);
+
 		va_status = vaUnmapBuffer(ctx->va_dpy, image.buf);
 		CHECK_VASTATUS(va_status, "vaUnmapBuffer");
 		va_status = vaDestroyImage(ctx->va_dpy, image.image_id);
@@ -45,8 +45,11 @@ int csc_alloc(struct csc_ctx_s *ctx,
 
 int csc_free(struct csc_ctx_s *ctx);
 
+/* params is used to etch the OSD into our copy of the frame */
+struct encoder_params_s;
 VAStatus csc_convert_rgbdata_to_yuv(struct csc_ctx_s *ctx,
-	unsigned char *data, VASurfaceID yuv_surface_output);
+	unsigned char *data, VASurfaceID yuv_surface_output,
+	struct encoder_params_s *params);
 
 #endif
 
@@ -0,0 +1,215 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include "deinterlace.h"
+#include "workers.h"
+
+#define MEASURE_PERFORMANCE 0
+
+int deinterlace_alloc(struct deinterlace_ctx_s *ctx, enum deinterlace_mode_e mode, unsigned int size)
+{
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->mode = mode;
+	ctx->size = size;
+
+	ctx->out = malloc(size);
+	if (mode == DEINTERLACE_MOTION_ADAPTIVE) {
+		ctx->prev[0] = malloc(size);
+		ctx->prev[1] = malloc(size);
+		if ((!ctx->prev[0]) || (!ctx->prev[1])) {
+			deinterlace_free(ctx);
+			return -1;
+		}
+	}
+	if (!ctx->out) {
+		deinterlace_free(ctx);
+		return -1;
+	}
+
+	return 0;
+}
+
+void deinterlace_plane(struct deinterlace_ctx_s *ctx, unsigned int offset, unsigned int stride, unsigned int lines)
+{
+	if (ctx->planes == DEINTERLACE_PLANES_MAX)
+		return;
+
+	ctx->offset[ctx->planes] = offset;
+	ctx->stride[ctx->planes] = stride;
+	ctx->lines[ctx->planes] = lines;
+	ctx->planes++;
+}
+
+void deinterlace_free(struct deinterlace_ctx_s *ctx)
+{
+	free(ctx->out);
+	free(ctx->prev[0]);
+	free(ctx->prev[1]);
+	memset(ctx, 0, sizeof(*ctx));
+}
+
+/* Rebuild a missing line as the average of the lines above (c) and below (e) */
+static void bob_line(unsigned char *dst, const unsigned char *c, const unsigned char *e, int len)
+{
+	int x = 0;
+#if defined(__SSE2__)
+	for (; x + 16 <= len; x += 16) {
+		__m128i a = _mm_loadu_si128((__m128i *)(c + x));
+		__m128i b = _mm_loadu_si128((__m128i *)(e + x));
+		_mm_storeu_si128((__m128i *)(dst + x), _mm_avg_epu8(a, b));
+	}
+#endif
+	for (; x < len; x++)
+		dst[x] = (c[x] + e[x] + 1) >> 1;
+}
+
+#if defined(__SSE2__)
+static inline __m128i absdiff_epu8(__m128i a, __m128i b)
+{
+	return _mm_or_si128(_mm_subs_epu8(a, b), _mm_subs_epu8(b, a));
+}
+#endif
+
+/* Rebuild a missing line. The spatial prediction (average of c and e, the
+ * lines above and below in the current frame) is clipped to a range around
+ * the temporal prediction (the same line in the previous and current
+ * frames, p and n). The range is how much the picture changed over time.
+ * Still areas get the full vertical resolution of the woven frame, moving
+ * areas fall back to bob.
+ */
+static void yadif_line(unsigned char *dst,
+	const unsigned char *c, const unsigned char *e, const unsigned char *n,
+	const unsigned char *pc, const unsigned char *pe, const unsigned char *p, int len)
+{
+	int x = 0;
+#if defined(__SSE2__)
+	for (; x + 16 <= len; x += 16) {
+		__m128i vc = _mm_loadu_si128((__m128i *)(c + x));
+		__m128i ve = _mm_loadu_si128((__m128i *)(e + x));
+		__m128i vn = _mm_loadu_si128((__m128i *)(n + x));
+		__m128i vp = _mm_loadu_si128((__m128i *)(p + x));
+		__m128i vpc = _mm_loadu_si128((__m128i *)(pc + x));
+		__m128i vpe = _mm_loadu_si128((__m128i *)(pe + x));
+
+		__m128i d = _mm_avg_epu8(vp, vn);
+		__m128i td0 = _mm_avg_epu8(absdiff_epu8(vp, vn), _mm_setzero_si128());
+		__m128i td1 = _mm_avg_epu8(absdiff_epu8(vpc, vc), absdiff_epu8(vpe, ve));
+		__m128i diff = _mm_max_epu8(td0, td1);
+
+		__m128i spatial = _mm_avg_epu8(vc, ve);
+		spatial = _mm_max_epu8(spatial, _mm_subs_epu8(d, diff));
+		spatial = _mm_min_epu8(spatial, _mm_adds_epu8(d, diff));
+
+		_mm_storeu_si128((__m128i *)(dst + x), spatial);
+	}
+#endif
+	for (; x < len; x++) {
+		int d = (p[x] + n[x] + 1) >> 1;
+		int td0 = (abs(p[x] - n[x]) + 1) >> 1;
+		int td1 = (abs(pc[x] - c[x]) + abs(pe[x] - e[x]) + 1) >> 1;
+		int diff = td0 > td1 ? td0 : td1;
+		int spatial = (c[x] + e[x] + 1) >> 1;
+		int lo = d - diff < 0 ? 0 : d - diff;
+		int hi = d + diff > 255 ? 255 : d + diff;
+
+		if (spatial < lo)
+			spatial = lo;
+		if (spatial > hi)
+			spatial = hi;
+		dst[x] = spatial;
+	}
+}
+
+static void deinterlace_band(void *arg, int band, int bands)
+{
+	struct deinterlace_ctx_s *ctx = arg;
+	int motion = (ctx->mode == DEINTERLACE_MOTION_ADAPTIVE);
+	const unsigned char *prev = motion ? ctx->prev[ctx->prev_idx] : NULL;
+	unsigned char *save = motion ? ctx->prev[ctx->prev_idx ^ 1] : NULL;
+
+	for (unsigned int i = 0; i < ctx->planes; i++) {
+		int stride = ctx->stride[i];
+		int lines = ctx->lines[i];
+		int first, last;
+
+		workers_band(band, bands, lines, 2, &first, &last);
+
+		const unsigned char *cur = ctx->cur + ctx->offset[i];
+		const unsigned char *old = motion ? prev + ctx->offset[i] : NULL;
+		unsigned char *out = ctx->out + ctx->offset[i];
+
+		for (int y = first; y < last; y++) {
+			const unsigned char *c = cur + ((y - 1) * stride);
+			const unsigned char *e = cur + ((y + 1) * stride);
+
+			if ((y & 1) == 0)
+				memcpy(out + (y * stride), cur + (y * stride), stride);
+			else
+			if (y == lines - 1)
+				memcpy(out + (y * stride), c, stride);
+			else
+			if (motion && ctx->have_prev)
+				yadif_line(out + (y * stride), c, e, cur + (y * stride),
+					old + ((y - 1) * stride), old + ((y + 1) * stride), old + (y * stride), stride);
+			else
+				bob_line(out + (y * stride), c, e, stride);
+		}
+
+		/* Keep this band of the input for the next frame */
+		if (motion)
+			memcpy(save + ctx->offset[i] + (first * stride), cur + (first * stride), (last - first) * stride);
+	}
+}
+
+unsigned char *deinterlace_frame(struct deinterlace_ctx_s *ctx, const unsigned char *frame)
+{
+#if MEASURE_PERFORMANCE
+	struct timeval then, now;
+	gettimeofday(&then, 0);
+#endif
+
+	ctx->cur = frame;
+	workers_run(deinterlace_band, ctx);
+
+	if (ctx->mode == DEINTERLACE_MOTION_ADAPTIVE) {
+		ctx->prev_idx ^= 1;
+		ctx->have_prev = 1;
+	}
+
+#if MEASURE_PERFORMANCE
+	gettimeofday(&now, 0);
+	printf("%s() took %ldus\n", __func__,
+		((now.tv_sec - then.tv_sec) * 1000000) + (now.tv_usec - then.tv_usec));
+#endif
+
+	return ctx->out;
+}
@@ -0,0 +1,73 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef DEINTERLACE_H
+#define DEINTERLACE_H
+
+/* CPU deinterlacer, for encoders without a hardware pipeline.
+ * Frames are treated as up to three planes of bytes, so any packed
+ * or planar input works as long as vertically adjacent bytes hold the
+ * same component. The top field is kept, the bottom field is rebuilt.
+ */
+
+enum deinterlace_mode_e {
+	DEINTERLACE_OFF = 0,
+	DEINTERLACE_MOTION_ADAPTIVE,	/* Yadif style, spatial prediction clipped by temporal change */
+	DEINTERLACE_BOB,		/* Line average of the top field */
+};
+
+#define DEINTERLACE_PLANES_MAX 3
+
+struct deinterlace_ctx_s
+{
+	enum deinterlace_mode_e mode;
+
+	unsigned int planes;
+	unsigned int offset[DEINTERLACE_PLANES_MAX];
+	unsigned int stride[DEINTERLACE_PLANES_MAX];
+	unsigned int lines[DEINTERLACE_PLANES_MAX];
+	unsigned int size;
+
+	/* Output frame, handed to the encoder in place of the input */
+	unsigned char *out;
+
+	/* Copies of the previous input, written and read alternately */
+	unsigned char *prev[2];
+	unsigned int prev_idx;
+	int have_prev;
+
+	/* The frame being processed, for the worker bands */
+	const unsigned char *cur;
+};
+
+/* Describe the frame layout with _plane() after alloc. */
+int  deinterlace_alloc(struct deinterlace_ctx_s *ctx, enum deinterlace_mode_e mode, unsigned int size);
+void deinterlace_plane(struct deinterlace_ctx_s *ctx, unsigned int offset, unsigned int stride, unsigned int lines);
+void deinterlace_free(struct deinterlace_ctx_s *ctx);
+
+/* Returns the deinterlaced frame, valid until the next call. */
+unsigned char *deinterlace_frame(struct deinterlace_ctx_s *ctx, const unsigned char *frame);
+
+#endif
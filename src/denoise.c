@@ -0,0 +1,140 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include "denoise.h"
+#include "workers.h"
+
+#define MEASURE_PERFORMANCE 0
+
+int denoise_alloc(struct denoise_ctx_s *ctx, unsigned int size)
+{
+	memset(ctx, 0, sizeof(*ctx));
+
+	ctx->out = malloc(size);
+	if (!ctx->out)
+		return -1;
+
+	return 0;
+}
+
+void denoise_plane(struct denoise_ctx_s *ctx, unsigned int offset, unsigned int stride, unsigned int lines,
+	const unsigned char threshold[4])
+{
+	if (ctx->planes == DENOISE_PLANES_MAX)
+		return;
+
+	ctx->offset[ctx->planes] = offset;
+	ctx->stride[ctx->planes] = stride;
+	ctx->lines[ctx->planes] = lines;
+	memcpy(&ctx->threshold[ctx->planes][0], threshold, 4);
+	ctx->planes++;
+}
+
+void denoise_free(struct denoise_ctx_s *ctx)
+{
+	free(ctx->out);
+	memset(ctx, 0, sizeof(*ctx));
+}
+
+/* out = |cur - out| <= threshold ? avg(cur, out) : cur */
+static void denoise_line(unsigned char *out, const unsigned char *cur, const unsigned char *thr, int len)
+{
+	int x = 0;
+#if defined(__SSE2__)
+	int thr4;
+	memcpy(&thr4, thr, sizeof(thr4));
+	__m128i t = _mm_set1_epi32(thr4);
+	__m128i zero = _mm_setzero_si128();
+
+	for (; x + 16 <= len; x += 16) {
+		__m128i c = _mm_loadu_si128((__m128i *)(cur + x));
+		__m128i p = _mm_loadu_si128((__m128i *)(out + x));
+		__m128i diff = _mm_or_si128(_mm_subs_epu8(c, p), _mm_subs_epu8(p, c));
+		__m128i still = _mm_cmpeq_epi8(_mm_subs_epu8(diff, t), zero);
+		__m128i r = _mm_or_si128(_mm_and_si128(still, _mm_avg_epu8(c, p)), _mm_andnot_si128(still, c));
+
+		_mm_storeu_si128((__m128i *)(out + x), r);
+	}
+#endif
+	for (; x < len; x++) {
+		if (abs(cur[x] - out[x]) <= thr[x & 3])
+			out[x] = (cur[x] + out[x] + 1) >> 1;
+		else
+			out[x] = cur[x];
+	}
+}
+
+static void denoise_band(void *arg, int band, int bands)
+{
+	struct denoise_ctx_s *ctx = arg;
+
+	for (unsigned int i = 0; i < ctx->planes; i++) {
+		int stride = ctx->stride[i];
+		int first, last;
+
+		workers_band(band, bands, ctx->lines[i], 1, &first, &last);
+
+		const unsigned char *cur = ctx->cur + ctx->offset[i] + (first * stride);
+		unsigned char *out = ctx->out + ctx->offset[i] + (first * stride);
+
+		if (!ctx->have_prev) {
+			memcpy(out, cur, (last - first) * stride);
+			continue;
+		}
+
+		for (int y = first; y < last; y++) {
+			denoise_line(out, cur, &ctx->threshold[i][0], stride);
+			out += stride;
+			cur += stride;
+		}
+	}
+}
+
+unsigned char *denoise_frame(struct denoise_ctx_s *ctx, const unsigned char *frame)
+{
+#if MEASURE_PERFORMANCE
+	struct timeval then, now;
+	gettimeofday(&then, 0);
+#endif
+
+	ctx->cur = frame;
+	workers_run(denoise_band, ctx);
+	ctx->have_prev = 1;
+
+#if MEASURE_PERFORMANCE
+	gettimeofday(&now, 0);
+	printf("%s() took %ldus\n", __func__,
+		((now.tv_sec - then.tv_sec) * 1000000) + (now.tv_usec - then.tv_usec));
+#endif
+
+	return ctx->out;
+}
@@ -0,0 +1,62 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef DENOISE_H
+#define DENOISE_H
+
+/* Temporal recursive noise reduction. Each output byte is blended with the
+ * previous output when the change is below a threshold (noise), otherwise
+ * the input passes untouched (motion). No motion compensation.
+ */
+
+#define DENOISE_PLANES_MAX 3
+
+struct denoise_ctx_s
+{
+	unsigned int planes;
+	unsigned int offset[DENOISE_PLANES_MAX];
+	unsigned int stride[DENOISE_PLANES_MAX];
+	unsigned int lines[DENOISE_PLANES_MAX];
+	/* Thresholds for each byte position, repeating every 4 bytes (Y U Y V for YUY2) */
+	unsigned char threshold[DENOISE_PLANES_MAX][4];
+
+	/* Filtered output, also the history for the next frame */
+	unsigned char *out;
+	int have_prev;
+
+	/* The frame being processed, for the worker bands */
+	const unsigned char *cur;
+};
+
+/* Describe the frame layout with _plane() after alloc. */
+int  denoise_alloc(struct denoise_ctx_s *ctx, unsigned int size);
+void denoise_plane(struct denoise_ctx_s *ctx, unsigned int offset, unsigned int stride, unsigned int lines,
+	const unsigned char threshold[4]);
+void denoise_free(struct denoise_ctx_s *ctx);
+
+/* Returns the filtered frame, valid until the next call. */
+unsigned char *denoise_frame(struct denoise_ctx_s *ctx, const unsigned char *frame);
+
+#endif
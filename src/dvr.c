@@ -0,0 +1,351 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include "dvr.h"
+#include "output.h"
+#include "frames.h"
+#include "metrics.h"
+
+struct dvr_au_s
+{
+	unsigned long long pos;		/* Absolute byte position, the ring offset is pos % size */
+	unsigned int len;
+	unsigned long long dts90k;
+	int idr;
+};
+
+/* Configuration */
+static char *dvr_dir;
+static unsigned long long span90k, post90k;
+
+/* Ring, au indices and byte positions only ever increase */
+static unsigned char *ring = NULL;
+static unsigned long long ring_size;
+static struct dvr_au_s *aus = NULL;
+static unsigned long long au_head, au_tail;	/* Oldest, one past the newest complete */
+static unsigned long long pos_head, pos_tail;	/* Bytes in use, pos_tail includes the AU in flight */
+static unsigned int au_len;			/* Bytes of the AU in flight */
+static int au_open = 0, au_skip = 0, au_idr = 0;
+static pthread_mutex_t ring_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ring_cond = PTHREAD_COND_INITIALIZER;
+
+/* Dump requests */
+static volatile sig_atomic_t trigger_pending = 0;
+static int dump_requested = 0;
+static unsigned long long dump_until90k;
+static pthread_t dump_thread;
+static int dump_running = 0;
+
+static struct {
+	struct metric_s *dumps;
+	struct metric_s *seconds;
+	struct metric_s *bytes;
+} dvr_metrics;
+
+static struct dvr_au_s *dvr_au(unsigned long long nr)
+{
+	return &aus[nr % DVR_AU_MAX];
+}
+
+/* Drop the oldest AU, then anything up to the next IDR. Called with ring_mutex held. */
+static void dvr_evict_gop()
+{
+	if (au_head == au_tail)
+		return;
+
+	do {
+		au_head++;
+	} while ((au_head < au_tail) && !dvr_au(au_head)->idr);
+
+	pos_head = (au_head < au_tail) ? dvr_au(au_head)->pos : pos_tail - au_len;
+}
+
+/* Whole GOPs go once the next one alone covers the span */
+static void dvr_evict_by_time(unsigned long long newest90k)
+{
+	while (au_head < au_tail) {
+		unsigned long long next = au_head + 1;
+		while ((next < au_tail) && !dvr_au(next)->idr)
+			next++;
+		if ((next == au_tail) || (newest90k - dvr_au(next)->dts90k < span90k))
+			break;
+		dvr_evict_gop();
+	}
+}
+
+static void dvr_copy_in(unsigned char *buf, int len)
+{
+	unsigned long long off = pos_tail % ring_size;
+	unsigned long long first = ring_size - off;
+
+	if (first > (unsigned long long)len)
+		first = len;
+	memcpy(ring + off, buf, first);
+	memcpy(ring, buf + first, len - first);
+	pos_tail += len;
+}
+
+static int dvr_codeddata(unsigned char *buf, int len, int frame_type)
+{
+	if (!au_open) {
+		au_open = 1;
+		au_len = 0;
+		au_idr = (frame_type == FRAME_IDR);
+		/* After an overflow the ring restarts at an IDR */
+		if (au_skip && (frame_type == FRAME_IDR))
+			au_skip = 0;
+		if ((au_head == au_tail) && (frame_type != FRAME_IDR))
+			au_skip = 1;
+	}
+	if (au_skip)
+		return 0;
+
+	pthread_mutex_lock(&ring_mutex);
+
+	/* Make room, a single AU larger than the ring is not kept. Neither is a
+	 * P or B frame that the eviction left as the oldest, a dump starts at an IDR.
+	 */
+	while ((pos_tail + len - pos_head > ring_size) && (au_head < au_tail))
+		dvr_evict_gop();
+	if ((pos_tail + len - pos_head > ring_size) || ((au_head == au_tail) && !au_idr)) {
+		pos_tail -= au_len;
+		au_skip = 1;
+	} else {
+		dvr_copy_in(buf, len);
+		au_len += len;
+	}
+
+	pthread_mutex_unlock(&ring_mutex);
+
+	return 0;
+}
+
+static void dvr_frame_complete(int frame_type, unsigned long long pts90k, unsigned long long dts90k)
+{
+	au_open = 0;
+
+	pthread_mutex_lock(&ring_mutex);
+
+	if (!au_skip && au_len) {
+		/* The index is full, make room */
+		if (au_tail - au_head == DVR_AU_MAX)
+			dvr_evict_gop();
+
+		if ((au_head == au_tail) && !au_idr) {
+			/* The whole index was one GOP, restart at the next IDR */
+			pos_tail -= au_len;
+		} else {
+			struct dvr_au_s *au = dvr_au(au_tail);
+			au->pos = pos_tail - au_len;
+			au->len = au_len;
+			au->dts90k = dts90k;
+			au->idr = au_idr;
+			au_tail++;
+
+			dvr_evict_by_time(dts90k);
+		}
+	}
+
+	/* A dump covers what we have now plus the post roll */
+	if (trigger_pending) {
+		trigger_pending = 0;
+		if (dump_requested)
+			printf("DVR dump already in progress\n");
+		else {
+			dump_requested = 1;
+			dump_until90k = dts90k + post90k;
+		}
+	}
+	pthread_cond_signal(&ring_cond);
+
+	pthread_mutex_unlock(&ring_mutex);
+}
+
+static struct output_sink_s dvr_sink =
+{
+	.name		= "DVR",
+	.codeddata	= dvr_codeddata,
+	.frame_complete	= dvr_frame_complete,
+};
+
+/* Dump thread, copies one AU at a time so the encoder is never held up for long */
+static void dvr_dump()
+{
+	char fn[4096], stamp[32];
+	time_t now = time(NULL);
+	struct tm tm;
+	unsigned char *buf = NULL;
+	unsigned int buf_size = 0;
+	unsigned long long bytes = 0, first90k = 0, last90k = 0;
+	int count = 0;
+
+	localtime_r(&now, &tm);
+	strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tm);
+	snprintf(fn, sizeof(fn), "%s/dvr-%s.264", dvr_dir, stamp);
+
+	FILE *fp = fopen(fn, "wb");
+	if (!fp)
+		fprintf(stderr, "%s() unable to create %s, %s\n", __func__, fn, strerror(errno));
+
+	pthread_mutex_lock(&ring_mutex);
+	unsigned long long nr = au_head;
+	while (fp) {
+		while ((nr == au_tail) && dump_running)
+			pthread_cond_wait(&ring_cond, &ring_mutex);
+		if (nr == au_tail)
+			break;
+
+		/* Overtaken by the encoder, the disk can't keep up with the ring */
+		if (nr < au_head) {
+			printf("DVR dump overrun, %s is truncated\n", fn);
+			break;
+		}
+
+		struct dvr_au_s au = *dvr_au(nr);
+		if (count && (au.dts90k > dump_until90k))
+			break;
+
+		if (au.len > buf_size) {
+			unsigned char *p = realloc(buf, au.len);
+			if (!p)
+				break;
+			buf = p;
+			buf_size = au.len;
+		}
+		unsigned long long off = au.pos % ring_size;
+		unsigned long long first = ring_size - off;
+		if (first > au.len)
+			first = au.len;
+		memcpy(buf, ring + off, first);
+		memcpy(buf + first, ring, au.len - first);
+		pthread_mutex_unlock(&ring_mutex);
+
+		fwrite(buf, 1, au.len, fp);
+		if (count++ == 0)
+			first90k = au.dts90k;
+		last90k = au.dts90k;
+		bytes += au.len;
+		nr++;
+
+		pthread_mutex_lock(&ring_mutex);
+	}
+	dump_requested = 0;
+	pthread_mutex_unlock(&ring_mutex);
+
+	free(buf);
+	if (fp) {
+		fclose(fp);
+		printf("DVR wrote %s, %d frames, %.1f seconds, %llu bytes\n",
+			fn, count, (last90k - first90k) / 90000.0, bytes);
+		metrics_add(dvr_metrics.dumps, 1);
+		metrics_set(dvr_metrics.seconds, (last90k - first90k) / 90000);
+		metrics_add(dvr_metrics.bytes, bytes);
+	}
+}
+
+static void *dvr_thread_func(void *arg)
+{
+	pthread_mutex_lock(&ring_mutex);
+	while (dump_running) {
+		if (!dump_requested) {
+			pthread_cond_wait(&ring_cond, &ring_mutex);
+			continue;
+		}
+		pthread_mutex_unlock(&ring_mutex);
+		dvr_dump();
+		pthread_mutex_lock(&ring_mutex);
+	}
+	pthread_mutex_unlock(&ring_mutex);
+
+	return NULL;
+}
+
+void dvr_trigger()
+{
+	trigger_pending = 1;
+}
+
+int dvr_open(char *dir, unsigned int seconds, unsigned long long max_bytes, unsigned int post_seconds)
+{
+	dvr_dir = dir;
+	span90k = seconds * 90000ULL;
+	post90k = post_seconds * 90000ULL;
+	ring_size = max_bytes;
+
+	ring = malloc(ring_size);
+	aus = calloc(DVR_AU_MAX, sizeof(struct dvr_au_s));
+	if (!ring || !aus) {
+		fprintf(stderr, "%s() unable to allocate %llu bytes\n", __func__, max_bytes);
+		dvr_close();
+		return -1;
+	}
+
+	au_head = au_tail = 0;
+	pos_head = pos_tail = 0;
+	au_open = au_skip = 0;
+	trigger_pending = 0;
+	dump_requested = 0;
+
+	dvr_metrics.dumps = metrics_register("dvr_dumps", METRIC_COUNTER);
+	dvr_metrics.seconds = metrics_register("dvr_dump_seconds", METRIC_GAUGE);
+	dvr_metrics.bytes = metrics_register("dvr_dump_bytes", METRIC_COUNTER);
+
+	dump_running = 1;
+	if (pthread_create(&dump_thread, NULL, dvr_thread_func, NULL) != 0) {
+		dump_running = 0;
+		dvr_close();
+		return -1;
+	}
+
+	printf("DVR keeping %d seconds (max %llu MB) in memory, dumps to %s on SIGUSR1\n",
+		seconds, max_bytes / 1048576, dir);
+
+	return output_register(&dvr_sink);
+}
+
+void dvr_close()
+{
+	output_unregister(&dvr_sink);
+
+	if (dump_running) {
+		pthread_mutex_lock(&ring_mutex);
+		dump_running = 0;
+		pthread_cond_broadcast(&ring_cond);
+		pthread_mutex_unlock(&ring_mutex);
+		pthread_join(dump_thread, NULL);
+	}
+
+	free(ring);
+	free(aus);
+	ring = NULL;
+	aus = NULL;
+}
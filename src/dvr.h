@@ -0,0 +1,44 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef DVR_H
+#define DVR_H
+
+/* Keeps the last N seconds of coded video in memory, whole GOPs so the
+ * oldest access unit is always an IDR. A dump, requested by SIGUSR1 or
+ * dvr_trigger(), writes the ring (and optionally what follows for a few
+ * seconds) to a new file from a dedicated thread while the live outputs
+ * carry on untouched.
+ */
+
+#define DVR_AU_MAX	65536	/* Access units indexed */
+
+int  dvr_open(char *dir, unsigned int seconds, unsigned long long max_bytes, unsigned int post_seconds);
+void dvr_close();
+
+/* Request a dump, safe from a signal handler */
+void dvr_trigger();
+
+#endif
@@ -24,12 +24,11 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/errno.h>
 #include "encoder-display.h"
 
-#define ALPHA_BACKGROUND 0
-
 static struct letter_t {
 	unsigned char *ptr;
 	unsigned char data[8];
@@ -1189,6 +1188,9 @@ static struct letter_t {
  /* 00000000 */
 };
 
+#define GLYPH_GROUPS	16	/* Pixel pairs across a 32 pixel glyph */
+#define GLYPH_LETTERS	(0x9f + 1)
+
 int encoder_display_init(struct encoder_display_context *ctx)
 {
 	memset(ctx, 0, sizeof(*ctx));
@@ -1196,120 +1198,207 @@ int encoder_display_init(struct encoder_display_context *ctx)
 	ctx->plotwidth = 8 * 4; /* The 8bit char is rendered as 32x32 */
 	ctx->plotheight = ctx->plotwidth;
 
-	ctx->currx = 0;
-	ctx->curry = 0;
-
 	return 0;
 }
 
-static int encoder_display_render_moveto(struct encoder_display_context *ctx, int x, int y)
+static void encoder_display_plane(struct encoder_display_context *ctx, int group_bytes, int vsub,
+	const unsigned char *fg, const unsigned char *bg)
 {
-	ctx->ptr = ctx->frame + (x * (ctx->plotwidth * 2));
-	ctx->ptr += ((y * (ctx->stride * 2)) * ctx->plotheight);
-
-	ctx->currx = x;
-	ctx->curry = y;
-
-	/* YUY2 colors for a single pixel (background/foreground) */
-	ctx->bg[0] = 0x00;
-	ctx->bg[1] = 0x80;
-
-	ctx->fg[0] = 0xc0;
-	ctx->fg[1] = 0x80;
+	struct encoder_display_plane *p = &ctx->plane[ctx->planes++];
 
-	return 0;
+	p->group_bytes = group_bytes;
+	p->vsub = vsub;
+	memcpy(p->fg, fg, group_bytes);
+	memcpy(p->bg, bg, group_bytes);
 }
 
-static int encoder_display_render_character(struct encoder_display_context *ctx, unsigned char letter)
+/* Expand every row of every glyph into ready to copy bytes */
+static int encoder_display_expand_glyphs(struct encoder_display_plane *p)
 {
-	unsigned char line;
+	int rowbytes = GLYPH_GROUPS * p->group_bytes;
 
-	if (letter > 0x9f)
+	p->glyphs = malloc(GLYPH_LETTERS * 8 * rowbytes);
+	if (!p->glyphs)
 		return -1;
 
-	for (int i = 0; i < 8; i++) {
-	
-		int k = 0;
-		while (k++ < 4) { /* line height (4) */
-			line = charset[ letter ].data[ i ];
-			for (int j = 0; j < 8; j++) {
-				if (line & 0x80) {
-					/* font color */
-					*(ctx->ptr + 0) = ctx->fg[0];
-					*(ctx->ptr + 1) = ctx->fg[1];
-					*(ctx->ptr + 2) = ctx->fg[0];
-					*(ctx->ptr + 3) = ctx->fg[1];
-					*(ctx->ptr + 4) = ctx->fg[0];
-					*(ctx->ptr + 5) = ctx->fg[1];
-					*(ctx->ptr + 6) = ctx->fg[0];
-					*(ctx->ptr + 7) = ctx->fg[1];
-				} else {
-					/* background color */
-#if ALPHA_BACKGROUND
-					/* Minor alpha */
-					*(ctx->ptr + 0) >>= 1;
-					*(ctx->ptr + 2) >>= 1;
-					*(ctx->ptr + 4) >>= 1;
-					*(ctx->ptr + 6) >>= 1;
-#else
-					/* Complete black background */
-					*(ctx->ptr + 0) = ctx->bg[0];
-					*(ctx->ptr + 1) = ctx->bg[1];
-					*(ctx->ptr + 2) = ctx->bg[0];
-					*(ctx->ptr + 3) = ctx->bg[1];
-					*(ctx->ptr + 4) = ctx->bg[0];
-					*(ctx->ptr + 5) = ctx->bg[1];
-					*(ctx->ptr + 6) = ctx->bg[0];
-					*(ctx->ptr + 7) = ctx->bg[1];
-#endif
-				}
+	for (int letter = 0; letter < GLYPH_LETTERS; letter++) {
+		for (int i = 0; i < 8; i++) {
+			unsigned char *dst = p->glyphs + (((letter * 8) + i) * rowbytes);
+			unsigned char line = charset[ letter ].data[ i ];
 
-				ctx->ptr += 8;
-				line <<= 1;
+			for (int j = 0; j < GLYPH_GROUPS; j++) {
+				/* Each glyph bit is 4 pixels, two groups */
+				memcpy(dst, (line << (j / 2)) & 0x80 ? p->fg : p->bg, p->group_bytes);
+				dst += p->group_bytes;
 			}
-			ctx->ptr += ((ctx->stride * 2) - (8 * 2 * 4));
 		}
 	}
 
 	return 0;
 }
 
-static int encoder_display_render_ascii(struct encoder_display_context *ctx, unsigned char letter, int x, int y)
+int encoder_display_configure(struct encoder_display_context *ctx, enum encoder_display_format_e format,
+	unsigned int width, unsigned int height)
 {
-	if (letter > 0x9f)
+	/* Foreground / background colors, per pixel pair */
+	static const unsigned char yuy2_fg[] = { 0xc0, 0x80, 0xc0, 0x80 };
+	static const unsigned char yuy2_bg[] = { 0x00, 0x80, 0x00, 0x80 };
+	static const unsigned char luma_fg[] = { 0xc0, 0xc0 };
+	static const unsigned char luma_bg[] = { 0x00, 0x00 };
+	static const unsigned char chroma[] = { 0x80, 0x80 };
+	static const unsigned char bgrx_fg[] = { 0xcb, 0xcb, 0xcb, 0xff, 0xcb, 0xcb, 0xcb, 0xff };
+	static const unsigned char bgrx_bg[] = { 0x00, 0x00, 0x00, 0xff, 0x00, 0x00, 0x00, 0xff };
+
+	encoder_display_free(ctx);
+
+	ctx->format = format;
+	ctx->width = width;
+	ctx->height = height;
+
+	switch (format) {
+	case EDF_YUY2:
+		encoder_display_plane(ctx, 4, 1, yuy2_fg, yuy2_bg);
+		break;
+	case EDF_I420:
+		encoder_display_plane(ctx, 2, 1, luma_fg, luma_bg);
+		encoder_display_plane(ctx, 1, 2, chroma, chroma);
+		encoder_display_plane(ctx, 1, 2, chroma, chroma);
+		break;
+	case EDF_NV12:
+		encoder_display_plane(ctx, 2, 1, luma_fg, luma_bg);
+		encoder_display_plane(ctx, 2, 2, chroma, chroma);
+		break;
+	case EDF_BGRX:
+		encoder_display_plane(ctx, 8, 1, bgrx_fg, bgrx_bg);
+		break;
+	default:
 		return -1;
+	}
 
-	encoder_display_render_moveto(ctx, x, y);
-	encoder_display_render_character(ctx, letter);
+	for (unsigned int i = 0; i < ctx->planes; i++) {
+		if (encoder_display_expand_glyphs(&ctx->plane[i]) < 0) {
+			encoder_display_free(ctx);
+			return -1;
+		}
+	}
 
 	return 0;
 }
 
-int encoder_display_render_string(struct encoder_display_context *ctx, unsigned char *s, unsigned int len, unsigned int x, unsigned int y)
+void encoder_display_free(struct encoder_display_context *ctx)
 {
-	if ((!ctx) || (!s) || (len > 80) || (x > 24) || (y > 24))
+	for (int i = 0; i < ENCODER_DISPLAY_PLANES; i++) {
+		free(ctx->plane[i].glyphs);
+		ctx->plane[i].glyphs = NULL;
+	}
+	for (int i = 0; i < ENCODER_DISPLAY_STRINGS; i++) {
+		for (int j = 0; j < ENCODER_DISPLAY_PLANES; j++) {
+			free(ctx->strip[i].pixels[j]);
+			ctx->strip[i].pixels[j] = NULL;
+		}
+		ctx->strip[i].len = 0;
+		ctx->strip[i].text[0] = 0;
+	}
+	ctx->planes = 0;
+}
+
+/* Render the strip text into its per plane pixel buffers */
+static void encoder_display_render_strip(struct encoder_display_context *ctx, struct encoder_display_strip *strip)
+{
+	for (unsigned int i = 0; i < ctx->planes; i++) {
+		struct encoder_display_plane *p = &ctx->plane[i];
+		int glyphbytes = GLYPH_GROUPS * p->group_bytes;
+		unsigned char *dst = strip->pixels[i];
+
+		for (int row = 0; row < ctx->plotheight; row += p->vsub) {
+			for (unsigned int c = 0; c < strip->len; c++) {
+				unsigned char letter = strip->text[c];
+				if (letter >= GLYPH_LETTERS)
+					letter = ' ';
+				memcpy(dst, p->glyphs + (((letter * 8) + (row / 4)) * glyphbytes), glyphbytes);
+				dst += glyphbytes;
+			}
+		}
+	}
+}
+
+int encoder_display_set_string(struct encoder_display_context *ctx, unsigned int nr,
+	const char *s, unsigned int x, unsigned int y)
+{
+	struct encoder_display_strip *strip;
+	unsigned int len;
+
+	if ((!ctx) || (!s) || (nr >= ENCODER_DISPLAY_STRINGS) || (ctx->planes == 0))
 		return -1;
 
-	for (unsigned i = 0; i < len; i++)
-		encoder_display_render_ascii(ctx, *(s + i), x + i, y);
+	len = strlen(s);
+	if (len > ENCODER_DISPLAY_CHARS)
+		len = ENCODER_DISPLAY_CHARS;
+
+	strip = &ctx->strip[nr];
+
+	/* Pixel pairs and chroma line pairs must line up */
+	x &= ~1;
+	y &= ~1;
+
+	if ((strip->x == x) && (strip->y == y) && (strip->len == len) && (memcmp(strip->text, s, len) == 0))
+		return 0;
+
+	if (len > strip->len) {
+		for (unsigned int i = 0; i < ctx->planes; i++) {
+			struct encoder_display_plane *p = &ctx->plane[i];
+			unsigned char *pixels = realloc(strip->pixels[i],
+				len * GLYPH_GROUPS * p->group_bytes * (ctx->plotheight / p->vsub));
+			if (!pixels)
+				return -1;
+			strip->pixels[i] = pixels;
+		}
+	}
+
+	memcpy(strip->text, s, len);
+	strip->text[len] = 0;
+	strip->len = len;
+	strip->x = x;
+	strip->y = y;
+
+	encoder_display_render_strip(ctx, strip);
 
 	return 0;
 }
 
-int encoder_display_render_reset(struct encoder_display_context *ctx, unsigned char *ptr, unsigned int stride)
+int encoder_display_blit(struct encoder_display_context *ctx, unsigned char *planes[], unsigned int strides[])
 {
-	if ((!ctx) || (!ptr))
+	if ((!ctx) || (!planes) || (!strides))
 		return -1;
 
-	if ((stride != (720 * 2)) && (stride != (960 * 2)) && (stride != (1280 * 2)) && (stride != (1920 * 2)) && (stride != (3840 * 2)))
-		return -1;
+	for (int n = 0; n < ENCODER_DISPLAY_STRINGS; n++) {
+		struct encoder_display_strip *strip = &ctx->strip[n];
+		unsigned int w = strip->len * ctx->plotwidth;
+		unsigned int h = ctx->plotheight;
+
+		if ((strip->len == 0) || (strip->x >= ctx->width) || (strip->y >= ctx->height))
+			continue;
 
-	ctx->ptr = ptr;
-	ctx->frame = ptr;
-	ctx->stride = stride / 2;
+		/* Clip to the frame */
+		if (strip->x + w > ctx->width)
+			w = ctx->width - strip->x;
+		if (strip->y + h > ctx->height)
+			h = ctx->height - strip->y;
 
-	encoder_display_render_moveto(ctx, 0, 0);
+		for (unsigned int i = 0; i < ctx->planes; i++) {
+			struct encoder_display_plane *p = &ctx->plane[i];
+			unsigned int srcstride = strip->len * GLYPH_GROUPS * p->group_bytes;
+			unsigned int bytes = (w / 2) * p->group_bytes;
+			unsigned char *src = strip->pixels[i];
+			unsigned char *dst = planes[i] + ((strip->y / p->vsub) * strides[i]) + ((strip->x / 2) * p->group_bytes);
+
+			for (unsigned int row = 0; row < h; row += p->vsub) {
+				memcpy(dst, src, bytes);
+				src += srcstride;
+				dst += strides[i];
+			}
+		}
+	}
 
 	return 0;
 }
-
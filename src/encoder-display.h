@@ -28,22 +28,64 @@
 
 /* Copyright 2014 Kernel Labs Inc. All Rights Reserved. */
 
+enum encoder_display_format_e {
+	EDF_YUY2 = 0,
+	EDF_I420,
+	EDF_NV12,
+	EDF_BGRX,
+};
+
+#define ENCODER_DISPLAY_PLANES	3
+#define ENCODER_DISPLAY_STRINGS	4
+#define ENCODER_DISPLAY_CHARS	80
+
+/* Characters are 8x8 glyphs rendered 4x, so 32x32 pixels. Every glyph bit
+ * covers a pair of horizontally adjacent pixels twice over, so we render in
+ * pixel pairs ('groups') which keeps subsampled chroma simple.
+ */
+struct encoder_display_plane
+{
+	int group_bytes;	/* Bytes per pixel pair in this plane */
+	int vsub;		/* Vertical subsampling */
+	unsigned char fg[8], bg[8];
+
+	/* Each glyph row pre-expanded, [letter][row][16 groups] */
+	unsigned char *glyphs;
+};
+
+/* A string, pre-rendered in the frame format whenever its text changes */
+struct encoder_display_strip
+{
+	char text[ENCODER_DISPLAY_CHARS + 1];
+	unsigned int len;
+	unsigned int x, y;	/* Pixels */
+	unsigned char *pixels[ENCODER_DISPLAY_PLANES];
+};
+
 struct encoder_display_context
 {
 	int plotwidth;
 	int plotheight;
-	int currx;
-	int curry;
-	int stride;
 
-	unsigned char *ptr;
-	unsigned char *frame;
+	enum encoder_display_format_e format;
+	unsigned int width;
+	unsigned int height;
+	unsigned int planes;
+	struct encoder_display_plane plane[ENCODER_DISPLAY_PLANES];
 
-	unsigned char bg[2], fg[2];
+	struct encoder_display_strip strip[ENCODER_DISPLAY_STRINGS];
 };
 
-int encoder_display_init(struct encoder_display_context *ctx);
-int encoder_display_render_string(struct encoder_display_context *ctx, unsigned char *s, unsigned int len, unsigned int x, unsigned int y);
-int encoder_display_render_reset(struct encoder_display_context *ctx, unsigned char *ptr, unsigned int stride);
+int  encoder_display_init(struct encoder_display_context *ctx);
+int  encoder_display_configure(struct encoder_display_context *ctx, enum encoder_display_format_e format,
+	unsigned int width, unsigned int height);
+void encoder_display_free(struct encoder_display_context *ctx);
+
+/* Place string nr at pixel x, y. Only re-rendered if the text or position changed. */
+int  encoder_display_set_string(struct encoder_display_context *ctx, unsigned int nr,
+	const char *s, unsigned int x, unsigned int y);
+
+/* Copy all strings into a frame of the configured format, clipped to its edges. */
+int  encoder_display_blit(struct encoder_display_context *ctx, unsigned char *planes[], unsigned int strides[]);
 
 #endif
@@ -27,6 +27,66 @@
 
 #define MEASURE_PERFORMANCE 0
 
+static int encoder_deinterlace_alloc(struct encoder_params_s *params)
+{
+	struct deinterlace_ctx_s *ctx = &params->deinterlace;
+	unsigned int w = params->width;
+	unsigned int h = params->height;
+
+	if (IS_YUY2(params)) {
+		if (deinterlace_alloc(ctx, params->deinterlacemode, w * 2 * h) < 0)
+			return -1;
+		deinterlace_plane(ctx, 0, w * 2, h);
+	} else
+	if (IS_BGRX(params)) {
+		if (deinterlace_alloc(ctx, params->deinterlacemode, w * 4 * h) < 0)
+			return -1;
+		deinterlace_plane(ctx, 0, w * 4, h);
+	} else
+	if (IS_I420(params)) {
+		if (deinterlace_alloc(ctx, params->deinterlacemode, (w * h * 3) / 2) < 0)
+			return -1;
+		deinterlace_plane(ctx, 0, w, h);
+		deinterlace_plane(ctx, w * h, w / 2, h / 2);
+		deinterlace_plane(ctx, (w * h * 5) / 4, w / 2, h / 2);
+	}
+
+	return 0;
+}
+
+static int encoder_denoise_alloc(struct encoder_params_s *params)
+{
+	struct denoise_ctx_s *ctx = &params->denoise;
+	unsigned int w = params->width;
+	unsigned int h = params->height;
+	unsigned char l = params->denoise_luma;
+	unsigned char c = params->denoise_chroma;
+
+	if (IS_YUY2(params)) {
+		const unsigned char yuyv[4] = { l, c, l, c };
+		if (denoise_alloc(ctx, w * 2 * h) < 0)
+			return -1;
+		denoise_plane(ctx, 0, w * 2, h, yuyv);
+	} else
+	if (IS_BGRX(params)) {
+		const unsigned char bgrx[4] = { l, l, l, l };
+		if (denoise_alloc(ctx, w * 4 * h) < 0)
+			return -1;
+		denoise_plane(ctx, 0, w * 4, h, bgrx);
+	} else
+	if (IS_I420(params)) {
+		const unsigned char luma[4] = { l, l, l, l };
+		const unsigned char chroma[4] = { c, c, c, c };
+		if (denoise_alloc(ctx, (w * h * 3) / 2) < 0)
+			return -1;
+		denoise_plane(ctx, 0, w, h, luma);
+		denoise_plane(ctx, w * h, w / 2, h / 2, chroma);
+		denoise_plane(ctx, (w * h * 5) / 4, w / 2, h / 2, chroma);
+	}
+
+	return 0;
+}
+
 int encoder_init(struct encoder_operations_s *ops, struct encoder_params_s *params)
 {
 	assert(ops);
@@ -47,6 +107,52 @@ int encoder_init(struct encoder_operations_s *ops, struct encoder_params_s *para
 		exit(1);
 	}
 
+	if (params->scenecut_threshold) {
+		if (scenecut_alloc(&params->scenecut, params->width, params->height) < 0) {
+			printf("Unable to allocate scene change detector\n");
+			return -1;
+		}
+		if (params->gop_min == 0)
+			params->gop_min = params->frame_rate / 2;
+	}
+
+	if (params->scenecut_threshold || metrics_enabled()) {
+		if (frame_stats_alloc(&params->stats, params->width, params->height) < 0) {
+			printf("Unable to allocate frame statistics\n");
+			return -1;
+		}
+	}
+
+	/* Encoders without a hardware deinterlacer, or when asked, use ours */
+	if (params->deinterlacemode && ((params->type != EM_VAAPI) || params->deinterlace_cpu)) {
+		params->deinterlace_cpu = 1;
+		workers_init(0);
+		if (encoder_deinterlace_alloc(params) < 0) {
+			printf("Unable to allocate deinterlacer\n");
+			return -1;
+		}
+	} else
+		params->deinterlace_cpu = 0;
+
+	if (params->denoise_luma || params->denoise_chroma) {
+		workers_init(0);
+		if (encoder_denoise_alloc(params) < 0) {
+			printf("Unable to allocate denoiser\n");
+			return -1;
+		}
+	}
+
+	params->metrics.frames = metrics_register("frames", METRIC_COUNTER);
+	params->metrics.coded_bytes = metrics_register("coded_bytes", METRIC_COUNTER);
+	params->metrics.output_us = metrics_register("output_us", METRIC_COUNTER);
+	params->metrics.idr_forced = metrics_register("idr_forced", METRIC_COUNTER);
+	params->metrics.scenecuts = metrics_register("scenecuts", METRIC_COUNTER);
+	params->metrics.luma_mean = metrics_register("luma_mean", METRIC_GAUGE);
+	params->metrics.mad = metrics_register("mad_x16", METRIC_GAUGE);
+	params->metrics.blocks_changed = metrics_register("blocks_changed", METRIC_GAUGE);
+	params->metrics.clip_low_pct = metrics_register("clip_low_pct", METRIC_GAUGE);
+	params->metrics.clip_high_pct = metrics_register("clip_high_pct", METRIC_GAUGE);
+
 	/* store coded data into a file */
 	encoder_create_nal_outfile(params);
 	encoder_print_input(params);
@@ -75,6 +181,10 @@ static void _set_defaults(struct encoder_params_s *p)
 	p->frame_rate = 30;
 	p->frame_count = 60;
 	p->quiet_encode = 0;
+	p->scenecut_threshold = 0;
+	p->scenecut_static_mad = 16;
+	p->gop_min = 0;
+	p->gop_max = 0;
 
 	encoder_display_init(&p->display_ctx);
 }
@@ -96,10 +206,25 @@ void encoder_close(struct encoder_operations_s *ops, struct encoder_params_s *pa
 	assert(params);
 
 	ops->close(params);
+	if (params->encoder_nalOutputFilename) {
+		if (mp4writer_match(params->encoder_nalOutputFilename))
+			mp4writer_close();
+		else
+			filewriter_close();
+	}
+
+	scenecut_free(&params->scenecut);
+	frame_stats_free(&params->stats);
+	deinterlace_free(&params->deinterlace);
+	denoise_free(&params->denoise);
+	encoder_display_free(&params->display_ctx);
+	workers_free();
 }
 
 /* Core func, all capture sources call us, we call the ops encode frame func and
  * handle param validation, performance measurements etc.
+ * inbuf is never modified, capture sources may hand it back to the producer
+ * as soon as we return.
  */
 int encoder_encode_frame(struct encoder_operations_s *ops, struct encoder_params_s *params, unsigned char *inbuf)
 {
@@ -112,8 +237,40 @@ int encoder_encode_frame(struct encoder_operations_s *ops, struct encoder_params
 		exit(1);
 	}
 
-	/* Etch into the frame the OSD stats before encoding, if required */
-	encoder_frame_add_osd(params, inbuf);
+	/* Remember when the frame arrived, for output timestamps. These count
+	 * from the start of the run, not host uptime, so the 33 bit 90KHz
+	 * timestamps downstream don't wrap at some arbitrary point.
+	 */
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	unsigned long long now_us = ((unsigned long long)ts.tv_sec * 1000000ULL) + (ts.tv_nsec / 1000);
+	if (params->frames_processed == 0) {
+		params->capture_origin_us = now_us - ENCODER_TS_START_US;
+		output_clock_origin(params->capture_origin_us);
+	}
+	params->capture_time_us[params->frames_processed % ENCODER_CAPTURE_RING] =
+		now_us - params->capture_origin_us;
+
+	/* Encoders that gather statistics mark them valid during conversion */
+	params->stats.valid = 0;
+	params->force_idr = 0;
+
+	/* Bitrate changes requested from other threads take effect between frames */
+	unsigned int bps = __sync_lock_test_and_set(&params->bitrate_request, 0);
+	if (bps && (bps != params->frame_bitrate)) {
+		if (ops->set_bitrate)
+			ops->set_bitrate(params, bps);
+		else
+			printf("Encoder %s can't change bitrate\n", ops->name);
+	}
+
+	/* The encoder sees our progressive copy of the frame */
+	if (params->deinterlace_cpu)
+		inbuf = deinterlace_frame(&params->deinterlace, inbuf);
+
+	/* Temporal noise reduction, before anything measures or encodes the frame */
+	if (params->denoise.out)
+		inbuf = denoise_frame(&params->denoise, inbuf);
 
 #if MEASURE_PERFORMANCE
 	unsigned int elapsedMS;
@@ -137,6 +294,37 @@ int encoder_encode_frame(struct encoder_operations_s *ops, struct encoder_params
 	return ret;
 }
 
+/* The longest the encoder goes between IDRs at fps, in ms. 0 when it has no
+ * periodic IDR (x264 uses intra refresh) or the period is infinite.
+ */
+unsigned int encoder_idr_interval_ms(unsigned int type, struct encoder_params_s *params, unsigned int fps)
+{
+	unsigned int frames = 0;
+
+	if (!fps)
+		return 0;
+
+	if (params->scenecut_threshold) {
+		/* encoder_frame_gop_decide(), cuts only make it shorter */
+		frames = params->intra_period;
+		if (params->gop_max > frames)
+			frames = params->gop_max;
+	} else
+	if (type == EM_VAAPI)
+		frames = params->intra_idr_period;
+	else
+	if (type == EM_AVCODEC_H264)
+		frames = fps * 3;
+
+	return (frames * 1000ULL) / fps;
+}
+
+/* Safe from any thread, the latest request wins */
+void encoder_request_bitrate(struct encoder_params_s *params, unsigned int bps)
+{
+	__sync_lock_test_and_set(&params->bitrate_request, bps);
+}
+
 int encoder_isSupportedColorspace(struct encoder_params_s *params, enum fourcc_e csc)
 {
 	struct encoder_operations_s *ops = getEncoderTarget(params->type);
@@ -187,48 +375,172 @@ void encoder_output_console_progress(struct encoder_params_s *params)
 	}
 }
 
-void encoder_frame_add_osd(struct encoder_params_s *params, unsigned char *frame)
+/* Encoders call this to etch the OSD into their own converted copy of
+ * the frame, after any analysis. The input frame is never written to,
+ * it may be shared with the capture source (ipcvideo, fixed frames).
+ */
+void encoder_frame_add_osd(struct encoder_params_s *params, enum encoder_display_format_e format,
+	unsigned char *planes[], unsigned int strides[])
 {
-	if (IS_YUY2(params) && params->enable_osd) {
-		/* Warning: We're going to directly modify the input pixels. In fixed
-		 * frame encoding we'll continuiously overwrite and alter the static
-		 * image. If for any reason our OSD strings below begin to shorten,
-		 * we'll leave old pixel data in the source image.
-		 * This is intensional and saves an additional frame copy.
-		 */
-		encoder_display_render_reset(&params->display_ctx, frame, params->width * 2);
-
-		/* Render any OSD */
-		char str[256];
-		time_t now = time(NULL);
-		struct tm *tm = localtime(&now);
+	struct encoder_display_context *ctx = &params->display_ctx;
+	static time_t last = 0;
+	char str[64];
+
+	if (!params->enable_osd)
+		return;
+
+	if ((ctx->planes == 0) || (ctx->format != format)) {
+		if (encoder_display_configure(ctx, format, params->width, params->height) < 0) {
+			printf("Unable to configure the OSD, disabling\n");
+			params->enable_osd = 0;
+			return;
+		}
+		last = 0;
+	}
+
+	/* The clock only changes once a second, as do the glyphs */
+	time_t now = time(NULL);
+	if (now != last) {
+		struct tm tm;
+		localtime_r(&now, &tm);
 		sprintf(str, "%04d/%02d/%02d-%02d:%02d:%02d",
-			tm->tm_year + 1900,
-			tm->tm_mon + 1,
-			tm->tm_mday,
-			tm->tm_hour,
-			tm->tm_min,
-			tm->tm_sec
+			tm.tm_year + 1900,
+			tm.tm_mon + 1,
+			tm.tm_mday,
+			tm.tm_hour,
+			tm.tm_min,
+			tm.tm_sec
 			);
-		encoder_display_render_string(&params->display_ctx, (unsigned char*)str, strlen(str), 0, 10);
+		encoder_display_set_string(ctx, 0, str, 0, 10 * ctx->plotheight);
+		last = now;
+	}
+
+	sprintf(str, "FRM: %lld", params->frames_processed);
+	encoder_display_set_string(ctx, 1, str, 0, 11 * ctx->plotheight);
 
-		sprintf(str, "FRM: %lld", params->frames_processed);
-		encoder_display_render_string(&params->display_ctx, (unsigned char*)str, strlen(str), 0, 11);
+	encoder_display_blit(ctx, planes, strides);
+}
+
+/* Decide whether the incoming frame should begin a new GOP.
+ * With scenecut enabled every intra refresh is an IDR placed here, nominally
+ * each intra_period frames. A cut forces an IDR (no closer than gop_min to
+ * the previous one). Static content lets the GOP stretch up to gop_max, the
+ * first frame with motion beyond the nominal period gets an IDR.
+ * Statistics from the conversion pass are used when the encoder gathered
+ * them, otherwise we sample the input frame ourselves.
+ */
+static void encoder_frame_gop_decide(struct encoder_params_s *params, unsigned char *frame)
+{
+	struct scenecut_ctx_s *sc = &params->scenecut;
+	unsigned int period = params->intra_period;
+	int cut;
+
+	params->force_idr = 0;
+	if (!params->scenecut_threshold)
+		return;
+
+	if (params->stats.valid)
+		cut = scenecut_analyze_stats(sc, &params->stats,
+			params->scenecut_threshold, params->scenecut_static_mad);
+	else {
+		if (IS_YUY2(params))
+			scenecut_sample_yuy2(sc, frame, params->width * 2);
+		else
+		if (IS_BGRX(params))
+			scenecut_sample_bgrx(sc, frame, params->width * 4);
+		else
+		if (IS_I420(params))
+			scenecut_sample_i420(sc, frame, params->width);
+
+		cut = scenecut_analyze(sc, params->scenecut_threshold, params->scenecut_static_mad);
+	}
+	if (cut)
+		metrics_add(params->metrics.scenecuts, 1);
+
+	/* Everything since the last IDR has been static, let the GOP grow */
+	if ((params->gop_max > period) && (sc->static_run + 1 >= params->frames_since_idr))
+		period = params->gop_max;
+
+	if (params->frames_processed == 0)
+		params->force_idr = 1;
+	else
+	if (period && (params->frames_since_idr >= period))
+		params->force_idr = 1;
+	else
+	if (cut && (params->frames_since_idr >= params->gop_min))
+		params->force_idr = 1;
+
+	if (params->force_idr) {
+		params->frames_since_idr = 0;
+		metrics_add(params->metrics.idr_forced, 1);
 	}
+	params->frames_since_idr++;
+}
+
+static void encoder_frame_metrics(struct encoder_params_s *params)
+{
+	struct frame_stats_s *st = &params->stats;
+	unsigned int low = 0, high = 0;
+
+	if (!metrics_enabled() || !st->valid)
+		return;
+
+	/* Exposure, % of pixels at or beyond the nominal black and white levels */
+	for (int i = 0; i <= 20; i++)
+		low += st->histogram[i];
+	for (int i = 235; i < 256; i++)
+		high += st->histogram[i];
+
+	metrics_set(params->metrics.luma_mean, st->luma_mean);
+	metrics_set(params->metrics.mad, (st->sad * 16) / (st->width * st->height));
+	metrics_set(params->metrics.blocks_changed, st->blocks_changed);
+	metrics_set(params->metrics.clip_low_pct, (low * 100ULL) / (st->width * st->height));
+	metrics_set(params->metrics.clip_high_pct, (high * 100ULL) / (st->width * st->height));
+}
+
+/* Encoders pass this to their conversion kernels, NULL when nobody needs statistics. */
+struct frame_stats_s *encoder_frame_stats(struct encoder_params_s *params)
+{
+	if (params->stats.prev_luma)
+		return &params->stats;
+
+	return NULL;
+}
+
+/* Encoders call this once the input frame has been converted into
+ * their own format, and before they encode it. Any statistics gathered
+ * during conversion are now available, frame is the original input.
+ */
+void encoder_frame_converted(struct encoder_params_s *params, unsigned char *frame)
+{
+	encoder_frame_gop_decide(params, frame);
+	encoder_frame_metrics(params);
 }
 
 int encoder_frame_ingested(struct encoder_params_s *params)
 {
 	params->frames_processed++;
+
+	metrics_add(params->metrics.frames, 1);
+	metrics_sample();
+
 	return 1;
 }
 
 int encoder_create_nal_outfile(struct encoder_params_s *params)
 {
-	/* store coded data into a file */
-	if (params->encoder_nalOutputFilename) {
-		params->nal_fp = fopen(params->encoder_nalOutputFilename, "w+");
-		if (params->nal_fp == NULL) {
+	/* store coded data into a file, fragmented MP4 or raw nals */
+	if (params->encoder_nalOutputFilename && mp4writer_match(params->encoder_nalOutputFilename)) {
+		if (params->file_direct)
+			printf("MP4 output is written through the page cache, ignoring O_DIRECT\n");
+		if (mp4writer_open(params->encoder_nalOutputFilename, params->width, params->height,
+			params->frame_rate, params->segment_bytes, params->segment_seconds) < 0) {
+			printf("Open file %s failed, exit\n", params->encoder_nalOutputFilename);
+			exit(1);
+		}
+	} else if (params->encoder_nalOutputFilename) {
+		if (filewriter_open(params->encoder_nalOutputFilename, params->segment_bytes,
+			params->segment_seconds, params->file_direct) < 0) {
 			printf("Open file %s failed, exit\n", params->encoder_nalOutputFilename);
 			exit(1);
 		}
@@ -238,28 +550,43 @@ int encoder_create_nal_outfile(struct encoder_params_s *params)
 
 int encoder_output_codeddata(struct encoder_params_s *params, unsigned char *buf, int size, int isIFrame)
 {
-	int s;
+	struct timespec t1, t2;
 
-	if (params->nal_fp) {
-		s = fwrite(buf, 1, size, params->nal_fp);
-		fflush(params->nal_fp);
-	} else
-		s = size;
+	if (params->metrics.output_us)
+		clock_gettime(CLOCK_MONOTONIC, &t1);
 
-/* TODO: Urgh, hardcoded list of callbacks. Put them in a list
- * and enumerate and call.
- */
-	/* ... will drop the packet if ES2TS was not requested */
-	sendESPacket(buf, size, isIFrame);
+	/* File, RTP, TS, MXC etc, whichever were requested */
+	output_codeddata(buf, size, isIFrame);
 
-	/* ... will drop the packet if RTP was not requested */
-	sendRTPPacket(buf, size, isIFrame);
+	if (params->metrics.output_us) {
+		clock_gettime(CLOCK_MONOTONIC, &t2);
+		metrics_add(params->metrics.output_us, ((t2.tv_sec - t1.tv_sec) * 1000000LL) +
+			((t2.tv_nsec - t1.tv_nsec) / 1000));
+	}
 
-	/* ... will drop the packet if MXC_VPU_UDP was not requested */
-	sendMXCVPUUDPPacket(buf, size, isIFrame);
+	params->coded_size += size;
+	metrics_add(params->metrics.coded_bytes, size);
+	return size;
+}
 
-	params->coded_size += s;
-	return s;
+/* Encoders call this once all coded data for a frame has been passed to
+ * encoder_output_codeddata(), and before those buffers are released.
+ * frame_nr is the order the frame was submitted to encoder_encode_frame().
+ */
+void encoder_output_frame_complete(struct encoder_params_s *params, int frame_type, unsigned long long frame_nr)
+{
+	unsigned long long us = params->capture_time_us[frame_nr % ENCODER_CAPTURE_RING];
+
+	/* Frames leave the encoder in decode order, the Nth frame out decodes at
+	 * the capture time of the Nth frame in, less the B frame reorder delay.
+	 */
+	unsigned long long dts_us = params->capture_time_us[params->frames_output++ % ENCODER_CAPTURE_RING];
+	if (params->ip_period > 1 && params->frame_rate)
+		dts_us -= ((params->ip_period - 1) * 1000000ULL) / params->frame_rate;
+	if (dts_us > us)
+		dts_us = us;
+
+	output_frame_complete(frame_type, (us * 9) / 100, (dts_us * 9) / 100);
 }
 
 void encoder_print_input(struct encoder_params_s *params)
@@ -279,6 +606,17 @@ void encoder_print_input(struct encoder_params_s *params)
 	printf("INPUT: Coded Clip   : %s\n", params->encoder_nalOutputFilename ?
 		params->encoder_nalOutputFilename : "N/A");
 	printf("INPUT: HRD BR/Multi : %d\n", params->hrd_bitrate_multiplier);
+	printf("INPUT: Deinterlace  : %s\n", params->deinterlacemode == 0 ? "Disabled" :
+		params->deinterlacemode == 1 ? "Motion adaptive" : "Bob");
+	if (params->denoise_luma || params->denoise_chroma)
+		printf("INPUT: Denoise Y/C  : %d/%d\n", params->denoise_luma, params->denoise_chroma);
+	else
+		printf("INPUT: Denoise      : Disabled\n");
+	if (params->scenecut_threshold) {
+		printf("INPUT: Scenecut     : %d%%\n", params->scenecut_threshold);
+		printf("INPUT: GOP Min/Max  : %d/%d\n", params->gop_min, params->gop_max);
+	} else
+		printf("INPUT: Scenecut     : Disabled\n");
 	printf("\n\n");		/* return back to startpoint */
 }
 
@@ -54,11 +54,20 @@
 #include "es2ts.h"
 #include "rtp.h"
 #include "mxcvpuudp.h"
+#include "output.h"
 #include "csc.h"
+#include "scenecut.h"
+#include "convert.h"
+#include "metrics.h"
+#include "workers.h"
+#include "deinterlace.h"
+#include "denoise.h"
 #include "va_display.h"
 #include "encoder-display.h"
 #include "main.h"
 #include "frames.h"
+#include "filewriter.h"
+#include "mp4writer.h"
 
 #include "encoder-display.h"
 #include "frames.h"
@@ -67,6 +76,12 @@
 #define IS_BGRX(p) ((p)->input_fourcc == E_FOURCC_BGRX)
 #define IS_I420(p) ((p)->input_fourcc == E_FOURCC_I420)
 
+/* Capture times are kept for this many frames in flight */
+#define ENCODER_CAPTURE_RING 64
+
+/* The first frames timestamp, room for the B frame and decoder delays */
+#define ENCODER_TS_START_US 1000000ULL
+
 enum fourcc_e {
 	E_FOURCC_UNDEFINED = 0,
 	E_FOURCC_YUY2,
@@ -100,9 +115,11 @@ struct encoder_params_s
 	enum encoder_type_e type;
 	struct encoder_display_context display_ctx;
 
-	/* Nals to disk */
+	/* Nals to disk, see filewriter.h, or MP4 (by extension) see mp4writer.h */
 	char *encoder_nalOutputFilename;
-	FILE *nal_fp;
+	unsigned long long segment_bytes;	/* Rotate files at this size, 0 = never */
+	unsigned int segment_seconds;		/* Rotate files at this duration, 0 = never */
+	int file_direct;			/* Write with O_DIRECT */
 
 	/* Total bytes output by the encoder */
 	unsigned long long coded_size;
@@ -111,6 +128,11 @@ struct encoder_params_s
 	unsigned int height;
 	unsigned int enable_osd;
 	unsigned int deinterlacemode;
+	int deinterlace_cpu;		/* Use ours rather than the encoders own (VPP) */
+	struct deinterlace_ctx_s deinterlace;
+	unsigned int denoise_luma;		/* Temporal noise thresholds, 0 = off */
+	unsigned int denoise_chroma;
+	struct denoise_ctx_s denoise;
 	unsigned int initial_qp;
 	unsigned int minimal_qp;
 	unsigned int frame_rate;
@@ -125,10 +147,43 @@ struct encoder_params_s
 	unsigned int frame_count;
 
 	unsigned int frame_bitrate; /* bps */
+	unsigned int bitrate_min;	/* Bounds for runtime adaptation, 0 = fixed */
+	unsigned int bitrate_max;
+	volatile unsigned int bitrate_request;	/* Applied before the next frame, 0 = none */
 	enum fourcc_e input_fourcc;
 
 	unsigned int hrd_bitrate_multiplier;
 
+	/* Scene change detection and content adaptive GOP.
+	 * When scenecut_threshold is non-zero the encoder core decides where
+	 * IDR frames go (nominally every intra_period frames) and signals them
+	 * to the encoder via force_idr.
+	 */
+	unsigned int scenecut_threshold;	/* 0 = off, else % histogram change */
+	unsigned int scenecut_static_mad;	/* Mean luma diff (x16) considered static */
+	unsigned int gop_min;			/* Min frames between scenecut IDRs */
+	unsigned int gop_max;			/* Max GOP length on static content */
+	unsigned int frames_since_idr;
+	int force_idr;
+	struct scenecut_ctx_s scenecut;
+
+	/* Per frame statistics, gathered by the encoders during colorspace
+	 * conversion when scenecut or metrics need them.
+	 */
+	struct frame_stats_s stats;
+	struct {
+		struct metric_s *frames;
+		struct metric_s *coded_bytes;
+		struct metric_s *output_us;
+		struct metric_s *idr_forced;
+		struct metric_s *scenecuts;
+		struct metric_s *luma_mean;
+		struct metric_s *mad;
+		struct metric_s *blocks_changed;
+		struct metric_s *clip_low_pct;
+		struct metric_s *clip_high_pct;
+	} metrics;
+
 	/* libavcodec Specific */
 	struct lavc_vars_s lavc_vars;
 
@@ -136,6 +191,9 @@ struct encoder_params_s
 	struct x264_vars_s x264_vars;
 
 	unsigned long long frames_processed;
+	unsigned long long frames_output;	/* Access units delivered to the outputs */
+	unsigned long long capture_time_us[ENCODER_CAPTURE_RING];
+	unsigned long long capture_origin_us;	/* CLOCK_MONOTONIC of the first frame, less ENCODER_TS_START_US */
 
 	FILE *csv_fp;
 	int quiet_encode;
@@ -167,6 +225,9 @@ struct encoder_operations_s
 	int  (*set_defaults)(struct encoder_params_s *);
 	void (*close)(struct encoder_params_s *);
 	int  (*encode_frame)(struct encoder_params_s *, unsigned char *);
+
+	/* Optional, change the target bitrate between frames */
+	int  (*set_bitrate)(struct encoder_params_s *, unsigned int bps);
 };
 
 extern struct encoder_operations_s vaapi_ops;
@@ -175,10 +236,16 @@ struct encoder_operations_s *getEncoderTarget(unsigned int type);
 
 void encoder_print_input(struct encoder_params_s *p);
 int  encoder_output_codeddata(struct encoder_params_s *params, unsigned char *buf, int size, int isIFrame);
+void encoder_output_frame_complete(struct encoder_params_s *params, int frame_type, unsigned long long frame_nr);
 int  encoder_create_nal_outfile(struct encoder_params_s *params);
 int  encoder_frame_ingested(struct encoder_params_s *params);
-void encoder_frame_add_osd(struct encoder_params_s *params, unsigned char *frame);
+void encoder_frame_add_osd(struct encoder_params_s *params, enum encoder_display_format_e format,
+	unsigned char *planes[], unsigned int strides[]);
+struct frame_stats_s *encoder_frame_stats(struct encoder_params_s *params);
+void encoder_frame_converted(struct encoder_params_s *params, unsigned char *frame);
 void encoder_output_console_progress(struct encoder_params_s *params);
+void encoder_request_bitrate(struct encoder_params_s *params, unsigned int bps);
+unsigned int encoder_idr_interval_ms(unsigned int type, struct encoder_params_s *params, unsigned int fps);
 int  encoder_pre_encode_checks(struct encoder_params_s *params);
 unsigned int encoder_measureElapsedMS(struct timeval *then);
 int  encoder_isSupportedColorspace(struct encoder_params_s *params, enum fourcc_e csc);
@@ -24,132 +24,134 @@
  */
 
 #include <stdio.h>
-#include <libes2ts/es2ts.h>
-#include <libavformat/avformat.h>
-#include <libavutil/opt.h>
-
-/* Compatibility with older versions of ffmpeg */
-#if LIBAVCODEC_VERSION_INT < AV_VERSION_INT(54,59,100)
-# define AV_CODEC_ID_MPEG2TS CODEC_ID_MPEG2TS
-#endif
-
-/* A combined ES to TS layer, where we convert nals into TS packets
- * using libes2ts then push the ts buffers out to RTP.
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include "output.h"
+#include "udpout.h"
+#include "tsmux.h"
+#include "fec.h"
+#include "frames.h"
+#include "es2ts.h"
+
+/* A combined ES to TS layer, where we convert nals into TS packets on the
+ * encoder thread then push them out as RTP (RFC 2250, MP2T) or plain UDP.
+ * TS packets are accumulated into fixed N x 188 byte datagrams, so payloads
+ * never exceed the MTU. A partly filled datagram is sent anyway once it has
+ * waited ES2TS_FLUSH_MS, bounding the latency added to the tail of a frame.
  */
-static struct es2ts_context_s *es2ts_ctx = 0;
-static AVFormatContext *tsav_ctx = NULL;
-static AVOutputFormat *tsav_fmt = NULL;
-static AVStream *tsav_strm = NULL;
-static int tsav_ifd = 0;
-
-static int es2ts_initRTPHandler(char *ipaddress, int port, int dscp, int pktsize, int ifd, int w, int h, int fps)
-{
-	char filename[64];
-
-	avformat_network_init();
-	av_register_all();
 
-	tsav_ctx = avformat_alloc_context();
-	if (!tsav_ctx)
-		return -1;
+#define ES2TS_RTP_HEADER	12
+#define ES2TS_PAYLOAD_TYPE	33	/* MP2T/90000 */
+#define ES2TS_PACKETS_MAX	7	/* 1316 bytes, fits a 1500 byte MTU */
+#define ES2TS_DATAGRAMS		64	/* Accumulated before each sendmmsg() */
+#define ES2TS_FLUSH_MS		10
 
-	tsav_fmt = av_guess_format("rtp", NULL, NULL);
-	if (!tsav_ctx) {
-		avformat_free_context(tsav_ctx);
-		return -1;
-	}
+struct es2ts_datagram_s
+{
+	unsigned char buf[ES2TS_RTP_HEADER + (ES2TS_PACKETS_MAX * TSMUX_PACKET_SIZE)];
+	struct iovec iov;
+};
+
+int es2ts_debug = 0;
+static struct tsmux_ctx_s tsmux;
+static int tsmux_active = 0;
+
+static struct udpout_ctx_s ts_out = { .skt = -1 };
+static struct es2ts_datagram_s datagrams[ES2TS_DATAGRAMS];
+static int datagram_count = 0;		/* Complete, queued for the next flush */
+static int datagram_fill = 0;		/* Payload bytes in datagrams[datagram_count] */
+static int datagram_payload = ES2TS_PACKETS_MAX * TSMUX_PACKET_SIZE;
+static unsigned long long datagram_time;	/* When the first packet entered a partial datagram */
+static int plain_udp = 0;
+static struct fec_ctx_s fec;
+static int fec_enabled = 0;
+static int ts_ifd = 0;
+static unsigned short seqno;
+static unsigned int ssrc;
+static unsigned int timestamp_base;
+
+static pthread_t flush_thread;
+static pthread_mutex_t ts_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ts_cond;
+static int flush_running = 0;
+
+static unsigned long long es2ts_now_us()
+{
+	struct timespec ts;
 
-	tsav_ctx->oformat = tsav_fmt;
-	tsav_ifd = ifd;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000000ULL) + (ts.tv_nsec / 1000);
+}
 
-	/* try to open the RTP stream */
-	snprintf(filename, sizeof(filename), "rtp://%s:%d?dscp=%d&pkt_size=%d", ipaddress, port,
-		 dscp, pktsize?pktsize:-1);
-	printf("Streaming to %s\n", filename);
-	if (avio_open(&(tsav_ctx->pb), filename, AVIO_FLAG_WRITE) < 0) {
-		printf("Couldn't open RTP output stream\n");
-		avformat_free_context(tsav_ctx);
-		return -1;
-	}
+/* Transmit whatever is queued, moving any partial datagram back to the start. */
+static void es2ts_flush()
+{
+	if (datagram_count == 0)
+		return;
 
-	/* add an H.264 stream */
-	tsav_strm = avformat_new_stream(tsav_ctx, NULL);
-	if (!tsav_strm) {
-		printf("Couldn't allocate H.264 stream\n");
-		avformat_free_context(tsav_ctx);
-		return -1;
-	}
+	udpout_flush(&ts_out);
+	if (fec_enabled)
+		fec_flush(&fec);
 
-	/* initalize codec */
-	AVCodecContext* c = tsav_strm->codec;
-	c->codec_id = AV_CODEC_ID_MPEG2TS;
-	c->codec_type = AVMEDIA_TYPE_VIDEO;
-	c->bit_rate = 3000000;
-	c->width = w;
-	c->height = h;
-	c->time_base.den = fps;
-	c->time_base.num = 1;
-
-	/* write the header */
-	if (avformat_write_header(tsav_ctx, NULL) != 0)
-		printf("%s() error write header\n", __func__);
-	
-	return 0;
+	if (datagram_fill)
+		memcpy(datagrams[0].buf + ES2TS_RTP_HEADER, datagrams[datagram_count].buf + ES2TS_RTP_HEADER,
+			datagram_fill);
+	datagram_count = 0;
 }
 
-static int es2ts_sendTSBufferAsRTP(unsigned char *tsbuf, int len, int isIFrame)
+/* The datagram being filled is complete (or has timed out), stamp and queue it. */
+static void es2ts_datagram_queue()
 {
-	if (tsav_ctx == NULL)
-		return 0;
-	if (tsav_ifd > 0) {
-		av_opt_set_int(tsav_ctx, "ifd", tsav_ifd, AV_OPT_SEARCH_CHILDREN);
-		tsav_ifd = 0;
-	}
-#if 1
-	AVPacket p;
-	av_init_packet(&p);
-	p.data = tsbuf;
-	p.size = len;
-	p.stream_index = tsav_strm->index;
-
-	av_write_frame(tsav_ctx, &p);
-#else
-	int rem = len;
-	int idx = 0;
-	while (rem > 0) {
-		int cnt = rem;
-		if ((7 * 188) < rem)
-			cnt = 7 * 188;
-
-		AVPacket p;
-		av_init_packet(&p);
-		p.data = tsbuf + idx;
-		p.size = cnt;
-		p.stream_index = tsav_strm->index;
-
-		av_write_frame(tsav_ctx, &p);
-
-		idx += cnt;
-		rem -= cnt;
+	struct es2ts_datagram_s *d = &datagrams[datagram_count];
+	unsigned int ts = timestamp_base + ((es2ts_now_us() * 9) / 100);
+	unsigned char *h = d->buf;
+
+	h[0] = 0x80;
+	h[1] = ES2TS_PAYLOAD_TYPE;
+	h[2] = seqno >> 8;
+	h[3] = seqno;
+	h[4] = ts >> 24;
+	h[5] = ts >> 16;
+	h[6] = ts >> 8;
+	h[7] = ts;
+	h[8] = ssrc >> 24;
+	h[9] = ssrc >> 16;
+	h[10] = ssrc >> 8;
+	h[11] = ssrc;
+	seqno++;
+
+	if (plain_udp) {
+		d->iov.iov_base = d->buf + ES2TS_RTP_HEADER;
+		d->iov.iov_len = datagram_fill;
+	} else {
+		d->iov.iov_base = d->buf;
+		d->iov.iov_len = ES2TS_RTP_HEADER + datagram_fill;
 	}
-#endif
-	return 0;
+	udpout_queue(&ts_out, &d->iov, 1);
+	if (fec_enabled)
+		fec_packet(&fec, &d->iov, 1);
+
+	datagram_count++;
+	datagram_fill = 0;
+
+	if (ts_ifd) {
+		/* Legacy pacing, one datagram per interframe delay */
+		es2ts_flush();
+		usleep(ts_ifd);
+	} else
+	if (datagram_count == ES2TS_DATAGRAMS)
+		es2ts_flush();
 }
 
-/* The es2ts library calls us back with buffers of TS packets .... */
-/* Callbacks are guaranteed to be exact multiples of 188 bytes */
-int downstream_callback(struct es2ts_context_s *ctx, unsigned char *buf, int len)
+/* The muxer calls us back with buffers of TS packets, always
+ * exact multiples of 188 bytes.
+ */
+static void downstream_callback(void *priv, unsigned char *buf, int len)
 {
-	if (len % 188) {
-		printf("%s(%p, %p, bytes %d) [ %02x %02x %02x %02x] %d/%d\n",
-			__func__, ctx, buf, len,
-			*(buf + 0),
-			*(buf + 1),
-			*(buf + 2),
-			*(buf + 3),
-			len / 188, len % 188
-			);
-	}
 #if 0
 	static FILE *fh = 0;
 	if (fh == 0) {
@@ -163,72 +165,193 @@ int downstream_callback(struct es2ts_context_s *ctx, unsigned char *buf, int len
 	fwrite(buf, 1, len, fh);
 #endif
 
-	/* We don't know if its an iframe, assume no in the following arg */
-	es2ts_sendTSBufferAsRTP(buf, len, 0);
+	pthread_mutex_lock(&ts_lock);
+
+	while (len) {
+		int cnt = datagram_payload - datagram_fill;
+		if (cnt > len)
+			cnt = len;
 
-	return ES2TS_OK;
+		if (datagram_fill == 0)
+			datagram_time = es2ts_now_us();
+
+		memcpy(datagrams[datagram_count].buf + ES2TS_RTP_HEADER + datagram_fill, buf, cnt);
+		datagram_fill += cnt;
+		buf += cnt;
+		len -= cnt;
+
+		if (datagram_fill == datagram_payload)
+			es2ts_datagram_queue();
+	}
+
+	/* Everything complete goes in a single sendmmsg() */
+	es2ts_flush();
+
+	/* Let the flush thread time out the remainder */
+	if (datagram_fill)
+		pthread_cond_signal(&ts_cond);
+
+	pthread_mutex_unlock(&ts_lock);
 }
 
-int sendESPacket(unsigned char *nal, int len)
+static void *es2ts_flush_thread(void *arg)
 {
-	if ((es2ts_ctx == NULL) || (!nal))
-		return 0; /* Success */
+	pthread_mutex_lock(&ts_lock);
 
-	/* Upstream application pushed data into the library */
-	int ret = es2ts_data_enqueue(es2ts_ctx, nal, len);
-	if (ES2TS_FAILED(ret)) {
-		return -1;
+	while (flush_running) {
+		if (datagram_fill == 0) {
+			pthread_cond_wait(&ts_cond, &ts_lock);
+			continue;
+		}
+
+		unsigned long long deadline = datagram_time + (ES2TS_FLUSH_MS * 1000);
+		if (es2ts_now_us() >= deadline) {
+			es2ts_datagram_queue();
+			es2ts_flush();
+			continue;
+		}
+
+		struct timespec ts;
+		ts.tv_sec = deadline / 1000000;
+		ts.tv_nsec = (deadline % 1000000) * 1000;
+		pthread_cond_timedwait(&ts_cond, &ts_lock, &ts);
 	}
 
-	return 0;
+	pthread_mutex_unlock(&ts_lock);
+
+	return NULL;
 }
 
-int initESHandler(char *ipaddress, int port, int dscp, int pktsize, int ifd, int w, int h, int fps)
+static int sendESPacket(unsigned char *nal, int len, int frame_type)
 {
-	int ret;
+	if (!tsmux_active || (!nal))
+		return 0; /* Success */
 
-	ret = es2ts_initRTPHandler(ipaddress, port, dscp, pktsize, ifd, w, h, fps);
-	if (ret < 0)
-		return -1;
+	/* Referenced, not copied. Packetized when the frame completes */
+	return tsmux_write_es(&tsmux, nal, len);
+}
 
-	ret = es2ts_alloc(&es2ts_ctx);
-	if (ES2TS_FAILED(ret))
-		return -1;
+static void sendESFrameComplete(int frame_type, unsigned long long pts90k, unsigned long long dts90k)
+{
+	if (!tsmux_active)
+		return;
+
+	tsmux_frame_complete(&tsmux, (frame_type == FRAME_IDR) || (frame_type == FRAME_I), pts90k, dts90k);
+
+	if (es2ts_debug)
+		printf("%s() type %d pts %llu dts %llu packets %llu nulls %llu late %llu\n", __func__,
+			frame_type, pts90k, dts90k, tsmux.packets, tsmux.null_packets, tsmux.overflows);
+}
 
-	printf("Allocated a context %p\n", es2ts_ctx);
-	ret = es2ts_callback_register(es2ts_ctx, &downstream_callback);
-	if (ES2TS_FAILED(ret))
+static struct output_sink_s es2ts_sink =
+{
+	.name		= "RTP/TS",
+	.codeddata	= sendESPacket,
+	.frame_complete	= sendESFrameComplete,
+};
+
+int initESHandler(char *ipaddress, int port, int dscp, int pktsize, int ifd, int w, int h, int fps,
+	unsigned int mux_rate, unsigned int pcr_interval_ms, int udp, int fec_l, int fec_d)
+{
+	pthread_condattr_t attr;
+	int packets;
+
+	if (udpout_open(&ts_out, ipaddress, port, dscp, 4 * 1048576) < 0) {
+		printf("Couldn't open TS output stream\n");
 		return -1;
+	}
 
-	printf("Callback registered\n");
+	/* As many whole TS packets as the requested packet size allows */
+	plain_udp = udp;
+	packets = ES2TS_PACKETS_MAX;
+	if (pktsize > 0) {
+		packets = (pktsize - (plain_udp ? 0 : ES2TS_RTP_HEADER)) / TSMUX_PACKET_SIZE;
+		if (packets < 1)
+			packets = 1;
+		if (packets > ES2TS_PACKETS_MAX)
+			packets = ES2TS_PACKETS_MAX;
+	}
+	datagram_payload = packets * TSMUX_PACKET_SIZE;
+	datagram_count = 0;
+	datagram_fill = 0;
+	ts_ifd = ifd;
+
+	srand(time(NULL));
+	seqno = rand();
+	ssrc = rand();
+	timestamp_base = rand();
+
+	/* FEC protects RTP sequence numbers, plain UDP has none */
+	if (fec_l && !plain_udp) {
+		if (fec_open(&fec, ipaddress, port, dscp, fec_l, fec_d) < 0) {
+			udpout_close(&ts_out);
+			return -1;
+		}
+		fec_enabled = 1;
+	}
 
-	ret = es2ts_process_start(es2ts_ctx);
-	if (ES2TS_FAILED(ret))
+	if (tsmux_alloc(&tsmux, mux_rate, pcr_interval_ms, downstream_callback, NULL) < 0) {
+		if (fec_enabled)
+			fec_close(&fec);
+		fec_enabled = 0;
+		udpout_close(&ts_out);
 		return -1;
+	}
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&ts_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	flush_running = 1;
+	if (pthread_create(&flush_thread, NULL, es2ts_flush_thread, NULL) != 0) {
+		flush_running = 0;
+		tsmux_free(&tsmux);
+		if (fec_enabled)
+			fec_close(&fec);
+		fec_enabled = 0;
+		udpout_close(&ts_out);
+		return -1;
+	}
+	tsmux_active = 1;
 
-	printf("Process Started\n");
+	printf("Streaming to %s://%s:%d (%d x 188 byte TS packets per datagram)\n",
+		plain_udp ? "udp" : "rtp", ipaddress, port, packets);
+	if (mux_rate)
+		printf("TS mux rate %d bps, PCR every %d ms\n", mux_rate, tsmux.pcr_interval90k / 90);
+	else
+		printf("TS mux rate VBR, PCR every %d ms\n", tsmux.pcr_interval90k / 90);
 
-	return 0;
+	return output_register(&es2ts_sink);
 }
 
 void freeESHandler()
 {
-	if (tsav_ctx)
-		avformat_free_context(tsav_ctx);
+	output_unregister(&es2ts_sink);
 
-	if (es2ts_ctx == NULL)
+	if (!tsmux_active)
 		return;
 
-	printf("Process ending\n");
-	int ret = es2ts_process_end(es2ts_ctx);
-	if (ES2TS_FAILED(ret)) {
-		fprintf(stderr, "%s() failed to terminate\n", __func__);
-		return;
+	pthread_mutex_lock(&ts_lock);
+	flush_running = 0;
+	pthread_cond_signal(&ts_cond);
+	pthread_mutex_unlock(&ts_lock);
+	pthread_join(flush_thread, NULL);
+
+	/* Anything left over */
+	if (datagram_fill)
+		es2ts_datagram_queue();
+	es2ts_flush();
+
+	printf("TS packets %llu, null %llu, late access units %llu, datagrams %llu\n",
+		tsmux.packets, tsmux.null_packets, tsmux.overflows, ts_out.datagrams);
+	tsmux_free(&tsmux);
+	if (fec_enabled) {
+		printf("TS FEC packets %llu\n", fec.packets);
+		fec_close(&fec);
+		fec_enabled = 0;
 	}
-
-	printf("Process ended\n");
-	es2ts_callback_unregister(es2ts_ctx);
-	es2ts_free(es2ts_ctx);
-	es2ts_ctx = 0;
+	udpout_close(&ts_out);
+	pthread_cond_destroy(&ts_cond);
+	tsmux_active = 0;
 }
-
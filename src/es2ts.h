@@ -23,6 +23,8 @@
  *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
  */
 
-int sendESPacket(unsigned char *nal, int len, int frame_type);
-int initESHandler(char *ipaddress, int port, int dscp, int pktsize, int ifd, int w, int h, int fps);
+extern int es2ts_debug;
+
+int initESHandler(char *ipaddress, int port, int dscp, int pktsize, int ifd, int w, int h, int fps,
+	unsigned int mux_rate, unsigned int pcr_interval_ms, int udp, int fec_l, int fec_d);
 void freeESHandler();
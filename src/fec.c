@@ -0,0 +1,198 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fec.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+static void fec_xor(unsigned char *dst, const unsigned char *src, int len)
+{
+	int i = 0;
+
+#if defined(__SSE2__)
+	for (; i + 64 <= len; i += 64) {
+		__m128i a0 = _mm_loadu_si128((const __m128i *)(src + i + 0));
+		__m128i a1 = _mm_loadu_si128((const __m128i *)(src + i + 16));
+		__m128i a2 = _mm_loadu_si128((const __m128i *)(src + i + 32));
+		__m128i a3 = _mm_loadu_si128((const __m128i *)(src + i + 48));
+		__m128i b0 = _mm_loadu_si128((const __m128i *)(dst + i + 0));
+		__m128i b1 = _mm_loadu_si128((const __m128i *)(dst + i + 16));
+		__m128i b2 = _mm_loadu_si128((const __m128i *)(dst + i + 32));
+		__m128i b3 = _mm_loadu_si128((const __m128i *)(dst + i + 48));
+		_mm_storeu_si128((__m128i *)(dst + i + 0), _mm_xor_si128(a0, b0));
+		_mm_storeu_si128((__m128i *)(dst + i + 16), _mm_xor_si128(a1, b1));
+		_mm_storeu_si128((__m128i *)(dst + i + 32), _mm_xor_si128(a2, b2));
+		_mm_storeu_si128((__m128i *)(dst + i + 48), _mm_xor_si128(a3, b3));
+	}
+	for (; i + 16 <= len; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i b = _mm_loadu_si128((const __m128i *)(dst + i));
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(a, b));
+	}
+#endif
+	for (; i < len; i++)
+		dst[i] ^= src[i];
+}
+
+/* XOR a media packet into a sum, the first packet starts it afresh */
+static void fec_sum_add(struct fec_sum_s *s, struct iovec *iov, int iovcnt)
+{
+	const unsigned char *hdr = iov[0].iov_base;
+	int skip = 12, len = 0;
+
+	if (s->count == 0) {
+		memset(s->payload, 0, s->max_len);
+		s->max_len = 0;
+		s->len_recovery = 0;
+		s->pt_recovery = 0;
+		s->ts_recovery = 0;
+		s->sn_base = (hdr[2] << 8) | hdr[3];
+	}
+
+	for (int i = 0; i < iovcnt; i++) {
+		const unsigned char *p = iov[i].iov_base;
+		int n = iov[i].iov_len;
+
+		/* The RTP header isn't protected, only its recovery fields */
+		if (skip) {
+			int k = n < skip ? n : skip;
+			p += k;
+			n -= k;
+			skip -= k;
+		}
+		if (len + n > FEC_PAYLOAD_MAX)
+			n = FEC_PAYLOAD_MAX - len;
+
+		fec_xor(s->payload + len, p, n);
+		len += n;
+	}
+
+	if (len > s->max_len)
+		s->max_len = len;
+	s->len_recovery ^= len;
+	s->pt_recovery ^= hdr[1] & 0x7f;
+	s->ts_recovery ^= (hdr[4] << 24) | (hdr[5] << 16) | (hdr[6] << 8) | hdr[7];
+	s->count++;
+}
+
+static void fec_emit(struct fec_ctx_s *ctx, struct fec_sum_s *s, int row)
+{
+	if (ctx->out_count == FEC_OUT_MAX)
+		fec_flush(ctx);
+
+	unsigned char *p = ctx->out[ctx->out_count];
+	unsigned short seq = row ? ctx->row_seqno++ : ctx->col_seqno++;
+
+	/* RTP header, timestamp and SSRC are zero for FEC streams */
+	memset(p, 0, 12);
+	p[0] = 0x80;
+	p[1] = FEC_PAYLOAD_TYPE;
+	p[2] = seq >> 8;
+	p[3] = seq;
+
+	unsigned char *h = p + 12;
+	h[0] = s->sn_base >> 8;
+	h[1] = s->sn_base;
+	h[2] = s->len_recovery >> 8;
+	h[3] = s->len_recovery;
+	h[4] = 0x80 | s->pt_recovery;	/* E */
+	h[5] = h[6] = h[7] = 0;		/* Mask */
+	h[8] = s->ts_recovery >> 24;
+	h[9] = s->ts_recovery >> 16;
+	h[10] = s->ts_recovery >> 8;
+	h[11] = s->ts_recovery;
+	h[12] = row ? 0x40 : 0x00;	/* D, type 0 (XOR), index 0 */
+	h[13] = row ? 1 : ctx->L;	/* Offset */
+	h[14] = row ? ctx->L : ctx->D;	/* NA */
+	h[15] = 0;			/* SNBase ext */
+	memcpy(h + FEC_HEADER_SIZE, s->payload, s->max_len);
+
+	ctx->out_iov[ctx->out_count].iov_base = p;
+	ctx->out_iov[ctx->out_count].iov_len = 12 + FEC_HEADER_SIZE + s->max_len;
+	udpout_queue(row ? &ctx->row_out : &ctx->col_out, &ctx->out_iov[ctx->out_count], 1);
+	ctx->out_count++;
+	ctx->packets++;
+
+	s->count = 0;
+}
+
+void fec_packet(struct fec_ctx_s *ctx, struct iovec *iov, int iovcnt)
+{
+	unsigned int c = ctx->index % ctx->L;
+	unsigned int r = ctx->index / ctx->L;
+
+	fec_sum_add(&ctx->row, iov, iovcnt);
+	fec_sum_add(&ctx->col[c], iov, iovcnt);
+
+	if (c == ctx->L - 1)
+		fec_emit(ctx, &ctx->row, 1);
+	if (r == ctx->D - 1)
+		fec_emit(ctx, &ctx->col[c], 0);
+
+	if (++ctx->index == ctx->L * ctx->D)
+		ctx->index = 0;
+}
+
+void fec_flush(struct fec_ctx_s *ctx)
+{
+	udpout_flush(&ctx->col_out);
+	udpout_flush(&ctx->row_out);
+	ctx->out_count = 0;
+}
+
+int fec_open(struct fec_ctx_s *ctx, char *ipaddress, int port, int dscp, unsigned int L, unsigned int D)
+{
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->col_out.skt = -1;
+	ctx->row_out.skt = -1;
+
+	if ((L < 1) || (L > FEC_L_MAX) || (D < 1) || (D > FEC_D_MAX)) {
+		fprintf(stderr, "%s() invalid matrix %dx%d\n", __func__, L, D);
+		return -1;
+	}
+	ctx->L = L;
+	ctx->D = D;
+
+	if ((udpout_open(&ctx->col_out, ipaddress, port + 2, dscp, 1048576) < 0) ||
+		(udpout_open(&ctx->row_out, ipaddress, port + 4, dscp, 1048576) < 0)) {
+		fec_close(ctx);
+		return -1;
+	}
+
+	printf("FEC %dx%d, columns to port %d, rows to port %d\n", L, D, port + 2, port + 4);
+
+	return 0;
+}
+
+void fec_close(struct fec_ctx_s *ctx)
+{
+	udpout_close(&ctx->col_out);
+	udpout_close(&ctx->row_out);
+}
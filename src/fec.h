@@ -0,0 +1,86 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef FEC_H
+#define FEC_H
+
+#include "udpout.h"
+
+/* SMPTE 2022-1 (RFC 2733 style) row and column XOR FEC for an RTP stream.
+ * Media packets are XORed into running row and column sums as they are
+ * sent, each completed sum is sent as an FEC packet on the media port + 2
+ * (columns) or + 4 (rows). A receiver can rebuild any single loss in a row
+ * or column of the L x D matrix.
+ */
+
+#define FEC_HEADER_SIZE		16
+#define FEC_PAYLOAD_MAX		1500
+#define FEC_L_MAX		20
+#define FEC_D_MAX		20
+#define FEC_PAYLOAD_TYPE	96
+#define FEC_OUT_MAX		128	/* FEC packets queued before a flush */
+
+struct fec_sum_s
+{
+	unsigned char payload[FEC_PAYLOAD_MAX] __attribute__ ((aligned (16)));
+	int max_len;			/* Longest payload so far, bytes beyond it are zero */
+	unsigned short len_recovery;
+	unsigned char pt_recovery;
+	unsigned int ts_recovery;
+	unsigned short sn_base;
+	int count;
+};
+
+struct fec_ctx_s
+{
+	unsigned int L, D;
+	unsigned int index;		/* Position of the next media packet in the matrix */
+
+	struct fec_sum_s row;
+	struct fec_sum_s col[FEC_L_MAX];
+
+	struct udpout_ctx_s col_out;
+	struct udpout_ctx_s row_out;
+	unsigned short col_seqno, row_seqno;
+	unsigned int ssrc;
+
+	unsigned char out[FEC_OUT_MAX][12 + FEC_HEADER_SIZE + FEC_PAYLOAD_MAX];
+	struct iovec out_iov[FEC_OUT_MAX];
+	int out_count;
+
+	/* Statistics */
+	unsigned long long packets;
+};
+
+int  fec_open(struct fec_ctx_s *ctx, char *ipaddress, int port, int dscp, unsigned int L, unsigned int D);
+void fec_close(struct fec_ctx_s *ctx);
+
+/* A media RTP packet (12 byte header, no CSRCs), in sequence order */
+void fec_packet(struct fec_ctx_s *ctx, struct iovec *iov, int iovcnt);
+
+/* Send the FEC packets produced since the last flush */
+void fec_flush(struct fec_ctx_s *ctx);
+
+#endif
@@ -0,0 +1,427 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "filewriter.h"
+#include "output.h"
+#include "frames.h"
+#include "metrics.h"
+
+struct filewriter_buffer_s
+{
+	unsigned char *data;
+	int len;
+	unsigned int segment;		/* File this data belongs in */
+	int last;			/* Final buffer of its segment */
+};
+
+static struct filewriter_buffer_s buffers[FILEWRITER_BUFFERS];
+
+/* Buffer indices, free ones for the encoder, full ones for the writer */
+static int free_list[FILEWRITER_BUFFERS], free_count;
+static int full_list[FILEWRITER_BUFFERS], full_head, full_count;
+static pthread_mutex_t writer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t writer_thread;
+static int writer_running = 0;
+
+/* Encode thread state */
+static struct filewriter_buffer_s *cur = NULL;
+static unsigned long long cur_ms;		/* When cur received its first data */
+static unsigned int segment;
+static unsigned long long segment_len;
+static unsigned long long segment_start90k, segment_last90k;
+static int segment_have_pts;
+static int au_open = 0;				/* Data for the current access unit has been seen */
+static int dropping = 0;			/* Lost data, discard until the next IDR */
+
+/* Configuration */
+static char *file_name = NULL;
+static unsigned long long max_bytes;
+static unsigned int max_seconds;
+static int use_direct;
+
+/* Writer thread state */
+static int fd = -1;
+static unsigned int fd_segment;
+static unsigned long long fd_len, fd_allocated;
+static unsigned long long bytes_written, write_us, buffers_dropped;
+
+static struct {
+	struct metric_s *bytes;
+	struct metric_s *write_us;
+	struct metric_s *dropped;
+	struct metric_s *segments;
+} fw_metrics;
+
+static unsigned long long filewriter_now_us()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000000ULL) + (ts.tv_nsec / 1000);
+}
+
+static void filewriter_name(char *dst, int len, unsigned int nr)
+{
+	if (!max_bytes && !max_seconds) {
+		snprintf(dst, len, "%s", file_name);
+		return;
+	}
+
+	/* capture.264 becomes capture-00001.264 */
+	char *ext = strrchr(file_name, '.');
+	if (ext && !strchr(ext, '/'))
+		snprintf(dst, len, "%.*s-%05u%s", (int)(ext - file_name), file_name, nr, ext);
+	else
+		snprintf(dst, len, "%s-%05u", file_name, nr);
+}
+
+/* Writer thread */
+static void filewriter_file_close()
+{
+	if (fd < 0)
+		return;
+
+	/* Preallocation was KEEP_SIZE, the file length is already right */
+	close(fd);
+	fd = -1;
+}
+
+static int filewriter_file_open(unsigned int nr)
+{
+	char fn[4096];
+
+	filewriter_name(fn, sizeof(fn), nr);
+	fd = open(fn, O_WRONLY | O_CREAT | O_TRUNC | (use_direct ? O_DIRECT : 0), 0644);
+	if ((fd < 0) && use_direct) {
+		/* Not every filesystem does O_DIRECT, tmpfs for one */
+		fd = open(fn, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd >= 0)
+			fprintf(stderr, "%s() O_DIRECT unsupported for %s, using the page cache\n", __func__, fn);
+	}
+	if (fd < 0) {
+		fprintf(stderr, "%s() unable to open %s, %s\n", __func__, fn, strerror(errno));
+		return -1;
+	}
+
+	fd_segment = nr;
+	fd_len = 0;
+	fd_allocated = 0;
+	metrics_add(fw_metrics.segments, 1);
+
+	return 0;
+}
+
+static void filewriter_write(struct filewriter_buffer_s *b)
+{
+	unsigned char *p = b->data;
+	int len = b->len;
+
+	if ((fd >= 0) && (fd_segment != b->segment))
+		filewriter_file_close();
+	if ((fd < 0) && (filewriter_file_open(b->segment) < 0))
+		return;
+
+	/* Keep the extents ahead of the data, fewer metadata updates per write */
+	if (fd_len + len > fd_allocated) {
+		if (fallocate(fd, FALLOC_FL_KEEP_SIZE, fd_allocated, FILEWRITER_PREALLOCATE) == 0)
+			fd_allocated += FILEWRITER_PREALLOCATE;
+		else
+			fd_allocated = ~0ULL;	/* Unsupported, don't ask again */
+	}
+
+	/* O_DIRECT needs whole blocks, only the end of a file may be partial */
+	if (use_direct && (len % FILEWRITER_ALIGN)) {
+		int flags = fcntl(fd, F_GETFL);
+		if (flags & O_DIRECT)
+			fcntl(fd, F_SETFL, flags & ~O_DIRECT);
+	}
+
+	unsigned long long t = filewriter_now_us();
+	while (len > 0) {
+		ssize_t n = write(fd, p, len);
+		if ((n < 0) && (errno == EINTR))
+			continue;
+		if (n <= 0) {
+			fprintf(stderr, "%s() write failed, %s\n", __func__, strerror(errno));
+			break;
+		}
+		p += n;
+		len -= n;
+	}
+	t = filewriter_now_us() - t;
+
+	fd_len += b->len - len;
+	bytes_written += b->len - len;
+	write_us += t;
+	metrics_add(fw_metrics.bytes, b->len - len);
+	metrics_add(fw_metrics.write_us, t);
+
+	if (b->last)
+		filewriter_file_close();
+}
+
+static void *filewriter_thread_func(void *arg)
+{
+	pthread_mutex_lock(&writer_mutex);
+	while (writer_running || full_count) {
+		if (full_count == 0) {
+			pthread_cond_wait(&writer_cond, &writer_mutex);
+			continue;
+		}
+
+		int idx = full_list[full_head];
+		full_head = (full_head + 1) % FILEWRITER_BUFFERS;
+		full_count--;
+		pthread_mutex_unlock(&writer_mutex);
+
+		filewriter_write(&buffers[idx]);
+
+		pthread_mutex_lock(&writer_mutex);
+		free_list[free_count++] = idx;
+	}
+	pthread_mutex_unlock(&writer_mutex);
+
+	filewriter_file_close();
+
+	return NULL;
+}
+
+/* Encode thread. Hand cur to the writer, never waiting for it. */
+static void filewriter_submit(int last)
+{
+	int carry = 0;
+
+	if (!cur)
+		return;
+
+	/* O_DIRECT writes whole blocks, the remainder moves to the next buffer */
+	if (use_direct && !last)
+		carry = cur->len % FILEWRITER_ALIGN;
+	cur->len -= carry;
+	cur->last = last;
+
+	pthread_mutex_lock(&writer_mutex);
+	if (cur->len || last)
+		full_list[(full_head + full_count++) % FILEWRITER_BUFFERS] = cur - buffers;
+	else
+		free_list[free_count++] = cur - buffers;
+
+	struct filewriter_buffer_s *next = NULL;
+	if (free_count)
+		next = &buffers[free_list[--free_count]];
+	pthread_cond_signal(&writer_cond);
+	pthread_mutex_unlock(&writer_mutex);
+
+	if (next) {
+		memcpy(next->data, cur->data + cur->len, carry);
+		next->len = carry;
+		next->segment = segment;
+		next->last = 0;
+	} else {
+		/* Writer is behind, the stream is broken until the next IDR */
+		buffers_dropped++;
+		metrics_add(fw_metrics.dropped, 1);
+		dropping = 1;
+	}
+	cur = next;
+	cur_ms = filewriter_now_us() / 1000;
+}
+
+/* Encode thread, find a buffer to write into. Returns NULL when none are free. */
+static struct filewriter_buffer_s *filewriter_buffer()
+{
+	if (cur)
+		return cur;
+
+	pthread_mutex_lock(&writer_mutex);
+	if (free_count)
+		cur = &buffers[free_list[--free_count]];
+	pthread_mutex_unlock(&writer_mutex);
+
+	if (cur) {
+		cur->len = 0;
+		cur->segment = segment;
+		cur->last = 0;
+		cur_ms = filewriter_now_us() / 1000;
+	}
+
+	return cur;
+}
+
+static int filewriter_codeddata(unsigned char *buf, int len, int frame_type)
+{
+	if (!au_open) {
+		au_open = 1;
+
+		if (frame_type == FRAME_IDR) {
+			/* Rotate ahead of the IDR once the segment is due */
+			int due = (max_bytes && (segment_len >= max_bytes)) ||
+				(max_seconds && segment_have_pts &&
+				(segment_last90k - segment_start90k >= max_seconds * 90000ULL));
+			if (due) {
+				filewriter_submit(1);
+				segment++;
+				segment_len = 0;
+				segment_have_pts = 0;
+				if (cur)
+					cur->segment = segment;
+			}
+			dropping = 0;
+		}
+	}
+
+	while (len > 0 && !dropping) {
+		struct filewriter_buffer_s *b = filewriter_buffer();
+		if (!b) {
+			buffers_dropped++;
+			metrics_add(fw_metrics.dropped, 1);
+			dropping = 1;
+			break;
+		}
+
+		int n = FILEWRITER_BUFFER_SIZE - b->len;
+		if (n > len)
+			n = len;
+		memcpy(b->data + b->len, buf, n);
+		b->len += n;
+		buf += n;
+		len -= n;
+		segment_len += n;
+
+		if (b->len == FILEWRITER_BUFFER_SIZE)
+			filewriter_submit(0);
+	}
+
+	return 0;
+}
+
+static void filewriter_frame_complete(int frame_type, unsigned long long pts90k, unsigned long long dts90k)
+{
+	au_open = 0;
+
+	if (!segment_have_pts) {
+		segment_start90k = dts90k;
+		segment_have_pts = 1;
+	}
+	segment_last90k = dts90k;
+
+	/* Don't let a low bitrate stream sit in memory for long */
+	if (cur && cur->len && ((filewriter_now_us() / 1000) - cur_ms >= FILEWRITER_SUBMIT_MS))
+		filewriter_submit(0);
+}
+
+static struct output_sink_s filewriter_sink =
+{
+	.name		= "File",
+	.codeddata	= filewriter_codeddata,
+	.frame_complete	= filewriter_frame_complete,
+};
+
+int filewriter_open(char *filename, unsigned long long segment_bytes, unsigned int segment_seconds,
+	int direct)
+{
+	file_name = filename;
+	max_bytes = segment_bytes;
+	max_seconds = segment_seconds;
+	use_direct = direct;
+
+	free_count = 0;
+	full_head = 0;
+	full_count = 0;
+	for (int i = 0; i < FILEWRITER_BUFFERS; i++) {
+		if (posix_memalign((void **)&buffers[i].data, FILEWRITER_ALIGN, FILEWRITER_BUFFER_SIZE) != 0) {
+			filewriter_close();
+			return -1;
+		}
+		/* Fault the pages in now rather than on the encode thread */
+		memset(buffers[i].data, 0, FILEWRITER_BUFFER_SIZE);
+		free_list[free_count++] = i;
+	}
+
+	segment = 0;
+	segment_len = 0;
+	segment_have_pts = 0;
+	au_open = 0;
+	dropping = 0;
+	cur = NULL;
+	bytes_written = write_us = buffers_dropped = 0;
+
+	/* Before the first file, so file_segments counts it */
+	fw_metrics.bytes = metrics_register("file_bytes", METRIC_COUNTER);
+	fw_metrics.write_us = metrics_register("file_write_us", METRIC_COUNTER);
+	fw_metrics.dropped = metrics_register("file_buffers_dropped", METRIC_COUNTER);
+	fw_metrics.segments = metrics_register("file_segments", METRIC_COUNTER);
+
+	/* Fail early, the writer opens each file itself */
+	if (filewriter_file_open(segment) < 0) {
+		filewriter_close();
+		return -1;
+	}
+
+	writer_running = 1;
+	if (pthread_create(&writer_thread, NULL, filewriter_thread_func, NULL) != 0) {
+		writer_running = 0;
+		filewriter_close();
+		return -1;
+	}
+
+	return output_register(&filewriter_sink);
+}
+
+void filewriter_close()
+{
+	output_unregister(&filewriter_sink);
+
+	if (writer_running) {
+		/* Whatever is buffered, then let the writer drain and exit */
+		filewriter_submit(1);
+
+		pthread_mutex_lock(&writer_mutex);
+		writer_running = 0;
+		pthread_cond_signal(&writer_cond);
+		pthread_mutex_unlock(&writer_mutex);
+		pthread_join(writer_thread, NULL);
+
+		printf("File writer: %llu bytes in %u files, %.1f MB/s while writing, %llu buffers dropped\n",
+			bytes_written, segment + 1,
+			write_us ? (double)bytes_written / write_us : 0.0, buffers_dropped);
+	}
+	filewriter_file_close();
+
+	for (int i = 0; i < FILEWRITER_BUFFERS; i++) {
+		free(buffers[i].data);
+		buffers[i].data = NULL;
+	}
+	cur = NULL;
+}
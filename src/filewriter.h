@@ -0,0 +1,49 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef FILEWRITER_H
+#define FILEWRITER_H
+
+/* Records the coded stream to disk from a dedicated thread. The encode
+ * thread only copies nals into large page aligned buffers, full buffers
+ * are written (optionally O_DIRECT) by the writer, so a slow or stalled
+ * disk costs dropped data rather than encoder time. Files can be rotated
+ * by size or duration, always starting a new file with an IDR.
+ */
+
+#define FILEWRITER_BUFFERS		16
+#define FILEWRITER_BUFFER_SIZE		(4 * 1048576)
+#define FILEWRITER_ALIGN		4096
+#define FILEWRITER_SUBMIT_MS		500		/* Partly full buffers wait this long at most */
+#define FILEWRITER_PREALLOCATE		(64 * 1048576)	/* fallocate() ahead of the data by this much */
+
+/* segment_bytes / segment_seconds of 0 disable that rotation trigger. With
+ * rotation, files are named with a sequence number before the extension.
+ */
+int  filewriter_open(char *filename, unsigned long long segment_bytes, unsigned int segment_seconds,
+	int direct);
+void filewriter_close();
+
+#endif
@@ -0,0 +1,599 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "httpserver.h"
+#include "tsmux.h"
+#include "output.h"
+#include "frames.h"
+#include "metrics.h"
+
+#define HTTPSERVER_IOV	64		/* Chunks per send */
+
+/* One muxed access unit, shared by the GOP cache and every client queue */
+struct httpserver_chunk_s
+{
+	int refs;
+	int len;
+	unsigned char data[];
+};
+
+enum httpserver_client_state_e {
+	CLIENT_FREE = 0,
+	CLIENT_REQUEST,		/* Waiting for (or sniffing for) an HTTP request */
+	CLIENT_STREAMING,
+};
+
+struct httpserver_client_s
+{
+	enum httpserver_client_state_e state;
+	int fd;
+	struct sockaddr_in addr;
+	unsigned long long accepted_ms;
+	int evict;			/* Set by the encode thread, closed by the server */
+
+	char request[HTTPSERVER_REQUEST_MAX];
+	int request_len;
+
+	/* Response header, sent ahead of the queue */
+	char header[256];
+	int header_len, header_sent;
+
+	struct httpserver_chunk_s *queue[HTTPSERVER_QUEUE_CHUNKS];
+	int q_head, q_count;
+	unsigned int q_bytes;
+	int q_offset;			/* Bytes of the head chunk already sent */
+	int want_out;			/* EPOLLOUT armed */
+};
+
+/* Encode thread */
+static struct tsmux_ctx_s tsmux;
+static unsigned char *au_buf = NULL;
+static int au_len, au_size;
+
+/* Shared, under server_mutex */
+static struct httpserver_client_s clients[HTTPSERVER_CLIENTS_MAX];
+static struct httpserver_chunk_s *gop[HTTPSERVER_QUEUE_CHUNKS];
+static int gop_count;
+static unsigned int gop_bytes;
+static int gop_valid;			/* The cache starts with an IDR */
+static pthread_mutex_t server_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Server thread */
+static int listen_fd = -1, event_fd = -1, epoll_fd = -1;
+static int server_dscp;
+static int client_count;
+static pthread_t server_thread;
+static volatile int server_running = 0;
+
+static struct {
+	struct metric_s *clients;
+	struct metric_s *bytes;
+	struct metric_s *evicted;
+} http_metrics;
+
+static unsigned long long httpserver_now_ms()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000ULL) + (ts.tv_nsec / 1000000);
+}
+
+/* Called with server_mutex held */
+static void httpserver_chunk_put(struct httpserver_chunk_s *c)
+{
+	if (--c->refs == 0)
+		free(c);
+}
+
+static int httpserver_enqueue(struct httpserver_client_s *cl, struct httpserver_chunk_s *c)
+{
+	if ((cl->q_count == HTTPSERVER_QUEUE_CHUNKS) || (cl->q_bytes + c->len > HTTPSERVER_QUEUE_BYTES))
+		return -1;
+
+	cl->queue[(cl->q_head + cl->q_count++) % HTTPSERVER_QUEUE_CHUNKS] = c;
+	cl->q_bytes += c->len;
+	c->refs++;
+
+	return 0;
+}
+
+static void httpserver_gop_reset()
+{
+	for (int i = 0; i < gop_count; i++)
+		httpserver_chunk_put(gop[i]);
+	gop_count = 0;
+	gop_bytes = 0;
+}
+
+/* Encode thread, tsmux output for the access unit being muxed */
+static void httpserver_append(void *priv, unsigned char *buf, int len)
+{
+	if (au_len + len > au_size) {
+		int size = au_size ? au_size * 2 : 1048576;
+		while (size < au_len + len)
+			size *= 2;
+		unsigned char *p = realloc(au_buf, size);
+		if (!p)
+			return;
+		au_buf = p;
+		au_size = size;
+	}
+	memcpy(au_buf + au_len, buf, len);
+	au_len += len;
+}
+
+static int httpserver_codeddata(unsigned char *buf, int len, int frame_type)
+{
+	return tsmux_write_es(&tsmux, buf, len);
+}
+
+static void httpserver_frame_complete(int frame_type, unsigned long long pts90k, unsigned long long dts90k)
+{
+	int idr = (frame_type == FRAME_IDR);
+
+	au_len = 0;
+	tsmux_frame_complete(&tsmux, idr, pts90k, dts90k);
+	if (au_len == 0)
+		return;
+
+	struct httpserver_chunk_s *c = malloc(sizeof(*c) + au_len);
+	if (!c)
+		return;
+	c->refs = 1;
+	c->len = au_len;
+	memcpy(c->data, au_buf, au_len);
+
+	pthread_mutex_lock(&server_mutex);
+
+	/* The cache always holds the GOP in progress, from its IDR */
+	if (idr) {
+		httpserver_gop_reset();
+		gop_valid = 1;
+	}
+	if (gop_valid) {
+		if ((gop_count < HTTPSERVER_QUEUE_CHUNKS) && (gop_bytes + c->len <= HTTPSERVER_QUEUE_BYTES)) {
+			gop[gop_count++] = c;
+			gop_bytes += c->len;
+			c->refs++;
+		} else {
+			/* Too long to replay, new clients wait for the next IDR */
+			httpserver_gop_reset();
+			gop_valid = 0;
+		}
+	}
+
+	for (int i = 0; i < HTTPSERVER_CLIENTS_MAX; i++) {
+		struct httpserver_client_s *cl = &clients[i];
+		if ((cl->state != CLIENT_STREAMING) || cl->evict)
+			continue;
+		if (httpserver_enqueue(cl, c) < 0)
+			cl->evict = 1;
+	}
+
+	httpserver_chunk_put(c);
+	pthread_mutex_unlock(&server_mutex);
+
+	/* Wake the server */
+	unsigned long long one = 1;
+	if (write(event_fd, &one, sizeof(one)) < 0) {
+		/* Counter overflow only, the server is awake anyway */
+	}
+}
+
+static struct output_sink_s httpserver_sink =
+{
+	.name		= "HTTP",
+	.codeddata	= httpserver_codeddata,
+	.frame_complete	= httpserver_frame_complete,
+};
+
+/* Server thread */
+static void httpserver_epoll_mod(struct httpserver_client_s *cl, int want_out)
+{
+	struct epoll_event ev = {
+		.events = EPOLLIN | (want_out ? EPOLLOUT : 0),
+		.data.ptr = cl,
+	};
+
+	if (cl->want_out == want_out)
+		return;
+	cl->want_out = want_out;
+	epoll_ctl(epoll_fd, EPOLL_CTL_MOD, cl->fd, &ev);
+}
+
+static void httpserver_client_close(struct httpserver_client_s *cl, char *reason)
+{
+	printf("HTTP client %s:%d %s\n", inet_ntoa(cl->addr.sin_addr), ntohs(cl->addr.sin_port), reason);
+
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, cl->fd, NULL);
+	close(cl->fd);
+
+	pthread_mutex_lock(&server_mutex);
+	while (cl->q_count) {
+		httpserver_chunk_put(cl->queue[cl->q_head]);
+		cl->q_head = (cl->q_head + 1) % HTTPSERVER_QUEUE_CHUNKS;
+		cl->q_count--;
+	}
+	cl->state = CLIENT_FREE;
+	pthread_mutex_unlock(&server_mutex);
+
+	metrics_set(http_metrics.clients, --client_count);
+}
+
+/* Start streaming, primed with the cached GOP */
+static void httpserver_client_start(struct httpserver_client_s *cl)
+{
+	pthread_mutex_lock(&server_mutex);
+	cl->q_head = cl->q_count = 0;
+	cl->q_bytes = 0;
+	cl->q_offset = 0;
+	for (int i = 0; i < gop_count; i++)
+		httpserver_enqueue(cl, gop[i]);
+	cl->state = CLIENT_STREAMING;
+	pthread_mutex_unlock(&server_mutex);
+
+	printf("HTTP client %s:%d streaming%s, %d frames cached\n", inet_ntoa(cl->addr.sin_addr),
+		ntohs(cl->addr.sin_port), cl->header_len ? "" : " (raw TCP)", cl->q_count);
+}
+
+/* Send as much as the socket takes. Returns -1 when the client has gone. */
+static int httpserver_client_flush(struct httpserver_client_s *cl)
+{
+	while (cl->header_sent < cl->header_len) {
+		ssize_t n = send(cl->fd, cl->header + cl->header_sent, cl->header_len - cl->header_sent, MSG_NOSIGNAL);
+		if (n < 0) {
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+				httpserver_epoll_mod(cl, 1);
+				return 0;
+			}
+			return -1;
+		}
+		cl->header_sent += n;
+	}
+
+	for (;;) {
+		struct iovec iov[HTTPSERVER_IOV];
+		int cnt = 0;
+
+		/* The chunks are immutable and referenced, send them unlocked */
+		pthread_mutex_lock(&server_mutex);
+		for (int i = 0; (i < cl->q_count) && (cnt < HTTPSERVER_IOV); i++) {
+			struct httpserver_chunk_s *c = cl->queue[(cl->q_head + i) % HTTPSERVER_QUEUE_CHUNKS];
+			int skip = i ? 0 : cl->q_offset;
+			iov[cnt].iov_base = c->data + skip;
+			iov[cnt].iov_len = c->len - skip;
+			cnt++;
+		}
+		pthread_mutex_unlock(&server_mutex);
+
+		if (cnt == 0) {
+			httpserver_epoll_mod(cl, 0);
+			return 0;
+		}
+
+		struct msghdr msg = { .msg_iov = iov, .msg_iovlen = cnt };
+		ssize_t n = sendmsg(cl->fd, &msg, MSG_NOSIGNAL);
+		if (n < 0) {
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+				httpserver_epoll_mod(cl, 1);
+				return 0;
+			}
+			return -1;
+		}
+		metrics_add(http_metrics.bytes, n);
+
+		/* Retire what went out */
+		pthread_mutex_lock(&server_mutex);
+		while (n > 0) {
+			struct httpserver_chunk_s *c = cl->queue[cl->q_head];
+			int left = c->len - cl->q_offset;
+			if (n < left) {
+				cl->q_offset += n;
+				break;
+			}
+			n -= left;
+			cl->q_offset = 0;
+			cl->q_bytes -= c->len;
+			cl->q_head = (cl->q_head + 1) % HTTPSERVER_QUEUE_CHUNKS;
+			cl->q_count--;
+			httpserver_chunk_put(c);
+		}
+		pthread_mutex_unlock(&server_mutex);
+	}
+}
+
+static void httpserver_accept()
+{
+	for (;;) {
+		struct sockaddr_in addr;
+		socklen_t alen = sizeof(addr);
+		int fd = accept4(listen_fd, (struct sockaddr *)&addr, &alen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0)
+			return;
+
+		struct httpserver_client_s *cl = NULL;
+		for (int i = 0; i < HTTPSERVER_CLIENTS_MAX; i++) {
+			if (clients[i].state == CLIENT_FREE) {
+				cl = &clients[i];
+				break;
+			}
+		}
+		if (!cl) {
+			printf("HTTP client %s:%d rejected, %d clients already\n",
+				inet_ntoa(addr.sin_addr), ntohs(addr.sin_port), HTTPSERVER_CLIENTS_MAX);
+			close(fd);
+			continue;
+		}
+
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		if (server_dscp) {
+			int tos = server_dscp << 2;
+			setsockopt(fd, IPPROTO_IP, IP_TOS, &tos, sizeof(tos));
+		}
+
+		memset(cl, 0, sizeof(*cl));
+		cl->fd = fd;
+		cl->addr = addr;
+		cl->accepted_ms = httpserver_now_ms();
+
+		struct epoll_event ev = { .events = EPOLLIN, .data.ptr = cl };
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+			close(fd);
+			continue;
+		}
+		cl->state = CLIENT_REQUEST;
+		metrics_set(http_metrics.clients, ++client_count);
+	}
+}
+
+static void httpserver_client_read(struct httpserver_client_s *cl)
+{
+	char discard[1024];
+
+	if (cl->state == CLIENT_STREAMING) {
+		/* Nothing more is expected, this is how we see the close */
+		ssize_t n = recv(cl->fd, discard, sizeof(discard), 0);
+		if ((n == 0) || ((n < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK)))
+			httpserver_client_close(cl, "disconnected");
+		return;
+	}
+
+	ssize_t n = recv(cl->fd, cl->request + cl->request_len, sizeof(cl->request) - 1 - cl->request_len, 0);
+	if (n <= 0) {
+		if ((n == 0) || ((errno != EAGAIN) && (errno != EWOULDBLOCK)))
+			httpserver_client_close(cl, "disconnected");
+		return;
+	}
+	cl->request_len += n;
+	cl->request[cl->request_len] = 0;
+
+	if (!strstr(cl->request, "\r\n\r\n") && !strstr(cl->request, "\n\n")) {
+		if (cl->request_len == sizeof(cl->request) - 1)
+			httpserver_client_close(cl, "request too large");
+		return;
+	}
+
+	if (strncmp(cl->request, "GET ", 4) != 0) {
+		static const char *bad = "HTTP/1.0 405 Method Not Allowed\r\nConnection: close\r\n\r\n";
+		if (send(cl->fd, bad, strlen(bad), MSG_NOSIGNAL) < 0) {
+			/* Closing anyway */
+		}
+		httpserver_client_close(cl, "bad request");
+		return;
+	}
+
+	cl->header_len = snprintf(cl->header, sizeof(cl->header),
+		"HTTP/1.0 200 OK\r\n"
+		"Content-Type: video/mp2t\r\n"
+		"Cache-Control: no-cache\r\n"
+		"Connection: close\r\n"
+		"\r\n");
+	httpserver_client_start(cl);
+	if (httpserver_client_flush(cl) < 0)
+		httpserver_client_close(cl, "disconnected");
+}
+
+/* Raw TCP clients never send a request, give up waiting for one */
+static void httpserver_timeouts()
+{
+	unsigned long long now = httpserver_now_ms();
+
+	for (int i = 0; i < HTTPSERVER_CLIENTS_MAX; i++) {
+		struct httpserver_client_s *cl = &clients[i];
+
+		if (cl->state == CLIENT_STREAMING && cl->evict) {
+			metrics_add(http_metrics.evicted, 1);
+			httpserver_client_close(cl, "evicted, too slow");
+			continue;
+		}
+		if (cl->state != CLIENT_REQUEST)
+			continue;
+
+		if ((cl->request_len == 0) && (now - cl->accepted_ms >= HTTPSERVER_SNIFF_MS)) {
+			httpserver_client_start(cl);
+			if (httpserver_client_flush(cl) < 0)
+				httpserver_client_close(cl, "disconnected");
+		} else if (now - cl->accepted_ms >= HTTPSERVER_REQUEST_MS)
+			httpserver_client_close(cl, "request timeout");
+	}
+}
+
+static void *httpserver_thread_func(void *arg)
+{
+	struct epoll_event events[HTTPSERVER_CLIENTS_MAX + 2];
+
+	while (server_running) {
+		int n = epoll_wait(epoll_fd, events, HTTPSERVER_CLIENTS_MAX + 2, HTTPSERVER_SNIFF_MS / 5);
+
+		for (int i = 0; i < n; i++) {
+			void *ptr = events[i].data.ptr;
+
+			if (ptr == &listen_fd) {
+				httpserver_accept();
+			} else if (ptr == &event_fd) {
+				/* New data for everyone */
+				unsigned long long v;
+				if (read(event_fd, &v, sizeof(v)) < 0) {
+					/* Non blocking, nothing pending */
+				}
+				for (int j = 0; j < HTTPSERVER_CLIENTS_MAX; j++) {
+					struct httpserver_client_s *cl = &clients[j];
+					if ((cl->state == CLIENT_STREAMING) && !cl->evict && !cl->want_out &&
+						(httpserver_client_flush(cl) < 0))
+						httpserver_client_close(cl, "disconnected");
+				}
+			} else {
+				struct httpserver_client_s *cl = ptr;
+				if (cl->state == CLIENT_FREE)
+					continue;
+				if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+					httpserver_client_close(cl, "disconnected");
+					continue;
+				}
+				if (events[i].events & EPOLLIN)
+					httpserver_client_read(cl);
+				if ((cl->state == CLIENT_STREAMING) && (events[i].events & EPOLLOUT) &&
+					(httpserver_client_flush(cl) < 0))
+					httpserver_client_close(cl, "disconnected");
+			}
+		}
+
+		httpserver_timeouts();
+	}
+
+	for (int i = 0; i < HTTPSERVER_CLIENTS_MAX; i++)
+		if (clients[i].state != CLIENT_FREE)
+			httpserver_client_close(&clients[i], "closed, shutting down");
+
+	return NULL;
+}
+
+int httpserver_open(int port, int dscp)
+{
+	struct sockaddr_in addr;
+	int one = 1;
+
+	server_dscp = dscp;
+	client_count = 0;
+	memset(clients, 0, sizeof(clients));
+	gop_count = 0;
+	gop_bytes = 0;
+	gop_valid = 0;
+
+	listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (listen_fd < 0) {
+		fprintf(stderr, "%s() socket failed, %s\n", __func__, strerror(errno));
+		return -1;
+	}
+	setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(port);
+	if ((bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) || (listen(listen_fd, 16) < 0)) {
+		fprintf(stderr, "%s() unable to listen on port %d, %s\n", __func__, port, strerror(errno));
+		httpserver_close();
+		return -1;
+	}
+
+	event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if ((event_fd < 0) || (epoll_fd < 0)) {
+		fprintf(stderr, "%s() epoll setup failed, %s\n", __func__, strerror(errno));
+		httpserver_close();
+		return -1;
+	}
+
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &listen_fd };
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+	ev.data.ptr = &event_fd;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, event_fd, &ev);
+
+	if (tsmux_alloc(&tsmux, 0, 0, httpserver_append, NULL) < 0) {
+		httpserver_close();
+		return -1;
+	}
+
+	http_metrics.clients = metrics_register("http_clients", METRIC_GAUGE);
+	http_metrics.bytes = metrics_register("http_bytes", METRIC_COUNTER);
+	http_metrics.evicted = metrics_register("http_evicted", METRIC_COUNTER);
+
+	server_running = 1;
+	if (pthread_create(&server_thread, NULL, httpserver_thread_func, NULL) != 0) {
+		server_running = 0;
+		httpserver_close();
+		return -1;
+	}
+
+	printf("HTTP/TCP server for MPEG-TS on port %d\n", port);
+
+	return output_register(&httpserver_sink);
+}
+
+void httpserver_close()
+{
+	output_unregister(&httpserver_sink);
+
+	if (server_running) {
+		server_running = 0;
+		pthread_join(server_thread, NULL);
+	}
+
+	pthread_mutex_lock(&server_mutex);
+	httpserver_gop_reset();
+	pthread_mutex_unlock(&server_mutex);
+
+	if (tsmux.out)
+		tsmux_free(&tsmux);
+	free(au_buf);
+	au_buf = NULL;
+	au_len = au_size = 0;
+
+	if (epoll_fd >= 0)
+		close(epoll_fd);
+	if (event_fd >= 0)
+		close(event_fd);
+	if (listen_fd >= 0)
+		close(listen_fd);
+	epoll_fd = event_fd = listen_fd = -1;
+}
@@ -0,0 +1,48 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef HTTPSERVER_H
+#define HTTPSERVER_H
+
+/* Serves the stream as MPEG-TS to TCP clients, plain HTTP GET or raw TCP
+ * (a client that says nothing for HTTPSERVER_SNIFF_MS). One epoll thread
+ * handles every connection. Each access unit is muxed once into a
+ * reference counted chunk shared by all the client queues, and the chunks
+ * since the last IDR are kept so that a new client starts with PAT/PMT,
+ * SPS/PPS and a whole GOP rather than waiting for the next IDR. Clients
+ * that fall HTTPSERVER_QUEUE_BYTES behind are disconnected.
+ */
+
+#define HTTPSERVER_CLIENTS_MAX	64
+#define HTTPSERVER_QUEUE_CHUNKS	2048		/* Access units queued per client */
+#define HTTPSERVER_QUEUE_BYTES	(16 * 1048576)	/* Also bounds the GOP cache */
+#define HTTPSERVER_SNIFF_MS	250		/* No request by then, raw TCP */
+#define HTTPSERVER_REQUEST_MS	2000		/* Time allowed to send the request */
+#define HTTPSERVER_REQUEST_MAX	2048
+
+int  httpserver_open(int port, int dscp);
+void httpserver_close();
+
+#endif
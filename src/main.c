@@ -32,7 +32,6 @@
 #include <stdlib.h>
 #include <string.h>
 
-#include <libes2ts/es2ts.h>
 #include <libipcvideo/ipcvideo.h>
 
 #include "capture.h"
@@ -40,6 +39,14 @@
 #include "mxcvpuudp.h"
 #include "encoder.h"
 #include "es2ts.h"
+#include "udpout.h"
+#include "fec.h"
+#include "congestion.h"
+#include "segmenter.h"
+#include "dvr.h"
+#include "httpserver.h"
+#include "rtsp.h"
+#include "shmout.h"
 #include "main.h"
 
 unsigned int capturemode = CM_V4L;
@@ -57,6 +64,25 @@ static void signalTermHandler(int a_Signal)
 	signal(SIGTERM, SIG_DFL);
 }
 
+static void signalHupHandler(int a_Signal)
+{
+	/* Pick up receiver list changes */
+	udpout_destinations_reload();
+}
+
+static void signalUsr1Handler(int a_Signal)
+{
+	/* Write out the DVR ring */
+	dvr_trigger();
+}
+
+/* RTCP thread, the congestion controller moved the target */
+static struct encoder_params_s *adaptive_params = NULL;
+static void adaptiveBitrate(unsigned int bps)
+{
+	encoder_request_bitrate(adaptive_params, bps);
+}
+
 static void usage(struct encoder_operations_s *encoder, int argc, char **argv)
 {
 	struct encoder_params_s p;
@@ -73,15 +99,33 @@ static void usage(struct encoder_operations_s *encoder, int argc, char **argv)
 	        "-q, --quiet                   Don't display progress indicator\n"
 		"-b, --bitrate <number>        Encoding bitrate [def: %d]\n"
 		"-d, --device=NAME             Video device name [/dev/video0]\n"
-		"-o, --output=filename         Record raw nals to output file\n"
+		"-o, --output=filename         Record raw nals to output file, fragmented MP4 if named .mp4\n"
+		"    --segment_size <MB>       Start a new output file at the first IDR past this size\n"
+		"    --segment_duration <sec>  Start a new output file at the first IDR past this duration\n"
+		"    --file_direct             Write the output file with O_DIRECT, bypassing the page cache\n"
+		"    --hls_dir <directory>     Write live HLS segments and index.m3u8 to directory\n"
+		"    --hls_format <ts|fmp4>    HLS segment container, fmp4 also writes a DASH manifest.mpd [def: ts]\n"
+		"    --hls_duration <sec>      Target segment duration, segments start on IDRs [def: 2]\n"
+		"    --hls_part <ms>           Low latency HLS parts of this duration. 0=off [def: 0]\n"
+		"    --hls_window <number>     Segments kept on disk and in the playlist [def: 6]\n"
+		"    --dvr_seconds <sec>       Keep the last N seconds in memory, written out on SIGUSR1\n"
+		"    --dvr_bytes <MB>          Upper bound on the DVR memory [def: 256]\n"
+		"    --dvr_dir <directory>     Where DVR dumps are written [def: .]\n"
+		"    --dvr_post <sec>          Keep writing this long after the SIGUSR1 [def: 0]\n"
+		"    --http_port <number>      Serve MPEG-TS to HTTP and raw TCP clients on this port\n"
+		"    --rtsp_port <number>      RTSP server for pull clients, RTP over UDP or TCP\n"
+		"    --shm <name>              Publish access units to a shared memory ring, see shmout.h\n"
+		"    --shm_size <MB>           Shared memory ring size, min 1 [def: 64]\n"
 		"-O, --csv=filename            Record output frames to a file\n"
 		"-i, --ipaddress=a.b.c.d       Remote IP RTP address\n"
 		"-p, --ipport=9999             Remote IP RTP port\n"
 		"    --mxc_ipaddress=a.b.c.d   Freescale MXC_VPU_TEST UDP IP address\n"
 		"    --mxc_ipport=9999         Freescale MXC_CPU_TEST UDP port\n"
 		"    --mxc_endian <0,1>        0 = little, 1 = big [def: 1]\n"
-		"    --mxc_validate <file>     Scan file and check for any basic header errors\n"
+		"    --mxc_validate <file>     Scan a mode 1 or 2 capture for header, sequence and fragment errors\n"
+		"    --mxc_validate_out <file> Write the reassembled nals from --mxc_validate as Annex-B\n"
 		"    --mxc_sendmode <1,2>      1=single xfer, 2=large-iframe [def: 2]\n"
+		"    --mxc_gso                 Use UDP segmentation offload for mode 2 fragments\n"
 		"    --dscp=XXX                DSCP class to use 1-63 (for example 26 for AF31)\n"
 		"    --packet-size=XXX         Use an alternate packet size\n"
 		"    --ifd=N                   Specify an interframe delay in microseconds\n"
@@ -94,6 +138,7 @@ static void usage(struct encoder_operations_s *encoder, int argc, char **argv)
 		"-M, --mode <number>           0=v4l 1=ipcvideo 2=fixedframe 3=fixedframe4k [def: 0]\n"
 		"                              4=decklink SDI 1080p60 (also see decklink-index)\n"
 		"-D, --vppdeinterlace <number> 0=off 1=motionadaptive 2=bob\n"
+		"    --cpu_deinterlace         Deinterlace on the CPU, implied for non vaapi encoders\n"
 		"    --compressor <number>     0=vaapi 1=libavcodec/x264 2=x264 [def: 0]\n",
 		p.frame_bitrate
 		);
@@ -107,9 +152,27 @@ static void usage(struct encoder_operations_s *encoder, int argc, char **argv)
 		"    --entropy <0|1>, 1 means cabac, 0 cavlc [def: %d]\n"
 		"    --profile <BP|CBP|MP|HP>  [def: %s]\n"
 		"    --payloadmode <0|1>, 0 means RTP/TS, 1 RTP/ES [def: 0]\n"
+		"    --mux_rate <bps>          RTP/TS constant mux rate, null packet padded. 0=VBR [def: 0]\n"
+		"    --pcr_interval <ms>       RTP/TS maximum interval between PCRs [def: 40]\n"
+		"    --ts_udp                  Send TS as plain UDP, without RTP headers\n"
+		"    --shape_rate <bps>        Pace all network output to this rate. 0=off [def: 0]\n"
+		"    --shape_burst <bytes>     Shaper bucket size [def: 2ms at shape_rate]\n"
+		"    --txtime                  Shaper hands launch times to the kernel (SO_TXTIME, ETF qdisc)\n"
+		"    --destinations <file>     Also send to each a.b.c.d[:port] listed, re-read on SIGHUP\n"
+		"    --nack                    RTP/ES retransmits packets NACKed (RTCP on port + 1)\n"
+		"    --rtx                     Retransmit as an RFC 4588 stream, pt 97 [def: resend as is]\n"
+		"    --bitrate_range <min,max> RTP/ES adapts the bitrate to receiver reports within range (bps)\n"
+		"    --fec <L[,D]>             SMPTE 2022-1 XOR FEC, L columns by D rows, to port + 2 and + 4\n"
+		"    --ttl <number>            Multicast TTL [def: 1]\n"
+		"    --mcast_if a.b.c.d        Multicast from the interface with this address\n"
 		"    --level_idc <number>      [def: %d]\n"
 		"    --hrd_bitrate_multiplier <number> [def: %d]\n"
-		"    --decklink-index <number> [def: 0]\n",
+		"    --decklink-index <number> [def: 0]\n"
+		"    --scenecut <0-100>        IDR on scene cuts, %% luma histogram change. 0=off [def: %d]\n"
+		"    --gop_min <number>        Minimum frames between scene cut IDRs [def: framerate / 2]\n"
+		"    --gop_max <number>        Stretch the GOP up to N frames on static content [def: %d]\n"
+		"    --metrics <filename>      Write encoder metrics once per second to file\n"
+		"    --denoise <luma[,chroma]> Temporal noise reduction thresholds 0-255. 0=off [def: 0]\n",
 			p.initial_qp,
 			p.minimal_qp,
 			p.intra_period,
@@ -119,7 +182,9 @@ static void usage(struct encoder_operations_s *encoder, int argc, char **argv)
 			p.h264_entropy_mode,
 			encoder_profile_to_string(p.h264_profile),
 			p.level_idc,
-			p.hrd_bitrate_multiplier
+			p.hrd_bitrate_multiplier,
+			p.scenecut_threshold,
+			p.gop_max
 	       );
 }
 
@@ -169,6 +234,43 @@ static const struct option long_options[] = {
 	{ "hrd_bitrate_multiplier", required_argument, NULL, 20 },
 	{ "compressor", required_argument, NULL, 21 },
 	{ "decklink-index", required_argument, NULL, 22 },
+	{ "scenecut", required_argument, NULL, 23 },
+	{ "gop_min", required_argument, NULL, 24 },
+	{ "gop_max", required_argument, NULL, 25 },
+	{ "metrics", required_argument, NULL, 26 },
+	{ "cpu_deinterlace", no_argument, NULL, 27 },
+	{ "denoise", required_argument, NULL, 28 },
+	{ "mxc_gso", no_argument, NULL, 29 },
+	{ "mux_rate", required_argument, NULL, 30 },
+	{ "pcr_interval", required_argument, NULL, 31 },
+	{ "ts_udp", no_argument, NULL, 32 },
+	{ "shape_rate", required_argument, NULL, 33 },
+	{ "shape_burst", required_argument, NULL, 34 },
+	{ "txtime", no_argument, NULL, 35 },
+	{ "destinations", required_argument, NULL, 36 },
+	{ "ttl", required_argument, NULL, 37 },
+	{ "mcast_if", required_argument, NULL, 38 },
+	{ "nack", no_argument, NULL, 39 },
+	{ "rtx", no_argument, NULL, 40 },
+	{ "fec", required_argument, NULL, 41 },
+	{ "bitrate_range", required_argument, NULL, 42 },
+	{ "segment_size", required_argument, NULL, 43 },
+	{ "segment_duration", required_argument, NULL, 44 },
+	{ "file_direct", no_argument, NULL, 45 },
+	{ "hls_dir", required_argument, NULL, 46 },
+	{ "hls_format", required_argument, NULL, 47 },
+	{ "hls_duration", required_argument, NULL, 48 },
+	{ "hls_part", required_argument, NULL, 49 },
+	{ "hls_window", required_argument, NULL, 50 },
+	{ "dvr_seconds", required_argument, NULL, 51 },
+	{ "dvr_bytes", required_argument, NULL, 52 },
+	{ "dvr_dir", required_argument, NULL, 53 },
+	{ "dvr_post", required_argument, NULL, 54 },
+	{ "http_port", required_argument, NULL, 55 },
+	{ "rtsp_port", required_argument, NULL, 56 },
+	{ "shm", required_argument, NULL, 57 },
+	{ "shm_size", required_argument, NULL, 58 },
+	{ "mxc_validate_out", required_argument, NULL, 59 },
 
 	{ 0, 0, 0, 0}
 };
@@ -182,6 +284,23 @@ int main(int argc, char **argv)
 
 	char *ipaddress = "192.168.0.67";
 	int ipport = 0, dscp = 0, pktsize = 0, ifd = 0;
+	unsigned int mux_rate = 0, pcr_interval = 40;
+	int ts_udp = 0;
+	unsigned int shape_rate = 0, shape_burst = 0;
+	int txtime = 0;
+	int mcast_ttl = -1;
+	char *mcast_if = NULL;
+	int nack = 0, rtx = 0;
+	unsigned int fec_l = 0, fec_d = 0;
+	char *hls_dir = NULL;
+	enum segmenter_format_e hls_format = SEGMENTER_TS;
+	unsigned int hls_duration_ms = 2000, hls_part_ms = 0, hls_window = 6;
+	unsigned int dvr_seconds = 0, dvr_post = 0;
+	unsigned long long dvr_bytes = 256ULL * 1048576;
+	char *dvr_dir = ".";
+	int http_port = 0, rtsp_port = 0;
+	char *shm_name = NULL;
+	unsigned long long shm_size = 64ULL * 1048576;
 	v4l_dev_name = (char *)"/dev/video0";
 	int req_deint_mode = -1;
 	int syncstall = 0;
@@ -189,8 +308,8 @@ int main(int argc, char **argv)
 	int V4LFrameRate = 0;
 	int V4LNumerator = 0;
 	char *mxc_ipaddress = "192.168.0.67";
-	char *mxc_validate_filename = 0;
-	int mxc_ipport = 0, mxc_endian = 0, mxc_sendmode = 2;
+	char *mxc_validate_filename = 0, *mxc_validate_out = 0;
+	int mxc_ipport = 0, mxc_endian = 0, mxc_sendmode = 2, mxc_gso = 0;
 	enum encoder_type_e compressor = EM_VAAPI;
 	int decklink_source_nr = 0;
 
@@ -231,7 +350,6 @@ int main(int argc, char **argv)
 			break;
 		case 'V':
 			fprintf(stderr, "%s\n", PACKAGE_STRING);
-			fprintf(stderr, "  |-- libes2ts %s\n", es2ts_get_version ());
 			fprintf(stderr, "  |-- libipcvideo %s\n", ipcvideo_get_version ());
 			exit(0);
 			break;
@@ -387,6 +505,158 @@ int main(int argc, char **argv)
 		case 22: /* decklink_index */
 			decklink_source_nr = atoi(optarg);
 			break;
+		case 23:
+			encoder_params.scenecut_threshold = atoi(optarg);
+			if (encoder_params.scenecut_threshold > 100) {
+				usage(encoder, argc, argv);
+				exit(1);
+			}
+			break;
+		case 24:
+			encoder_params.gop_min = atoi(optarg);
+			break;
+		case 25:
+			encoder_params.gop_max = atoi(optarg);
+			break;
+		case 26:
+			if (metrics_open(optarg) < 0)
+				exit(1);
+			break;
+		case 27:
+			encoder_params.deinterlace_cpu = 1;
+			break;
+		case 28:
+			if (sscanf(optarg, "%u,%u", &encoder_params.denoise_luma, &encoder_params.denoise_chroma) == 1)
+				encoder_params.denoise_chroma = encoder_params.denoise_luma;
+			if ((encoder_params.denoise_luma > 255) || (encoder_params.denoise_chroma > 255)) {
+				usage(encoder, argc, argv);
+				exit(1);
+			}
+			break;
+		case 29:
+			mxc_gso = 1;
+			break;
+		case 30:
+			mux_rate = atoi(optarg);
+			break;
+		case 31:
+			pcr_interval = atoi(optarg);
+			if ((pcr_interval < 1) || (pcr_interval > 100)) {
+				usage(encoder, argc, argv);
+				exit(1);
+			}
+			break;
+		case 32:
+			ts_udp = 1;
+			break;
+		case 33:
+			shape_rate = atoi(optarg);
+			break;
+		case 34:
+			shape_burst = atoi(optarg);
+			break;
+		case 35:
+			txtime = 1;
+			break;
+		case 36:
+			udpout_destinations_file(optarg);
+			break;
+		case 37:
+			mcast_ttl = atoi(optarg);
+			if ((mcast_ttl < 0) || (mcast_ttl > 255)) {
+				usage(encoder, argc, argv);
+				exit(1);
+			}
+			break;
+		case 38:
+			mcast_if = optarg;
+			break;
+		case 39:
+			nack = 1;
+			break;
+		case 40:
+			nack = 1;
+			rtx = 1;
+			break;
+		case 41:
+			if (sscanf(optarg, "%u,%u", &fec_l, &fec_d) == 1)
+				fec_d = fec_l;
+			if ((fec_l < 1) || (fec_l > FEC_L_MAX) || (fec_d < 1) || (fec_d > FEC_D_MAX)) {
+				usage(encoder, argc, argv);
+				exit(1);
+			}
+			break;
+		case 42:
+			if ((sscanf(optarg, "%u,%u", &encoder_params.bitrate_min, &encoder_params.bitrate_max) != 2) ||
+				(encoder_params.bitrate_min == 0) ||
+				(encoder_params.bitrate_max < encoder_params.bitrate_min)) {
+				usage(encoder, argc, argv);
+				exit(1);
+			}
+			break;
+		case 43:
+			encoder_params.segment_bytes = strtoull(optarg, NULL, 10) * 1048576ULL;
+			break;
+		case 44:
+			encoder_params.segment_seconds = atoi(optarg);
+			break;
+		case 45:
+			encoder_params.file_direct = 1;
+			break;
+		case 46:
+			hls_dir = optarg;
+			break;
+		case 47:
+			if (strcasecmp(optarg, "ts") == 0)
+				hls_format = SEGMENTER_TS;
+			else
+			if (strcasecmp(optarg, "fmp4") == 0)
+				hls_format = SEGMENTER_FMP4;
+			else {
+				usage(encoder, argc, argv);
+				exit(1);
+			}
+			break;
+		case 48:
+			hls_duration_ms = atof(optarg) * 1000;
+			break;
+		case 49:
+			hls_part_ms = atoi(optarg);
+			break;
+		case 50:
+			hls_window = atoi(optarg);
+			break;
+		case 51:
+			dvr_seconds = atoi(optarg);
+			break;
+		case 52:
+			dvr_bytes = strtoull(optarg, NULL, 10) * 1048576;
+			break;
+		case 53:
+			dvr_dir = optarg;
+			break;
+		case 54:
+			dvr_post = atoi(optarg);
+			break;
+		case 55:
+			http_port = atoi(optarg);
+			break;
+		case 56:
+			rtsp_port = atoi(optarg);
+			break;
+		case 57:
+			shm_name = optarg;
+			break;
+		case 58:
+			shm_size = strtoull(optarg, NULL, 10) * 1048576;
+			if (shm_size < SHMOUT_DATA_MIN) {
+				usage(encoder, argc, argv);
+				exit(1);
+			}
+			break;
+		case 59:
+			mxc_validate_out = optarg;
+			break;
 		case 'W':
 			width = atoi(optarg);
 			break;
@@ -404,7 +674,7 @@ int main(int argc, char **argv)
 
 	/* Utility function, varify a file looks like valid MXC VPU test data */
 	if (mxc_validate_filename) {
-		if (validateMXCVPUUDPOutput(mxc_validate_filename, mxc_endian) < 0) {
+		if (validateMXCVPUUDPOutput(mxc_validate_filename, mxc_endian, mxc_validate_out) < 0) {
 			fprintf(stderr, "file:%s is invalid or contains illegal content\n",
 				mxc_validate_filename);
 			return -1;
@@ -459,6 +729,14 @@ int main(int argc, char **argv)
 		printf("signal() failed\n");
 		time_to_quit = 1;
 	}
+	if (signal(SIGHUP, signalHupHandler) == SIG_ERR) {
+		printf("signal() failed\n");
+		time_to_quit = 1;
+	}
+	if (signal(SIGUSR1, signalUsr1Handler) == SIG_ERR) {
+		printf("signal() failed\n");
+		time_to_quit = 1;
+	}
 
 	if (source->open() < 0) {
 		printf("Error: %s capture did not start\n", source->name);
@@ -498,30 +776,84 @@ int main(int argc, char **argv)
 	}
 #endif
 
+	udpout_multicast(mcast_ttl, mcast_if);
+
+	/* Pacing for every network output that follows */
+	if (shape_rate && (udpout_shaper_init(shape_rate, shape_burst, txtime) < 0)) {
+		printf("Error: shaper init failed\n");
+		goto rtp_failed;
+	}
+
 	/* Open the 'nals via freescale UDP proprietary' mechanism if requested */
-	if (mxc_ipport && (initMXCVPUUDPHandler(mxc_ipaddress, mxc_ipport, dscp, 4 * 1048576, ifd, mxc_endian, mxc_sendmode) < 0)) {
+	if (mxc_ipport && (initMXCVPUUDPHandler(mxc_ipaddress, mxc_ipport, dscp, 4 * 1048576, ifd, mxc_endian, mxc_sendmode, mxc_gso) < 0)) {
 		printf("Error: MXCVPUUDP init failed\n");
 		goto rtp_failed;
 	}
 
 	/* RPT/ES , routed out via RTP */
 	if ((payloadMode == PAYLOAD_RTP_ES) && ipport) {
+		adaptive_params = &encoder_params;
+		if (encoder_params.bitrate_max && (congestion_init(encoder_params.frame_bitrate,
+			encoder_params.bitrate_min, encoder_params.bitrate_max, adaptiveBitrate) < 0)) {
+			printf("Error: bitrate adaptation init failed\n");
+			goto mxc_failed;
+		}
 	 	if (initRTPHandler(ipaddress, ipport, dscp, pktsize, ifd,
-			encoder_params.width, encoder_params.height, V4LFrameRate) < 0) {
+			encoder_params.width, encoder_params.height, V4LFrameRate, nack, rtx, fec_l, fec_d) < 0) {
 			printf("Error: RTP init failed\n");
 			goto mxc_failed;
 		}
 	}
 
+	/* RTSP sessions share the RTP packetiser, run it without a destination if need be */
+	if (rtsp_port) {
+		if (!((payloadMode == PAYLOAD_RTP_ES) && ipport) && (initRTPHandler(ipaddress, 0, dscp, pktsize, ifd,
+			encoder_params.width, encoder_params.height, V4LFrameRate, 0, 0, 0, 0) < 0)) {
+			printf("Error: RTP init failed\n");
+			goto rtp_failed;
+		}
+		if (rtsp_open(rtsp_port, dscp) < 0) {
+			printf("Error: RTSP init failed\n");
+			goto rtp_failed;
+		}
+	}
+
 	/* the NAL/es to TS conversion layer, while routes out via RTP */
 	if ((payloadMode == PAYLOAD_RTP_TS) && ipport) {
 		if (initESHandler(ipaddress, ipport, dscp, pktsize, ifd,
-			encoder_params.width, encoder_params.height, V4LFrameRate) < 0) {
+			encoder_params.width, encoder_params.height, V4LFrameRate, mux_rate, pcr_interval, ts_udp, fec_l, fec_d) < 0) {
 			printf("Error: ES2TS init failed\n");
 			goto rtp_failed;
 		}
 	}
 
+	/* Live HLS / DASH, written to disk */
+	if (hls_dir && (segmenter_open(hls_dir, hls_format, hls_duration_ms, hls_part_ms, hls_window,
+		encoder_params.width, encoder_params.height, V4LFrameRate,
+		encoder_idr_interval_ms(compressor, &encoder_params, V4LFrameRate)) < 0)) {
+		printf("Error: HLS init failed\n");
+		goto hls_failed;
+	}
+
+	/* Recent history, dumped on demand */
+	if (dvr_seconds && (dvr_open(dvr_dir, dvr_seconds, dvr_bytes, dvr_post) < 0)) {
+		printf("Error: DVR init failed\n");
+		goto dvr_failed;
+	}
+
+	/* TCP clients, started from the cached GOP */
+	if (http_port && (httpserver_open(http_port, dscp) < 0)) {
+		printf("Error: HTTP server init failed\n");
+		goto http_failed;
+	}
+
+	/* Co-located readers */
+	if (shm_name && (shmout_open(shm_name, shm_size, encoder_params.width, encoder_params.height,
+		V4LFrameRate) < 0)) {
+		printf("Error: shared memory output init failed\n");
+		goto shm_failed;
+	}
+
 	/* Start, capture content and stop the device, the main processing */
 	if (source->start(encoder) < 0) {
 		printf("Source failed to start\n");
@@ -533,7 +865,24 @@ int main(int argc, char **argv)
 
 start_failed:
 	encoder_close(encoder, &encoder_params);
+	metrics_close();
+
+	if (shm_name)
+		shmout_close();
+
+shm_failed:
+	if (http_port)
+		httpserver_close();
+
+http_failed:
+	if (dvr_seconds)
+		dvr_close();
+
+dvr_failed:
+	if (hls_dir)
+		segmenter_close();
 
+hls_failed:
 	freeESHandler();
 
 mxc_failed:
@@ -541,8 +890,12 @@ mxc_failed:
 		freeMXCVPUUDPHandler();
 
 rtp_failed:
-	if (ipport)
+	if (rtsp_port)
+		rtsp_close();
+	if (ipport || rtsp_port)
 		freeRTPHandler();
+	congestion_free();
+	udpout_shaper_free();
 
 encoder_failed:
 	source->uninit();
@@ -0,0 +1,104 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+#include "metrics.h"
+
+#define METRICS_MAX 64
+
+static FILE *metrics_fp = NULL;
+static struct metric_s metrics[METRICS_MAX];
+static int metrics_count = 0;
+static time_t metrics_last = 0;
+
+int metrics_open(char *filename)
+{
+	metrics_fp = fopen(filename, "w");
+	if (!metrics_fp) {
+		printf("Unable to open metrics file %s\n", filename);
+		return -1;
+	}
+
+	return 0;
+}
+
+void metrics_close()
+{
+	if (metrics_fp) {
+		fclose(metrics_fp);
+		metrics_fp = NULL;
+	}
+}
+
+int metrics_enabled()
+{
+	return metrics_fp != NULL;
+}
+
+struct metric_s *metrics_register(char *name, enum metric_type_e type)
+{
+	if (!metrics_fp)
+		return NULL;
+
+	for (int i = 0; i < metrics_count; i++) {
+		if (strcmp(metrics[i].name, name) == 0)
+			return &metrics[i];
+	}
+
+	if (metrics_count == METRICS_MAX) {
+		printf("Too many metrics, ignoring %s\n", name);
+		return NULL;
+	}
+
+	struct metric_s *m = &metrics[metrics_count++];
+	m->name = name;
+	m->type = type;
+	m->value = 0;
+
+	return m;
+}
+
+void metrics_sample()
+{
+	struct timeval now;
+
+	if (!metrics_fp)
+		return;
+
+	gettimeofday(&now, 0);
+	if (now.tv_sec == metrics_last)
+		return;
+	metrics_last = now.tv_sec;
+
+	fprintf(metrics_fp, "%ld.%03ld", (long)now.tv_sec, (long)now.tv_usec / 1000);
+	for (int i = 0; i < metrics_count; i++)
+		fprintf(metrics_fp, " %s=%lld", metrics[i].name, metrics[i].value);
+	fprintf(metrics_fp, "\n");
+	fflush(metrics_fp);
+}
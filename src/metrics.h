@@ -0,0 +1,67 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+/* Named counters and gauges, updated from any thread and written to a
+ * file (one line of name=value pairs) roughly once per second.
+ */
+
+enum metric_type_e {
+	METRIC_COUNTER = 0,	/* Monotonic, updated with metrics_add() */
+	METRIC_GAUGE,		/* Instantaneous, updated with metrics_set() */
+};
+
+struct metric_s
+{
+	char *name;
+	enum metric_type_e type;
+	volatile long long value;
+};
+
+int  metrics_open(char *filename);
+void metrics_close();
+int  metrics_enabled();
+
+/* Returns NULL when metrics are disabled, the update calls accept NULL. */
+struct metric_s *metrics_register(char *name, enum metric_type_e type);
+
+/* Called by the encoder core once per frame, writes a line when due. */
+void metrics_sample();
+
+static inline void metrics_add(struct metric_s *m, long long val)
+{
+	if (m)
+		__sync_fetch_and_add(&m->value, val);
+}
+
+static inline void metrics_set(struct metric_s *m, long long val)
+{
+	if (m)
+		m->value = val;
+}
+
+#endif
@@ -0,0 +1,590 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mp4mux.h"
+
+#define NAL_TYPE_SPS	7
+#define NAL_TYPE_PPS	8
+#define NAL_TYPE_AUD	9
+
+/* Box writer, nested boxes have their sizes patched when they end */
+struct mp4mux_writer_s
+{
+	unsigned char *buf;
+	int len, size;
+	int overflow;
+	int stack[16];
+	int depth;
+};
+
+static void w8(struct mp4mux_writer_s *w, unsigned int v)
+{
+	if (w->len + 1 > w->size) {
+		w->overflow = 1;
+		return;
+	}
+	w->buf[w->len++] = v;
+}
+
+static void w16(struct mp4mux_writer_s *w, unsigned int v)
+{
+	w8(w, v >> 8);
+	w8(w, v);
+}
+
+static void w32(struct mp4mux_writer_s *w, unsigned int v)
+{
+	w16(w, v >> 16);
+	w16(w, v);
+}
+
+static void w64(struct mp4mux_writer_s *w, unsigned long long v)
+{
+	w32(w, v >> 32);
+	w32(w, v);
+}
+
+static void wbytes(struct mp4mux_writer_s *w, const void *p, int len)
+{
+	if (w->len + len > w->size) {
+		w->overflow = 1;
+		return;
+	}
+	memcpy(w->buf + w->len, p, len);
+	w->len += len;
+}
+
+static void box_start(struct mp4mux_writer_s *w, const char *type)
+{
+	w->stack[w->depth++] = w->len;
+	w32(w, 0);
+	wbytes(w, type, 4);
+}
+
+static void fullbox_start(struct mp4mux_writer_s *w, const char *type, int version, unsigned int flags)
+{
+	box_start(w, type);
+	w32(w, (version << 24) | flags);
+}
+
+static void box_end(struct mp4mux_writer_s *w)
+{
+	int start = w->stack[--w->depth];
+
+	if (w->overflow)
+		return;
+
+	unsigned int size = w->len - start;
+	w->buf[start + 0] = size >> 24;
+	w->buf[start + 1] = size >> 16;
+	w->buf[start + 2] = size >> 8;
+	w->buf[start + 3] = size;
+}
+
+/* Identity, as used by mvhd and tkhd */
+static void wmatrix(struct mp4mux_writer_s *w)
+{
+	static const unsigned int m[9] = { 0x00010000, 0, 0, 0, 0x00010000, 0, 0, 0, 0x40000000 };
+
+	for (int i = 0; i < 9; i++)
+		w32(w, m[i]);
+}
+
+static int mp4mux_grow(struct mp4mux_ctx_s *ctx, int len)
+{
+	if (ctx->mdat_len + len <= ctx->mdat_size)
+		return 0;
+
+	int size = ctx->mdat_size * 2;
+	while (size < ctx->mdat_len + len)
+		size *= 2;
+
+	unsigned char *p = realloc(ctx->mdat, size);
+	if (!p)
+		return -1;
+	ctx->mdat = p;
+	ctx->mdat_size = size;
+
+	return 0;
+}
+
+static void mp4mux_nal(struct mp4mux_ctx_s *ctx, unsigned char *nal, int len)
+{
+	int type = nal[0] & 0x1f;
+
+	/* Parameter sets live in the sample entry, AUDs are implied by the samples */
+	if (type == NAL_TYPE_SPS || type == NAL_TYPE_PPS) {
+		if (len <= MP4MUX_PARAMSET_MAX) {
+			memcpy(type == NAL_TYPE_SPS ? ctx->sps : ctx->pps, nal, len);
+			if (type == NAL_TYPE_SPS)
+				ctx->sps_len = len;
+			else
+				ctx->pps_len = len;
+		}
+		return;
+	}
+	if (type == NAL_TYPE_AUD)
+		return;
+
+	if (mp4mux_grow(ctx, len + 4) < 0)
+		return;
+
+	unsigned char *p = ctx->mdat + ctx->mdat_len;
+	p[0] = len >> 24;
+	p[1] = len >> 16;
+	p[2] = len >> 8;
+	p[3] = len;
+	memcpy(p + 4, nal, len);
+	ctx->mdat_len += len + 4;
+	ctx->sample_open += len + 4;
+}
+
+static unsigned char *annexb_find_startcode(unsigned char *p, unsigned char *end)
+{
+	while (p + 3 <= end) {
+		if (p[0] == 0 && p[1] == 0 && p[2] == 1)
+			return p;
+		p++;
+	}
+
+	return end;
+}
+
+int mp4mux_write_es(struct mp4mux_ctx_s *ctx, unsigned char *buf, int len)
+{
+	unsigned char *end = buf + len;
+	unsigned char *p = annexb_find_startcode(buf, end);
+
+	while (p < end) {
+		unsigned char *nal = p + 3;
+		unsigned char *next = annexb_find_startcode(nal, end);
+		unsigned char *nal_end = next;
+
+		/* Trailing zeros belong to the next four byte start code */
+		while (nal_end > nal && nal_end[-1] == 0 && next < end)
+			nal_end--;
+		if (nal_end > nal)
+			mp4mux_nal(ctx, nal, nal_end - nal);
+		p = next;
+	}
+
+	return 0;
+}
+
+void mp4mux_frame_complete(struct mp4mux_ctx_s *ctx, int sync, unsigned long long pts90k,
+	unsigned long long dts90k)
+{
+	if (ctx->sample_open == 0)
+		return;
+
+	if (ctx->sample_count == ctx->sample_max) {
+		int max = ctx->sample_max * 2;
+		struct mp4mux_sample_s *s = realloc(ctx->samples, max * sizeof(*s));
+		if (!s)
+			return;
+		ctx->samples = s;
+		ctx->sample_max = max;
+	}
+
+	if (!ctx->have_base) {
+		ctx->base_dts90k = dts90k;
+		ctx->have_base = 1;
+	}
+
+	/* The previous sample lasts until this one decodes */
+	if (ctx->sample_count) {
+		struct mp4mux_sample_s *prev = &ctx->samples[ctx->sample_count - 1];
+		if (dts90k > prev->dts90k && (dts90k - prev->dts90k) < MP4MUX_TIMESCALE) {
+			prev->duration = dts90k - prev->dts90k;
+			ctx->frame_duration90k = prev->duration;
+		}
+	}
+
+	struct mp4mux_sample_s *s = &ctx->samples[ctx->sample_count++];
+	s->size = ctx->sample_open;
+	s->duration = ctx->frame_duration90k;
+	s->cts = (int)(pts90k - dts90k);
+	s->sync = sync;
+	s->dts90k = dts90k;
+	ctx->sample_open = 0;
+}
+
+unsigned long long mp4mux_pending90k(struct mp4mux_ctx_s *ctx)
+{
+	unsigned long long d = 0;
+
+	for (int i = 0; i < ctx->sample_count; i++)
+		d += ctx->samples[i].duration;
+
+	return d;
+}
+
+int mp4mux_init_segment(struct mp4mux_ctx_s *ctx, unsigned char *buf, int size)
+{
+	struct mp4mux_writer_s w = { .buf = buf, .size = size };
+
+	if (!ctx->sps_len || !ctx->pps_len)
+		return 0;
+
+	box_start(&w, "ftyp");
+	wbytes(&w, "iso6", 4);
+	w32(&w, 0);
+	wbytes(&w, "iso6cmfcmp41avc1", 16);
+	box_end(&w);
+
+	box_start(&w, "moov");
+
+	fullbox_start(&w, "mvhd", 0, 0);
+	w32(&w, 0);			/* creation_time */
+	w32(&w, 0);			/* modification_time */
+	w32(&w, MP4MUX_TIMESCALE);
+	w32(&w, 0);			/* duration, fragmented */
+	w32(&w, 0x00010000);		/* rate */
+	w16(&w, 0x0100);		/* volume */
+	w16(&w, 0);
+	w64(&w, 0);
+	wmatrix(&w);
+	for (int i = 0; i < 6; i++)
+		w32(&w, 0);		/* pre_defined */
+	w32(&w, 2);			/* next_track_ID */
+	box_end(&w);
+
+	box_start(&w, "trak");
+	fullbox_start(&w, "tkhd", 0, 0x000003);	/* enabled, in movie */
+	w32(&w, 0);
+	w32(&w, 0);
+	w32(&w, 1);			/* track_ID */
+	w32(&w, 0);
+	w32(&w, 0);			/* duration */
+	w64(&w, 0);
+	w16(&w, 0);			/* layer */
+	w16(&w, 0);			/* alternate_group */
+	w16(&w, 0);			/* volume */
+	w16(&w, 0);
+	wmatrix(&w);
+	w32(&w, ctx->width << 16);
+	w32(&w, ctx->height << 16);
+	box_end(&w);
+
+	box_start(&w, "mdia");
+	fullbox_start(&w, "mdhd", 0, 0);
+	w32(&w, 0);
+	w32(&w, 0);
+	w32(&w, MP4MUX_TIMESCALE);
+	w32(&w, 0);
+	w16(&w, 0x55c4);		/* und */
+	w16(&w, 0);
+	box_end(&w);
+
+	fullbox_start(&w, "hdlr", 0, 0);
+	w32(&w, 0);
+	wbytes(&w, "vide", 4);
+	w32(&w, 0);
+	w32(&w, 0);
+	w32(&w, 0);
+	wbytes(&w, "VideoHandler", 13);
+	box_end(&w);
+
+	box_start(&w, "minf");
+	fullbox_start(&w, "vmhd", 0, 1);
+	w64(&w, 0);
+	box_end(&w);
+
+	box_start(&w, "dinf");
+	fullbox_start(&w, "dref", 0, 0);
+	w32(&w, 1);
+	fullbox_start(&w, "url ", 0, 1);	/* Media is in this file */
+	box_end(&w);
+	box_end(&w);
+	box_end(&w);
+
+	box_start(&w, "stbl");
+	fullbox_start(&w, "stsd", 0, 0);
+	w32(&w, 1);
+
+	box_start(&w, "avc1");
+	w32(&w, 0);
+	w16(&w, 0);
+	w16(&w, 1);			/* data_reference_index */
+	w16(&w, 0);
+	w16(&w, 0);
+	w32(&w, 0);
+	w32(&w, 0);
+	w32(&w, 0);
+	w16(&w, ctx->width);
+	w16(&w, ctx->height);
+	w32(&w, 0x00480000);		/* 72 dpi */
+	w32(&w, 0x00480000);
+	w32(&w, 0);
+	w16(&w, 1);			/* frame_count */
+	for (int i = 0; i < 32; i++)
+		w8(&w, 0);		/* compressorname */
+	w16(&w, 0x0018);		/* depth */
+	w16(&w, 0xffff);		/* pre_defined */
+
+	box_start(&w, "avcC");
+	w8(&w, 1);
+	w8(&w, ctx->sps[1]);		/* profile_idc */
+	w8(&w, ctx->sps[2]);		/* constraint flags */
+	w8(&w, ctx->sps[3]);		/* level_idc */
+	w8(&w, 0xff);			/* 4 byte nal lengths */
+	w8(&w, 0xe1);			/* 1 SPS */
+	w16(&w, ctx->sps_len);
+	wbytes(&w, ctx->sps, ctx->sps_len);
+	w8(&w, 1);			/* 1 PPS */
+	w16(&w, ctx->pps_len);
+	wbytes(&w, ctx->pps, ctx->pps_len);
+	if (ctx->sps[1] == 100 || ctx->sps[1] == 110 || ctx->sps[1] == 122 || ctx->sps[1] == 144) {
+		w8(&w, 0xfd);		/* 4:2:0 */
+		w8(&w, 0xf8);		/* 8 bit luma */
+		w8(&w, 0xf8);		/* 8 bit chroma */
+		w8(&w, 0);		/* No SPS extensions */
+	}
+	box_end(&w);
+
+	box_end(&w);	/* avc1 */
+	box_end(&w);	/* stsd */
+
+	/* Empty sample tables, the samples are in the fragments */
+	fullbox_start(&w, "stts", 0, 0);
+	w32(&w, 0);
+	box_end(&w);
+	fullbox_start(&w, "stsc", 0, 0);
+	w32(&w, 0);
+	box_end(&w);
+	fullbox_start(&w, "stsz", 0, 0);
+	w32(&w, 0);
+	w32(&w, 0);
+	box_end(&w);
+	fullbox_start(&w, "stco", 0, 0);
+	w32(&w, 0);
+	box_end(&w);
+
+	box_end(&w);	/* stbl */
+	box_end(&w);	/* minf */
+	box_end(&w);	/* mdia */
+	box_end(&w);	/* trak */
+
+	box_start(&w, "mvex");
+	fullbox_start(&w, "trex", 0, 0);
+	w32(&w, 1);			/* track_ID */
+	w32(&w, 1);			/* default_sample_description_index */
+	w32(&w, 0);
+	w32(&w, 0);
+	w32(&w, 0);
+	box_end(&w);
+	box_end(&w);
+
+	box_end(&w);	/* moov */
+
+	return w.overflow ? -1 : w.len;
+}
+
+/* moof for the completed samples, followed by the mdat header */
+static unsigned char *mp4mux_moof(struct mp4mux_ctx_s *ctx, int *len)
+{
+	int count = ctx->sample_count;
+	int size = 256 + (count * 16);
+	unsigned char *buf = malloc(size);
+	if (!buf)
+		return NULL;
+
+	struct mp4mux_writer_s w = { .buf = buf, .size = size };
+	int mdat_bytes = ctx->mdat_len - ctx->sample_open;
+	int data_offset_pos;
+
+	box_start(&w, "moof");
+	fullbox_start(&w, "mfhd", 0, 0);
+	w32(&w, ++ctx->sequence);
+	box_end(&w);
+
+	box_start(&w, "traf");
+	fullbox_start(&w, "tfhd", 0, 0x020000);	/* default-base-is-moof */
+	w32(&w, 1);
+	box_end(&w);
+
+	fullbox_start(&w, "tfdt", 1, 0);
+	w64(&w, ctx->samples[0].dts90k - ctx->base_dts90k);
+	box_end(&w);
+
+	/* data offset, and per sample duration, size, flags and composition offset */
+	fullbox_start(&w, "trun", 1, 0x000f01);
+	w32(&w, count);
+	data_offset_pos = w.len;
+	w32(&w, 0);
+	for (int i = 0; i < count; i++) {
+		struct mp4mux_sample_s *s = &ctx->samples[i];
+		w32(&w, s->duration);
+		w32(&w, s->size);
+		w32(&w, s->sync ? 0x02000000 : 0x01010000);
+		w32(&w, s->cts);
+	}
+	box_end(&w);
+
+	box_end(&w);	/* traf */
+	box_end(&w);	/* moof */
+
+	/* Samples start straight after the mdat header */
+	unsigned int data_offset = w.len + 8;
+	buf[data_offset_pos + 0] = data_offset >> 24;
+	buf[data_offset_pos + 1] = data_offset >> 16;
+	buf[data_offset_pos + 2] = data_offset >> 8;
+	buf[data_offset_pos + 3] = data_offset;
+
+	w32(&w, mdat_bytes + 8);
+	wbytes(&w, "mdat", 4);
+
+	*len = w.len;
+	return buf;
+}
+
+int mp4mux_fragment(struct mp4mux_ctx_s *ctx, void (*output)(void *priv, unsigned char *buf, int len),
+	void *priv)
+{
+	int count = ctx->sample_count;
+	int len;
+
+	if (count == 0)
+		return 0;
+
+	unsigned char *buf = mp4mux_moof(ctx, &len);
+	if (!buf)
+		return 0;
+
+	int mdat_bytes = ctx->mdat_len - ctx->sample_open;
+	output(priv, buf, len);
+	output(priv, ctx->mdat, mdat_bytes);
+	free(buf);
+
+	/* Keep any access unit still in flight */
+	memmove(ctx->mdat, ctx->mdat + mdat_bytes, ctx->sample_open);
+	ctx->mdat_len = ctx->sample_open;
+	ctx->sample_count = 0;
+
+	return count;
+}
+
+int mp4mux_fragment_detach(struct mp4mux_ctx_s *ctx, struct mp4mux_fragment_s *frag,
+	unsigned char *mdat, int mdat_size)
+{
+	int count = ctx->sample_count;
+
+	memset(frag, 0, sizeof(*frag));
+	if (count == 0)
+		return 0;
+
+	/* Room for the access unit in flight in the replacement buffer */
+	if (mdat && (mdat_size < (int)ctx->sample_open)) {
+		free(mdat);
+		mdat = NULL;
+	}
+	if (!mdat) {
+		mdat_size = ctx->mdat_size;
+		mdat = malloc(mdat_size);
+		if (!mdat)
+			return 0;
+	}
+
+	frag->decode_time90k = ctx->samples[0].dts90k - ctx->base_dts90k;
+	frag->sync = ctx->samples[0].sync;
+	frag->samples = count;
+	frag->moof = mp4mux_moof(ctx, &frag->moof_len);
+	if (!frag->moof) {
+		free(mdat);
+		return 0;
+	}
+
+	/* Hand over the mdat, carry on in the replacement */
+	frag->mdat = ctx->mdat;
+	frag->mdat_len = ctx->mdat_len - ctx->sample_open;
+	frag->mdat_size = ctx->mdat_size;
+	memcpy(mdat, ctx->mdat + frag->mdat_len, ctx->sample_open);
+	ctx->mdat = mdat;
+	ctx->mdat_size = mdat_size;
+	ctx->mdat_len = ctx->sample_open;
+	ctx->sample_count = 0;
+
+	return count;
+}
+
+int mp4mux_mfra(struct mp4mux_tfra_s *entries, int count, unsigned char *buf, int size)
+{
+	struct mp4mux_writer_s w = { .buf = buf, .size = size };
+
+	box_start(&w, "mfra");
+
+	fullbox_start(&w, "tfra", 1, 0);
+	w32(&w, 1);		/* track_ID */
+	w32(&w, 0);		/* One byte traf, trun and sample numbers */
+	w32(&w, count);
+	for (int i = 0; i < count; i++) {
+		w64(&w, entries[i].time90k);
+		w64(&w, entries[i].moof_offset);
+		w8(&w, 1);
+		w8(&w, 1);
+		w8(&w, 1);
+	}
+	box_end(&w);
+
+	/* Size of the whole mfra, players find it from the end of the file */
+	fullbox_start(&w, "mfro", 0, 0);
+	w32(&w, w.len + 4);
+	box_end(&w);
+
+	box_end(&w);	/* mfra */
+
+	return w.overflow ? -1 : w.len;
+}
+
+int mp4mux_alloc(struct mp4mux_ctx_s *ctx, unsigned int width, unsigned int height, unsigned int fps)
+{
+	memset(ctx, 0, sizeof(*ctx));
+
+	ctx->width = width;
+	ctx->height = height;
+	ctx->frame_duration90k = MP4MUX_TIMESCALE / (fps ? fps : 30);
+
+	ctx->mdat_size = 1048576;
+	ctx->mdat = malloc(ctx->mdat_size);
+	ctx->sample_max = 256;
+	ctx->samples = malloc(ctx->sample_max * sizeof(struct mp4mux_sample_s));
+	if (!ctx->mdat || !ctx->samples) {
+		mp4mux_free(ctx);
+		return -1;
+	}
+
+	return 0;
+}
+
+void mp4mux_free(struct mp4mux_ctx_s *ctx)
+{
+	free(ctx->mdat);
+	free(ctx->samples);
+	ctx->mdat = NULL;
+	ctx->samples = NULL;
+}
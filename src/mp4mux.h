@@ -0,0 +1,123 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef MP4MUX_H
+#define MP4MUX_H
+
+/* Fragmented MP4 (ISO BMFF, CMAF style) for one H.264 track. Access units
+ * are copied as they arrive, converted from annexb to length prefixed nals,
+ * and emitted as a moof + mdat fragment on request. The init segment
+ * (ftyp + moov) is available once an SPS and PPS have been seen.
+ */
+
+#define MP4MUX_TIMESCALE	90000
+#define MP4MUX_PARAMSET_MAX	256
+
+struct mp4mux_sample_s
+{
+	unsigned int size;
+	unsigned int duration;
+	int cts;		/* pts - dts */
+	int sync;
+	unsigned long long dts90k;
+};
+
+/* A fragment handed over by mp4mux_fragment_detach(), the caller owns
+ * (and frees) both buffers.
+ */
+struct mp4mux_fragment_s
+{
+	unsigned char *moof;		/* moof and the mdat header */
+	int moof_len;
+	unsigned char *mdat;		/* Sample data, mdat_size allocated */
+	int mdat_len, mdat_size;
+	unsigned long long decode_time90k;
+	int sync;			/* Starts with a sync sample */
+	int samples;
+};
+
+/* Random access points for the mfra */
+struct mp4mux_tfra_s
+{
+	unsigned long long time90k;
+	unsigned long long moof_offset;
+};
+
+struct mp4mux_ctx_s
+{
+	unsigned int width, height;
+	unsigned int frame_duration90k;	/* Nominal, for the last sample of a fragment */
+
+	unsigned char sps[MP4MUX_PARAMSET_MAX];
+	unsigned char pps[MP4MUX_PARAMSET_MAX];
+	int sps_len, pps_len;
+
+	/* Fragment being assembled */
+	unsigned char *mdat;
+	int mdat_len, mdat_size;
+	struct mp4mux_sample_s *samples;
+	int sample_count, sample_max;
+	unsigned int sample_open;	/* Bytes of the access unit in flight */
+
+	unsigned int sequence;		/* moof sequence number */
+	int have_base;
+	unsigned long long base_dts90k;	/* Timeline origin */
+};
+
+int  mp4mux_alloc(struct mp4mux_ctx_s *ctx, unsigned int width, unsigned int height, unsigned int fps);
+void mp4mux_free(struct mp4mux_ctx_s *ctx);
+
+/* Annexb data for the current access unit, copied. */
+int  mp4mux_write_es(struct mp4mux_ctx_s *ctx, unsigned char *buf, int len);
+void mp4mux_frame_complete(struct mp4mux_ctx_s *ctx, int sync, unsigned long long pts90k,
+	unsigned long long dts90k);
+
+/* The ftyp + moov, into buf. Returns its length, 0 before the parameter
+ * sets have been seen or -1 when buf is too small.
+ */
+int  mp4mux_init_segment(struct mp4mux_ctx_s *ctx, unsigned char *buf, int size);
+
+/* Completed samples as a moof + mdat, handed to output(). Returns the
+ * number of samples in the fragment.
+ */
+int  mp4mux_fragment(struct mp4mux_ctx_s *ctx, void (*output)(void *priv, unsigned char *buf, int len),
+	void *priv);
+
+/* As mp4mux_fragment() but without copying, the mdat buffer itself is
+ * handed over in frag and the muxer continues in the replacement buffer,
+ * or a new one when mdat is NULL.
+ */
+int  mp4mux_fragment_detach(struct mp4mux_ctx_s *ctx, struct mp4mux_fragment_s *frag,
+	unsigned char *mdat, int mdat_size);
+
+/* An mfra index of the sync fragments, for the end of a file. Returns its
+ * length or -1 when buf is too small.
+ */
+int  mp4mux_mfra(struct mp4mux_tfra_s *entries, int count, unsigned char *buf, int size);
+
+/* Time covered by the completed samples waiting for mp4mux_fragment() */
+unsigned long long mp4mux_pending90k(struct mp4mux_ctx_s *ctx);
+
+#endif
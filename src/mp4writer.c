@@ -0,0 +1,441 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include "mp4writer.h"
+#include "mp4mux.h"
+#include "output.h"
+#include "frames.h"
+#include "metrics.h"
+
+#define MP4WRITER_INIT_MAX	4096
+
+struct mp4writer_job_s
+{
+	struct mp4mux_fragment_s frag;
+	unsigned int file_nr;		/* Start this file first if it isn't the current one */
+};
+
+/* Encode thread */
+static struct mp4mux_ctx_s mux;
+static int au_open = 0;
+static int dropping = 1;		/* Until an IDR, also after a queue overflow */
+static unsigned int segment;
+static unsigned long long segment_len;
+static unsigned long long segment_start90k;
+static int segment_have_dts;
+static unsigned long long last_dts90k;
+
+/* Shared, under writer_mutex */
+static struct mp4writer_job_s jobs[MP4WRITER_QUEUE];
+static int job_head, job_count;
+static unsigned char *spare[MP4WRITER_QUEUE];	/* Written mdat buffers, for reuse */
+static int spare_size[MP4WRITER_QUEUE];
+static int spare_count;
+static unsigned char init_seg[MP4WRITER_INIT_MAX];
+static int init_len;
+static pthread_mutex_t writer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t writer_thread;
+static int writer_running = 0;
+
+/* Configuration */
+static char *file_name = NULL;
+static unsigned long long max_bytes;
+static unsigned int max_seconds;
+
+/* Writer thread */
+static int fd = -1;
+static unsigned int fd_file_nr;
+static unsigned long long fd_len;
+static struct mp4mux_tfra_s *tfra = NULL;
+static int tfra_count, tfra_max;
+static unsigned long long bytes_written, fragments_written, fragments_dropped;
+
+static struct {
+	struct metric_s *bytes;
+	struct metric_s *write_us;
+	struct metric_s *fragments;
+	struct metric_s *dropped;
+} mp4_metrics;
+
+static unsigned long long mp4writer_now_us()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000000ULL) + (ts.tv_nsec / 1000);
+}
+
+static void mp4writer_name(char *dst, int len, unsigned int nr)
+{
+	if (!max_bytes && !max_seconds) {
+		snprintf(dst, len, "%s", file_name);
+		return;
+	}
+
+	/* capture.mp4 becomes capture-00001.mp4 */
+	char *ext = strrchr(file_name, '.');
+	if (ext && !strchr(ext, '/'))
+		snprintf(dst, len, "%.*s-%05u%s", (int)(ext - file_name), file_name, nr, ext);
+	else
+		snprintf(dst, len, "%s-%05u", file_name, nr);
+}
+
+/* Writer thread */
+static int mp4writer_writev(struct iovec *iov, int cnt)
+{
+	while (cnt) {
+		ssize_t n = writev(fd, iov, cnt);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "%s() write failed, %s\n", __func__, strerror(errno));
+			return -1;
+		}
+		fd_len += n;
+		bytes_written += n;
+		metrics_add(mp4_metrics.bytes, n);
+
+		/* Short write, step past what went out */
+		while (cnt && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			cnt--;
+		}
+		if (cnt) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+
+	return 0;
+}
+
+static void mp4writer_file_close()
+{
+	if (fd < 0)
+		return;
+
+	int size = 64 + (tfra_count * 19);
+	unsigned char *buf = malloc(size);
+	if (buf) {
+		int len = mp4mux_mfra(tfra, tfra_count, buf, size);
+		if (len > 0) {
+			struct iovec iov = { .iov_base = buf, .iov_len = len };
+			mp4writer_writev(&iov, 1);
+		}
+		free(buf);
+	}
+
+	close(fd);
+	fd = -1;
+	tfra_count = 0;
+}
+
+static int mp4writer_file_open(unsigned int nr)
+{
+	char fn[4096];
+
+	mp4writer_name(fn, sizeof(fn), nr);
+	fd = open(fn, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "%s() unable to open %s, %s\n", __func__, fn, strerror(errno));
+		return -1;
+	}
+	fd_file_nr = nr;
+	fd_len = 0;
+
+	return 0;
+}
+
+static void mp4writer_write(struct mp4writer_job_s *job)
+{
+	unsigned long long t = mp4writer_now_us();
+
+	if ((fd >= 0) && (job->file_nr != fd_file_nr))
+		mp4writer_file_close();
+	if (fd < 0) {
+		if (mp4writer_file_open(job->file_nr) < 0)
+			return;
+		struct iovec iov = { .iov_base = init_seg, .iov_len = init_len };
+		mp4writer_writev(&iov, 1);
+	}
+
+	if (job->frag.sync) {
+		if (tfra_count == tfra_max) {
+			int max = tfra_max ? tfra_max * 2 : 256;
+			struct mp4mux_tfra_s *p = realloc(tfra, max * sizeof(*p));
+			if (p) {
+				tfra = p;
+				tfra_max = max;
+			}
+		}
+		if (tfra_count < tfra_max) {
+			tfra[tfra_count].time90k = job->frag.decode_time90k;
+			tfra[tfra_count].moof_offset = fd_len;
+			tfra_count++;
+		}
+	}
+
+	/* moof and mdat straight from the muxers buffers */
+	struct iovec iov[2] = {
+		{ .iov_base = job->frag.moof, .iov_len = job->frag.moof_len },
+		{ .iov_base = job->frag.mdat, .iov_len = job->frag.mdat_len },
+	};
+	mp4writer_writev(iov, 2);
+
+	fragments_written++;
+	metrics_add(mp4_metrics.fragments, 1);
+	metrics_add(mp4_metrics.write_us, mp4writer_now_us() - t);
+}
+
+static void mp4writer_release(struct mp4writer_job_s *job)
+{
+	free(job->frag.moof);
+
+	/* Keep the mdat for the muxer to fill again */
+	pthread_mutex_lock(&writer_mutex);
+	if (spare_count < MP4WRITER_QUEUE) {
+		spare[spare_count] = job->frag.mdat;
+		spare_size[spare_count] = job->frag.mdat_size;
+		spare_count++;
+		job->frag.mdat = NULL;
+	}
+	pthread_mutex_unlock(&writer_mutex);
+
+	free(job->frag.mdat);
+}
+
+static void *mp4writer_thread_func(void *arg)
+{
+	pthread_mutex_lock(&writer_mutex);
+	while (writer_running || job_count) {
+		if (job_count == 0) {
+			pthread_cond_wait(&writer_cond, &writer_mutex);
+			continue;
+		}
+		struct mp4writer_job_s job = jobs[job_head];
+		pthread_mutex_unlock(&writer_mutex);
+
+		mp4writer_write(&job);
+		mp4writer_release(&job);
+
+		pthread_mutex_lock(&writer_mutex);
+		job_head = (job_head + 1) % MP4WRITER_QUEUE;
+		job_count--;
+	}
+	pthread_mutex_unlock(&writer_mutex);
+
+	mp4writer_file_close();
+
+	return NULL;
+}
+
+/* Encode thread, the completed samples go to the writer */
+static void mp4writer_submit(int rotate)
+{
+	struct mp4mux_fragment_s frag;
+	unsigned char *mdat = NULL;
+	int mdat_size = 0;
+
+	pthread_mutex_lock(&writer_mutex);
+	if (init_len == 0)
+		init_len = mp4mux_init_segment(&mux, init_seg, sizeof(init_seg));
+	if (spare_count) {
+		spare_count--;
+		mdat = spare[spare_count];
+		mdat_size = spare_size[spare_count];
+	}
+	pthread_mutex_unlock(&writer_mutex);
+
+	if (mp4mux_fragment_detach(&mux, &frag, mdat, mdat_size) == 0)
+		return;
+
+	segment_len += frag.moof_len + frag.mdat_len;
+
+	pthread_mutex_lock(&writer_mutex);
+	if ((init_len > 0) && (job_count < MP4WRITER_QUEUE)) {
+		struct mp4writer_job_s *job = &jobs[(job_head + job_count) % MP4WRITER_QUEUE];
+		job->frag = frag;
+		job->file_nr = segment;
+		job_count++;
+		pthread_cond_signal(&writer_cond);
+		frag.moof = NULL;
+		frag.mdat = NULL;
+	}
+	pthread_mutex_unlock(&writer_mutex);
+
+	if (frag.moof) {
+		/* The disk has fallen behind, lose the GOP rather than stall the encoder */
+		fragments_dropped++;
+		metrics_add(mp4_metrics.dropped, 1);
+		free(frag.moof);
+		free(frag.mdat);
+		dropping = 1;
+	}
+
+	/* The IDR that triggered this starts the next file */
+	if (rotate) {
+		segment++;
+		segment_len = 0;
+		segment_have_dts = 0;
+	}
+}
+
+static int mp4writer_codeddata(unsigned char *buf, int len, int frame_type)
+{
+	if (!au_open) {
+		au_open = 1;
+
+		int idr = (frame_type == FRAME_IDR);
+		unsigned long long pending = mp4mux_pending90k(&mux);
+
+		/* A fragment per GOP, long GOPs are split every second */
+		if (mux.sample_count && (idr || (pending >= MP4WRITER_FRAGMENT_MS * 90))) {
+			int rotate = idr &&
+				((max_bytes && (segment_len >= max_bytes)) ||
+				 (max_seconds && (last_dts90k - segment_start90k >= max_seconds * 90000ULL)));
+			mp4writer_submit(rotate);
+		}
+
+		if (idr)
+			dropping = 0;
+	}
+	if (dropping)
+		return 0;
+
+	return mp4mux_write_es(&mux, buf, len);
+}
+
+static void mp4writer_frame_complete(int frame_type, unsigned long long pts90k, unsigned long long dts90k)
+{
+	au_open = 0;
+	if (dropping)
+		return;
+
+	if (!segment_have_dts) {
+		segment_start90k = dts90k;
+		segment_have_dts = 1;
+	}
+	last_dts90k = dts90k;
+
+	mp4mux_frame_complete(&mux, frame_type == FRAME_IDR, pts90k, dts90k);
+}
+
+static struct output_sink_s mp4writer_sink =
+{
+	.name		= "MP4",
+	.codeddata	= mp4writer_codeddata,
+	.frame_complete	= mp4writer_frame_complete,
+};
+
+int mp4writer_match(char *filename)
+{
+	char *ext = strrchr(filename, '.');
+
+	return ext && (!strcasecmp(ext, ".mp4") || !strcasecmp(ext, ".m4v"));
+}
+
+int mp4writer_open(char *filename, unsigned int width, unsigned int height, unsigned int fps,
+	unsigned long long segment_bytes, unsigned int segment_seconds)
+{
+	file_name = filename;
+	max_bytes = segment_bytes;
+	max_seconds = segment_seconds;
+
+	if (mp4mux_alloc(&mux, width, height, fps) < 0)
+		return -1;
+
+	au_open = 0;
+	dropping = 1;
+	segment = 0;
+	segment_len = 0;
+	segment_have_dts = 0;
+	job_head = job_count = 0;
+	spare_count = 0;
+	init_len = 0;
+	tfra_count = 0;
+	bytes_written = fragments_written = fragments_dropped = 0;
+
+	/* Fail early, the writer creates the file itself */
+	if (mp4writer_file_open(0) < 0) {
+		mp4mux_free(&mux);
+		return -1;
+	}
+	close(fd);
+	fd = -1;
+
+	mp4_metrics.bytes = metrics_register("mp4_bytes", METRIC_COUNTER);
+	mp4_metrics.write_us = metrics_register("mp4_write_us", METRIC_COUNTER);
+	mp4_metrics.fragments = metrics_register("mp4_fragments", METRIC_COUNTER);
+	mp4_metrics.dropped = metrics_register("mp4_fragments_dropped", METRIC_COUNTER);
+
+	writer_running = 1;
+	if (pthread_create(&writer_thread, NULL, mp4writer_thread_func, NULL) != 0) {
+		writer_running = 0;
+		mp4mux_free(&mux);
+		return -1;
+	}
+
+	return output_register(&mp4writer_sink);
+}
+
+void mp4writer_close()
+{
+	output_unregister(&mp4writer_sink);
+
+	if (writer_running) {
+		/* The last partial GOP, then let the writer drain and exit */
+		if (!dropping)
+			mp4writer_submit(0);
+
+		pthread_mutex_lock(&writer_mutex);
+		writer_running = 0;
+		pthread_cond_signal(&writer_cond);
+		pthread_mutex_unlock(&writer_mutex);
+		pthread_join(writer_thread, NULL);
+
+		printf("MP4 writer: %llu bytes in %u files, %llu fragments, %llu dropped\n",
+			bytes_written, segment + 1, fragments_written, fragments_dropped);
+	}
+
+	for (int i = 0; i < spare_count; i++)
+		free(spare[i]);
+	spare_count = 0;
+	free(tfra);
+	tfra = NULL;
+	tfra_max = 0;
+	mp4mux_free(&mux);
+}
@@ -0,0 +1,50 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef MP4WRITER_H
+#define MP4WRITER_H
+
+/* Records the coded stream as fragmented MP4, playable and seekable without
+ * a remux. Each GOP (or each second, whichever comes first) becomes a
+ * moof + mdat. The encode thread converts the access units to length
+ * prefixed nals once, finished fragments are passed by reference to a
+ * writer thread that gathers the moof and mdat into a single writev().
+ * An mfra index is appended when each file is closed.
+ */
+
+#define MP4WRITER_FRAGMENT_MS	1000	/* Longest fragment when IDRs are far apart */
+#define MP4WRITER_QUEUE		16	/* Fragments waiting for the disk */
+
+/* Is this filename one we should write as MP4 */
+int  mp4writer_match(char *filename);
+
+/* segment_bytes / segment_seconds of 0 disable that rotation trigger, as
+ * for the filewriter.
+ */
+int  mp4writer_open(char *filename, unsigned int width, unsigned int height, unsigned int fps,
+	unsigned long long segment_bytes, unsigned int segment_seconds);
+void mp4writer_close();
+
+#endif
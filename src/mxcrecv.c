@@ -0,0 +1,655 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* Reference receiver for the MXC VPU UDP streams (mxcvpuudp.c), a local
+ * stand-in for the Freescale target. Datagrams are pulled in batches with
+ * recvmmsg(), mode 1 and mode 2 streams are reassembled into nals and loss,
+ * reordering, per frame latency and throughput are reported.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include "mxcvpuudp.h"
+
+#define RECV_BATCH		64
+#define RECV_DGRAM_MAX		65536
+#define RECV_SLOTS		4	/* Nals assembled concurrently, absorbs reordering */
+#define RECV_SEQ_HISTORY	1024	/* Sequence numbers remembered for late arrivals */
+
+struct nal_slot_s
+{
+	int busy;
+	unsigned int seq;
+	unsigned int len;
+	unsigned int received;		/* Nal bytes placed so far */
+	unsigned char type;
+	int have_end;
+	int frags;			/* Full sized fragments placed */
+	int last_frag;			/* Index of the previous one, frag_no unwrapped */
+	struct timespec first;		/* Kernel arrival of the first fragment */
+
+	unsigned char *buf;
+	unsigned int buf_size;
+	unsigned char *seen;		/* Per fragment index, duplicates */
+	int seen_size;
+	int seen_used;
+};
+
+struct recv_stats_s
+{
+	unsigned long long packets;
+	unsigned long long bytes;
+	unsigned long long nals;
+	unsigned long long nal_bytes;
+	unsigned long long types[4];
+	unsigned long long lost;		/* Nals never seen */
+	unsigned long long incomplete;		/* Nals missing fragments */
+	unsigned long long reordered;		/* Nals arriving behind a later one */
+	unsigned long long late;		/* Fragments of nals already done with */
+	unsigned long long duplicates;
+	unsigned long long malformed;
+	unsigned long long latency_us_total;
+	unsigned long long latency_us_min;
+	unsigned long long latency_us_max;
+};
+
+static int time_to_quit = 0;
+static int mode = 0;		/* 0 = detect */
+static int be_mode = -1;	/* -1 = detect */
+static int out_fd = -1;
+
+static struct nal_slot_s slots[RECV_SLOTS];
+static int have_seq = 0;
+static unsigned int highest_seq;
+static unsigned int seq_history[RECV_SEQ_HISTORY];	/* seq + 1, 0 = unused */
+
+static struct recv_stats_s total, interval;
+
+static void signalHandler(int a_Signal)
+{
+	time_to_quit = 1;
+	signal(SIGINT, SIG_DFL);
+}
+
+static void usage(char *progname)
+{
+	printf("A reference receiver for the h264encoder --mxc_ipport UDP streams.\n");
+	printf("Usage: %s -p <port> [options]\n"
+		"\n"
+		"Options:\n"
+		"-h, --help                    Print this message\n"
+		"-p, --port <number>           UDP port to listen on\n"
+		"-a, --address <a.b.c.d>       Local address or multicast group [def: any]\n"
+		"-m, --mode <0,1,2>            Sender mode, 0 = detect [def: 0]\n"
+		"-e, --endian <0,1>            0 = little, 1 = big, detected when omitted\n"
+		"-o, --output <file>           Write the reassembled nals to file\n"
+		"-i, --interval <sec>          Statistics interval [def: 1]\n"
+		"-t, --duration <sec>          Stop after this many seconds, 0 = never [def: 0]\n"
+		"-r, --rcvbuf <MB>             Socket receive buffer size [def: 8]\n",
+		progname);
+}
+
+static long long timespec_diff_us(struct timespec *a, struct timespec *b)
+{
+	return ((long long)(b->tv_sec - a->tv_sec) * 1000000LL) + ((b->tv_nsec - a->tv_nsec) / 1000);
+}
+
+#define STATS_ADD(field, v) \
+	do { total.field += (v); interval.field += (v); } while (0)
+
+static void stats_latency(struct recv_stats_s *s, unsigned long long us)
+{
+	if ((s->nals == 1) || (us < s->latency_us_min))
+		s->latency_us_min = us;
+	if (us > s->latency_us_max)
+		s->latency_us_max = us;
+	s->latency_us_total += us;
+}
+
+static void stats_print(char *label, struct recv_stats_s *s, double secs)
+{
+	if (secs <= 0)
+		secs = 1;
+
+	printf("%s pkts %llu, %.2f Mbps, nals %llu (I %llu IDR %llu B %llu P %llu), "
+		"lost %llu, incomplete %llu, reordered %llu, late %llu, dup %llu, bad %llu, "
+		"latency us %llu/%llu/%llu\n",
+		label, s->packets, ((s->bytes * 8) / secs) / 1000000.0,
+		s->nals, s->types[FLAG_FRAME_I], s->types[FLAG_FRAME_IDR],
+		s->types[FLAG_FRAME_B], s->types[FLAG_FRAME_P],
+		s->lost, s->incomplete, s->reordered, s->late, s->duplicates, s->malformed,
+		s->latency_us_min, s->nals ? s->latency_us_total / s->nals : 0, s->latency_us_max);
+	fflush(stdout);
+}
+
+/* Nal done, account for it and pass it on. Latency runs from the kernel
+ * receiving the first packet of the nal to the nal being whole in user space.
+ */
+static void nal_complete(unsigned char *buf, unsigned int len, unsigned char type, struct timespec *first)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	long long us = timespec_diff_us(first, &now);
+	if (us < 0)
+		us = 0;
+
+	STATS_ADD(nals, 1);
+	STATS_ADD(nal_bytes, len);
+	STATS_ADD(types[type & 3], 1);
+	stats_latency(&total, us);
+	stats_latency(&interval, us);
+
+	if (out_fd >= 0) {
+		while (len) {
+			ssize_t l = write(out_fd, buf, len);
+			if (l < 0) {
+				if (errno == EINTR)
+					continue;
+				fprintf(stderr, "Output write failed, %s\n", strerror(errno));
+				close(out_fd);
+				out_fd = -1;
+				break;
+			}
+			buf += l;
+			len -= l;
+		}
+	}
+}
+
+/* Classify a sequence number against those seen so far. Returns 1 for a
+ * nal to accept, 0 when it belongs to one already finished or abandoned.
+ */
+static int sequence_check(unsigned int seq)
+{
+	if (!have_seq) {
+		have_seq = 1;
+		highest_seq = seq;
+		seq_history[seq % RECV_SEQ_HISTORY] = seq + 1;
+		return 1;
+	}
+
+	int diff = (int)(seq - highest_seq);
+	if (diff > 0) {
+		STATS_ADD(lost, diff - 1);
+		for (int i = 1; i < diff && i <= RECV_SEQ_HISTORY; i++)
+			seq_history[(seq - i) % RECV_SEQ_HISTORY] = 0;
+		highest_seq = seq;
+	} else {
+		if ((diff <= -RECV_SEQ_HISTORY) || (seq_history[seq % RECV_SEQ_HISTORY] == seq + 1)) {
+			STATS_ADD(late, 1);
+			return 0;
+		}
+
+		/* Counted lost when the gap opened, it was only delayed */
+		STATS_ADD(reordered, 1);
+		if (total.lost)
+			total.lost--;
+		if (interval.lost)
+			interval.lost--;
+	}
+	seq_history[seq % RECV_SEQ_HISTORY] = seq + 1;
+
+	return 1;
+}
+
+static int slot_reserve(struct nal_slot_s *s, unsigned int len)
+{
+	if (len > s->buf_size) {
+		unsigned char *p = realloc(s->buf, len);
+		if (!p)
+			return -1;
+		s->buf = p;
+		s->buf_size = len;
+	}
+	memset(s->seen, 0, s->seen_used);
+	s->seen_used = 0;
+
+	return 0;
+}
+
+static int slot_mark_seen(struct nal_slot_s *s, int idx)
+{
+	if (idx >= s->seen_size) {
+		int size = s->seen_size ? s->seen_size : 256;
+		while (size <= idx)
+			size *= 2;
+		unsigned char *p = realloc(s->seen, size);
+		if (!p)
+			return -1;
+		memset(p + s->seen_size, 0, size - s->seen_size);
+		s->seen = p;
+		s->seen_size = size;
+	}
+	if (idx >= s->seen_used)
+		s->seen_used = idx + 1;
+	if (s->seen[idx])
+		return 1;
+	s->seen[idx] = 1;
+
+	return 0;
+}
+
+static struct nal_slot_s *slot_find(unsigned int seq)
+{
+	for (int i = 0; i < RECV_SLOTS; i++) {
+		if (slots[i].busy && (slots[i].seq == seq))
+			return &slots[i];
+	}
+	return NULL;
+}
+
+/* Free slot, else abandon the oldest nal in flight */
+static struct nal_slot_s *slot_alloc(void)
+{
+	struct nal_slot_s *oldest = NULL;
+
+	for (int i = 0; i < RECV_SLOTS; i++) {
+		if (!slots[i].busy)
+			return &slots[i];
+		if (!oldest || ((int)(slots[i].seq - oldest->seq) < 0))
+			oldest = &slots[i];
+	}
+	oldest->busy = 0;
+	STATS_ADD(incomplete, 1);
+
+	return oldest;
+}
+
+static void process_mode1(unsigned char *pkt, int len, struct timespec *ts)
+{
+	struct nethdr h;
+
+	memcpy(&h, pkt, sizeof(h));
+	if (be_mode)
+		nethdr_to_be(&h);
+
+	if ((h.len <= 0) || (h.len != len - (int)sizeof(h))) {
+		STATS_ADD(malformed, 1);
+		return;
+	}
+	if (!sequence_check(h.seqno))
+		return;
+
+	nal_complete(pkt + sizeof(h), h.len, h.iframe ? FLAG_FRAME_I : FLAG_FRAME_P, ts);
+}
+
+static void process_mode2(unsigned char *pkt, int len, struct timespec *ts)
+{
+	struct nal_slot_s *s;
+	struct nethdr2 h;
+	unsigned int offset;
+
+	memcpy(&h, pkt, sizeof(h));
+	if (be_mode)
+		nethdr2_to_be(&h);
+
+	if ((h.frag_len == 0) || (h.frag_len != len - (int)sizeof(h)) || (h.frag_len > h.seq_len)) {
+		STATS_ADD(malformed, 1);
+		return;
+	}
+
+	s = slot_find(h.seq_no);
+	if (!s) {
+		if (!sequence_check(h.seq_no))
+			return;
+		s = slot_alloc();
+		if (slot_reserve(s, h.seq_len) < 0) {
+			fprintf(stderr, "No memory for a %d byte nal\n", h.seq_len);
+			return;
+		}
+		s->busy = 1;
+		s->seq = h.seq_no;
+		s->len = h.seq_len;
+		s->received = 0;
+		s->have_end = 0;
+		s->frags = 0;
+		s->last_frag = 0;
+		s->type = h.flags & 3;
+		s->first = *ts;
+	} else if (h.seq_len != s->len) {
+		STATS_ADD(malformed, 1);
+		return;
+	}
+
+	/* The final fragment is anchored to the end of the nal, every other
+	 * fragment is full sized, its position follows from frag_no.
+	 */
+	if (h.flags & FLAGS_FRAG_END) {
+		if (s->have_end) {
+			STATS_ADD(duplicates, 1);
+			return;
+		}
+		s->have_end = 1;
+		offset = s->len - h.frag_len;
+	} else {
+		/* frag_no is 8 bits, unwrap to the index nearest the previous
+		 * fragment, or the end when that arrived first.
+		 */
+		int nfrags = (s->len + h.frag_len - 1) / h.frag_len;
+		int anchor = (!s->frags && s->have_end) ? nfrags - 1 : s->last_frag;
+		int idx = -1;
+		for (int cand = h.frag_no; cand < nfrags - 1; cand += 256) {
+			if ((idx < 0) || (abs(cand - anchor) < abs(idx - anchor)))
+				idx = cand;
+		}
+		if (idx < 0) {
+			STATS_ADD(malformed, 1);
+			return;
+		}
+
+		offset = idx * h.frag_len;
+		int r = slot_mark_seen(s, idx);
+		if (r) {
+			if (r > 0)
+				STATS_ADD(duplicates, 1);
+			return;
+		}
+		s->last_frag = idx;
+		s->frags++;
+	}
+
+	memcpy(s->buf + offset, pkt + sizeof(h), h.frag_len);
+	s->received += h.frag_len;
+
+	if (s->received >= s->len) {
+		s->busy = 0;
+		nal_complete(s->buf, s->len, s->type, &s->first);
+	}
+}
+
+/* Pick the mode and byte order from the first datagram, the length fields
+ * have to agree with the datagram size.
+ */
+static int detect_format(unsigned char *pkt, int len)
+{
+	int payload = len - sizeof(struct nethdr2);
+
+	for (int i = 0; i < 2; i++) {
+		int be = be_mode >= 0 ? be_mode : i;
+		if (mode != 1) {
+			struct nethdr2 h;
+			memcpy(&h, pkt, sizeof(h));
+			if (be)
+				nethdr2_to_be(&h);
+			if (((h.flags & 0x3c) == 0) && (h.frag_len == payload) && (h.frag_len <= h.seq_len)) {
+				mode = 2;
+				be_mode = be;
+				return 0;
+			}
+		}
+		if (mode != 2) {
+			struct nethdr h;
+			memcpy(&h, pkt, sizeof(h));
+			if (be)
+				nethdr_to_be(&h);
+			if (h.len == payload) {
+				mode = 1;
+				be_mode = be;
+				return 0;
+			}
+		}
+	}
+
+	return -1;
+}
+
+static int open_socket(char *address, int port, int rcvbuf)
+{
+	struct sockaddr_in sin;
+	int on = 1;
+
+	int skt = socket(AF_INET, SOCK_DGRAM, 0);
+	if (skt < 0) {
+		fprintf(stderr, "socket() failed, %s\n", strerror(errno));
+		return -1;
+	}
+
+	setsockopt(skt, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	if (setsockopt(skt, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof(rcvbuf)) < 0)
+		setsockopt(skt, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+	if (setsockopt(skt, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) < 0)
+		printf("Kernel timestamps unavailable, latency is measured from user space\n");
+
+	/* Wake periodically for statistics and shutdown */
+	struct timeval tv = { 0, 100000 };
+	setsockopt(skt, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	sin.sin_addr.s_addr = htonl(INADDR_ANY);
+	if (address && (inet_pton(AF_INET, address, &sin.sin_addr) != 1)) {
+		fprintf(stderr, "Illegal address %s\n", address);
+		close(skt);
+		return -1;
+	}
+
+	if (bind(skt, (struct sockaddr *)&sin, sizeof(sin)) < 0) {
+		fprintf(stderr, "bind() failed, %s\n", strerror(errno));
+		close(skt);
+		return -1;
+	}
+
+	if (IN_MULTICAST(ntohl(sin.sin_addr.s_addr))) {
+		struct ip_mreq mreq;
+		mreq.imr_multiaddr = sin.sin_addr;
+		mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+		if (setsockopt(skt, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+			fprintf(stderr, "Unable to join %s, %s\n", address, strerror(errno));
+			close(skt);
+			return -1;
+		}
+	}
+
+	return skt;
+}
+
+static struct option long_options[] = {
+	{ "help", no_argument, NULL, 'h' },
+	{ "port", required_argument, NULL, 'p' },
+	{ "address", required_argument, NULL, 'a' },
+	{ "mode", required_argument, NULL, 'm' },
+	{ "endian", required_argument, NULL, 'e' },
+	{ "output", required_argument, NULL, 'o' },
+	{ "interval", required_argument, NULL, 'i' },
+	{ "duration", required_argument, NULL, 't' },
+	{ "rcvbuf", required_argument, NULL, 'r' },
+	{ NULL, 0, NULL, 0 }
+};
+
+int main(int argc, char **argv)
+{
+	static unsigned char bufs[RECV_BATCH][RECV_DGRAM_MAX];
+	static unsigned char ctrl[RECV_BATCH][CMSG_SPACE(sizeof(struct timespec))];
+	static struct mmsghdr msgs[RECV_BATCH];
+	static struct iovec iovs[RECV_BATCH];
+	char *address = NULL, *output = NULL;
+	int port = 0, interval_secs = 1, duration = 0, rcvbuf = 8;
+	struct timespec start, last, now;
+	int c;
+
+	while ((c = getopt_long(argc, argv, "hp:a:m:e:o:i:t:r:", long_options, NULL)) != -1) {
+		switch (c) {
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'a':
+			address = optarg;
+			break;
+		case 'm':
+			mode = atoi(optarg);
+			if ((mode < 0) || (mode > 2))
+				mode = 0;
+			break;
+		case 'e':
+			be_mode = atoi(optarg) & 1;
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		case 'i':
+			interval_secs = atoi(optarg);
+			if (interval_secs < 1)
+				interval_secs = 1;
+			break;
+		case 't':
+			duration = atoi(optarg);
+			break;
+		case 'r':
+			rcvbuf = atoi(optarg);
+			break;
+		case 'h':
+		default:
+			usage(argv[0]);
+			return 0;
+		}
+	}
+
+	if ((port < 1) || (port > 65535)) {
+		usage(argv[0]);
+		return -1;
+	}
+
+	int skt = open_socket(address, port, rcvbuf * 1048576);
+	if (skt < 0)
+		return -1;
+
+	if (output) {
+		out_fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (out_fd < 0) {
+			fprintf(stderr, "Unable to create %s, %s\n", output, strerror(errno));
+			close(skt);
+			return -1;
+		}
+	}
+
+	if (signal(SIGINT, signalHandler) == SIG_ERR) {
+		printf("signal() failed\n");
+		return -1;
+	}
+	if (signal(SIGTERM, signalHandler) == SIG_ERR) {
+		printf("signal() failed\n");
+		return -1;
+	}
+
+	for (int i = 0; i < RECV_BATCH; i++) {
+		iovs[i].iov_base = bufs[i];
+		iovs[i].iov_len = RECV_DGRAM_MAX;
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	printf("Listening on %s:%d\n", address ? address : "0.0.0.0", port);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	last = start;
+
+	while (!time_to_quit) {
+		for (int i = 0; i < RECV_BATCH; i++) {
+			msgs[i].msg_hdr.msg_control = ctrl[i];
+			msgs[i].msg_hdr.msg_controllen = sizeof(ctrl[i]);
+		}
+
+		int n = recvmmsg(skt, msgs, RECV_BATCH, MSG_WAITFORONE, NULL);
+		if ((n < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)) {
+			fprintf(stderr, "recvmmsg() failed, %s\n", strerror(errno));
+			break;
+		}
+
+		struct timespec arrival;
+		if (n > 0)
+			clock_gettime(CLOCK_REALTIME, &arrival);
+
+		for (int i = 0; i < n; i++) {
+			int len = msgs[i].msg_len;
+			struct timespec ts = arrival;
+
+			for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cm;
+				cm = CMSG_NXTHDR(&msgs[i].msg_hdr, cm)) {
+				if ((cm->cmsg_level == SOL_SOCKET) && (cm->cmsg_type == SCM_TIMESTAMPNS))
+					memcpy(&ts, CMSG_DATA(cm), sizeof(ts));
+			}
+
+			STATS_ADD(packets, 1);
+			STATS_ADD(bytes, len);
+
+			if ((len < (int)sizeof(struct nethdr2)) || (msgs[i].msg_hdr.msg_flags & MSG_TRUNC)) {
+				STATS_ADD(malformed, 1);
+				continue;
+			}
+
+			if ((mode == 0) || (be_mode < 0)) {
+				if (detect_format(bufs[i], len) < 0) {
+					STATS_ADD(malformed, 1);
+					continue;
+				}
+				printf("Detected mode %d, %s endian\n", mode, be_mode ? "big" : "little");
+			}
+
+			if (mode == 1)
+				process_mode1(bufs[i], len, &ts);
+			else
+				process_mode2(bufs[i], len, &ts);
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (timespec_diff_us(&last, &now) >= interval_secs * 1000000LL) {
+			stats_print("interval", &interval, timespec_diff_us(&last, &now) / 1000000.0);
+			memset(&interval, 0, sizeof(interval));
+			last = now;
+		}
+		if (duration && (timespec_diff_us(&start, &now) >= duration * 1000000LL))
+			break;
+	}
+
+	/* Whatever is still being assembled never completed */
+	for (int i = 0; i < RECV_SLOTS; i++) {
+		if (slots[i].busy)
+			total.incomplete++;
+		free(slots[i].buf);
+		free(slots[i].seen);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	stats_print("total", &total, timespec_diff_us(&start, &now) / 1000000.0);
+
+	if (out_fd >= 0)
+		close(out_fd);
+	close(skt);
+
+	return 0;
+}
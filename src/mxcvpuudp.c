@@ -30,59 +30,25 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <fcntl.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include "frames.h"
+#include "output.h"
+#include "udpout.h"
+#include "mxcvpuudp.h"
 
 /* TODO: user context required */
-static int skt = -1;
-static struct sockaddr_in udpsock;
+static struct udpout_ctx_s mxc_out = { .skt = -1 };
 static unsigned int seqno = 0;
 static int be_mode = 0;
 static int send_mode = 2;
 static int interframe_delay = 0;
 
-/* Freeslace - custom header, taken from mxc_vpu_test/utils.c */
-/* No concept of endian, no concept of the size of an int.
- * Generally considered bad form to put a raw struct to/from the
- * network.
- */
-struct nethdr {
-	int seqno;
-	int iframe;
-	int len;
-} __attribute__ ((__packed__));
-
-/* Each packet we push to the network contains this header. */
-struct nethdr2 {
-
-	/* During testing, this value was always 1 and it worked reliably */
-
-	/* These are a direct clone from encoder.c */
-	/* bits 1:0 frame type, FRAME_I etc */
-#define FLAG_FRAME_I		0x00
-#define FLAG_FRAME_IDR		0x01
-#define FLAG_FRAME_B		0x02
-#define FLAG_FRAME_P		0x03
-	/* bits 5:4 unused */
-#define FLAGS_FRAG_START	0x40
-#define FLAGS_FRAG_END		0x80
-	unsigned char flags;
-
-	/* An incrementing value that represents an entire nal */
-	unsigned int seq_no;
-
-	/* Total length of the entire nal (0-large number), not including any nethdr2 structs */
-	unsigned int seq_len;
-
-	/* nals can exceed 64KB so we split them into pieces, each new seqno has
-	 * a fragno of zero. Fragno increments each time a fragment is broadcast.
-	 */
-	/* Number of nal bytes included in this transaction (0-65535) */
-	unsigned char frag_no;
-	unsigned short frag_len;
-} __attribute__ ((__packed__));
-
 #if 0
 static void dump_nethdr2(struct nethdr2 *h)
 {
@@ -96,40 +62,34 @@ static void dump_nethdr2(struct nethdr2 *h)
 static struct nethdr pkt_header;
 static struct nethdr2 pkt_header2;
 
-#define ENDIAN_SWAP_U32(n) \
-		(((n) & 0xff000000) >> 24) | \
-		(((n) & 0x00ff0000) >>  8) | \
-		(((n) & 0x0000ff00) <<  8) | \
-		(((n) & 0x000000ff) << 24);
-#define ENDIAN_SWAP_U16(n) \
-		(((n) & 0xff00) >> 8) | \
-		(((n) & 0x00ff) << 8);
+/* Mode 2 fragment payload size, derived from the path MTU when known */
+#define MXC_FRAGLEN_DEFAULT	1300
+#define MXC_FRAGLEN_MAX		(32 * 1024)
+static int fraglen = MXC_FRAGLEN_DEFAULT;
+static int use_gso = 0;
 
-static void nethdr_to_be(struct nethdr *h)
-{
-	h->seqno = ENDIAN_SWAP_U32(h->seqno);
-	h->iframe = ENDIAN_SWAP_U32(h->iframe);
-	h->len = ENDIAN_SWAP_U32(h->len);
-}
+/* Mode 2 sends straight from the coded buffer, one header and a pair of
+ * iovecs (header, nal slice) per fragment. Valid until the batch is flushed.
+ */
+#define MXC_FRAGS_MAX		UDPOUT_BATCH
+static struct nethdr2 frag_header[MXC_FRAGS_MAX];
+static struct iovec frag_iov[MXC_FRAGS_MAX][2];
+
+static int sendMXCVPUUDPPacket(unsigned char *nal, int len, int frame_type);
 
-static void nethdr2_to_be(struct nethdr2 *h)
+static struct output_sink_s mxc_sink =
 {
-	//h->flags = ENDIAN_SWAP_U32(h->flags);
-	h->seq_no  = ENDIAN_SWAP_U32(h->seq_no);
-	h->seq_len = ENDIAN_SWAP_U32(h->seq_len);
-	//h->frag_no = ENDIAN_SWAP_U32(h->frag_no);
-	h->frag_len = ENDIAN_SWAP_U16(h->frag_len);
-}
+	.name		= "MXC VPU UDP",
+	.codeddata	= sendMXCVPUUDPPacket,
+};
 
 void freeMXCVPUUDPHandler()
 {
-	if (skt != -1) {
-		close(skt);
-		skt = -1;
-	}
+	output_unregister(&mxc_sink);
+	udpout_close(&mxc_out);
 }
 
-int initMXCVPUUDPHandler(char *ipaddress, int port, int dscp, int sendsize, int ifd, int big_endian, int mode)
+int initMXCVPUUDPHandler(char *ipaddress, int port, int dscp, int sendsize, int ifd, int big_endian, int mode, int gso)
 {
 	if (!ipaddress || (port < 1024 || (port > 65535) || (ifd < 0)))
 		return -1;
@@ -138,46 +98,25 @@ int initMXCVPUUDPHandler(char *ipaddress, int port, int dscp, int sendsize, int
 	send_mode = mode;
 	interframe_delay = ifd; /* microsecond delay between mode 2 frame transmits */
 
-	skt = socket(AF_INET, SOCK_DGRAM, 0);
-	if (skt < 0) {
-		fprintf(stderr, "socket() failed\n");
+	if (udpout_open(&mxc_out, ipaddress, port, dscp, sendsize) < 0)
 		return -2;
-	}
 
-	memset((char *) &udpsock, 0, sizeof(udpsock));
-	udpsock.sin_family = AF_INET;
-	udpsock.sin_addr.s_addr = inet_addr(ipaddress);
-	udpsock.sin_port = htons(port);
-   
-	if (inet_aton(ipaddress, &udpsock.sin_addr) == 0) {
-		fprintf(stderr, "inet_aton() failed\n");
-		close(skt);
-		return -2;
-	}
+	/* Largest fragment that avoids IP fragmentation: less IP, UDP and our header */
+	int mtu = udpout_path_mtu(&mxc_out);
+	if (mtu > 0)
+		fraglen = mtu - 20 - 8 - sizeof(struct nethdr2);
+	if ((fraglen <= 0) || (fraglen > MXC_FRAGLEN_MAX))
+		fraglen = mtu > 0 ? MXC_FRAGLEN_MAX : MXC_FRAGLEN_DEFAULT;
 
-	int s = sendsize;
-	if (setsockopt(skt, SOL_SOCKET, SO_SNDBUF, (char *)&s, (int)sizeof(s)) < 0) {
-		fprintf(stderr, "Setting local interface error, %s\n", strerror(errno));
-		close(skt);
-		return -1;
-        }
-
-	if (dscp >= 0) {
-		/* Apprently we shift this two places, see vincents ffmpeg patch, validated by
-		 * other posts on the web also.
-		 */
-		dscp <<= 2;
-		if (setsockopt(skt, IPPROTO_IP, IP_TOS, &dscp, sizeof(dscp)) != 0) {
-			fprintf(stderr, "Setting dscp, %s\n", strerror(errno));
-			close(skt);
-			return -1;
-		}
-	}
+	use_gso = gso && mxc_out.gso && (interframe_delay == 0);
+	if (gso && !use_gso)
+		printf("%s() UDP segmentation offload unavailable\n", __func__);
 
-	printf("%s() configured for use.\n", __func__);
+	printf("%s() configured for use, path mtu %d, fragments %d bytes%s.\n", __func__,
+		mtu, fraglen, use_gso ? ", gso" : "");
 	memset(&pkt_header, 0, sizeof(pkt_header));
 
-	return 0;
+	return output_register(&mxc_sink);
 }
 
 /* Convert encoders id for frame types into generic network representation */
@@ -193,27 +132,43 @@ static unsigned char encoderFrameTypeToNetwork(int type)
 	return FLAG_FRAME_P;
 }
 
+/* Queue fragments [0, count) for transmission. With GSO, runs of fragments
+ * go to the kernel as one send, split back into datagrams by the kernel.
+ */
+static void queue_fragments(int count)
+{
+	int segsize = sizeof(struct nethdr2) + fraglen;
+	int per_send = 1;
+	int n;
+
+	if (use_gso) {
+		per_send = 65000 / segsize;
+		if (per_send > UDPOUT_GSO_SEGMENTS)
+			per_send = UDPOUT_GSO_SEGMENTS;
+	}
+
+	for (int i = 0; i < count; i += n) {
+		n = count - i < per_send ? count - i : per_send;
+		if (n > 1)
+			udpout_queue_segmented(&mxc_out, &frag_iov[i][0], n * 2, segsize);
+		else
+			udpout_queue(&mxc_out, &frag_iov[i][0], 2);
+	}
+}
+
 /* Send a full nal, spread across multiple packets as necessary, each with their
  * own header.
  */
 static int sendMXCVPUUDPPacket_2(unsigned char *nal, int len, int frame_type)
 {
-	/* Maximum size + header of a single UDP transmit that we'll support.
-	 * Must be less than 64KB else Linux refuses to send it.
-	 */
-	int fraglen = (32 * 1024);
-	fraglen = 1300;
+	int nr = 0;
 
 	/* The encoder will feed us regardless, just OK
 	 * the transaction if we're not enabled.
 	 */
-	if (skt == -1)
+	if (mxc_out.skt == -1)
 		return 0;
 
-	unsigned char *buf = malloc(fraglen + sizeof(pkt_header2));
-	if (!buf)
-		return -1;
-
 	/* Roll the seq no for every major nal, don't roll it when we fragment */
 	pkt_header2.seq_no = seqno++;
 	pkt_header2.seq_len = len;
@@ -221,8 +176,8 @@ static int sendMXCVPUUDPPacket_2(unsigned char *nal, int len, int frame_type)
 	pkt_header2.frag_len = 0;
 
 	/* One header per fragment */
-	unsigned char *p = buf + sizeof(pkt_header2);
 	for (int i = 0; i < len; i += fraglen) {
+		struct nethdr2 *h = &frag_header[nr];
 
 		if ((i + fraglen) < len) {
 			pkt_header2.frag_len = fraglen;
@@ -236,31 +191,38 @@ static int sendMXCVPUUDPPacket_2(unsigned char *nal, int len, int frame_type)
 		if (pkt_header2.frag_no == 0)
 			pkt_header2.flags |= FLAGS_FRAG_START;
 
-		memcpy(buf, &pkt_header2, sizeof(pkt_header2));
-
-		/* Take a fragment slice */
-		memcpy(buf + sizeof(pkt_header2), nal + i, pkt_header2.frag_len);
-
 		//dump_nethdr2(&pkt_header2);
 
+		/* Header + fragment slice, referenced not copied */
+		*h = pkt_header2;
+		frag_iov[nr][0].iov_base = h;
+		frag_iov[nr][0].iov_len = sizeof(*h);
+		frag_iov[nr][1].iov_base = nal + i;
+		frag_iov[nr][1].iov_len = pkt_header2.frag_len;
+
 		/* Prep endianness prior to xmit */
 		if (be_mode)
-			nethdr2_to_be((struct nethdr2 *)buf);
+			nethdr2_to_be(h);
 
-		/* Send the header + partial fragment */
-		int l = sizeof(pkt_header2) + pkt_header2.frag_len;
-		int ret = sendto(skt, buf, l, 0, (struct sockaddr*)&udpsock, sizeof(udpsock));
-		if (ret < 0)
-			fprintf(stderr, "Sending %d byte hdr msg err, %s\n", l,
-				strerror(errno));
+		nr++;
+		pkt_header2.frag_no++;
 
-		if (interframe_delay)
+		if (interframe_delay) {
+			udpout_queue(&mxc_out, frag_iov[0], 2);
+			udpout_flush(&mxc_out);
 			usleep(interframe_delay);
-
-		p += pkt_header2.frag_len;
-		pkt_header2.frag_no++;
+			nr = 0;
+		} else
+		if (nr == MXC_FRAGS_MAX) {
+			queue_fragments(nr);
+			udpout_flush(&mxc_out);
+			nr = 0;
+		}
 	}
-	free(buf);
+
+	/* Everything left in a single sendmmsg() */
+	queue_fragments(nr);
+	udpout_flush(&mxc_out);
 
 	return 0;
 }
@@ -268,17 +230,15 @@ static int sendMXCVPUUDPPacket_2(unsigned char *nal, int len, int frame_type)
 /* Send a header and full nal in a single transaction */
 static int sendMXCVPUUDPPacket_1(unsigned char *nal, int len, int isIFrame)
 {
+	struct nethdr hdr;
+	struct iovec iov[2];
+
 	/* The encoder will feed us regardless, just OK
 	 * the transaction if we're not enabled.
 	 */
-	if (skt == -1)
+	if (mxc_out.skt == -1)
 		return 0;
 
-	int sendlen = len + sizeof(pkt_header);
-	unsigned char *buf = malloc(sendlen);
-	if (!buf)
-		return -1;
-
 	/* Roll the seq no for every major nal, don't roll it when we fragment */
 	pkt_header.seqno = seqno++;
 	pkt_header.iframe = 1;
@@ -287,22 +247,22 @@ static int sendMXCVPUUDPPacket_1(unsigned char *nal, int len, int isIFrame)
 	/* Construct a proprietary network frame, in whichever
 	 * format freescale prefers, big or little endian.
 	 */
-	memcpy(buf, &pkt_header, sizeof(pkt_header));
+	hdr = pkt_header;
 	if (be_mode)
-		nethdr_to_be((struct nethdr *)buf);
-	memcpy(buf + sizeof(pkt_header), nal, len);
+		nethdr_to_be(&hdr);
 
 	/* Header and nal in one complete write */
-	int ret = sendto(skt, buf, sendlen, 0, (struct sockaddr*)&udpsock, sizeof(udpsock));
-	if (ret < 0) {
-		fprintf(stderr, "Sending %d byte datagram message error, %s\n", sendlen, strerror(errno));
-	}
-	free(buf);
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = nal;
+	iov[1].iov_len = len;
+	udpout_queue(&mxc_out, iov, 2);
+	udpout_flush(&mxc_out);
 
 	return 0;
 }
 
-int sendMXCVPUUDPPacket(unsigned char *nal, int len, int frame_type)
+static int sendMXCVPUUDPPacket(unsigned char *nal, int len, int frame_type)
 {
 	if (send_mode == 1)
 		return sendMXCVPUUDPPacket_1(nal, len, frame_type);
@@ -312,59 +272,417 @@ int sendMXCVPUUDPPacket(unsigned char *nal, int len, int frame_type)
 	return 0;
 }
 
-int validateMXCVPUUDPOutput(char *filename, int big_endian)
+/* Capture validation. A capture is the UDP payloads as received, back to
+ * back: mode 1 records are a nethdr followed by the whole nal, mode 2 records
+ * a nethdr2 followed by one fragment. The file is mapped and walked in place,
+ * fragments are reassembled by reference and written with writev().
+ */
+#define MXC_VALIDATE_PROBE	32
+#define MXC_VALIDATE_IOV	1024
+
+struct mxc_validate_s
+{
+	int mode;
+	int be;
+
+	/* Annex-B output, slices of the mapping queued until the batch fills */
+	int ofd;
+	struct iovec iov[MXC_VALIDATE_IOV];
+	int iovcnt;
+	unsigned long long written;
+
+	/* Nal being reassembled (mode 2) */
+	int in_nal;
+	unsigned int nal_seq;
+	unsigned int nal_len;
+	unsigned int nal_bytes;
+	unsigned char nal_fragno;
+	unsigned char nal_type;
+	int nal_iov;
+
+	/* Statistics */
+	unsigned long long records;
+	unsigned long long nals;
+	unsigned long long nal_bytes_total;
+	unsigned long long seq_gaps;
+	unsigned long long seq_missing;
+	unsigned long long frag_errors;
+	unsigned long long nals_dropped;
+	unsigned long long types[4];
+	int have_seq;
+	unsigned int last_seq;
+};
+
+static const unsigned char mxc_startcode[4] = { 0x00, 0x00, 0x00, 0x01 };
+
+static void read_nethdr(const unsigned char *p, struct nethdr *h, int be)
+{
+	memcpy(h, p, sizeof(*h));
+	if (be)
+		nethdr_to_be(h);
+}
+
+static void read_nethdr2(const unsigned char *p, struct nethdr2 *h, int be)
 {
-	int isok = 1;
-	int old_seqno;
-	pkt_header.seqno = -1;
+	memcpy(h, p, sizeof(*h));
+	if (be)
+		nethdr2_to_be(h);
+}
 
-	if (!filename)
+/* Count how many records from the head of the capture parse cleanly in the
+ * given mode and byte order, used to pick the format.
+ */
+static int validate_probe(const unsigned char *buf, size_t size, int mode, int be)
+{
+	size_t pos = 0;
+	int good = 0;
+
+	while ((good < MXC_VALIDATE_PROBE) && (pos + sizeof(struct nethdr) <= size)) {
+		if (mode == 1) {
+			struct nethdr h;
+			read_nethdr(buf + pos, &h, be);
+			if ((h.len <= 0) || ((size_t)h.len > size - pos - sizeof(h)))
+				break;
+			if ((h.iframe & ~1) != 0)
+				break;
+			pos += sizeof(h) + h.len;
+		} else {
+			struct nethdr2 h;
+			read_nethdr2(buf + pos, &h, be);
+			if ((h.flags & 0x3c) || (h.frag_len == 0) || (h.frag_len > h.seq_len))
+				break;
+			if ((h.flags & FLAGS_FRAG_START) && (h.frag_no != 0))
+				break;
+			if (h.frag_len > size - pos - sizeof(h))
+				break;
+			pos += sizeof(h) + h.frag_len;
+		}
+		good++;
+	}
+
+	return good;
+}
+
+static int validate_flush(struct mxc_validate_s *v, int count)
+{
+	struct iovec *iov = v->iov;
+	int remaining = count;
+
+	while (remaining > 0) {
+		ssize_t l = writev(v->ofd, iov, remaining);
+		if (l < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "%s() write failed, %s\n", __func__, strerror(errno));
+			return -1;
+		}
+		v->written += l;
+
+		/* Partial writes, skip what went out and retry the rest */
+		while (remaining && ((size_t)l >= iov->iov_len)) {
+			l -= iov->iov_len;
+			iov++;
+			remaining--;
+		}
+		if (remaining) {
+			iov->iov_base = (unsigned char *)iov->iov_base + l;
+			iov->iov_len -= l;
+		}
+	}
+
+	/* Anything beyond count belongs to a nal still being assembled */
+	memmove(&v->iov[0], &v->iov[count], (v->iovcnt - count) * sizeof(struct iovec));
+	v->iovcnt -= count;
+	v->nal_iov = v->nal_iov >= count ? v->nal_iov - count : -1;
+
+	return 0;
+}
+
+static int validate_queue(struct mxc_validate_s *v, const unsigned char *buf, unsigned int len)
+{
+	if (v->ofd < 0)
+		return 0;
+
+	/* A nal too fragmented for one batch goes out incomplete, rare enough */
+	if (v->iovcnt == MXC_VALIDATE_IOV) {
+		int count = v->nal_iov > 0 ? v->nal_iov : v->iovcnt;
+		if (validate_flush(v, count) < 0)
+			return -1;
+	}
+
+	v->iov[v->iovcnt].iov_base = (void *)buf;
+	v->iov[v->iovcnt].iov_len = len;
+	v->iovcnt++;
+
+	return 0;
+}
+
+static void validate_sequence(struct mxc_validate_s *v, unsigned int seq)
+{
+	if (v->have_seq && (seq != v->last_seq + 1)) {
+		v->seq_gaps++;
+		if (seq > v->last_seq)
+			v->seq_missing += seq - v->last_seq - 1;
+		if (v->seq_gaps <= 16)
+			printf("Sequence gap: %u -> %u at record %llu\n",
+				v->last_seq, seq, v->records);
+	}
+	v->have_seq = 1;
+	v->last_seq = seq;
+}
+
+/* Start a nal in the output, prefixing a start code when the payload lacks one */
+static int validate_nal_begin(struct mxc_validate_s *v, const unsigned char *p, unsigned int len)
+{
+	v->nal_iov = v->iovcnt;
+	if ((len >= 3) && (p[0] == 0) && (p[1] == 0) &&
+		((p[2] == 1) || ((len >= 4) && (p[2] == 0) && (p[3] == 1))))
+		return 0;
+
+	return validate_queue(v, mxc_startcode, sizeof(mxc_startcode));
+}
+
+/* Drop the partially assembled nal from the output queue */
+static void validate_nal_abandon(struct mxc_validate_s *v)
+{
+	if ((v->ofd >= 0) && (v->nal_iov >= 0))
+		v->iovcnt = v->nal_iov;
+	v->nals_dropped++;
+	v->in_nal = 0;
+}
+
+static int validate_nal_end(struct mxc_validate_s *v)
+{
+	v->nals++;
+	v->nal_bytes_total += v->nal_len;
+	v->types[v->nal_type & 3]++;
+	v->in_nal = 0;
+	v->nal_iov = -1;
+
+	/* Whole nals only, the batch boundary falls between them */
+	if ((v->ofd >= 0) && (v->iovcnt >= MXC_VALIDATE_IOV - 2))
+		return validate_flush(v, v->iovcnt);
+
+	return 0;
+}
+
+static int validate_mode1(struct mxc_validate_s *v, const unsigned char *buf, size_t size, size_t *pos)
+{
+	struct nethdr h;
+
+	read_nethdr(buf + *pos, &h, v->be);
+	if ((h.len <= 0) || ((size_t)h.len > size - *pos - sizeof(h))) {
+		printf("Record %llu at offset %zu, illegal length %d\n", v->records, *pos, h.len);
 		return -1;
+	}
 
-	be_mode = big_endian & 1;
-	FILE *fh = fopen(filename, "rb");
+	const unsigned char *p = buf + *pos + sizeof(h);
+	*pos += sizeof(h) + h.len;
 
-	while (!feof(fh)) {
-		old_seqno = pkt_header.seqno;
-		int l = fread(&pkt_header, sizeof(pkt_header), 1, fh);
-		if (feof(fh))
-			break;
+	validate_sequence(v, h.seqno);
+	v->nal_len = h.len;
+	v->nal_type = h.iframe ? FLAG_FRAME_I : FLAG_FRAME_P;
 
-		if (l != 1) {
-			isok = 0;
-			break;
+	if ((validate_nal_begin(v, p, h.len) < 0) || (validate_queue(v, p, h.len) < 0))
+		return -2;
+
+	return validate_nal_end(v) < 0 ? -2 : 0;
+}
+
+static int validate_mode2(struct mxc_validate_s *v, const unsigned char *buf, size_t size, size_t *pos)
+{
+	struct nethdr2 h;
+
+	read_nethdr2(buf + *pos, &h, v->be);
+	if ((h.frag_len == 0) || (h.frag_len > size - *pos - sizeof(h))) {
+		printf("Record %llu at offset %zu, illegal fragment length %d\n",
+			v->records, *pos, h.frag_len);
+		return -1;
+	}
+
+	const unsigned char *p = buf + *pos + sizeof(h);
+	*pos += sizeof(h) + h.frag_len;
+
+	/* A new seq_no while assembling, the previous nal lost its tail */
+	if (v->in_nal && (h.seq_no != v->nal_seq)) {
+		v->frag_errors++;
+		validate_nal_abandon(v);
+	}
+
+	if (!v->in_nal) {
+		if (!(h.flags & FLAGS_FRAG_START) || (h.frag_no != 0)) {
+			/* Head of this nal was lost, skip to the next start */
+			if (!v->have_seq || (h.seq_no != v->last_seq)) {
+				validate_sequence(v, h.seq_no);
+				v->frag_errors++;
+				v->nals_dropped++;
+			}
+			return 0;
 		}
+		validate_sequence(v, h.seq_no);
+		v->in_nal = 1;
+		v->nal_seq = h.seq_no;
+		v->nal_len = h.seq_len;
+		v->nal_bytes = 0;
+		v->nal_fragno = 0;
+		v->nal_type = h.flags & 3;
+		if (validate_nal_begin(v, p, h.frag_len) < 0)
+			return -2;
+	} else if ((h.frag_no != (unsigned char)(v->nal_fragno + 1)) || (h.seq_len != v->nal_len) ||
+		(h.flags & FLAGS_FRAG_START)) {
+		v->frag_errors++;
+		validate_nal_abandon(v);
+		return 0;
+	} else
+		v->nal_fragno = h.frag_no;
 
-		if (be_mode)
-			nethdr_to_be(&pkt_header);
+	v->nal_bytes += h.frag_len;
+	if (v->nal_bytes > v->nal_len) {
+		v->frag_errors++;
+		validate_nal_abandon(v);
+		return 0;
+	}
 
-		printf("seq:%08d iframe:%1d len:%08d[0x%08x] ...\n",
-			pkt_header.seqno, 
-			pkt_header.iframe, 
-			pkt_header.len, pkt_header.len);
+	if (validate_queue(v, p, h.frag_len) < 0)
+		return -2;
 
-		if (old_seqno + 1 != pkt_header.seqno) {
-			printf("Illegal sequence number\n");
-			isok = 0;
-			break;
+	if (h.flags & FLAGS_FRAG_END) {
+		if (v->nal_bytes != v->nal_len) {
+			v->frag_errors++;
+			validate_nal_abandon(v);
+			return 0;
 		}
+		if (validate_nal_end(v) < 0)
+			return -2;
+	}
 
-		unsigned char *buf = malloc(pkt_header.len);
-		if (!buf) {	
-			isok = 0;
-			break;
+	return 0;
+}
+
+int validateMXCVPUUDPOutput(char *filename, int big_endian, char *annexb_filename)
+{
+	static const char *type_names[4] = { "I", "IDR", "B", "P" };
+	struct mxc_validate_s *v;
+	struct timeval start, end;
+	struct stat st;
+	int ret = -1;
+
+	if (!filename)
+		return -1;
+
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "%s() unable to open %s, %s\n", __func__, filename, strerror(errno));
+		return -1;
+	}
+	if ((fstat(fd, &st) < 0) || (st.st_size < (off_t)sizeof(struct nethdr))) {
+		fprintf(stderr, "%s() %s is too small to be a capture\n", __func__, filename);
+		close(fd);
+		return -1;
+	}
+
+	size_t size = st.st_size;
+	unsigned char *buf = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (buf == MAP_FAILED) {
+		fprintf(stderr, "%s() unable to map %s, %s\n", __func__, filename, strerror(errno));
+		return -1;
+	}
+	madvise(buf, size, MADV_SEQUENTIAL);
+
+	v = calloc(1, sizeof(*v));
+	if (!v) {
+		munmap(buf, size);
+		return -1;
+	}
+	v->ofd = -1;
+	v->nal_iov = -1;
+
+	/* Both layouts are 12 bytes of header, pick whichever parses furthest.
+	 * Ties go to the byte order the user asked for, then mode 2.
+	 */
+	int best = 0;
+	for (int mode = 2; mode >= 1; mode--) {
+		for (int i = 0; i < 2; i++) {
+			int be = i ? !(big_endian & 1) : (big_endian & 1);
+			int n = validate_probe(buf, size, mode, be);
+			if (n > best) {
+				best = n;
+				v->mode = mode;
+				v->be = be;
+			}
 		}
-		l = fread(buf, 1, pkt_header.len, fh); 
-		if (feof(fh))
-			break;
-		if (l != pkt_header.len) {
-			isok = 0;
-			break;
+	}
+	if (best == 0) {
+		printf("%s: no recognisable mode 1 or mode 2 records\n", filename);
+		goto out;
+	}
+	printf("%s: %zu bytes, mode %d, %s endian\n", filename, size, v->mode,
+		v->be ? "big" : "little");
+
+	if (annexb_filename) {
+		v->ofd = open(annexb_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (v->ofd < 0) {
+			fprintf(stderr, "%s() unable to create %s, %s\n", __func__,
+				annexb_filename, strerror(errno));
+			goto out;
 		}
-
-		free(buf);
 	}
 
-	return isok;
+	gettimeofday(&start, NULL);
+
+	size_t pos = 0;
+	int r = 0;
+	while (pos + sizeof(struct nethdr) <= size) {
+		if (v->mode == 1)
+			r = validate_mode1(v, buf, size, &pos);
+		else
+			r = validate_mode2(v, buf, size, &pos);
+		if (r < 0)
+			break;
+		v->records++;
+	}
+	if (v->in_nal) {
+		v->frag_errors++;
+		validate_nal_abandon(v);
+	}
+	if ((r != -2) && (v->ofd >= 0) && v->iovcnt && (validate_flush(v, v->iovcnt) < 0))
+		r = -2;
+
+	gettimeofday(&end, NULL);
+	double secs = (end.tv_sec - start.tv_sec) + ((end.tv_usec - start.tv_usec) / 1000000.0);
+
+	printf("Records: %llu, nals: %llu (%llu bytes), dropped: %llu\n",
+		v->records, v->nals, v->nal_bytes_total, v->nals_dropped);
+	printf("Sequence gaps: %llu (%llu missing), fragment errors: %llu\n",
+		v->seq_gaps, v->seq_missing, v->frag_errors);
+	if (v->mode == 2) {
+		printf("Frame types:");
+		for (int i = 0; i < 4; i++)
+			printf(" %s %llu", type_names[i], v->types[i]);
+		printf("\n");
+	} else
+		printf("Frame types: iframe flagged %llu, other %llu\n",
+			v->types[FLAG_FRAME_I], v->types[FLAG_FRAME_P]);
+	if (v->ofd >= 0)
+		printf("Annex-B: %llu bytes to %s\n", v->written, annexb_filename);
+	printf("Scanned %zu bytes in %.3f secs, %.1f MB/s\n", pos, secs,
+		secs > 0 ? (pos / 1048576.0) / secs : 0.0);
+
+	if (r == -1)
+		printf("Capture truncated or corrupt at offset %zu\n", pos);
+	else if (pos != size)
+		printf("Trailing %zu bytes, partial record\n", size - pos);
+
+	if ((r == 0) && (pos == size) && !v->seq_gaps && !v->frag_errors)
+		ret = 0;
+
+out:
+	if (v->ofd >= 0)
+		close(v->ofd);
+	free(v);
+	munmap(buf, size);
+
+	return ret;
 }
 
@@ -23,10 +23,86 @@
  *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
  */
 
+#ifndef MXCVPUUDP_H
+#define MXCVPUUDP_H
+
+/* Wire formats, shared by the sender (mxcvpuudp.c) and mxcrecv */
+
+/* Freeslace - custom header, taken from mxc_vpu_test/utils.c */
+/* No concept of endian, no concept of the size of an int.
+ * Generally considered bad form to put a raw struct to/from the
+ * network.
+ */
+struct nethdr {
+	int seqno;
+	int iframe;
+	int len;
+} __attribute__ ((__packed__));
+
+/* Each packet we push to the network contains this header. */
+struct nethdr2 {
+
+	/* During testing, this value was always 1 and it worked reliably */
+
+	/* These are a direct clone from encoder.c */
+	/* bits 1:0 frame type, FRAME_I etc */
+#define FLAG_FRAME_I		0x00
+#define FLAG_FRAME_IDR		0x01
+#define FLAG_FRAME_B		0x02
+#define FLAG_FRAME_P		0x03
+	/* bits 5:4 unused */
+#define FLAGS_FRAG_START	0x40
+#define FLAGS_FRAG_END		0x80
+	unsigned char flags;
+
+	/* An incrementing value that represents an entire nal */
+	unsigned int seq_no;
+
+	/* Total length of the entire nal (0-large number), not including any nethdr2 structs */
+	unsigned int seq_len;
+
+	/* nals can exceed 64KB so we split them into pieces, each new seqno has
+	 * a fragno of zero. Fragno increments each time a fragment is broadcast.
+	 */
+	/* Number of nal bytes included in this transaction (0-65535) */
+	unsigned char frag_no;
+	unsigned short frag_len;
+} __attribute__ ((__packed__));
+
+#define ENDIAN_SWAP_U32(n) \
+		(((n) & 0xff000000) >> 24) | \
+		(((n) & 0x00ff0000) >>  8) | \
+		(((n) & 0x0000ff00) <<  8) | \
+		(((n) & 0x000000ff) << 24);
+#define ENDIAN_SWAP_U16(n) \
+		(((n) & 0xff00) >> 8) | \
+		(((n) & 0x00ff) << 8);
+
+static inline void nethdr_to_be(struct nethdr *h)
+{
+	h->seqno = ENDIAN_SWAP_U32(h->seqno);
+	h->iframe = ENDIAN_SWAP_U32(h->iframe);
+	h->len = ENDIAN_SWAP_U32(h->len);
+}
+
+static inline void nethdr2_to_be(struct nethdr2 *h)
+{
+	//h->flags = ENDIAN_SWAP_U32(h->flags);
+	h->seq_no  = ENDIAN_SWAP_U32(h->seq_no);
+	h->seq_len = ENDIAN_SWAP_U32(h->seq_len);
+	//h->frag_no = ENDIAN_SWAP_U32(h->frag_no);
+	h->frag_len = ENDIAN_SWAP_U16(h->frag_len);
+}
+
 /* Broadcast Packets specific to the freescale mxc_vpu_test udp test app */
 
 void freeMXCVPUUDPHandler();
-int  initMXCVPUUDPHandler(char *ipaddress, int port, int dscp, int sendsize, int ifd, int bigendian, int send_mode);
-int  sendMXCVPUUDPPacket(unsigned char *nal, int len, int frame_type);
+int  initMXCVPUUDPHandler(char *ipaddress, int port, int dscp, int sendsize, int ifd, int bigendian, int send_mode, int gso);
+
+/* Scan a capture of mode 1 or mode 2 records (detected), report sequence gaps,
+ * frame types and throughput. Reassembled nals are written to annexb_filename
+ * when not NULL. Returns 0 when the capture is clean, else -1.
+ */
+int  validateMXCVPUUDPOutput(char *filename, int bigendian, char *annexb_filename);
 
-int  validateMXCVPUUDPOutput(char *filename, int bigendian);
+#endif
@@ -0,0 +1,87 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "output.h"
+
+#define OUTPUT_SINKS_MAX 8
+
+static struct output_sink_s *sinks[OUTPUT_SINKS_MAX];
+static int sink_count = 0;
+static unsigned long long clock_origin_us = 0;
+
+int output_register(struct output_sink_s *sink)
+{
+	if (sink_count == OUTPUT_SINKS_MAX) {
+		printf("%s() too many outputs, ignoring %s\n", __func__, sink->name);
+		return -1;
+	}
+
+	sinks[sink_count++] = sink;
+	return 0;
+}
+
+void output_unregister(struct output_sink_s *sink)
+{
+	for (int i = 0; i < sink_count; i++) {
+		if (sinks[i] != sink)
+			continue;
+
+		memmove(&sinks[i], &sinks[i + 1], (sink_count - i - 1) * sizeof(sinks[0]));
+		sink_count--;
+		return;
+	}
+}
+
+void output_clock_origin(unsigned long long origin_us)
+{
+	clock_origin_us = origin_us;
+}
+
+unsigned long long output_clock90k()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	unsigned long long us = ((unsigned long long)ts.tv_sec * 1000000ULL) + (ts.tv_nsec / 1000);
+
+	return ((us - clock_origin_us) * 9) / 100;
+}
+
+void output_codeddata(unsigned char *buf, int len, int frame_type)
+{
+	for (int i = 0; i < sink_count; i++)
+		sinks[i]->codeddata(buf, len, frame_type);
+}
+
+void output_frame_complete(int frame_type, unsigned long long pts90k, unsigned long long dts90k)
+{
+	for (int i = 0; i < sink_count; i++) {
+		if (sinks[i]->frame_complete)
+			sinks[i]->frame_complete(frame_type, pts90k, dts90k);
+	}
+}
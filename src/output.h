@@ -0,0 +1,59 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+/* Destinations for coded video (RTP, TS, MXC ...) register a sink
+ * during their init and are fed by the encoder core.
+ */
+struct output_sink_s
+{
+	char *name;
+
+	/* Annex B coded data for the current access unit, one or more
+	 * complete nals. The buffer remains valid until frame_complete().
+	 */
+	int  (*codeddata)(unsigned char *buf, int len, int frame_type);
+
+	/* Every nal of the access unit has been delivered. pts90k is the
+	 * capture time of the frame on a 90KHz clock, dts90k its decode time
+	 * on the same clock (equal to pts90k without B frames). Optional.
+	 */
+	void (*frame_complete)(int frame_type, unsigned long long pts90k, unsigned long long dts90k);
+};
+
+int  output_register(struct output_sink_s *sink);
+void output_unregister(struct output_sink_s *sink);
+
+/* Now on the 90KHz clock of pts90k and dts90k, to map other clocks onto it */
+unsigned long long output_clock90k();
+
+/* Called by the encoder core only. The clock is CLOCK_MONOTONIC less origin_us. */
+void output_clock_origin(unsigned long long origin_us);
+void output_codeddata(unsigned char *buf, int len, int frame_type);
+void output_frame_complete(int frame_type, unsigned long long pts90k, unsigned long long dts90k);
+
+#endif
@@ -0,0 +1,263 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include "rtcp.h"
+
+static int skt = -1;
+static pthread_t rtcp_thread;
+static int rtcp_running = 0;
+static struct rtcp_handler_s *rtcp_handler;
+static char cname[64];
+
+static unsigned int rd32(const unsigned char *p)
+{
+	return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+/* Generic NACK FCI entries, a packet id and a bitmask of the 16 following */
+static void rtcp_nack(const unsigned char *p, int len, struct sockaddr_in *from)
+{
+	if ((len < 12) || (rd32(p + 8) != rtcp_handler->ssrc))
+		return;
+
+	for (int i = 12; i + 4 <= len; i += 4) {
+		unsigned short pid = (p[i] << 8) | p[i + 1];
+		unsigned short blp = (p[i + 2] << 8) | p[i + 3];
+
+		rtcp_handler->nack(pid, from);
+		for (int b = 0; b < 16; b++) {
+			if (blp & (1 << b))
+				rtcp_handler->nack(pid + b + 1, from);
+		}
+	}
+}
+
+/* The middle 32 bits of the NTP wallclock, the LSR/DLSR format (1/65536s) */
+static unsigned int rtcp_ntp_mid32(unsigned int *msw, unsigned int *lsw)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	unsigned int sec = ts.tv_sec + 2208988800UL;	/* 1900 epoch */
+	unsigned int frac = ((unsigned long long)ts.tv_nsec << 32) / 1000000000ULL;
+
+	if (msw)
+		*msw = sec;
+	if (lsw)
+		*lsw = frac;
+
+	return (sec << 16) | (frac >> 16);
+}
+
+/* Report blocks in an SR or RR, offset is where the first one starts */
+static void rtcp_reports(const unsigned char *p, int len, int offset, struct sockaddr_in *from)
+{
+	int count = p[0] & 0x1f;
+
+	if (len < 8)
+		return;
+
+	for (int i = 0; i < count; i++) {
+		const unsigned char *b = p + offset + (i * 24);
+		if (b + 24 > p + len)
+			return;
+		if (rd32(b) != rtcp_handler->ssrc)
+			continue;
+
+		struct rtcp_report_s r;
+		r.reporter = rd32(p + 4);
+		r.fraction_lost = b[4];
+		r.cumulative_lost = (b[5] << 16) | (b[6] << 8) | b[7];
+		if (r.cumulative_lost & 0x800000)
+			r.cumulative_lost -= 0x1000000;
+		r.highest_seq = rd32(b + 8);
+		r.jitter = rd32(b + 12);
+
+		unsigned int lsr = rd32(b + 16);
+		unsigned int dlsr = rd32(b + 20);
+		r.rtt_ms = -1;
+		if (lsr) {
+			unsigned int rtt = rtcp_ntp_mid32(NULL, NULL) - lsr - dlsr;
+			if (rtt < 0x80000000)
+				r.rtt_ms = ((unsigned long long)rtt * 1000) >> 16;
+		}
+
+		rtcp_handler->report(&r, from);
+	}
+}
+
+/* Walk a compound packet */
+static void rtcp_parse(const unsigned char *buf, int len, struct sockaddr_in *from)
+{
+	while (len >= 4) {
+		int plen = (((buf[2] << 8) | buf[3]) + 1) * 4;
+		if (((buf[0] >> 6) != 2) || (plen > len))
+			return;
+
+		if ((buf[1] == RTCP_PT_RTPFB) && ((buf[0] & 0x1f) == RTCP_FMT_NACK) && rtcp_handler->nack)
+			rtcp_nack(buf, plen, from);
+		if ((buf[1] == RTCP_PT_RR) && rtcp_handler->report)
+			rtcp_reports(buf, plen, 8, from);
+		if ((buf[1] == RTCP_PT_SR) && rtcp_handler->report)
+			rtcp_reports(buf, plen, 28, from);
+
+		buf += plen;
+		len -= plen;
+	}
+}
+
+static void *rtcp_thread_func(void *arg)
+{
+	unsigned char buf[1500];
+	struct pollfd pfd = { .fd = skt, .events = POLLIN };
+
+	while (rtcp_running) {
+		/* Wake periodically to notice shutdown */
+		if (poll(&pfd, 1, 200) <= 0)
+			continue;
+
+		struct sockaddr_in from;
+		socklen_t fromlen = sizeof(from);
+		int len = recvfrom(skt, buf, sizeof(buf), 0, (struct sockaddr *)&from, &fromlen);
+		if (len > 0)
+			rtcp_parse(buf, len, &from);
+	}
+
+	return NULL;
+}
+
+int rtcp_open(int port, struct rtcp_handler_s *handler)
+{
+	struct sockaddr_in sa;
+
+	skt = socket(AF_INET, SOCK_DGRAM, 0);
+	if (skt < 0)
+		return -1;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(port);
+	sa.sin_addr.s_addr = htonl(INADDR_ANY);
+	if (bind(skt, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+		fprintf(stderr, "%s() unable to bind port %d, %s\n", __func__, port, strerror(errno));
+		close(skt);
+		skt = -1;
+		return -1;
+	}
+
+	if (gethostname(cname, sizeof(cname) - 16) < 0)
+		strcpy(cname, "localhost");
+	cname[sizeof(cname) - 16] = 0;
+	memmove(cname + 12, cname, strlen(cname) + 1);
+	memcpy(cname, "h264encoder@", 12);
+
+	rtcp_handler = handler;
+	rtcp_running = 1;
+	if (pthread_create(&rtcp_thread, NULL, rtcp_thread_func, NULL) != 0) {
+		rtcp_running = 0;
+		close(skt);
+		skt = -1;
+		return -1;
+	}
+
+	printf("RTCP feedback on port %d\n", port);
+
+	return 0;
+}
+
+void rtcp_close()
+{
+	if (!rtcp_running)
+		return;
+
+	rtcp_running = 0;
+	pthread_join(rtcp_thread, NULL);
+	close(skt);
+	skt = -1;
+}
+
+static void wr32(unsigned char *p, unsigned int v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+void rtcp_send_sr(unsigned int rtp_timestamp, unsigned int packets, unsigned int octets,
+	struct sockaddr_in *dst, int dst_count)
+{
+	unsigned char buf[28 + 8 + 2 + 64 + 4];
+	unsigned int msw, lsw;
+	int cnamelen = strlen(cname);
+	int len, sdeslen;
+
+	if (skt < 0)
+		return;
+
+	rtcp_ntp_mid32(&msw, &lsw);
+
+	/* SR, no report blocks as we receive nothing */
+	buf[0] = 0x80;
+	buf[1] = RTCP_PT_SR;
+	buf[2] = 0;
+	buf[3] = 6;
+	wr32(buf + 4, rtcp_handler->ssrc);
+	wr32(buf + 8, msw);
+	wr32(buf + 12, lsw);
+	wr32(buf + 16, rtp_timestamp);
+	wr32(buf + 20, packets);
+	wr32(buf + 24, octets);
+
+	/* SDES with a single CNAME chunk, null terminated and padded to 32 bits */
+	unsigned char *p = buf + 28;
+	sdeslen = (4 + 2 + cnamelen + 1 + 3) & ~3;
+	memset(p, 0, 4 + sdeslen);
+	p[0] = 0x81;
+	p[1] = RTCP_PT_SDES;
+	p[2] = 0;
+	p[3] = sdeslen / 4;
+	wr32(p + 4, rtcp_handler->ssrc);
+	p[8] = 1;	/* CNAME */
+	p[9] = cnamelen;
+	memcpy(p + 10, cname, cnamelen);
+	len = 28 + 4 + sdeslen;
+
+	for (int i = 0; i < dst_count; i++) {
+		struct sockaddr_in sa = dst[i];
+		sa.sin_port = htons(ntohs(sa.sin_port) + 1);
+		sendto(skt, buf, len, 0, (struct sockaddr *)&sa, sizeof(sa));
+	}
+}
@@ -0,0 +1,73 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef RTCP_H
+#define RTCP_H
+
+#include <netinet/in.h>
+
+/* RTCP listener for the RTP output. Receivers send their feedback to the
+ * RTP port + 1, a dedicated thread parses it and calls back into the
+ * packetiser. Callbacks run on the RTCP thread.
+ */
+
+#define RTCP_PT_SR		200
+#define RTCP_PT_RR		201
+#define RTCP_PT_SDES		202
+#define RTCP_PT_RTPFB		205
+#define RTCP_FMT_NACK		1	/* RFC 4585 generic NACK */
+
+/* A receiver report block about our stream */
+struct rtcp_report_s
+{
+	unsigned int reporter;		/* Receivers ssrc */
+	unsigned char fraction_lost;	/* Since its last report, x / 256 */
+	int cumulative_lost;
+	unsigned int highest_seq;	/* Extended */
+	unsigned int jitter;		/* RTP timestamp units */
+	int rtt_ms;			/* From LSR/DLSR, -1 before it has seen an SR */
+};
+
+struct rtcp_handler_s
+{
+	unsigned int ssrc;	/* The media source we answer for */
+
+	/* A receiver reports seq as lost */
+	void (*nack)(unsigned short seq, struct sockaddr_in *from);
+
+	/* A receiver report (RR or SR) block for our ssrc */
+	void (*report)(struct rtcp_report_s *report, struct sockaddr_in *from);
+};
+
+int  rtcp_open(int port, struct rtcp_handler_s *handler);
+void rtcp_close();
+
+/* Send a sender report, with an SDES CNAME, to port + 1 of each destination
+ * (the RTCP convention for RTP on an even port).
+ */
+void rtcp_send_sr(unsigned int rtp_timestamp, unsigned int packets, unsigned int octets,
+	struct sockaddr_in *dst, int dst_count);
+
+#endif
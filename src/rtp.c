@@ -24,99 +24,553 @@
  */
 
 #include <stdio.h>
-#include <libavformat/avformat.h>
-#include <libavutil/opt.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "rtp.h"
+#include "rtcp.h"
+#include "fec.h"
+#include "congestion.h"
+#include "udpout.h"
+#include "output.h"
+#include "metrics.h"
 
-/* Compatibility with older versions of ffmpeg */
-#if LIBAVCODEC_VERSION_INT < AV_VERSION_INT(54,59,100)
-# define AV_CODEC_ID_H264 CODEC_ID_H264
-#endif
+/* RFC 6184 H.264 RTP packetiser (packetization-mode=1).
+ * Small parameter set / SEI nals are aggregated into STAP-A packets, nals
+ * larger than the packet size are split into FU-A fragments, everything else
+ * is sent as a single nal packet. Packets reference the encoders coded buffer
+ * rather than copying it, and all packets of an access unit are transmitted
+ * together with sendmmsg() once the encoder signals the frame is complete.
+ */
+
+#define RTP_HEADER_SIZE		12
+#define RTP_PAYLOAD_TYPE	96
+#define RTP_DEFAULT_PKTSIZE	1400	/* UDP payload */
+#define RTP_STAP_MAX		8	/* Nals per STAP-A */
+#define RTP_IOV_MAX		(1 + (RTP_STAP_MAX * 2))
 
-/* libavformat
- * http://stackoverflow.com/questions/10143753/streaming-h-264-over-rtp-with-libavformat
+#define NAL_TYPE_SEI		6
+#define NAL_TYPE_SPS		7
+#define NAL_TYPE_PPS		8
+#define NAL_TYPE_AUD		9
+#define NAL_TYPE_STAP_A		24
+#define NAL_TYPE_FU_A		28
+
+/* Sent packets are copied into a history indexed by sequence number, to be
+ * retransmitted when a receiver NACKs them. RFC 4588 RTX wraps the original
+ * in its own stream (payload type, ssrc and sequence) with the original
+ * sequence number prepended.
  */
-static AVFormatContext *av_ctx = NULL;
-static AVOutputFormat *av_fmt = NULL;
-static AVStream *av_strm = NULL;
-static int av_ifd = 0;
+#define RTP_HISTORY		1024
+#define RTP_HISTORY_AGE_MS	1000
+#define RTP_RTX_PAYLOAD_TYPE	97
+#define RTP_RTCP_SR_INTERVAL_MS	1000
 
-void freeRTPHandler()
+struct rtp_history_s
+{
+	unsigned short seqno;
+	int len;		/* 0 when unused */
+	unsigned long long sent_ms;
+	unsigned char *data;	/* Complete RTP packet */
+};
+
+/* Packets are allocated in blocks, never moved, as the iovecs point into them */
+#define RTP_BLOCK_PACKETS	256
+#define RTP_BLOCKS_MAX		64
+
+struct rtp_packet_s
+{
+	/* RTP header, then the FU-A indicator and header, or the STAP-A
+	 * indicator and the size of each aggregated nal.
+	 */
+	unsigned char hdr[RTP_HEADER_SIZE + 2 + (RTP_STAP_MAX * 2)];
+	struct iovec iov[RTP_IOV_MAX];
+	int iovcnt;
+	int len;	/* Payload bytes, excluding the RTP header */
+	int stap;	/* Number of nals aggregated, 0 if not a STAP-A */
+};
+
+static struct udpout_ctx_s rtp_out = { .skt = -1 };
+static struct rtp_packet_s *blocks[RTP_BLOCKS_MAX];
+static unsigned int packet_count = 0;
+static int stap_open = 0;	/* The last packet is a STAP-A accepting more nals */
+static int max_payload = RTP_DEFAULT_PKTSIZE - RTP_HEADER_SIZE;
+static unsigned short seqno;
+static unsigned int ssrc;
+static unsigned int timestamp_base;
+
+static struct rtp_history_s *history = NULL;
+static unsigned char *history_data = NULL;
+static pthread_mutex_t history_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int rtx_enabled = 0;
+static unsigned short rtx_seqno;
+static unsigned int rtx_ssrc;
+static struct rtcp_handler_s rtcp_handler;
+static int rtcp_enabled = 0;
+static unsigned long long rtcp_sr_ms;
+static unsigned int packets_sent, octets_sent;
+static struct fec_ctx_s fec;
+static int fec_enabled = 0;
+static void (*rtp_tap)(struct iovec *iov, int iovcnt) = NULL;
+static struct {
+	struct metric_s *served;
+	struct metric_s *expired;
+} rtp_metrics;
+static unsigned long long nacks_served, nacks_expired;
+
+static unsigned long long rtp_now_ms()
 {
-	if (av_ctx)
-		avformat_free_context(av_ctx);
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000ULL) + (ts.tv_nsec / 1000000);
 }
 
-int initRTPHandler(char *ipaddress, int port, int dscp, int pktsize, int ifd, int w, int h, int fps)
+/* Keep a copy of a sent packet. Called with history_mutex held. */
+static void rtp_history_add(struct rtp_packet_s *pkt, unsigned short seq, unsigned long long now)
 {
-	char filename[64];
+	struct rtp_history_s *h = &history[seq % RTP_HISTORY];
+	unsigned char *dst = h->data;
 
-	avformat_network_init();
-	av_register_all();
+	for (int i = 0; i < pkt->iovcnt; i++) {
+		memcpy(dst, pkt->iov[i].iov_base, pkt->iov[i].iov_len);
+		dst += pkt->iov[i].iov_len;
+	}
+	h->seqno = seq;
+	h->len = dst - h->data;
+	h->sent_ms = now;
+}
 
-	av_ctx = avformat_alloc_context();
-	if (!av_ctx)
-		return -1;
+/* RTCP thread, a receiver report about our stream */
+static void rtp_report(struct rtcp_report_s *r, struct sockaddr_in *from)
+{
+	congestion_report(r->reporter, from, r->fraction_lost, r->jitter, r->rtt_ms);
+}
 
-	av_fmt = av_guess_format("rtp", NULL, NULL);
-	if (!av_ctx) {
-		avformat_free_context(av_ctx);
-		return -1;
+/* RTCP thread, a receiver lost seq */
+static void rtp_nack(unsigned short seq, struct sockaddr_in *from)
+{
+	static unsigned char buf[65536 + 2];	/* Only the RTCP thread */
+	struct sockaddr_in dsts[UDPOUT_DESTINATIONS];
+	struct sockaddr_in *dst = &dsts[0];
+	int len;
+
+	pthread_mutex_lock(&history_mutex);
+
+	struct rtp_history_s *h = &history[seq % RTP_HISTORY];
+	if ((h->len == 0) || (h->seqno != seq) || ((rtp_now_ms() - h->sent_ms) > RTP_HISTORY_AGE_MS)) {
+		pthread_mutex_unlock(&history_mutex);
+		nacks_expired++;
+		metrics_add(rtp_metrics.expired, 1);
+		return;
 	}
 
-	av_ctx->oformat = av_fmt;
-	av_ifd = ifd;
+	if (rtx_enabled) {
+		/* Original header with the RTX stream's payload type, seq and ssrc,
+		 * then the original seq and payload.
+		 */
+		memcpy(buf, h->data, RTP_HEADER_SIZE);
+		buf[1] = (buf[1] & 0x80) | RTP_RTX_PAYLOAD_TYPE;
+		buf[2] = rtx_seqno >> 8;
+		buf[3] = rtx_seqno;
+		buf[8] = rtx_ssrc >> 24;
+		buf[9] = rtx_ssrc >> 16;
+		buf[10] = rtx_ssrc >> 8;
+		buf[11] = rtx_ssrc;
+		buf[12] = seq >> 8;
+		buf[13] = seq;
+		memcpy(buf + RTP_HEADER_SIZE + 2, h->data + RTP_HEADER_SIZE, h->len - RTP_HEADER_SIZE);
+		len = h->len + 2;
+		rtx_seqno++;
+	} else {
+		memcpy(buf, h->data, h->len);
+		len = h->len;
+	}
+	pthread_mutex_unlock(&history_mutex);
 
-	/* try to open the RTP stream */
-	snprintf(filename, sizeof(filename), "rtp://%s:%d?dscp=%d&pkt_size=%d", ipaddress, port,
-		 dscp, pktsize?pktsize:-1);
-	printf("Streaming to %s\n", filename);
-	if (avio_open(&(av_ctx->pb), filename, AVIO_FLAG_WRITE) < 0) {
-		printf("Couldn't open RTP output stream\n");
-		avformat_free_context(av_ctx);
-		return -1;
+	/* Back to the receiver that asked, or the primary if we don't know it.
+	 * The encode thread may be changing the list, work from a copy.
+	 */
+	int count = udpout_destinations_get(&rtp_out, dsts, UDPOUT_DESTINATIONS);
+	for (int i = 0; i < count; i++) {
+		if (dsts[i].sin_addr.s_addr == from->sin_addr.s_addr) {
+			dst = &dsts[i];
+			break;
+		}
+	}
+	udpout_send(&rtp_out, dst, buf, len);
+
+	nacks_served++;
+	metrics_add(rtp_metrics.served, 1);
+}
+
+static struct rtp_packet_s *rtp_packet(unsigned int nr)
+{
+	return &blocks[nr / RTP_BLOCK_PACKETS][nr % RTP_BLOCK_PACKETS];
+}
+
+static struct rtp_packet_s *rtp_packet_new()
+{
+	unsigned int b = packet_count / RTP_BLOCK_PACKETS;
+
+	if (b == RTP_BLOCKS_MAX)
+		return NULL;
+	if (!blocks[b]) {
+		blocks[b] = malloc(RTP_BLOCK_PACKETS * sizeof(struct rtp_packet_s));
+		if (!blocks[b])
+			return NULL;
+	}
+
+	struct rtp_packet_s *pkt = rtp_packet(packet_count++);
+	pkt->iov[0].iov_base = pkt->hdr;
+	pkt->iov[0].iov_len = RTP_HEADER_SIZE;
+	pkt->iovcnt = 1;
+	pkt->len = 0;
+	pkt->stap = 0;
+
+	return pkt;
+}
+
+static void rtp_stap_close()
+{
+	if (!stap_open)
+		return;
+	stap_open = 0;
+
+	struct rtp_packet_s *pkt = rtp_packet(packet_count - 1);
+	if (pkt->stap == 1) {
+		/* Nothing was aggregated, send as a single nal */
+		pkt->iov[0].iov_len = RTP_HEADER_SIZE;
+		pkt->iov[1] = pkt->iov[2];
+		pkt->iovcnt = 2;
+		pkt->len -= 3;
+		pkt->stap = 0;
+		return;
+	}
+
+	/* F bit if any nal has it, highest NRI of them all */
+	unsigned char f = 0, nri = 0;
+	for (int i = 0; i < pkt->stap; i++) {
+		unsigned char h = *(unsigned char *)pkt->iov[2 + (i * 2)].iov_base;
+		f |= h & 0x80;
+		if ((h & 0x60) > nri)
+			nri = h & 0x60;
+	}
+	pkt->hdr[RTP_HEADER_SIZE] = f | nri | NAL_TYPE_STAP_A;
+}
+
+static int rtp_stap_add(unsigned char *nal, int len)
+{
+	struct rtp_packet_s *pkt = NULL;
+
+	if (stap_open) {
+		pkt = rtp_packet(packet_count - 1);
+		if ((pkt->stap == RTP_STAP_MAX) || (pkt->len + 2 + len > max_payload)) {
+			rtp_stap_close();
+			pkt = NULL;
+		}
+	}
+
+	if (!pkt) {
+		pkt = rtp_packet_new();
+		if (!pkt)
+			return -1;
+		pkt->iov[0].iov_len = RTP_HEADER_SIZE + 1;
+		pkt->len = 1;
+		stap_open = 1;
 	}
 
-	/* add an H.264 stream */
-	av_strm = avformat_new_stream(av_ctx, NULL);
-	if (!av_strm) {
-		printf("Couldn't allocate H.264 stream\n");
-		avformat_free_context(av_ctx);
+	unsigned char *size = &pkt->hdr[RTP_HEADER_SIZE + 1 + (pkt->stap * 2)];
+	size[0] = len >> 8;
+	size[1] = len;
+	pkt->iov[pkt->iovcnt].iov_base = size;
+	pkt->iov[pkt->iovcnt++].iov_len = 2;
+	pkt->iov[pkt->iovcnt].iov_base = nal;
+	pkt->iov[pkt->iovcnt++].iov_len = len;
+	pkt->len += 2 + len;
+	pkt->stap++;
+
+	return 0;
+}
+
+static int rtp_single(unsigned char *nal, int len)
+{
+	struct rtp_packet_s *pkt = rtp_packet_new();
+	if (!pkt)
 		return -1;
+
+	pkt->iov[1].iov_base = nal;
+	pkt->iov[1].iov_len = len;
+	pkt->iovcnt = 2;
+	pkt->len = len;
+
+	return 0;
+}
+
+static int rtp_fragment(unsigned char *nal, int len)
+{
+	unsigned char indicator = (nal[0] & 0xe0) | NAL_TYPE_FU_A;
+	unsigned char type = nal[0] & 0x1f;
+	int fraglen = max_payload - 2;
+
+	/* The nal header is carried in the FU indicator and header */
+	nal++;
+	len--;
+
+	for (int i = 0; i < len; i += fraglen) {
+		struct rtp_packet_s *pkt = rtp_packet_new();
+		if (!pkt)
+			return -1;
+
+		int l = len - i < fraglen ? len - i : fraglen;
+
+		pkt->hdr[RTP_HEADER_SIZE + 0] = indicator;
+		pkt->hdr[RTP_HEADER_SIZE + 1] = type;
+		if (i == 0)
+			pkt->hdr[RTP_HEADER_SIZE + 1] |= 0x80;	/* Start */
+		if (i + l == len)
+			pkt->hdr[RTP_HEADER_SIZE + 1] |= 0x40;	/* End */
+
+		pkt->iov[0].iov_len = RTP_HEADER_SIZE + 2;
+		pkt->iov[1].iov_base = nal + i;
+		pkt->iov[1].iov_len = l;
+		pkt->iovcnt = 2;
+		pkt->len = 2 + l;
 	}
 
-	/* initalize codec */
-	AVCodecContext* c = av_strm->codec;
-	c->codec_id = AV_CODEC_ID_H264;
-	c->codec_type = AVMEDIA_TYPE_VIDEO;
-	c->bit_rate = 3000000;
-	c->width = w;
-	c->height = h;
-	c->time_base.den = fps;
-	c->time_base.num = 1;
-
-	/* write the header */
-	if (avformat_write_header(av_ctx, NULL) != 0)
-		printf("%s() error write header\n", __func__);
-	
 	return 0;
 }
 
-int sendRTPPacket(unsigned char *nal, int len, int isIFrame)
+static int rtp_nal(unsigned char *nal, int len)
+{
+	int type = nal[0] & 0x1f;
+
+	if (((type == NAL_TYPE_SPS) || (type == NAL_TYPE_PPS) || (type == NAL_TYPE_SEI) || (type == NAL_TYPE_AUD)) &&
+		(1 + 2 + len <= max_payload))
+		return rtp_stap_add(nal, len);
+
+	rtp_stap_close();
+
+	if (len <= max_payload)
+		return rtp_single(nal, len);
+
+	return rtp_fragment(nal, len);
+}
+
+/* Find the next 00 00 01 start code, or return end */
+static unsigned char *annexb_find_startcode(unsigned char *p, unsigned char *end)
 {
-	if (av_ctx == NULL)
-		return 0;
-	if (av_ifd > 0) {
-		av_opt_set_int(av_ctx, "ifd", av_ifd, AV_OPT_SEARCH_CHILDREN);
-		av_ifd = 0;
+	while (p + 2 < end) {
+		if (p[2] > 1) {
+			/* Can't be part of a start code at p, p + 1 or p + 2 */
+			p += 3;
+			continue;
+		}
+		if ((p[0] == 0) && (p[1] == 0) && (p[2] == 1))
+			return p;
+		p++;
 	}
 
-	AVPacket p;
-	av_init_packet(&p);
-	p.data = nal;
-	p.size = len;
-	p.stream_index = av_strm->index;
+	return end;
+}
+
+static int rtp_codeddata(unsigned char *buf, int len, int frame_type)
+{
+	unsigned char *end = buf + len;
+	unsigned char *p = annexb_find_startcode(buf, end);
+
+	while (p < end) {
+		unsigned char *nal = p + 3;
+		p = annexb_find_startcode(nal, end);
 
-	av_write_frame(av_ctx, &p);
+		/* Trailing zeros belong to the next (4 byte) start code */
+		unsigned char *nal_end = p;
+		while ((nal_end > nal) && (*(nal_end - 1) == 0))
+			nal_end--;
+
+		if ((nal_end > nal) && (rtp_nal(nal, nal_end - nal) < 0)) {
+			printf("%s() access unit too large, dropping nal\n", __func__);
+			return -1;
+		}
+	}
 
 	return 0;
 }
+
+static void rtp_frame_complete(int frame_type, unsigned long long pts90k, unsigned long long dts90k)
+{
+	unsigned int timestamp = timestamp_base + (unsigned int)pts90k;
+
+	rtp_stap_close();
+
+	if (history)
+		pthread_mutex_lock(&history_mutex);
+	unsigned long long now = rtp_now_ms();
+
+	for (unsigned int i = 0; i < packet_count; i++) {
+		struct rtp_packet_s *pkt = rtp_packet(i);
+		unsigned char *h = pkt->hdr;
+
+		h[0] = 0x80;	/* Version 2 */
+		h[1] = RTP_PAYLOAD_TYPE;
+		if (i == packet_count - 1)
+			h[1] |= 0x80;	/* Marker, last packet of the access unit */
+		h[2] = seqno >> 8;
+		h[3] = seqno;
+		h[4] = timestamp >> 24;
+		h[5] = timestamp >> 16;
+		h[6] = timestamp >> 8;
+		h[7] = timestamp;
+		h[8] = ssrc >> 24;
+		h[9] = ssrc >> 16;
+		h[10] = ssrc >> 8;
+		h[11] = ssrc;
+
+		if (history)
+			rtp_history_add(pkt, seqno, now);
+		seqno++;
+
+		udpout_queue(&rtp_out, pkt->iov, pkt->iovcnt);
+		packets_sent++;
+		octets_sent += pkt->len;
+		if (fec_enabled)
+			fec_packet(&fec, pkt->iov, pkt->iovcnt);
+		if (rtp_tap)
+			rtp_tap(pkt->iov, pkt->iovcnt);
+	}
+	if (history)
+		pthread_mutex_unlock(&history_mutex);
+	udpout_flush(&rtp_out);
+	if (fec_enabled)
+		fec_flush(&fec);
+	if (rtp_tap)
+		rtp_tap(NULL, 0);
+
+	/* A sender report roughly once a second, mapping wallclock to RTP time,
+	 * on the clock the media timestamps come from.
+	 */
+	if (rtcp_enabled && (now - rtcp_sr_ms >= RTP_RTCP_SR_INTERVAL_MS)) {
+		rtcp_send_sr(timestamp_base + (unsigned int)output_clock90k(), packets_sent, octets_sent,
+			rtp_out.dst, rtp_out.dst_count);
+		rtcp_sr_ms = now;
+	}
+
+	packet_count = 0;
+}
+
+void rtp_set_tap(void (*tap)(struct iovec *iov, int iovcnt))
+{
+	rtp_tap = tap;
+}
+
+static struct output_sink_s rtp_sink =
+{
+	.name		= "RTP/ES",
+	.codeddata	= rtp_codeddata,
+	.frame_complete	= rtp_frame_complete,
+};
+
+void freeRTPHandler()
+{
+	output_unregister(&rtp_sink);
+
+	if (rtcp_enabled) {
+		rtcp_close();
+		rtcp_enabled = 0;
+	}
+
+	if (history) {
+		printf("RTP retransmissions %llu, expired %llu\n", nacks_served, nacks_expired);
+		free(history);
+		free(history_data);
+		history = NULL;
+		history_data = NULL;
+	}
+
+	if (fec_enabled) {
+		printf("RTP FEC packets %llu\n", fec.packets);
+		fec_close(&fec);
+		fec_enabled = 0;
+	}
+
+	udpout_close(&rtp_out);
+
+	for (int i = 0; i < RTP_BLOCKS_MAX; i++) {
+		free(blocks[i]);
+		blocks[i] = NULL;
+	}
+	packet_count = 0;
+}
+
+int initRTPHandler(char *ipaddress, int port, int dscp, int pktsize, int ifd, int w, int h, int fps,
+	int nack, int rtx, int fec_l, int fec_d)
+{
+	if (port && (udpout_open(&rtp_out, ipaddress, port, dscp, 4 * 1048576) < 0)) {
+		printf("Couldn't open RTP output stream\n");
+		return -1;
+	}
+
+	if (pktsize > RTP_HEADER_SIZE + 16)
+		max_payload = pktsize - RTP_HEADER_SIZE;
+	else
+		max_payload = RTP_DEFAULT_PKTSIZE - RTP_HEADER_SIZE;
+
+	srand(time(NULL));
+	seqno = rand();
+	ssrc = rand();
+	timestamp_base = rand();
+	rtx_seqno = rand();
+	rtx_ssrc = rand();
+
+	if (nack) {
+		int slot = RTP_HEADER_SIZE + max_payload;
+
+		history = calloc(RTP_HISTORY, sizeof(struct rtp_history_s));
+		history_data = malloc(RTP_HISTORY * slot);
+		if (!history || !history_data) {
+			freeRTPHandler();
+			return -1;
+		}
+		for (int i = 0; i < RTP_HISTORY; i++)
+			history[i].data = history_data + (i * slot);
+
+		rtx_enabled = rtx;
+		rtp_metrics.served = metrics_register("rtp_nack_served", METRIC_COUNTER);
+		rtp_metrics.expired = metrics_register("rtp_nack_expired", METRIC_COUNTER);
+
+		rtcp_handler.nack = rtp_nack;
+		if (rtx_enabled)
+			printf("RTP retransmission as rtx pt %d, ssrc 0x%08x\n", RTP_RTX_PAYLOAD_TYPE, rtx_ssrc);
+	}
+
+	/* Sender reports out, receiver feedback in */
+	if (port && (nack || congestion_enabled())) {
+		rtcp_handler.ssrc = ssrc;
+		rtcp_handler.report = rtp_report;
+		if (rtcp_open(port + 1, &rtcp_handler) < 0) {
+			freeRTPHandler();
+			return -1;
+		}
+		rtcp_enabled = 1;
+	}
+
+	if (port && fec_l) {
+		if (RTP_HEADER_SIZE + max_payload > FEC_PAYLOAD_MAX) {
+			printf("FEC needs a packet size of %d or less\n", FEC_PAYLOAD_MAX);
+			freeRTPHandler();
+			return -1;
+		}
+		if (fec_open(&fec, ipaddress, port, dscp, fec_l, fec_d) < 0) {
+			freeRTPHandler();
+			return -1;
+		}
+		fec_enabled = 1;
+	}
+
+	if (port)
+		printf("Streaming to rtp://%s:%d (payload %d bytes, H264/90000 pt %d, packetization-mode=1)\n",
+			ipaddress, port, max_payload, RTP_PAYLOAD_TYPE);
+
+	return output_register(&rtp_sink);
+}
@@ -23,6 +23,16 @@
  *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
  */
 
+#include <sys/uio.h>
+
 void freeRTPHandler();
-int initRTPHandler(char *ipaddress, int port, int dscp, int pktsize, int ifd, int w, int h, int fps);
-int sendRTPPacket(unsigned char *nal, int len, int frame_type);
+
+/* A port of 0 runs the packetiser without a UDP destination, for the tap */
+int initRTPHandler(char *ipaddress, int port, int dscp, int pktsize, int ifd, int w, int h, int fps,
+	int nack, int rtx, int fec_l, int fec_d);
+
+/* Observer of every packet sent, for the RTSP server. Called on the encode
+ * thread with the complete packet (iov[0] is the RTP header), then with
+ * iovcnt 0 once the access unit has been sent.
+ */
+void rtp_set_tap(void (*tap)(struct iovec *iov, int iovcnt));
@@ -0,0 +1,858 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "rtsp.h"
+#include "rtp.h"
+#include "metrics.h"
+
+#define RTSP_IOV		64		/* Chunks per TCP send */
+#define RTSP_MMSG		1024		/* Datagrams per sendmmsg(), UIO_MAXIOV */
+#define RTSP_SESSION_TIMEOUT	60
+
+#define NAL_TYPE_SPS		7
+#define NAL_TYPE_PPS		8
+#define NAL_TYPE_STAP_A		24
+
+/* One access unit of RTP packets, each framed for interleaving ($, channel
+ * 0, length) so TCP sessions send the chunk as is and UDP sessions skip the
+ * four byte prefix. RTSP responses are chunks too, so they queue in order
+ * with the media on a TCP session.
+ */
+struct rtsp_chunk_s
+{
+	int refs;
+	int len;
+	int packets;		/* 0 for a response */
+	int *offset;		/* Of each framed packet */
+	unsigned char *data;
+};
+
+enum rtsp_transport_e {
+	TRANSPORT_NONE = 0,
+	TRANSPORT_UDP,
+	TRANSPORT_TCP,
+};
+
+struct rtsp_client_s
+{
+	int fd;				/* -1 when the slot is free */
+	struct sockaddr_in addr;
+	int evict;			/* Set by the encode thread, closed by the server */
+
+	char request[RTSP_REQUEST_MAX];
+	int request_len;
+
+	unsigned long long session;	/* 0 until SETUP */
+	enum rtsp_transport_e transport;
+	struct sockaddr_in udp_dst;
+	int playing;
+
+	struct rtsp_chunk_s *queue[RTSP_QUEUE_CHUNKS];
+	int q_head, q_count;
+	unsigned int q_bytes;
+	int q_offset;			/* Bytes of the head chunk already sent */
+	int want_out;			/* EPOLLOUT armed */
+};
+
+/* Encode thread, the access unit being packetised */
+static unsigned char *au_buf = NULL;
+static int au_len, au_size;
+static int au_offset[RTSP_PACKETS_MAX];
+static int au_packets;
+static struct mmsghdr udp_msgs[RTSP_MMSG];
+static struct iovec udp_iov[RTSP_MMSG];
+
+/* Shared, under server_mutex */
+static struct rtsp_client_s clients[RTSP_CLIENTS_MAX];
+static unsigned char sps[RTSP_PARAMSET_MAX], pps[RTSP_PARAMSET_MAX];
+static int sps_len, pps_len;
+static unsigned int stream_ssrc, stream_rtptime;
+static unsigned short stream_seqno;		/* Of the next packet */
+static pthread_mutex_t server_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Server thread */
+static int listen_fd = -1, udp_fd = -1, event_fd = -1, epoll_fd = -1;
+static int udp_port;
+static pthread_t server_thread;
+static volatile int server_running = 0;
+static int session_count;
+
+static struct {
+	struct metric_s *sessions;
+	struct metric_s *evicted;
+} rtsp_metrics;
+
+/* Called with server_mutex held */
+static void rtsp_chunk_put(struct rtsp_chunk_s *c)
+{
+	if (--c->refs == 0)
+		free(c);
+}
+
+static struct rtsp_chunk_s *rtsp_chunk_alloc(int len, int packets)
+{
+	struct rtsp_chunk_s *c = malloc(sizeof(*c) + (packets * sizeof(int)) + len);
+	if (!c)
+		return NULL;
+
+	c->refs = 1;
+	c->len = len;
+	c->packets = packets;
+	c->offset = (int *)(c + 1);
+	c->data = (unsigned char *)(c->offset + packets);
+
+	return c;
+}
+
+static int rtsp_enqueue(struct rtsp_client_s *cl, struct rtsp_chunk_s *c, int force)
+{
+	if (cl->q_count == RTSP_QUEUE_CHUNKS)
+		return -1;
+	if (!force && (cl->q_bytes + c->len > RTSP_QUEUE_BYTES))
+		return -1;
+
+	cl->queue[(cl->q_head + cl->q_count++) % RTSP_QUEUE_CHUNKS] = c;
+	cl->q_bytes += c->len;
+	c->refs++;
+
+	return 0;
+}
+
+/* Encode thread. Keep the parameter sets for the SDP. */
+static void rtsp_paramset(unsigned char *nal, int len)
+{
+	int type = nal[0] & 0x1f;
+
+	if ((len > RTSP_PARAMSET_MAX) || ((type != NAL_TYPE_SPS) && (type != NAL_TYPE_PPS)))
+		return;
+
+	pthread_mutex_lock(&server_mutex);
+	if (type == NAL_TYPE_SPS) {
+		memcpy(sps, nal, len);
+		sps_len = len;
+	} else {
+		memcpy(pps, nal, len);
+		pps_len = len;
+	}
+	pthread_mutex_unlock(&server_mutex);
+}
+
+static void rtsp_udp_send(struct rtsp_client_s *cl, struct rtsp_chunk_s *c)
+{
+	for (int i = 0; i < c->packets; i += RTSP_MMSG) {
+		int n = c->packets - i < RTSP_MMSG ? c->packets - i : RTSP_MMSG;
+
+		for (int j = 0; j < n; j++) {
+			unsigned char *f = c->data + c->offset[i + j];
+			udp_iov[j].iov_base = f + 4;
+			udp_iov[j].iov_len = (f[2] << 8) | f[3];
+			memset(&udp_msgs[j], 0, sizeof(udp_msgs[j]));
+			udp_msgs[j].msg_hdr.msg_name = &cl->udp_dst;
+			udp_msgs[j].msg_hdr.msg_namelen = sizeof(cl->udp_dst);
+			udp_msgs[j].msg_hdr.msg_iov = &udp_iov[j];
+			udp_msgs[j].msg_hdr.msg_iovlen = 1;
+		}
+		if (sendmmsg(udp_fd, udp_msgs, n, MSG_DONTWAIT) < 0)
+			return;
+	}
+}
+
+static void rtsp_publish()
+{
+	if (au_packets == 0)
+		return;
+
+	struct rtsp_chunk_s *c = rtsp_chunk_alloc(au_len, au_packets);
+	if (!c)
+		return;
+	memcpy(c->offset, au_offset, au_packets * sizeof(int));
+	memcpy(c->data, au_buf, au_len);
+
+	unsigned char *last = au_buf + au_offset[au_packets - 1] + 4;
+
+	pthread_mutex_lock(&server_mutex);
+	stream_seqno = ((last[2] << 8) | last[3]) + 1;
+	stream_rtptime = (last[4] << 24) | (last[5] << 16) | (last[6] << 8) | last[7];
+	stream_ssrc = (last[8] << 24) | (last[9] << 16) | (last[10] << 8) | last[11];
+
+	for (int i = 0; i < RTSP_CLIENTS_MAX; i++) {
+		struct rtsp_client_s *cl = &clients[i];
+		if ((cl->fd < 0) || !cl->playing || cl->evict)
+			continue;
+		if (cl->transport == TRANSPORT_UDP)
+			rtsp_udp_send(cl, c);
+		else
+		if ((cl->transport == TRANSPORT_TCP) && (rtsp_enqueue(cl, c, 0) < 0))
+			cl->evict = 1;
+	}
+
+	rtsp_chunk_put(c);
+	pthread_mutex_unlock(&server_mutex);
+
+	unsigned long long one = 1;
+	if (write(event_fd, &one, sizeof(one)) < 0) {
+		/* Counter overflow only, the server is awake anyway */
+	}
+}
+
+/* Encode thread, from the packetiser */
+static void rtsp_tap(struct iovec *iov, int iovcnt)
+{
+	if (iovcnt == 0) {
+		rtsp_publish();
+		au_len = 0;
+		au_packets = 0;
+		return;
+	}
+
+	int len = 0;
+	for (int i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+
+	if ((au_packets == RTSP_PACKETS_MAX) || (len > 65535))
+		return;
+	if (au_len + 4 + len > au_size) {
+		int size = au_size ? au_size * 2 : 1048576;
+		while (size < au_len + 4 + len)
+			size *= 2;
+		unsigned char *p = realloc(au_buf, size);
+		if (!p)
+			return;
+		au_buf = p;
+		au_size = size;
+	}
+
+	unsigned char *f = au_buf + au_len;
+	f[0] = '$';
+	f[1] = 0;
+	f[2] = len >> 8;
+	f[3] = len;
+	au_offset[au_packets++] = au_len;
+	au_len += 4;
+	for (int i = 0; i < iovcnt; i++) {
+		memcpy(au_buf + au_len, iov[i].iov_base, iov[i].iov_len);
+		au_len += iov[i].iov_len;
+	}
+
+	/* Parameter sets travel alone or aggregated in a STAP-A */
+	unsigned char *pl = f + 4 + 12;
+	int pl_len = len - 12;
+	if ((pl_len > 0) && ((pl[0] & 0x1f) == NAL_TYPE_STAP_A)) {
+		for (int i = 1; i + 2 < pl_len; ) {
+			int n = (pl[i] << 8) | pl[i + 1];
+			if (i + 2 + n > pl_len)
+				break;
+			rtsp_paramset(pl + i + 2, n);
+			i += 2 + n;
+		}
+	} else if (pl_len > 0)
+		rtsp_paramset(pl, pl_len);
+}
+
+/* Server thread */
+static void rtsp_epoll_mod(struct rtsp_client_s *cl, int want_out)
+{
+	struct epoll_event ev = {
+		.events = EPOLLIN | (want_out ? EPOLLOUT : 0),
+		.data.ptr = cl,
+	};
+
+	if (cl->want_out == want_out)
+		return;
+	cl->want_out = want_out;
+	epoll_ctl(epoll_fd, EPOLL_CTL_MOD, cl->fd, &ev);
+}
+
+static void rtsp_client_close(struct rtsp_client_s *cl, char *reason)
+{
+	printf("RTSP client %s:%d %s\n", inet_ntoa(cl->addr.sin_addr), ntohs(cl->addr.sin_port), reason);
+
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, cl->fd, NULL);
+	close(cl->fd);
+
+	pthread_mutex_lock(&server_mutex);
+	while (cl->q_count) {
+		rtsp_chunk_put(cl->queue[cl->q_head]);
+		cl->q_head = (cl->q_head + 1) % RTSP_QUEUE_CHUNKS;
+		cl->q_count--;
+	}
+	if (cl->session)
+		session_count--;
+	cl->fd = -1;
+	pthread_mutex_unlock(&server_mutex);
+
+	metrics_set(rtsp_metrics.sessions, session_count);
+}
+
+/* Send as much as the socket takes. Returns -1 when the client has gone. */
+static int rtsp_client_flush(struct rtsp_client_s *cl)
+{
+	for (;;) {
+		struct iovec iov[RTSP_IOV];
+		int cnt = 0;
+
+		/* The chunks are immutable and referenced, send them unlocked */
+		pthread_mutex_lock(&server_mutex);
+		for (int i = 0; (i < cl->q_count) && (cnt < RTSP_IOV); i++) {
+			struct rtsp_chunk_s *c = cl->queue[(cl->q_head + i) % RTSP_QUEUE_CHUNKS];
+			int skip = i ? 0 : cl->q_offset;
+			iov[cnt].iov_base = c->data + skip;
+			iov[cnt].iov_len = c->len - skip;
+			cnt++;
+		}
+		pthread_mutex_unlock(&server_mutex);
+
+		if (cnt == 0) {
+			rtsp_epoll_mod(cl, 0);
+			return 0;
+		}
+
+		struct msghdr msg = { .msg_iov = iov, .msg_iovlen = cnt };
+		ssize_t n = sendmsg(cl->fd, &msg, MSG_NOSIGNAL);
+		if (n < 0) {
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+				rtsp_epoll_mod(cl, 1);
+				return 0;
+			}
+			return -1;
+		}
+
+		/* Retire what went out */
+		pthread_mutex_lock(&server_mutex);
+		while (n > 0) {
+			struct rtsp_chunk_s *c = cl->queue[cl->q_head];
+			int left = c->len - cl->q_offset;
+			if (n < left) {
+				cl->q_offset += n;
+				break;
+			}
+			n -= left;
+			cl->q_offset = 0;
+			cl->q_bytes -= c->len;
+			cl->q_head = (cl->q_head + 1) % RTSP_QUEUE_CHUNKS;
+			cl->q_count--;
+			rtsp_chunk_put(c);
+		}
+		pthread_mutex_unlock(&server_mutex);
+	}
+}
+
+static void rtsp_base64(char *dst, unsigned char *src, int len)
+{
+	static const char *b64 = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+	for (int i = 0; i < len; i += 3) {
+		unsigned int v = src[i] << 16;
+		if (i + 1 < len)
+			v |= src[i + 1] << 8;
+		if (i + 2 < len)
+			v |= src[i + 2];
+		*dst++ = b64[(v >> 18) & 0x3f];
+		*dst++ = b64[(v >> 12) & 0x3f];
+		*dst++ = i + 1 < len ? b64[(v >> 6) & 0x3f] : '=';
+		*dst++ = i + 2 < len ? b64[v & 0x3f] : '=';
+	}
+	*dst = 0;
+}
+
+/* The value of a header, copied into dst */
+static int rtsp_header(char *request, char *name, char *dst, int size)
+{
+	int nlen = strlen(name);
+
+	for (char *p = strchr(request, '\n'); p; p = strchr(p, '\n')) {
+		p++;
+		if (strncasecmp(p, name, nlen) || (p[nlen] != ':'))
+			continue;
+		p += nlen + 1;
+		while (*p == ' ' || *p == '\t')
+			p++;
+		int len = strcspn(p, "\r\n");
+		if (len >= size)
+			len = size - 1;
+		memcpy(dst, p, len);
+		dst[len] = 0;
+		return 0;
+	}
+
+	return -1;
+}
+
+static void rtsp_respond(struct rtsp_client_s *cl, int code, char *reason, char *cseq, char *headers, char *body)
+{
+	char hdr[1024], clen[32] = "";
+	int blen = body ? strlen(body) : 0;
+
+	if (blen)
+		snprintf(clen, sizeof(clen), "Content-Length: %d\r\n", blen);
+
+	int hlen = snprintf(hdr, sizeof(hdr),
+		"RTSP/1.0 %d %s\r\n"
+		"CSeq: %s\r\n"
+		"Server: h264encoder\r\n"
+		"%s%s"
+		"\r\n",
+		code, reason, cseq, headers ? headers : "", clen);
+	if (hlen >= (int)sizeof(hdr))
+		hlen = sizeof(hdr) - 1;
+
+	struct rtsp_chunk_s *c = rtsp_chunk_alloc(hlen + blen, 0);
+	if (!c)
+		return;
+	memcpy(c->data, hdr, hlen);
+	if (blen)
+		memcpy(c->data + hlen, body, blen);
+
+	pthread_mutex_lock(&server_mutex);
+	rtsp_enqueue(cl, c, 1);
+	rtsp_chunk_put(c);
+	pthread_mutex_unlock(&server_mutex);
+}
+
+static void rtsp_describe(struct rtsp_client_s *cl, char *url, char *cseq)
+{
+	char sdp[4096], headers[2048], fmtp[2048] = "";
+	char sps64[RTSP_PARAMSET_MAX * 2], pps64[RTSP_PARAMSET_MAX * 2];
+	struct sockaddr_in local;
+	socklen_t alen = sizeof(local);
+
+	getsockname(cl->fd, (struct sockaddr *)&local, &alen);
+
+	/* Until the first IDR the parameter sets are in band only */
+	pthread_mutex_lock(&server_mutex);
+	if (sps_len >= 4 && pps_len) {
+		rtsp_base64(sps64, sps, sps_len);
+		rtsp_base64(pps64, pps, pps_len);
+		snprintf(fmtp, sizeof(fmtp), ";profile-level-id=%02X%02X%02X;sprop-parameter-sets=%s,%s",
+			sps[1], sps[2], sps[3], sps64, pps64);
+	}
+	pthread_mutex_unlock(&server_mutex);
+
+	snprintf(sdp, sizeof(sdp),
+		"v=0\r\n"
+		"o=- %u 1 IN IP4 %s\r\n"
+		"s=h264encoder\r\n"
+		"c=IN IP4 0.0.0.0\r\n"
+		"t=0 0\r\n"
+		"a=control:*\r\n"
+		"m=video 0 RTP/AVP 96\r\n"
+		"a=rtpmap:96 H264/90000\r\n"
+		"a=fmtp:96 packetization-mode=1%s\r\n"
+		"a=control:track1\r\n",
+		(unsigned int)time(NULL), inet_ntoa(local.sin_addr), fmtp);
+
+	snprintf(headers, sizeof(headers),
+		"Content-Type: application/sdp\r\n"
+		"Content-Base: %s%s\r\n",
+		url, url[strlen(url) - 1] == '/' ? "" : "/");
+
+	rtsp_respond(cl, 200, "OK", cseq, headers, sdp);
+}
+
+static void rtsp_setup(struct rtsp_client_s *cl, char *request, char *cseq)
+{
+	char transport[256], headers[512];
+
+	if (rtsp_header(request, "Transport", transport, sizeof(transport)) < 0) {
+		rtsp_respond(cl, 461, "Unsupported Transport", cseq, NULL, NULL);
+		return;
+	}
+
+	pthread_mutex_lock(&server_mutex);
+	unsigned int ssrc = stream_ssrc;
+	pthread_mutex_unlock(&server_mutex);
+
+	enum rtsp_transport_e t;
+	char reply[256];
+	char *p;
+
+	if (strstr(transport, "RTP/AVP/TCP")) {
+		/* One track, the packets are framed for channel 0 */
+		t = TRANSPORT_TCP;
+		snprintf(reply, sizeof(reply), "RTP/AVP/TCP;unicast;interleaved=0-1;ssrc=%08X", ssrc);
+	} else if (!strstr(transport, "multicast") && (p = strstr(transport, "client_port="))) {
+		int rtp_port = atoi(p + 12);
+		if ((rtp_port < 1) || (rtp_port > 65535)) {
+			rtsp_respond(cl, 461, "Unsupported Transport", cseq, NULL, NULL);
+			return;
+		}
+		t = TRANSPORT_UDP;
+		memset(&cl->udp_dst, 0, sizeof(cl->udp_dst));
+		cl->udp_dst.sin_family = AF_INET;
+		cl->udp_dst.sin_addr = cl->addr.sin_addr;
+		cl->udp_dst.sin_port = htons(rtp_port);
+		snprintf(reply, sizeof(reply), "RTP/AVP;unicast;client_port=%d-%d;server_port=%d-%d;ssrc=%08X",
+			rtp_port, rtp_port + 1, udp_port, udp_port + 1, ssrc);
+	} else {
+		rtsp_respond(cl, 461, "Unsupported Transport", cseq, NULL, NULL);
+		return;
+	}
+
+	pthread_mutex_lock(&server_mutex);
+	if (!cl->session) {
+		cl->session = ((unsigned long long)rand() << 32) | rand();
+		session_count++;
+	}
+	cl->transport = t;
+	pthread_mutex_unlock(&server_mutex);
+	metrics_set(rtsp_metrics.sessions, session_count);
+
+	snprintf(headers, sizeof(headers), "Transport: %s\r\nSession: %016llX;timeout=%d\r\n",
+		reply, cl->session, RTSP_SESSION_TIMEOUT);
+	rtsp_respond(cl, 200, "OK", cseq, headers, NULL);
+}
+
+static void rtsp_play(struct rtsp_client_s *cl, char *url, char *cseq, int play)
+{
+	char headers[1024];
+
+	if (cl->transport == TRANSPORT_NONE) {
+		rtsp_respond(cl, 455, "Method Not Valid in This State", cseq, NULL, NULL);
+		return;
+	}
+
+	pthread_mutex_lock(&server_mutex);
+	if (play)
+		snprintf(headers, sizeof(headers), "Session: %016llX\r\nRange: npt=0.000-\r\n"
+			"RTP-Info: url=%s;seq=%u;rtptime=%u\r\n",
+			cl->session, url, stream_seqno, stream_rtptime);
+	else
+		snprintf(headers, sizeof(headers), "Session: %016llX\r\n", cl->session);
+	pthread_mutex_unlock(&server_mutex);
+
+	/* The response goes out ahead of the first media */
+	rtsp_respond(cl, 200, "OK", cseq, headers, NULL);
+
+	pthread_mutex_lock(&server_mutex);
+	cl->playing = play;
+	pthread_mutex_unlock(&server_mutex);
+
+	printf("RTSP client %s:%d %s over %s\n", inet_ntoa(cl->addr.sin_addr), ntohs(cl->addr.sin_port),
+		play ? "playing" : "paused", cl->transport == TRANSPORT_TCP ? "TCP" : "UDP");
+}
+
+static void rtsp_request(struct rtsp_client_s *cl, char *request)
+{
+	char method[32], url[1024], cseq[32] = "0", session[64];
+
+	if (sscanf(request, "%31s %1023s", method, url) != 2) {
+		rtsp_respond(cl, 400, "Bad Request", cseq, NULL, NULL);
+		return;
+	}
+	rtsp_header(request, "CSeq", cseq, sizeof(cseq));
+
+	/* Anything after SETUP must name our session */
+	if (cl->session && (rtsp_header(request, "Session", session, sizeof(session)) == 0) &&
+		(strtoull(session, NULL, 16) != cl->session)) {
+		rtsp_respond(cl, 454, "Session Not Found", cseq, NULL, NULL);
+		return;
+	}
+
+	if (!strcmp(method, "OPTIONS"))
+		rtsp_respond(cl, 200, "OK", cseq,
+			"Public: OPTIONS, DESCRIBE, SETUP, PLAY, PAUSE, TEARDOWN, GET_PARAMETER\r\n", NULL);
+	else if (!strcmp(method, "DESCRIBE"))
+		rtsp_describe(cl, url, cseq);
+	else if (!strcmp(method, "SETUP"))
+		rtsp_setup(cl, request, cseq);
+	else if (!strcmp(method, "PLAY"))
+		rtsp_play(cl, url, cseq, 1);
+	else if (!strcmp(method, "PAUSE"))
+		rtsp_play(cl, url, cseq, 0);
+	else if (!strcmp(method, "TEARDOWN")) {
+		pthread_mutex_lock(&server_mutex);
+		cl->playing = 0;
+		cl->transport = TRANSPORT_NONE;
+		pthread_mutex_unlock(&server_mutex);
+		rtsp_respond(cl, 200, "OK", cseq, NULL, NULL);
+	} else if (!strcmp(method, "GET_PARAMETER") || !strcmp(method, "SET_PARAMETER"))
+		rtsp_respond(cl, 200, "OK", cseq, NULL, NULL);	/* Keepalives */
+	else
+		rtsp_respond(cl, 501, "Not Implemented", cseq, NULL, NULL);
+}
+
+/* Requests, and interleaved RTCP from TCP sessions which we discard */
+static void rtsp_client_read(struct rtsp_client_s *cl)
+{
+	ssize_t n = recv(cl->fd, cl->request + cl->request_len, sizeof(cl->request) - 1 - cl->request_len, 0);
+	if (n <= 0) {
+		if ((n == 0) || ((errno != EAGAIN) && (errno != EWOULDBLOCK)))
+			rtsp_client_close(cl, "disconnected");
+		return;
+	}
+	cl->request_len += n;
+	cl->request[cl->request_len] = 0;
+
+	for (;;) {
+		long used;
+
+		if ((cl->request_len >= 1) && (cl->request[0] == '$')) {
+			if (cl->request_len < 4)
+				break;
+			used = 4 + (((unsigned char)cl->request[2] << 8) | (unsigned char)cl->request[3]);
+			if (used > cl->request_len)
+				break;
+		} else {
+			char *end = strstr(cl->request, "\r\n\r\n");
+			if (!end)
+				break;
+			used = end + 4 - cl->request;
+
+			/* SET_PARAMETER and friends may carry a body */
+			char clen[16], *p;
+			if (rtsp_header(cl->request, "Content-Length", clen, sizeof(clen)) == 0) {
+				errno = 0;
+				long body = strtol(clen, &p, 10);
+				if ((p == clen) || errno || (body < 0) || (body > (long)sizeof(cl->request))) {
+					rtsp_client_close(cl, "illegal Content-Length");
+					return;
+				}
+				used += body;
+			}
+			if (used > cl->request_len)
+				break;
+
+			*end = 0;
+			rtsp_request(cl, cl->request);
+		}
+
+		memmove(cl->request, cl->request + used, cl->request_len - used);
+		cl->request_len -= used;
+		cl->request[cl->request_len] = 0;
+	}
+
+	if (cl->request_len == sizeof(cl->request) - 1) {
+		rtsp_client_close(cl, "request too large");
+		return;
+	}
+
+	if (rtsp_client_flush(cl) < 0)
+		rtsp_client_close(cl, "disconnected");
+}
+
+static void rtsp_accept()
+{
+	for (;;) {
+		struct sockaddr_in addr;
+		socklen_t alen = sizeof(addr);
+		int fd = accept4(listen_fd, (struct sockaddr *)&addr, &alen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0)
+			return;
+
+		struct rtsp_client_s *cl = NULL;
+		for (int i = 0; i < RTSP_CLIENTS_MAX; i++) {
+			if (clients[i].fd < 0) {
+				cl = &clients[i];
+				break;
+			}
+		}
+		if (!cl) {
+			printf("RTSP client %s:%d rejected, %d clients already\n",
+				inet_ntoa(addr.sin_addr), ntohs(addr.sin_port), RTSP_CLIENTS_MAX);
+			close(fd);
+			continue;
+		}
+
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+		pthread_mutex_lock(&server_mutex);
+		memset(cl, 0, sizeof(*cl));
+		cl->addr = addr;
+		cl->fd = fd;
+		pthread_mutex_unlock(&server_mutex);
+
+		struct epoll_event ev = { .events = EPOLLIN, .data.ptr = cl };
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+			rtsp_client_close(cl, "rejected");
+	}
+}
+
+static void *rtsp_thread_func(void *arg)
+{
+	struct epoll_event events[RTSP_CLIENTS_MAX + 2];
+
+	while (server_running) {
+		int n = epoll_wait(epoll_fd, events, RTSP_CLIENTS_MAX + 2, 100);
+
+		for (int i = 0; i < n; i++) {
+			void *ptr = events[i].data.ptr;
+
+			if (ptr == &listen_fd) {
+				rtsp_accept();
+			} else if (ptr == &event_fd) {
+				unsigned long long v;
+				if (read(event_fd, &v, sizeof(v)) < 0) {
+					/* Non blocking, nothing pending */
+				}
+				for (int j = 0; j < RTSP_CLIENTS_MAX; j++) {
+					struct rtsp_client_s *cl = &clients[j];
+					if ((cl->fd >= 0) && (cl->transport == TRANSPORT_TCP) && !cl->evict &&
+						!cl->want_out && (rtsp_client_flush(cl) < 0))
+						rtsp_client_close(cl, "disconnected");
+				}
+			} else {
+				struct rtsp_client_s *cl = ptr;
+				if (cl->fd < 0)
+					continue;
+				if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+					rtsp_client_close(cl, "disconnected");
+					continue;
+				}
+				if (events[i].events & EPOLLIN)
+					rtsp_client_read(cl);
+				if ((cl->fd >= 0) && (events[i].events & EPOLLOUT) && (rtsp_client_flush(cl) < 0))
+					rtsp_client_close(cl, "disconnected");
+			}
+		}
+
+		for (int i = 0; i < RTSP_CLIENTS_MAX; i++) {
+			if ((clients[i].fd >= 0) && clients[i].evict) {
+				metrics_add(rtsp_metrics.evicted, 1);
+				rtsp_client_close(&clients[i], "evicted, too slow");
+			}
+		}
+	}
+
+	for (int i = 0; i < RTSP_CLIENTS_MAX; i++)
+		if (clients[i].fd >= 0)
+			rtsp_client_close(&clients[i], "closed, shutting down");
+
+	return NULL;
+}
+
+int rtsp_open(int port, int dscp)
+{
+	struct sockaddr_in addr;
+	socklen_t alen = sizeof(addr);
+	int one = 1;
+
+	for (int i = 0; i < RTSP_CLIENTS_MAX; i++)
+		clients[i].fd = -1;
+	sps_len = pps_len = 0;
+	session_count = 0;
+	au_len = au_packets = 0;
+	srand(time(NULL));
+
+	listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	udp_fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if ((listen_fd < 0) || (udp_fd < 0)) {
+		fprintf(stderr, "%s() socket failed, %s\n", __func__, strerror(errno));
+		rtsp_close();
+		return -1;
+	}
+	setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(port);
+	if ((bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) || (listen(listen_fd, 16) < 0)) {
+		fprintf(stderr, "%s() unable to listen on port %d, %s\n", __func__, port, strerror(errno));
+		rtsp_close();
+		return -1;
+	}
+
+	/* UDP sessions are all sent from the one socket */
+	addr.sin_port = 0;
+	if ((bind(udp_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) ||
+		(getsockname(udp_fd, (struct sockaddr *)&addr, &alen) < 0)) {
+		fprintf(stderr, "%s() udp bind failed, %s\n", __func__, strerror(errno));
+		rtsp_close();
+		return -1;
+	}
+	udp_port = ntohs(addr.sin_port);
+	if (dscp > 0) {
+		int tos = dscp << 2;
+		setsockopt(udp_fd, IPPROTO_IP, IP_TOS, &tos, sizeof(tos));
+	}
+
+	event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if ((event_fd < 0) || (epoll_fd < 0)) {
+		fprintf(stderr, "%s() epoll setup failed, %s\n", __func__, strerror(errno));
+		rtsp_close();
+		return -1;
+	}
+
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &listen_fd };
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+	ev.data.ptr = &event_fd;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, event_fd, &ev);
+
+	rtsp_metrics.sessions = metrics_register("rtsp_sessions", METRIC_GAUGE);
+	rtsp_metrics.evicted = metrics_register("rtsp_evicted", METRIC_COUNTER);
+
+	server_running = 1;
+	if (pthread_create(&server_thread, NULL, rtsp_thread_func, NULL) != 0) {
+		server_running = 0;
+		rtsp_close();
+		return -1;
+	}
+
+	rtp_set_tap(rtsp_tap);
+	printf("RTSP server on rtsp://0.0.0.0:%d/\n", port);
+
+	return 0;
+}
+
+void rtsp_close()
+{
+	rtp_set_tap(NULL);
+
+	if (server_running) {
+		server_running = 0;
+		pthread_join(server_thread, NULL);
+	}
+
+	free(au_buf);
+	au_buf = NULL;
+	au_len = au_size = au_packets = 0;
+
+	if (epoll_fd >= 0)
+		close(epoll_fd);
+	if (event_fd >= 0)
+		close(event_fd);
+	if (udp_fd >= 0)
+		close(udp_fd);
+	if (listen_fd >= 0)
+		close(listen_fd);
+	epoll_fd = event_fd = udp_fd = listen_fd = -1;
+}
@@ -0,0 +1,46 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef RTSP_H
+#define RTSP_H
+
+/* RTSP (RFC 2326) server for pull clients. The packets come from the RTP
+ * packetiser in rtp.c, so every session gets the same single encode. A
+ * session plays over UDP (sent straight from the encode thread) or
+ * interleaved on its RTSP connection (queued, sent by the server thread).
+ * DESCRIBE answers with SDP built from the SPS/PPS seen in the stream.
+ */
+
+#define RTSP_CLIENTS_MAX	32
+#define RTSP_QUEUE_CHUNKS	1024		/* Access units queued per TCP session */
+#define RTSP_QUEUE_BYTES	(8 * 1048576)
+#define RTSP_REQUEST_MAX	4096
+#define RTSP_PACKETS_MAX	4096		/* RTP packets per access unit */
+#define RTSP_PARAMSET_MAX	256
+
+int  rtsp_open(int port, int dscp);
+void rtsp_close();
+
+#endif
@@ -0,0 +1,171 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "scenecut.h"
+#include "convert.h"
+
+int scenecut_alloc(struct scenecut_ctx_s *ctx, unsigned int width, unsigned int height)
+{
+	memset(ctx, 0, sizeof(*ctx));
+
+	ctx->dw = width / SCENECUT_DECIMATE;
+	ctx->dh = height / SCENECUT_DECIMATE;
+	if ((ctx->dw == 0) || (ctx->dh == 0))
+		return -1;
+
+	ctx->cur = malloc(ctx->dw * ctx->dh);
+	ctx->prev = malloc(ctx->dw * ctx->dh);
+	if ((!ctx->cur) || (!ctx->prev)) {
+		scenecut_free(ctx);
+		return -1;
+	}
+
+	return 0;
+}
+
+void scenecut_free(struct scenecut_ctx_s *ctx)
+{
+	free(ctx->cur);
+	free(ctx->prev);
+	memset(ctx, 0, sizeof(*ctx));
+}
+
+void scenecut_sample_yuy2(struct scenecut_ctx_s *ctx, const unsigned char *frame, unsigned int stride)
+{
+	unsigned char *dst = ctx->cur;
+
+	for (unsigned int y = 0; y < ctx->dh; y++) {
+		const unsigned char *src = frame + (y * SCENECUT_DECIMATE * stride);
+		for (unsigned int x = 0; x < ctx->dw; x++) {
+			*(dst++) = *src;
+			src += SCENECUT_DECIMATE * 2;
+		}
+	}
+}
+
+void scenecut_sample_i420(struct scenecut_ctx_s *ctx, const unsigned char *luma, unsigned int stride)
+{
+	unsigned char *dst = ctx->cur;
+
+	for (unsigned int y = 0; y < ctx->dh; y++) {
+		const unsigned char *src = luma + (y * SCENECUT_DECIMATE * stride);
+		for (unsigned int x = 0; x < ctx->dw; x++) {
+			*(dst++) = *src;
+			src += SCENECUT_DECIMATE;
+		}
+	}
+}
+
+void scenecut_sample_bgrx(struct scenecut_ctx_s *ctx, const unsigned char *frame, unsigned int stride)
+{
+	unsigned char *dst = ctx->cur;
+
+	for (unsigned int y = 0; y < ctx->dh; y++) {
+		const unsigned char *src = frame + (y * SCENECUT_DECIMATE * stride);
+		for (unsigned int x = 0; x < ctx->dw; x++) {
+			/* BT.601 studio range luma */
+			*(dst++) = ((66 * src[2] + 129 * src[1] + 25 * src[0] + 128) >> 8) + 16;
+			src += SCENECUT_DECIMATE * 4;
+		}
+	}
+}
+
+/* Compare the histogram in hist[hist_idx] and the luma SAD over samples
+ * pixels with those of the previous frame.
+ */
+static int scenecut_compare(struct scenecut_ctx_s *ctx, unsigned int samples, unsigned long long sad,
+	unsigned int threshold, unsigned int static_mad)
+{
+	unsigned int *hist = &ctx->hist[ctx->hist_idx][0];
+	unsigned int *prev_hist = &ctx->hist[ctx->hist_idx ^ 1][0];
+	unsigned int delta = 0;
+	int cut = 0;
+
+	if (ctx->have_prev) {
+		for (unsigned int i = 0; i < SCENECUT_HIST_BINS; i++)
+			delta += abs((int)hist[i] - (int)prev_hist[i]);
+
+		/* Every sample that changes bin is counted twice, once leaving and once arriving. */
+		ctx->hist_delta = (unsigned int)(((unsigned long long)delta * 100) / (samples * 2));
+		ctx->mad = (unsigned int)((sad * 16) / samples);
+
+		if (threshold && (ctx->hist_delta >= threshold) && (ctx->mad > static_mad)) {
+			cut = 1;
+			ctx->cuts++;
+		}
+
+		if (ctx->mad <= static_mad)
+			ctx->static_run++;
+		else
+			ctx->static_run = 0;
+	}
+
+	ctx->hist_idx ^= 1;
+	ctx->have_prev = 1;
+
+	return cut;
+}
+
+int scenecut_analyze(struct scenecut_ctx_s *ctx, unsigned int threshold, unsigned int static_mad)
+{
+	unsigned int samples = ctx->dw * ctx->dh;
+	unsigned int *hist = &ctx->hist[ctx->hist_idx][0];
+	unsigned long long sad = 0;
+
+	memset(hist, 0, sizeof(ctx->hist[0]));
+
+	if (ctx->have_prev) {
+		for (unsigned int i = 0; i < samples; i++) {
+			hist[ctx->cur[i] >> 2]++;
+			sad += abs((int)ctx->cur[i] - (int)ctx->prev[i]);
+		}
+	} else {
+		for (unsigned int i = 0; i < samples; i++)
+			hist[ctx->cur[i] >> 2]++;
+	}
+
+	/* This frame becomes the reference for the next */
+	unsigned char *t = ctx->prev;
+	ctx->prev = ctx->cur;
+	ctx->cur = t;
+
+	return scenecut_compare(ctx, samples, sad, threshold, static_mad);
+}
+
+int scenecut_analyze_stats(struct scenecut_ctx_s *ctx, struct frame_stats_s *st,
+	unsigned int threshold, unsigned int static_mad)
+{
+	unsigned int *hist = &ctx->hist[ctx->hist_idx][0];
+
+	/* Fold the full resolution histogram down to our bin count */
+	memset(hist, 0, sizeof(ctx->hist[0]));
+	for (unsigned int i = 0; i < 256; i++)
+		hist[i >> 2] += st->histogram[i];
+
+	return scenecut_compare(ctx, st->width * st->height, st->sad, threshold, static_mad);
+}
@@ -0,0 +1,80 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef SCENECUT_H
+#define SCENECUT_H
+
+/* Every Nth pixel on every Nth line is sampled for analysis. */
+#define SCENECUT_DECIMATE	4
+#define SCENECUT_HIST_BINS	64
+
+/* Lightweight scene change / static content detector. We sample a
+ * decimated luma plane from each input frame, then compare its
+ * histogram and SAD against the previous frame.
+ */
+struct scenecut_ctx_s
+{
+	unsigned int dw;
+	unsigned int dh;
+
+	/* Decimated luma of the current and previous frames */
+	unsigned char *cur;
+	unsigned char *prev;
+	int have_prev;
+
+	unsigned int hist[2][SCENECUT_HIST_BINS];
+	unsigned int hist_idx;
+
+	/* Results of the most recent scenecut_analyze() */
+	unsigned int hist_delta;	/* 0-100, % of samples that moved histogram bin */
+	unsigned int mad;		/* Mean absolute luma difference, x16 */
+
+	/* Number of consecutive frames considered static */
+	unsigned int static_run;
+	unsigned long long cuts;
+};
+
+int  scenecut_alloc(struct scenecut_ctx_s *ctx, unsigned int width, unsigned int height);
+void scenecut_free(struct scenecut_ctx_s *ctx);
+
+/* Pull the decimated luma plane out of the input frame. */
+void scenecut_sample_yuy2(struct scenecut_ctx_s *ctx, const unsigned char *frame, unsigned int stride);
+void scenecut_sample_i420(struct scenecut_ctx_s *ctx, const unsigned char *luma, unsigned int stride);
+void scenecut_sample_bgrx(struct scenecut_ctx_s *ctx, const unsigned char *frame, unsigned int stride);
+
+/* Compare the sampled frame to the previous one. Returns 1 if the histogram
+ * moved by more than threshold percent, otherwise 0. static_mad is the
+ * mean absolute difference (x16) below which the frame counts as static.
+ */
+int  scenecut_analyze(struct scenecut_ctx_s *ctx, unsigned int threshold, unsigned int static_mad);
+
+/* As above, but using full resolution statistics gathered during colorspace
+ * conversion instead of the decimated sample. See convert.h
+ */
+struct frame_stats_s;
+int  scenecut_analyze_stats(struct scenecut_ctx_s *ctx, struct frame_stats_s *st,
+	unsigned int threshold, unsigned int static_mad);
+
+#endif
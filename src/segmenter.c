@@ -0,0 +1,663 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "segmenter.h"
+#include "output.h"
+#include "tsmux.h"
+#include "mp4mux.h"
+#include "frames.h"
+#include "metrics.h"
+
+enum segmenter_job_e {
+	JOB_INIT = 0,		/* fMP4 init segment */
+	JOB_PART,		/* Media, optionally ending the segment */
+};
+
+struct segmenter_job_s
+{
+	enum segmenter_job_e type;
+	unsigned char *data;		/* Owned by the job */
+	int len;
+	unsigned int segment;
+	unsigned int part;
+	int use_part;			/* Written as a part file too */
+	int independent;		/* Starts with an IDR */
+	int end_of_segment;
+	int discard;			/* Drop the open segment first, a part of it was lost */
+	unsigned long long start90k;	/* Of the part */
+	unsigned int duration90k;
+	char codecs[32];		/* JOB_INIT */
+};
+
+struct segmenter_part_s
+{
+	unsigned int duration90k;
+	int independent;
+};
+
+struct segmenter_segment_s
+{
+	unsigned int nr;
+	unsigned long long start90k;
+	unsigned int duration90k;
+	unsigned long long bytes;
+	struct segmenter_part_s parts[SEGMENTER_PARTS_MAX];
+	int part_count;
+	int discontinuity;		/* Follows a discarded segment */
+};
+
+/* Configuration */
+static char *seg_dir;
+static enum segmenter_format_e seg_format;
+static char *seg_ext;
+static unsigned int target90k, part90k;
+static unsigned int target_duration;	/* Seconds, fixed for the life of the playlist */
+static int seg_window;
+
+/* Encode thread */
+static struct tsmux_ctx_s tsmux;
+static struct mp4mux_ctx_s mp4mux;
+static unsigned char *chunk = NULL;
+static int chunk_len, chunk_size;
+static unsigned int cur_segment, cur_part;
+static unsigned long long segment_start90k, part_start90k, last_dts90k;
+static unsigned int frame_duration90k;
+static int segment_frames, part_frames;
+static int part_independent;
+static int au_open = 0, au_skip = 0;
+static int init_sent = 0;
+static int discard_segment = 0;
+
+/* Job queue */
+static struct segmenter_job_s jobs[SEGMENTER_JOBS];
+static int job_head, job_count;
+static pthread_mutex_t job_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t writer_thread;
+static int writer_running = 0;
+
+/* Writer thread */
+static struct segmenter_segment_s window[SEGMENTER_WINDOW_MAX];
+static int window_count;
+static unsigned int discontinuity_sequence;
+static struct segmenter_segment_s open_segment;
+static FILE *segment_fp = NULL;
+static unsigned int part_target90k;	/* Fixed once the first playlist is out */
+static int playlist_published;
+static int overlong_warned;
+static char codecs[32];
+static time_t availability_start;
+static unsigned long long jobs_dropped;
+
+static struct {
+	struct metric_s *segments;
+	struct metric_s *parts;
+	struct metric_s *dropped;
+} seg_metrics;
+
+/* Encode thread, muxed bytes for the current part */
+static void segmenter_append(void *priv, unsigned char *buf, int len)
+{
+	if (chunk_len + len > chunk_size) {
+		int size = chunk_size ? chunk_size * 2 : 1048576;
+		while (size < chunk_len + len)
+			size *= 2;
+		unsigned char *p = realloc(chunk, size);
+		if (!p)
+			return;
+		chunk = p;
+		chunk_size = size;
+	}
+	memcpy(chunk + chunk_len, buf, len);
+	chunk_len += len;
+}
+
+/* Encode thread, never blocks. The job owns data afterwards, also when dropped. */
+static int segmenter_queue(struct segmenter_job_s *job)
+{
+	pthread_mutex_lock(&job_mutex);
+	if (job_count == SEGMENTER_JOBS) {
+		pthread_mutex_unlock(&job_mutex);
+		free(job->data);
+		jobs_dropped++;
+		metrics_add(seg_metrics.dropped, 1);
+		return -1;
+	}
+	jobs[(job_head + job_count++) % SEGMENTER_JOBS] = *job;
+	pthread_cond_signal(&job_cond);
+	pthread_mutex_unlock(&job_mutex);
+
+	return 0;
+}
+
+/* Encode thread, close the current part and optionally its segment */
+static void segmenter_cut(int end_of_segment)
+{
+	struct segmenter_job_s job;
+
+	if (seg_format == SEGMENTER_FMP4) {
+		if (!init_sent) {
+			unsigned char buf[1024];
+			int len = mp4mux_init_segment(&mp4mux, buf, sizeof(buf));
+			if (len > 0) {
+				memset(&job, 0, sizeof(job));
+				job.type = JOB_INIT;
+				job.data = malloc(len);
+				if (job.data) {
+					memcpy(job.data, buf, len);
+					job.len = len;
+					snprintf(job.codecs, sizeof(job.codecs), "avc1.%02x%02x%02x",
+						mp4mux.sps[1], mp4mux.sps[2], mp4mux.sps[3]);
+					/* Otherwise retried with the next part */
+					if (segmenter_queue(&job) == 0)
+						init_sent = 1;
+				}
+			}
+		}
+		mp4mux_fragment(&mp4mux, segmenter_append, NULL);
+	}
+
+	memset(&job, 0, sizeof(job));
+	job.type = JOB_PART;
+	job.data = chunk;
+	job.len = chunk_len;
+	job.segment = cur_segment;
+	job.part = cur_part;
+	job.use_part = part90k != 0;
+	job.independent = part_independent;
+	job.end_of_segment = end_of_segment;
+	job.discard = discard_segment;
+	job.start90k = part_start90k;
+	job.duration90k = (last_dts90k + frame_duration90k) - part_start90k;
+	int dropped = segmenter_queue(&job) < 0;
+
+	chunk = NULL;
+	chunk_len = 0;
+	chunk_size = 0;
+	part_frames = 0;
+
+	if (dropped) {
+		/* The segment has a hole. Start it over at the next IDR, the
+		 * writer discards what it already has of it.
+		 */
+		discard_segment = 1;
+		segment_frames = 0;
+		cur_part = 0;
+		return;
+	}
+	discard_segment = 0;
+	cur_part++;
+
+	if (end_of_segment) {
+		segment_frames = 0;
+		cur_segment++;
+		cur_part = 0;
+	}
+}
+
+static int segmenter_codeddata(unsigned char *buf, int len, int frame_type)
+{
+	if (!au_open) {
+		au_open = 1;
+
+		unsigned long long end90k = last_dts90k + frame_duration90k;
+		if (segment_frames && (frame_type == FRAME_IDR) && (end90k - segment_start90k >= target90k))
+			segmenter_cut(1);
+		else
+		if (part90k && part_frames && (end90k - part_start90k >= part90k))
+			segmenter_cut(0);
+
+		/* Every segment starts with an IDR, also one started over after a lost part */
+		if (segment_frames == 0 && frame_type != FRAME_IDR) {
+			au_skip = 1;
+			return 0;
+		}
+		au_skip = 0;
+
+		if (part_frames == 0)
+			part_independent = (frame_type == FRAME_IDR);
+	}
+
+	if (au_skip)
+		return 0;
+
+	if (seg_format == SEGMENTER_TS)
+		tsmux_write_es(&tsmux, buf, len);
+	else
+		mp4mux_write_es(&mp4mux, buf, len);
+
+	return 0;
+}
+
+static void segmenter_frame_complete(int frame_type, unsigned long long pts90k, unsigned long long dts90k)
+{
+	au_open = 0;
+	if (au_skip)
+		return;
+
+	int sync = (frame_type == FRAME_IDR);
+	if (seg_format == SEGMENTER_TS)
+		tsmux_frame_complete(&tsmux, sync, pts90k, dts90k);
+	else
+		mp4mux_frame_complete(&mp4mux, sync, pts90k, dts90k);
+
+	if (segment_frames && (dts90k > last_dts90k) && (dts90k - last_dts90k) < 90000)
+		frame_duration90k = dts90k - last_dts90k;
+	if (segment_frames == 0)
+		segment_start90k = dts90k;
+	if (part_frames == 0)
+		part_start90k = dts90k;
+	last_dts90k = dts90k;
+	segment_frames++;
+	part_frames++;
+}
+
+static struct output_sink_s segmenter_sink =
+{
+	.name		= "HLS",
+	.codeddata	= segmenter_codeddata,
+	.frame_complete	= segmenter_frame_complete,
+};
+
+/* Writer thread */
+static void segmenter_path(char *dst, int len, unsigned int segment, int part)
+{
+	if (part >= 0)
+		snprintf(dst, len, "%s/seg%u.%d%s", seg_dir, segment, part, seg_ext);
+	else
+		snprintf(dst, len, "%s/seg%u%s", seg_dir, segment, seg_ext);
+}
+
+static int segmenter_write_file(char *fn, unsigned char *data, int len)
+{
+	char tmp[4096];
+
+	/* Readers only ever see complete files */
+	snprintf(tmp, sizeof(tmp), "%s.tmp", fn);
+	FILE *fp = fopen(tmp, "wb");
+	if (!fp) {
+		fprintf(stderr, "%s() unable to create %s, %s\n", __func__, tmp, strerror(errno));
+		return -1;
+	}
+	if (len && fwrite(data, 1, len, fp) != (size_t)len) {
+		fclose(fp);
+		unlink(tmp);
+		return -1;
+	}
+	fclose(fp);
+
+	return rename(tmp, fn);
+}
+
+static void segmenter_remove(struct segmenter_segment_s *s)
+{
+	char fn[4096];
+
+	segmenter_path(fn, sizeof(fn), s->nr, -1);
+	unlink(fn);
+	for (int i = 0; i < s->part_count; i++) {
+		segmenter_path(fn, sizeof(fn), s->nr, i);
+		unlink(fn);
+	}
+}
+
+static void segmenter_playlist_parts(FILE *fp, struct segmenter_segment_s *s)
+{
+	for (int i = 0; i < s->part_count; i++) {
+		fprintf(fp, "#EXT-X-PART:DURATION=%.5f,URI=\"seg%u.%d%s\"%s\n",
+			s->parts[i].duration90k / 90000.0, s->nr, i, seg_ext,
+			s->parts[i].independent ? ",INDEPENDENT=YES" : "");
+	}
+}
+
+static void segmenter_playlist()
+{
+	char fn[4096], tmp[4096];
+
+	snprintf(fn, sizeof(fn), "%s/index.m3u8", seg_dir);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", fn);
+	FILE *fp = fopen(tmp, "w");
+	if (!fp)
+		return;
+
+	fprintf(fp, "#EXTM3U\n");
+	fprintf(fp, "#EXT-X-VERSION:%d\n", part90k ? 9 : seg_format == SEGMENTER_FMP4 ? 7 : 3);
+	fprintf(fp, "#EXT-X-TARGETDURATION:%u\n", target_duration);
+	if (part90k) {
+		fprintf(fp, "#EXT-X-SERVER-CONTROL:PART-HOLD-BACK=%.3f\n", (3 * part_target90k) / 90000.0);
+		fprintf(fp, "#EXT-X-PART-INF:PART-TARGET=%.5f\n", part_target90k / 90000.0);
+	}
+	fprintf(fp, "#EXT-X-MEDIA-SEQUENCE:%u\n", window_count ? window[0].nr : open_segment.nr);
+	if (seg_format == SEGMENTER_FMP4)
+		fprintf(fp, "#EXT-X-MAP:URI=\"init.mp4\"\n");
+
+	if (discontinuity_sequence)
+		fprintf(fp, "#EXT-X-DISCONTINUITY-SEQUENCE:%u\n", discontinuity_sequence);
+
+	for (int i = 0; i < window_count; i++) {
+		if (window[i].discontinuity)
+			fprintf(fp, "#EXT-X-DISCONTINUITY\n");
+		if (part90k && (i >= window_count - SEGMENTER_PART_SEGMENTS))
+			segmenter_playlist_parts(fp, &window[i]);
+		fprintf(fp, "#EXTINF:%.5f,\nseg%u%s\n", window[i].duration90k / 90000.0, window[i].nr, seg_ext);
+	}
+	if (part90k) {
+		if (open_segment.discontinuity && open_segment.part_count)
+			fprintf(fp, "#EXT-X-DISCONTINUITY\n");
+		segmenter_playlist_parts(fp, &open_segment);
+	}
+
+	fclose(fp);
+	if (rename(tmp, fn) == 0)
+		playlist_published = 1;
+}
+
+static void segmenter_iso8601(char *dst, int len, time_t t)
+{
+	struct tm tm;
+
+	gmtime_r(&t, &tm);
+	strftime(dst, len, "%Y-%m-%dT%H:%M:%SZ", &tm);
+}
+
+static void segmenter_manifest()
+{
+	char fn[4096], tmp[4096], ast[32], now[32];
+	unsigned long long bandwidth = 0;
+	unsigned int depth90k = 0;
+
+	if ((seg_format != SEGMENTER_FMP4) || !window_count)
+		return;
+
+	for (int i = 0; i < window_count; i++) {
+		if (window[i].duration90k) {
+			unsigned long long bps = (window[i].bytes * 8 * 90000) / window[i].duration90k;
+			if (bps > bandwidth)
+				bandwidth = bps;
+		}
+		depth90k += window[i].duration90k;
+	}
+
+	segmenter_iso8601(ast, sizeof(ast), availability_start);
+	segmenter_iso8601(now, sizeof(now), time(NULL));
+
+	snprintf(fn, sizeof(fn), "%s/manifest.mpd", seg_dir);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", fn);
+	FILE *fp = fopen(tmp, "w");
+	if (!fp)
+		return;
+
+	fprintf(fp, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
+	fprintf(fp, "<MPD xmlns=\"urn:mpeg:dash:schema:mpd:2011\" profiles=\"urn:mpeg:dash:profile:isoff-live:2011\"\n");
+	fprintf(fp, "  type=\"dynamic\" availabilityStartTime=\"%s\" publishTime=\"%s\"\n", ast, now);
+	fprintf(fp, "  minimumUpdatePeriod=\"PT%.3fS\" minBufferTime=\"PT%.3fS\" timeShiftBufferDepth=\"PT%.3fS\">\n",
+		target90k / 90000.0, target90k / 90000.0, depth90k / 90000.0);
+	fprintf(fp, "  <Period id=\"0\" start=\"PT0S\">\n");
+	fprintf(fp, "    <AdaptationSet mimeType=\"video/mp4\" segmentAlignment=\"true\" startWithSAP=\"1\">\n");
+	fprintf(fp, "      <Representation id=\"0\" codecs=\"%s\" width=\"%u\" height=\"%u\" bandwidth=\"%llu\">\n",
+		codecs, mp4mux.width, mp4mux.height, bandwidth);
+	fprintf(fp, "        <SegmentTemplate timescale=\"90000\" initialization=\"init.mp4\" media=\"seg$Number$%s\" startNumber=\"%u\">\n",
+		seg_ext, window[0].nr);
+	fprintf(fp, "          <SegmentTimeline>\n");
+	for (int i = 0; i < window_count; i++)
+		fprintf(fp, "            <S t=\"%llu\" d=\"%u\"/>\n", window[i].start90k, window[i].duration90k);
+	fprintf(fp, "          </SegmentTimeline>\n");
+	fprintf(fp, "        </SegmentTemplate>\n");
+	fprintf(fp, "      </Representation>\n");
+	fprintf(fp, "    </AdaptationSet>\n");
+	fprintf(fp, "  </Period>\n");
+	fprintf(fp, "</MPD>\n");
+
+	fclose(fp);
+	rename(tmp, fn);
+}
+
+static void segmenter_discard()
+{
+	char fn[4096], tmp[4096];
+
+	if (segment_fp) {
+		fclose(segment_fp);
+		segment_fp = NULL;
+		segmenter_path(fn, sizeof(fn), open_segment.nr, -1);
+		snprintf(tmp, sizeof(tmp), "%s.tmp", fn);
+		unlink(tmp);
+	}
+	segmenter_remove(&open_segment);
+	memset(&open_segment, 0, sizeof(open_segment));
+}
+
+static void segmenter_job(struct segmenter_job_s *job)
+{
+	char fn[4096], tmp[4096];
+
+	if (job->type == JOB_INIT) {
+		snprintf(fn, sizeof(fn), "%s/init.mp4", seg_dir);
+		segmenter_write_file(fn, job->data, job->len);
+		strcpy(codecs, job->codecs);
+		return;
+	}
+
+	/* What was written of the open segment has a hole, it is never published */
+	if (job->discard)
+		segmenter_discard();
+
+	/* A new segment */
+	if (!segment_fp) {
+		memset(&open_segment, 0, sizeof(open_segment));
+		open_segment.nr = job->segment;
+		/* The fMP4 timeline, zero at the first sample */
+		open_segment.start90k = job->start90k - mp4mux.base_dts90k;
+
+		segmenter_path(fn, sizeof(fn), job->segment, -1);
+		snprintf(tmp, sizeof(tmp), "%s.tmp", fn);
+		segment_fp = fopen(tmp, "wb");
+		if (!segment_fp)
+			fprintf(stderr, "%s() unable to create %s, %s\n", __func__, tmp, strerror(errno));
+	}
+	if (job->discard)
+		open_segment.discontinuity = 1;
+
+	/* Past a full part array the media only goes into the segment, no part
+	 * file is written that the playlist and segmenter_remove() don't know of.
+	 */
+	if (job->use_part && (open_segment.part_count < SEGMENTER_PARTS_MAX)) {
+		segmenter_path(fn, sizeof(fn), job->segment, job->part);
+		segmenter_write_file(fn, job->data, job->len);
+		struct segmenter_part_s *p = &open_segment.parts[open_segment.part_count++];
+		p->duration90k = job->duration90k;
+		p->independent = job->independent;
+		if (!playlist_published && (job->duration90k > part_target90k))
+			part_target90k = job->duration90k;
+		metrics_add(seg_metrics.parts, 1);
+	}
+
+	if (segment_fp)
+		fwrite(job->data, 1, job->len, segment_fp);
+	open_segment.duration90k += job->duration90k;
+	open_segment.bytes += job->len;
+
+	if (job->end_of_segment) {
+		if (!overlong_warned && (open_segment.duration90k > target_duration * 90000)) {
+			overlong_warned = 1;
+			printf("HLS segment of %.3fs is longer than the %us target duration, IDRs are too far apart\n",
+				open_segment.duration90k / 90000.0, target_duration);
+		}
+		if (segment_fp) {
+			fclose(segment_fp);
+			segment_fp = NULL;
+			segmenter_path(fn, sizeof(fn), job->segment, -1);
+			snprintf(tmp, sizeof(tmp), "%s.tmp", fn);
+			rename(tmp, fn);
+		}
+
+		/* Slide the window, the oldest files go */
+		if (window_count == seg_window) {
+			segmenter_remove(&window[0]);
+			if (window[0].discontinuity)
+				discontinuity_sequence++;
+			memmove(&window[0], &window[1], (window_count - 1) * sizeof(window[0]));
+			window_count--;
+		}
+		window[window_count++] = open_segment;
+		memset(&open_segment, 0, sizeof(open_segment));
+		open_segment.nr = job->segment + 1;
+		metrics_add(seg_metrics.segments, 1);
+
+		segmenter_manifest();
+	}
+
+	segmenter_playlist();
+}
+
+static void *segmenter_thread_func(void *arg)
+{
+	pthread_mutex_lock(&job_mutex);
+	while (writer_running || job_count) {
+		if (job_count == 0) {
+			pthread_cond_wait(&job_cond, &job_mutex);
+			continue;
+		}
+
+		struct segmenter_job_s job = jobs[job_head];
+		job_head = (job_head + 1) % SEGMENTER_JOBS;
+		job_count--;
+		pthread_mutex_unlock(&job_mutex);
+
+		segmenter_job(&job);
+		free(job.data);
+
+		pthread_mutex_lock(&job_mutex);
+	}
+	pthread_mutex_unlock(&job_mutex);
+
+	/* The last part was lost */
+	if (segment_fp)
+		segmenter_discard();
+
+	return NULL;
+}
+
+int segmenter_open(char *dir, enum segmenter_format_e format, unsigned int target_ms, unsigned int part_ms,
+	unsigned int window_segments, unsigned int width, unsigned int height, unsigned int fps,
+	unsigned int gop_ms)
+{
+	if ((window_segments < 2) || (window_segments > SEGMENTER_WINDOW_MAX)) {
+		fprintf(stderr, "%s() window must be 2 - %d segments\n", __func__, SEGMENTER_WINDOW_MAX);
+		return -1;
+	}
+	if (part_ms && (part_ms * SEGMENTER_PARTS_MAX < target_ms)) {
+		fprintf(stderr, "%s() parts too short for the segment duration\n", __func__);
+		return -1;
+	}
+	if (access(dir, W_OK) < 0) {
+		fprintf(stderr, "%s() unable to write to %s, %s\n", __func__, dir, strerror(errno));
+		return -1;
+	}
+
+	seg_dir = dir;
+	seg_format = format;
+	seg_ext = format == SEGMENTER_FMP4 ? ".m4s" : ".ts";
+	target90k = target_ms * 90;
+	part90k = part_ms * 90;
+	seg_window = window_segments;
+
+	if ((format == SEGMENTER_FMP4) && (mp4mux_alloc(&mp4mux, width, height, fps) < 0))
+		return -1;
+	if ((format == SEGMENTER_TS) && (tsmux_alloc(&tsmux, 0, 0, segmenter_append, NULL) < 0))
+		return -1;
+
+	frame_duration90k = 90000 / (fps ? fps : 30);
+
+	/* A segment is cut at the first IDR past the target, a part at the
+	 * first frame past its duration.
+	 */
+	target_duration = (target90k + (gop_ms * 90) + 89999) / 90000;
+	part_target90k = part90k ? part90k + frame_duration90k : 0;
+	playlist_published = 0;
+	overlong_warned = 0;
+	cur_segment = cur_part = 0;
+	segment_frames = part_frames = 0;
+	au_open = au_skip = 0;
+	init_sent = 0;
+	discard_segment = 0;
+	window_count = 0;
+	discontinuity_sequence = 0;
+	memset(&open_segment, 0, sizeof(open_segment));
+	job_head = job_count = 0;
+	jobs_dropped = 0;
+	availability_start = time(NULL);
+
+	seg_metrics.segments = metrics_register("hls_segments", METRIC_COUNTER);
+	seg_metrics.parts = metrics_register("hls_parts", METRIC_COUNTER);
+	seg_metrics.dropped = metrics_register("hls_jobs_dropped", METRIC_COUNTER);
+
+	writer_running = 1;
+	if (pthread_create(&writer_thread, NULL, segmenter_thread_func, NULL) != 0) {
+		writer_running = 0;
+		segmenter_close();
+		return -1;
+	}
+
+	printf("HLS%s %s segments of %dms%s to %s, keeping %d\n",
+		format == SEGMENTER_FMP4 ? "/DASH" : "", format == SEGMENTER_FMP4 ? "fMP4" : "TS",
+		target_ms, part_ms ? " with low latency parts" : "", dir, window_segments);
+
+	return output_register(&segmenter_sink);
+}
+
+void segmenter_close()
+{
+	output_unregister(&segmenter_sink);
+
+	if (writer_running) {
+		/* The last, possibly short, segment */
+		if (segment_frames)
+			segmenter_cut(1);
+
+		pthread_mutex_lock(&job_mutex);
+		writer_running = 0;
+		pthread_cond_signal(&job_cond);
+		pthread_mutex_unlock(&job_mutex);
+		pthread_join(writer_thread, NULL);
+
+		printf("HLS segments %u, writer jobs dropped %llu\n", cur_segment, jobs_dropped);
+	}
+
+	if (seg_format == SEGMENTER_TS)
+		tsmux_free(&tsmux);
+	else
+		mp4mux_free(&mp4mux);
+	free(chunk);
+	chunk = NULL;
+	chunk_len = chunk_size = 0;
+}
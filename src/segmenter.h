@@ -0,0 +1,55 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef SEGMENTER_H
+#define SEGMENTER_H
+
+/* Live HLS / DASH output. The coded stream is cut into segments of at least
+ * the target duration, each starting with an IDR, muxed as MPEG-TS or
+ * fragmented MP4. Segments may be split further into low latency parts,
+ * which start at any frame. Files, the playlist (index.m3u8) and for fMP4
+ * the DASH manifest (manifest.mpd) are written, and old segments deleted,
+ * by a dedicated thread.
+ */
+
+#define SEGMENTER_JOBS		64	/* Parts queued for the writer */
+#define SEGMENTER_PARTS_MAX	64	/* Per segment */
+#define SEGMENTER_WINDOW_MAX	64	/* Segments kept on disk and listed */
+#define SEGMENTER_PART_SEGMENTS	3	/* Parts are listed for this many of the newest segments */
+
+enum segmenter_format_e {
+	SEGMENTER_TS = 0,
+	SEGMENTER_FMP4,
+};
+
+/* gop_ms is the longest expected distance between IDRs, 0 if unknown. With
+ * the target it fixes the playlist's EXT-X-TARGETDURATION.
+ */
+int  segmenter_open(char *dir, enum segmenter_format_e format, unsigned int target_ms, unsigned int part_ms,
+	unsigned int window, unsigned int width, unsigned int height, unsigned int fps,
+	unsigned int gop_ms);
+void segmenter_close();
+
+#endif
@@ -0,0 +1,211 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "shmout.h"
+#include "output.h"
+#include "frames.h"
+#include "metrics.h"
+
+static char *shm_name = NULL;
+static struct shmout_header_s *hdr = NULL;
+static unsigned char *data = NULL;
+static size_t map_size;
+
+/* Access unit in flight */
+static unsigned long long au_offset;
+static unsigned int au_size;
+static int au_open = 0;
+static int au_skip = 0;
+static int oversize_warned = 0;
+
+static struct {
+	struct metric_s *frames;
+	struct metric_s *bytes;
+	struct metric_s *oversize;
+} shm_metrics;
+
+static int shmout_codeddata(unsigned char *buf, int len, int frame_type)
+{
+	if (!au_open) {
+		au_open = 1;
+		au_offset = hdr->write_reserved;
+		au_size = 0;
+		au_skip = 0;
+	}
+	if (au_skip)
+		return 0;
+
+	/* Readers could never hold it whole */
+	if (au_size + len > hdr->data_size / 2) {
+		au_skip = 1;
+		metrics_add(shm_metrics.oversize, 1);
+		if (!oversize_warned) {
+			oversize_warned = 1;
+			printf("Shared memory access unit larger than half the ring, dropped, increase --shm_size\n");
+		}
+		return 0;
+	}
+
+	/* Claim the space first, so readers can tell what is being overwritten */
+	unsigned long long pos = au_offset + au_size;
+	hdr->write_reserved = pos + len;
+	__sync_synchronize();
+
+	unsigned long long off = pos % hdr->data_size;
+	unsigned long long first = hdr->data_size - off;
+	if (first > (unsigned long long)len)
+		first = len;
+	memcpy(data + off, buf, first);
+	memcpy(data, buf + first, len - first);
+	au_size += len;
+
+	return 0;
+}
+
+static void shmout_frame_complete(int frame_type, unsigned long long pts90k, unsigned long long dts90k)
+{
+	au_open = 0;
+	if (au_skip || !au_size)
+		return;
+
+	unsigned long long nr = hdr->write_nr;
+	struct shmout_slot_s *s = &hdr->slots[nr % SHMOUT_SLOTS];
+
+	s->seq++;
+	__sync_synchronize();
+	s->frame_type = frame_type;
+	s->nr = nr;
+	s->pts90k = pts90k;
+	s->dts90k = dts90k;
+	s->offset = au_offset;
+	s->size = au_size;
+	__sync_synchronize();
+	s->seq++;
+
+	if (frame_type == FRAME_IDR)
+		hdr->last_idr_nr = nr;
+	__sync_synchronize();
+	hdr->write_nr = nr + 1;
+
+	/* Only pay for the wake up when someone is asleep */
+	__sync_fetch_and_add(&hdr->futex, 1);
+	if (hdr->waiters)
+		syscall(SYS_futex, &hdr->futex, FUTEX_WAKE, 0x7fffffff, NULL, NULL, 0);
+
+	metrics_add(shm_metrics.frames, 1);
+	metrics_add(shm_metrics.bytes, au_size);
+}
+
+static struct output_sink_s shmout_sink =
+{
+	.name		= "SHM",
+	.codeddata	= shmout_codeddata,
+	.frame_complete	= shmout_frame_complete,
+};
+
+int shmout_open(char *name, unsigned long long data_size, unsigned int width, unsigned int height,
+	unsigned int fps)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	size_t hdr_size = (sizeof(struct shmout_header_s) + page - 1) & ~(page - 1);
+
+	if (data_size < SHMOUT_DATA_MIN) {
+		fprintf(stderr, "%s() ring of %llu bytes too small, %d minimum\n", __func__, data_size, SHMOUT_DATA_MIN);
+		return -1;
+	}
+
+	shm_name = name;
+	map_size = hdr_size + data_size;
+
+	/* Readers may still have the last one mapped, start afresh */
+	shm_unlink(name);
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "%s() unable to create %s, %s\n", __func__, name, strerror(errno));
+		return -1;
+	}
+	if (ftruncate(fd, map_size) < 0) {
+		fprintf(stderr, "%s() unable to size %s, %s\n", __func__, name, strerror(errno));
+		close(fd);
+		shmout_close();
+		return -1;
+	}
+
+	void *p = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		fprintf(stderr, "%s() unable to map %s, %s\n", __func__, name, strerror(errno));
+		shmout_close();
+		return -1;
+	}
+	hdr = p;
+	data = (unsigned char *)p + hdr_size;
+
+	hdr->slot_count = SHMOUT_SLOTS;
+	hdr->data_offset = hdr_size;
+	hdr->data_size = data_size;
+	hdr->width = width;
+	hdr->height = height;
+	hdr->fps = fps;
+	hdr->version = SHMOUT_VERSION;
+	__sync_synchronize();
+	hdr->magic = SHMOUT_MAGIC;
+
+	au_open = 0;
+	oversize_warned = 0;
+
+	shm_metrics.frames = metrics_register("shm_frames", METRIC_COUNTER);
+	shm_metrics.bytes = metrics_register("shm_bytes", METRIC_COUNTER);
+	shm_metrics.oversize = metrics_register("shm_oversize", METRIC_COUNTER);
+
+	printf("Publishing access units to shared memory %s, %llu MB\n", name, data_size / 1048576);
+
+	return output_register(&shmout_sink);
+}
+
+void shmout_close()
+{
+	output_unregister(&shmout_sink);
+
+	if (hdr) {
+		/* Readers see the magic go, then the name */
+		hdr->magic = 0;
+		munmap(hdr, map_size);
+		hdr = NULL;
+		data = NULL;
+	}
+	if (shm_name) {
+		shm_unlink(shm_name);
+		shm_name = NULL;
+	}
+}
@@ -0,0 +1,143 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef SHMOUT_H
+#define SHMOUT_H
+
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+/* Publishes coded access units into a POSIX shared memory ring for readers
+ * on the same host, without packetisation or a syscall per frame. There
+ * is a single writer (the encoder) and any number of readers, none of
+ * which take a lock or write to the ring, other than the waiter count.
+ *
+ * The object is a shmout_header_s, SHMOUT_SLOTS descriptors and then the
+ * data area. Access unit N is described by slot N % SHMOUT_SLOTS under a
+ * seqlock (seq odd while it's rewritten). Its bytes are at offset %
+ * data_size in the data area, possibly wrapping, and are valid as long
+ * as write_reserved - offset <= data_size once they have been copied.
+ * Readers include this header and use shmout_read() / shmout_wait(),
+ * the latter needs the object mapped writable for the waiter count.
+ */
+
+#define SHMOUT_MAGIC		0x48323634	/* "H264" */
+#define SHMOUT_VERSION		1
+#define SHMOUT_SLOTS		1024
+#define SHMOUT_DATA_MIN		1048576		/* Bytes, an AU may use up to half */
+#define SHMOUT_DEFAULT_NAME	"/h264encoder"
+
+struct shmout_slot_s
+{
+	volatile unsigned int seq;
+	unsigned int frame_type;	/* FRAME_P, FRAME_B, FRAME_I or FRAME_IDR */
+	unsigned long long nr;		/* Access unit number, slot = nr % SHMOUT_SLOTS */
+	unsigned long long pts90k;
+	unsigned long long dts90k;
+	unsigned long long offset;	/* Absolute byte position of the data */
+	unsigned int size;
+	unsigned int reserved;
+};
+
+struct shmout_header_s
+{
+	unsigned int magic;
+	unsigned int version;
+	unsigned int slot_count;
+	unsigned int data_offset;	/* From the start of the object, page aligned */
+	unsigned long long data_size;
+	unsigned int width, height, fps;
+
+	volatile unsigned long long write_nr;		/* Access units published */
+	volatile unsigned long long write_reserved;	/* Bytes handed to the writer, past the last AU */
+	volatile unsigned long long last_idr_nr;	/* For readers joining or recovering */
+	volatile int futex;				/* Bumped per access unit */
+	volatile int waiters;
+
+	struct shmout_slot_s slots[SHMOUT_SLOTS];
+};
+
+/* Copy access unit nr into dst. Returns its size, 0 when it hasn't been
+ * published yet, -1 when it has been overwritten (skip to last_idr_nr) and
+ * -2 when dst is too small.
+ */
+static inline int shmout_read(struct shmout_header_s *h, unsigned long long nr, struct shmout_slot_s *desc,
+	unsigned char *dst, unsigned int dst_size)
+{
+	const unsigned char *data = (const unsigned char *)h + h->data_offset;
+	struct shmout_slot_s *s = &h->slots[nr % SHMOUT_SLOTS];
+	unsigned int seq;
+
+	if (nr >= h->write_nr)
+		return 0;
+
+	do {
+		seq = s->seq;
+		__sync_synchronize();
+		*desc = *s;
+		__sync_synchronize();
+	} while ((seq & 1) || (seq != s->seq));
+
+	if (desc->nr != nr)
+		return -1;
+	if (desc->size > dst_size)
+		return -2;
+
+	unsigned long long off = desc->offset % h->data_size;
+	unsigned long long first = h->data_size - off;
+	if (first > desc->size)
+		first = desc->size;
+	memcpy(dst, data + off, first);
+	memcpy(dst + first, data, desc->size - first);
+
+	/* The writer may have lapped us during the copy */
+	__sync_synchronize();
+	if (h->write_reserved - desc->offset > h->data_size)
+		return -1;
+
+	return desc->size;
+}
+
+/* Sleep until access unit nr is published, or timeout_ms passes. */
+static inline void shmout_wait(struct shmout_header_s *h, unsigned long long nr, int timeout_ms)
+{
+	struct timespec ts = { timeout_ms / 1000, (timeout_ms % 1000) * 1000000 };
+
+	__sync_fetch_and_add(&h->waiters, 1);
+	int f = h->futex;
+	if (nr >= h->write_nr)
+		syscall(SYS_futex, &h->futex, FUTEX_WAIT, f, &ts, NULL, 0);
+	__sync_fetch_and_sub(&h->waiters, 1);
+}
+
+/* Writer, the encoder */
+int  shmout_open(char *name, unsigned long long data_size, unsigned int width, unsigned int height,
+	unsigned int fps);
+void shmout_close();
+
+#endif
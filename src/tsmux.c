@@ -0,0 +1,436 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tsmux.h"
+
+#define PCR_HZ 27000000ULL
+#define PCR_WRAP (0x200000000ULL * 300)
+
+static unsigned int crc32_mpeg(const unsigned char *p, int len)
+{
+	unsigned int crc = 0xffffffff;
+
+	while (len--) {
+		crc ^= *p++ << 24;
+		for (int i = 0; i < 8; i++)
+			crc = crc & 0x80000000 ? (crc << 1) ^ 0x04c11db7 : crc << 1;
+	}
+
+	return crc;
+}
+
+/* A complete PSI section (less CRC) in a single packet, the CRC is appended
+ * and the remainder stuffed. The continuity counter is patched on output.
+ */
+static void tsmux_psi_packet(unsigned char *pkt, unsigned short pid, const unsigned char *section, int len)
+{
+	unsigned int crc = crc32_mpeg(section, len);
+
+	memset(pkt, 0xff, TSMUX_PACKET_SIZE);
+	pkt[0] = 0x47;
+	pkt[1] = 0x40 | (pid >> 8);	/* payload_unit_start */
+	pkt[2] = pid;
+	pkt[3] = 0x10;
+	pkt[4] = 0;			/* pointer_field */
+	memcpy(pkt + 5, section, len);
+	pkt[5 + len + 0] = crc >> 24;
+	pkt[5 + len + 1] = crc >> 16;
+	pkt[5 + len + 2] = crc >> 8;
+	pkt[5 + len + 3] = crc;
+}
+
+static void tsmux_build_psi(struct tsmux_ctx_s *ctx)
+{
+	const unsigned char pat[] = {
+		0x00, 0xb0, 13,			/* table_id, section_length */
+		0x00, 0x01,			/* transport_stream_id */
+		0xc1, 0x00, 0x00,		/* version 0, current, section 0 of 0 */
+		0x00, 0x01,			/* program_number */
+		0xe0 | (TSMUX_PID_PMT >> 8), TSMUX_PID_PMT & 0xff,
+	};
+	const unsigned char pmt[] = {
+		0x02, 0xb0, 18,			/* table_id, section_length */
+		0x00, 0x01,			/* program_number */
+		0xc1, 0x00, 0x00,		/* version 0, current, section 0 of 0 */
+		0xe0 | (TSMUX_PID_VIDEO >> 8), TSMUX_PID_VIDEO & 0xff,	/* PCR_PID */
+		0xf0, 0x00,			/* program_info_length */
+		0x1b,				/* H.264 */
+		0xe0 | (TSMUX_PID_VIDEO >> 8), TSMUX_PID_VIDEO & 0xff,
+		0xf0, 0x00,			/* ES_info_length */
+	};
+
+	tsmux_psi_packet(ctx->pat, TSMUX_PID_PAT, pat, sizeof(pat));
+	tsmux_psi_packet(ctx->pmt, TSMUX_PID_PMT, pmt, sizeof(pmt));
+}
+
+int tsmux_alloc(struct tsmux_ctx_s *ctx, unsigned int mux_rate, unsigned int pcr_interval_ms,
+	void (*output)(void *priv, unsigned char *pkts, int len), void *priv)
+{
+	memset(ctx, 0, sizeof(*ctx));
+
+	ctx->out = malloc(TSMUX_OUTPUT_PACKETS * TSMUX_PACKET_SIZE);
+	ctx->seg_max = 64;
+	ctx->segs = malloc(ctx->seg_max * sizeof(struct tsmux_segment_s));
+	if (!ctx->out || !ctx->segs) {
+		tsmux_free(ctx);
+		return -1;
+	}
+
+	ctx->mux_rate = mux_rate;
+	ctx->pcr_interval90k = (pcr_interval_ms ? pcr_interval_ms : 40) * 90;
+	ctx->psi_interval90k = 100 * 90;
+	ctx->frame_duration90k = 90000 / 30;
+	ctx->output = output;
+	ctx->priv = priv;
+
+	/* Segment 0 is reserved for the PES header */
+	ctx->seg_count = 1;
+
+	tsmux_build_psi(ctx);
+
+	return 0;
+}
+
+void tsmux_free(struct tsmux_ctx_s *ctx)
+{
+	free(ctx->out);
+	free(ctx->segs);
+	ctx->out = NULL;
+	ctx->segs = NULL;
+}
+
+int tsmux_write_es(struct tsmux_ctx_s *ctx, unsigned char *buf, int len)
+{
+	if (ctx->seg_count == ctx->seg_max) {
+		struct tsmux_segment_s *s = realloc(ctx->segs, ctx->seg_max * 2 * sizeof(*s));
+		if (!s)
+			return -1;
+		ctx->segs = s;
+		ctx->seg_max *= 2;
+	}
+
+	ctx->segs[ctx->seg_count].buf = buf;
+	ctx->segs[ctx->seg_count].len = len;
+	ctx->seg_count++;
+	ctx->es_len += len;
+
+	return 0;
+}
+
+static void tsmux_flush(struct tsmux_ctx_s *ctx)
+{
+	if (ctx->out_count)
+		ctx->output(ctx->priv, ctx->out, ctx->out_count * TSMUX_PACKET_SIZE);
+	ctx->out_count = 0;
+}
+
+/* The PCR of the next packet to be written. CBR follows the packet clock,
+ * VBR spreads the packets of each access unit across one frame interval.
+ */
+static unsigned long long tsmux_pcr(struct tsmux_ctx_s *ctx)
+{
+	if (ctx->mux_rate) {
+		unsigned long long bits = ctx->cbr_packets * TSMUX_PACKET_SIZE * 8;
+		return ctx->cbr_origin + (bits / ctx->mux_rate) * PCR_HZ +
+			((bits % ctx->mux_rate) * PCR_HZ) / ctx->mux_rate;
+	}
+
+	return ctx->au_pcr + ctx->au_packet * ctx->au_pcr_step;
+}
+
+/* a - b for PCRs, which wrap with the 33 bit base */
+static long long tsmux_pcr_diff(unsigned long long a, unsigned long long b)
+{
+	long long d = (long long)(a % PCR_WRAP) - (long long)(b % PCR_WRAP);
+
+	if (d >= (long long)(PCR_WRAP / 2))
+		d -= PCR_WRAP;
+	if (d < -(long long)(PCR_WRAP / 2))
+		d += PCR_WRAP;
+
+	return d;
+}
+
+static unsigned char *tsmux_next_packet(struct tsmux_ctx_s *ctx)
+{
+	if (ctx->out_count == TSMUX_OUTPUT_PACKETS)
+		tsmux_flush(ctx);
+
+	ctx->packets++;
+	ctx->cbr_packets++;
+	ctx->au_packet++;
+
+	return ctx->out + (ctx->out_count++ * TSMUX_PACKET_SIZE);
+}
+
+static void tsmux_pcr_write(unsigned char *p, unsigned long long pcr)
+{
+	unsigned long long base = (pcr / 300) & 0x1ffffffffULL;
+	unsigned int ext = pcr % 300;
+
+	p[0] = base >> 25;
+	p[1] = base >> 17;
+	p[2] = base >> 9;
+	p[3] = base >> 1;
+	p[4] = ((base & 1) << 7) | 0x7e | (ext >> 8);
+	p[5] = ext;
+}
+
+static int tsmux_pcr_due(struct tsmux_ctx_s *ctx, unsigned long long pcr)
+{
+	return !ctx->have_pcr || (pcr - ctx->last_pcr) >= (ctx->pcr_interval90k * 300ULL);
+}
+
+static void tsmux_psi(struct tsmux_ctx_s *ctx, unsigned long long pcr)
+{
+	unsigned char *p;
+
+	p = tsmux_next_packet(ctx);
+	memcpy(p, ctx->pat, TSMUX_PACKET_SIZE);
+	p[3] = 0x10 | (ctx->cc_pat++ & 0x0f);
+
+	p = tsmux_next_packet(ctx);
+	memcpy(p, ctx->pmt, TSMUX_PACKET_SIZE);
+	p[3] = 0x10 | (ctx->cc_pmt++ & 0x0f);
+
+	ctx->last_psi = pcr;
+}
+
+static void tsmux_null(struct tsmux_ctx_s *ctx)
+{
+	unsigned char *p = tsmux_next_packet(ctx);
+
+	p[0] = 0x47;
+	p[1] = TSMUX_PID_NULL >> 8;
+	p[2] = TSMUX_PID_NULL & 0xff;
+	p[3] = 0x10;
+	memset(p + 4, 0xff, TSMUX_PACKET_SIZE - 4);
+
+	ctx->null_packets++;
+}
+
+/* Adaptation field only, no payload so the continuity counter holds */
+static void tsmux_pcr_only(struct tsmux_ctx_s *ctx, unsigned long long pcr)
+{
+	unsigned char *p = tsmux_next_packet(ctx);
+
+	p[0] = 0x47;
+	p[1] = TSMUX_PID_VIDEO >> 8;
+	p[2] = TSMUX_PID_VIDEO & 0xff;
+	p[3] = 0x20 | ((ctx->cc_video - 1) & 0x0f);
+	p[4] = TSMUX_PACKET_SIZE - 5;
+	p[5] = 0x10;
+	tsmux_pcr_write(p + 6, pcr);
+	memset(p + 12, 0xff, TSMUX_PACKET_SIZE - 12);
+
+	ctx->have_pcr = 1;
+	ctx->last_pcr = pcr;
+}
+
+static void tsmux_timestamp_write(unsigned char *p, int prefix, unsigned long long ts)
+{
+	p[0] = (prefix << 4) | (((ts >> 30) & 0x07) << 1) | 1;
+	p[1] = ts >> 22;
+	p[2] = ((ts >> 14) & 0xfe) | 1;
+	p[3] = ts >> 7;
+	p[4] = ((ts << 1) & 0xfe) | 1;
+}
+
+/* H.222 requires each access unit in a PES to start with an AUD */
+static int tsmux_has_aud(struct tsmux_ctx_s *ctx)
+{
+	unsigned char *p = ctx->segs[1].buf;
+	int len = ctx->segs[1].len;
+
+	if (len >= 5 && p[0] == 0 && p[1] == 0 && p[2] == 0 && p[3] == 1)
+		return (p[4] & 0x1f) == 9;
+	if (len >= 4 && p[0] == 0 && p[1] == 0 && p[2] == 1)
+		return (p[3] & 0x1f) == 9;
+
+	return 0;
+}
+
+void tsmux_frame_complete(struct tsmux_ctx_s *ctx, int random_access,
+	unsigned long long pts90k, unsigned long long dts90k)
+{
+	unsigned char hdr[32];
+	int hdr_len = 0;
+
+	if (ctx->seg_count <= 1)
+		return;
+
+	pts90k &= 0x1ffffffffULL;
+	dts90k &= 0x1ffffffffULL;
+
+	/* The capture interval, used to pace VBR PCRs */
+	if (ctx->last_dts90k && (dts90k > ctx->last_dts90k) && (dts90k - ctx->last_dts90k) < 90000)
+		ctx->frame_duration90k = dts90k - ctx->last_dts90k;
+	ctx->last_dts90k = dts90k;
+
+	/* When the first byte of this access unit should enter the decoder */
+	unsigned long long start = ((dts90k - TSMUX_PCR_DELAY90K) & 0x1ffffffffULL) * 300;
+
+	/* PES header */
+	hdr[hdr_len++] = 0x00;
+	hdr[hdr_len++] = 0x00;
+	hdr[hdr_len++] = 0x01;
+	hdr[hdr_len++] = 0xe0;		/* Video stream 0 */
+	hdr[hdr_len++] = 0x00;		/* Unbounded length */
+	hdr[hdr_len++] = 0x00;
+	hdr[hdr_len++] = 0x84;		/* data_alignment_indicator */
+	if (dts90k != pts90k) {
+		hdr[hdr_len++] = 0xc0;
+		hdr[hdr_len++] = 10;
+		tsmux_timestamp_write(&hdr[hdr_len], 0x3, pts90k);
+		tsmux_timestamp_write(&hdr[hdr_len + 5], 0x1, dts90k);
+		hdr_len += 10;
+	} else {
+		hdr[hdr_len++] = 0x80;
+		hdr[hdr_len++] = 5;
+		tsmux_timestamp_write(&hdr[hdr_len], 0x2, pts90k);
+		hdr_len += 5;
+	}
+	if (!tsmux_has_aud(ctx)) {
+		const unsigned char aud[] = { 0x00, 0x00, 0x00, 0x01, 0x09, 0xf0 };
+		memcpy(&hdr[hdr_len], aud, sizeof(aud));
+		hdr_len += sizeof(aud);
+	}
+	ctx->segs[0].buf = hdr;
+	ctx->segs[0].len = hdr_len;
+
+	int remaining = hdr_len + ctx->es_len;
+
+	if (ctx->mux_rate) {
+		unsigned long long pcr = tsmux_pcr(ctx);
+
+		/* The packet clock counts on, start wraps with the 33 bit DTS.
+		 * Compare them modulo the PCR range and follow the clock from there.
+		 */
+		long long diff = tsmux_pcr_diff(start, pcr);
+
+		/* (Re)start the packet clock on the first frame, after a stall
+		 * we'd otherwise spend seconds padding through, or when the
+		 * timestamps jumped backwards.
+		 */
+		if (!ctx->have_pcr || (diff > (long long)PCR_HZ) || (diff < -(long long)PCR_HZ)) {
+			ctx->cbr_origin = start;
+			ctx->cbr_packets = 0;
+		} else {
+			start = pcr + diff;
+			if (diff < 0)
+				ctx->overflows++;
+		}
+
+		/* Pad up to this access units start time, keeping PCRs flowing */
+		while ((pcr = tsmux_pcr(ctx)) < start) {
+			if (tsmux_pcr_due(ctx, pcr))
+				tsmux_pcr_only(ctx, pcr);
+			else
+				tsmux_null(ctx);
+		}
+	} else {
+		/* Spread the PCRs of this access unit across one frame interval */
+		ctx->au_pcr = start;
+		ctx->au_packet = 0;
+		ctx->au_pcr_step = (ctx->frame_duration90k * 300ULL) / (remaining / 184 + 3);
+	}
+
+	if (random_access || !ctx->have_pcr ||
+		(tsmux_pcr(ctx) - ctx->last_psi) >= (ctx->psi_interval90k * 300ULL))
+		tsmux_psi(ctx, tsmux_pcr(ctx));
+
+	int first = 1;
+	int seg = 0, off = 0;
+	while (remaining) {
+		unsigned long long pcr = tsmux_pcr(ctx);
+		int pcr_flag = tsmux_pcr_due(ctx, pcr) || (first && random_access);
+
+		/* VBR has no packets between access units, don't wait for the next one if
+		 * that would overrun the interval.
+		 */
+		if (first && !ctx->mux_rate &&
+			(pcr + ctx->frame_duration90k * 300ULL - ctx->last_pcr) >= (ctx->pcr_interval90k * 300ULL))
+			pcr_flag = 1;
+		int rai_flag = first && random_access;
+		int af = 0;
+
+		if (pcr_flag || rai_flag)
+			af = 2 + (pcr_flag ? 6 : 0);
+
+		/* Stuff the last packet of the PES via the adaptation field */
+		if (remaining < (184 - af))
+			af += (184 - af) - remaining;
+
+		unsigned char *p = tsmux_next_packet(ctx);
+		p[0] = 0x47;
+		p[1] = (first ? 0x40 : 0x00) | (TSMUX_PID_VIDEO >> 8);
+		p[2] = TSMUX_PID_VIDEO & 0xff;
+		p[3] = (af ? 0x30 : 0x10) | (ctx->cc_video++ & 0x0f);
+
+		if (af) {
+			int used = 1;
+			p[4] = af - 1;
+			if (af > 1) {
+				p[5] = (rai_flag ? 0x40 : 0x00) | (pcr_flag ? 0x10 : 0x00);
+				used++;
+			}
+			if (pcr_flag) {
+				tsmux_pcr_write(p + 6, pcr);
+				used += 6;
+				ctx->have_pcr = 1;
+				ctx->last_pcr = pcr;
+			}
+			memset(p + 4 + used, 0xff, af - used);
+		}
+
+		/* Payload, gathered from the PES header and the encoders buffers */
+		unsigned char *dst = p + 4 + af;
+		int space = 184 - af;
+		remaining -= space;
+		while (space) {
+			int cnt = ctx->segs[seg].len - off;
+			if (cnt > space)
+				cnt = space;
+			memcpy(dst, ctx->segs[seg].buf + off, cnt);
+			dst += cnt;
+			space -= cnt;
+			off += cnt;
+			if (off == ctx->segs[seg].len) {
+				seg++;
+				off = 0;
+			}
+		}
+
+		first = 0;
+	}
+
+	tsmux_flush(ctx);
+
+	ctx->seg_count = 1;
+	ctx->es_len = 0;
+}
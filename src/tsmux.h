@@ -0,0 +1,112 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef TSMUX_H
+#define TSMUX_H
+
+/* A single program MPEG-TS multiplexer for one H.264 stream. Access units
+ * are referenced (not copied) as they arrive from the encoder, then packed
+ * into 188 byte packets in a preallocated buffer when the frame completes.
+ */
+
+#define TSMUX_PACKET_SIZE	188
+#define TSMUX_PID_PAT		0x0000
+#define TSMUX_PID_PMT		0x1000
+#define TSMUX_PID_VIDEO		0x0100
+#define TSMUX_PID_NULL		0x1fff
+
+/* Packets produced before the output callback is called */
+#define TSMUX_OUTPUT_PACKETS	256
+
+/* PCR runs this far behind DTS, the decoders buffering allowance */
+#define TSMUX_PCR_DELAY90K	(90000 / 10)
+
+struct tsmux_segment_s
+{
+	unsigned char *buf;
+	int len;
+};
+
+struct tsmux_ctx_s
+{
+	/* Configuration */
+	unsigned int pcr_interval90k;		/* Max distance between PCRs */
+	unsigned int psi_interval90k;		/* Max distance between PAT/PMT */
+	unsigned int mux_rate;			/* bps, 0 = VBR (no null padding) */
+
+	/* Whole packets are handed downstream, len is a multiple of 188 */
+	void (*output)(void *priv, unsigned char *pkts, int len);
+	void *priv;
+
+	/* Access unit being assembled, references into the encoders buffers */
+	struct tsmux_segment_s *segs;
+	int seg_count;
+	int seg_max;
+	int es_len;
+
+	unsigned char pat[TSMUX_PACKET_SIZE];
+	unsigned char pmt[TSMUX_PACKET_SIZE];
+	unsigned char cc_pat, cc_pmt, cc_video;
+
+	/* Output */
+	unsigned char *out;
+	int out_count;
+
+	/* Timing, in 27MHz PCR units */
+	int have_pcr;
+	unsigned long long last_pcr;
+	unsigned long long last_psi;
+	unsigned long long last_dts90k;
+	unsigned int frame_duration90k;
+
+	/* CBR, the packet clock */
+	unsigned long long cbr_origin;
+	unsigned long long cbr_packets;
+
+	/* VBR, PCRs for the access unit in flight */
+	unsigned long long au_pcr;
+	unsigned long long au_pcr_step;
+	unsigned long long au_packet;
+
+	/* Statistics */
+	unsigned long long packets;
+	unsigned long long null_packets;
+	unsigned long long overflows;		/* AUs that started late, mux_rate too low */
+};
+
+int  tsmux_alloc(struct tsmux_ctx_s *ctx, unsigned int mux_rate, unsigned int pcr_interval_ms,
+	void (*output)(void *priv, unsigned char *pkts, int len), void *priv);
+void tsmux_free(struct tsmux_ctx_s *ctx);
+
+/* Queue annexb data for the current access unit, the buffer must remain
+ * valid until tsmux_frame_complete().
+ */
+int  tsmux_write_es(struct tsmux_ctx_s *ctx, unsigned char *buf, int len);
+
+/* Packetize the access unit and push it downstream. */
+void tsmux_frame_complete(struct tsmux_ctx_s *ctx, int random_access,
+	unsigned long long pts90k, unsigned long long dts90k);
+
+#endif
@@ -0,0 +1,773 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <arpa/inet.h>
+#include <netinet/udp.h>
+#include "udpout.h"
+
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef SO_TXTIME
+#define SO_TXTIME 61
+#define SCM_TXTIME SO_TXTIME
+struct sock_txtime {
+	clockid_t clockid;
+	unsigned int flags;
+};
+#else
+#include <linux/net_tstamp.h>
+#endif
+
+/* Token bucket shaper. When enabled, flushed datagrams are copied into a
+ * ring and released by a dedicated thread at the configured rate, so a
+ * large IDR leaves over the frame interval rather than at line rate.
+ */
+#define SHAPER_RING_SIZE	(8 * 1048576)
+#define SHAPER_ENTRIES		16384
+
+/* With SO_TXTIME datagrams are passed down this far ahead of their launch
+ * time, so thread wakeup jitter no longer reaches the wire.
+ */
+#define SHAPER_TXTIME_LEAD	2000000
+#define SHAPER_TXTIME_MARGIN	500000
+
+struct shaper_entry_s
+{
+	struct udpout_ctx_s *ctx;	/* NULL once the context closes */
+	struct sockaddr_in dst;
+	unsigned int offset;
+	unsigned int len;
+};
+
+static int shaper_running = 0;
+static pthread_t shaper_thread;
+static pthread_mutex_t shaper_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t shaper_send_mutex = PTHREAD_MUTEX_INITIALIZER;	/* Held while sending unlocked */
+static pthread_cond_t shaper_cond;
+static long long shaper_rate;		/* Bytes per second */
+static long long shaper_burst;		/* Bytes */
+static unsigned long long shaper_tau;	/* The burst, in ns at shaper_rate */
+static unsigned long long shaper_tat;	/* Theoretical arrival time */
+static int shaper_txtime = 0;		/* Let the kernel (ETF qdisc) time the release */
+static long long shaper_tai_offset;	/* CLOCK_TAI - CLOCK_MONOTONIC */
+static unsigned char *shaper_ring;
+static unsigned int shaper_wr;
+static struct shaper_entry_s shaper_entries[SHAPER_ENTRIES];
+static unsigned int shaper_head, shaper_tail;	/* Entries queued at head, released from tail */
+static unsigned long long shaper_datagrams, shaper_drops, shaper_max_burst;
+
+static unsigned long long shaper_now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+/* Reserve len contiguous bytes in the ring, NULL when full. Called locked. */
+static unsigned char *shaper_alloc(struct udpout_ctx_s *ctx, struct sockaddr_in *dst, unsigned int len)
+{
+	unsigned int offset;
+
+	if ((shaper_head - shaper_tail) == SHAPER_ENTRIES)
+		return NULL;
+
+	if (shaper_head == shaper_tail) {
+		offset = 0;
+	} else {
+		unsigned int rd = shaper_entries[shaper_tail % SHAPER_ENTRIES].offset;
+		if (shaper_wr >= rd) {
+			if ((shaper_wr + len) <= SHAPER_RING_SIZE)
+				offset = shaper_wr;
+			else if (len < rd)
+				offset = 0;
+			else
+				return NULL;
+		} else {
+			if ((shaper_wr + len) < rd)
+				offset = shaper_wr;
+			else
+				return NULL;
+		}
+	}
+
+	struct shaper_entry_s *e = &shaper_entries[shaper_head++ % SHAPER_ENTRIES];
+	e->ctx = ctx;
+	e->dst = *dst;
+	e->offset = offset;
+	e->len = len;
+	shaper_wr = offset + len;
+
+	return shaper_ring + offset;
+}
+
+/* Copy a datagram (or each segment of a GSO send) into the ring. Called locked. */
+static void shaper_enqueue(struct udpout_ctx_s *ctx, struct msghdr *hdr)
+{
+	unsigned int total = 0, segsize;
+
+	for (unsigned int i = 0; i < hdr->msg_iovlen; i++)
+		total += hdr->msg_iov[i].iov_len;
+
+	segsize = total;
+	if (hdr->msg_control)
+		segsize = *(unsigned short *)CMSG_DATA(CMSG_FIRSTHDR(hdr));
+
+	unsigned int iov = 0, off = 0;
+	while (total) {
+		unsigned int len = total < segsize ? total : segsize;
+		unsigned char *dst = shaper_alloc(ctx, hdr->msg_name, len);
+
+		total -= len;
+		if (!dst)
+			shaper_drops++;
+
+		/* Gather, or skip when dropped */
+		while (len) {
+			unsigned int cnt = hdr->msg_iov[iov].iov_len - off;
+			if (cnt > len)
+				cnt = len;
+			if (dst) {
+				memcpy(dst, (unsigned char *)hdr->msg_iov[iov].iov_base + off, cnt);
+				dst += cnt;
+			}
+			len -= cnt;
+			off += cnt;
+			if (off == hdr->msg_iov[iov].iov_len) {
+				iov++;
+				off = 0;
+			}
+		}
+	}
+}
+
+/* Launch time of a datagram under the token bucket, expressed as a GCRA:
+ * a datagram may leave once the theoretical arrival time is no more than
+ * one bucket ahead of now. Called locked.
+ */
+static unsigned long long shaper_schedule(unsigned long long now)
+{
+	unsigned long long launch = now;
+
+	if (shaper_tat > shaper_tau && (shaper_tat - shaper_tau) > now)
+		launch = shaper_tat - shaper_tau;
+
+	return launch;
+}
+
+static void *shaper_thread_func(void *arg)
+{
+	static struct mmsghdr msgs[UDPOUT_BATCH];
+	static struct iovec iovs[UDPOUT_BATCH];
+	static unsigned char control[UDPOUT_BATCH][CMSG_SPACE(sizeof(unsigned long long))];
+
+	pthread_mutex_lock(&shaper_mutex);
+	while (shaper_running) {
+		if (shaper_head == shaper_tail) {
+			pthread_cond_wait(&shaper_cond, &shaper_mutex);
+			continue;
+		}
+
+		unsigned long long now = shaper_now_ns();
+		struct udpout_ctx_s *ctx = shaper_entries[shaper_tail % SHAPER_ENTRIES].ctx;
+
+		/* Kernel paced sockets are handed datagrams a little ahead of time */
+		unsigned long long horizon = now + ((ctx && ctx->txtime) ? SHAPER_TXTIME_LEAD : 0);
+
+		unsigned long long launch = shaper_schedule(now);
+		if (ctx && launch > horizon) {
+			/* Sleep until the bucket allows the next datagram */
+			unsigned long long wake = launch - (horizon - now);
+			struct timespec ts;
+			ts.tv_sec = wake / 1000000000ULL;
+			ts.tv_nsec = wake % 1000000000ULL;
+			pthread_cond_timedwait(&shaper_cond, &shaper_mutex, &ts);
+			continue;
+		}
+
+		/* Release a batch for one socket, everything due by the horizon */
+		unsigned int count = 0, bytes = 0;
+		while ((shaper_tail + count) != shaper_head && count < UDPOUT_BATCH) {
+			struct shaper_entry_s *e = &shaper_entries[(shaper_tail + count) % SHAPER_ENTRIES];
+			struct msghdr *hdr = &msgs[count].msg_hdr;
+			if (e->ctx != ctx)
+				break;
+
+			if (ctx) {
+				launch = shaper_schedule(now);
+				if (launch > horizon)
+					break;
+			}
+
+			iovs[count].iov_base = shaper_ring + e->offset;
+			iovs[count].iov_len = e->len;
+			memset(hdr, 0, sizeof(struct msghdr));
+			hdr->msg_iov = &iovs[count];
+			hdr->msg_iovlen = 1;
+			count++;
+
+			/* Purged entries are skipped without cost */
+			if (!ctx)
+				continue;
+
+			hdr->msg_name = &e->dst;
+			hdr->msg_namelen = sizeof(e->dst);
+			if (ctx->txtime) {
+				/* The ETF qdisc drops anything already late, keep a margin */
+				unsigned long long txtime = launch;
+				if (txtime < now + SHAPER_TXTIME_MARGIN)
+					txtime = now + SHAPER_TXTIME_MARGIN;
+
+				hdr->msg_control = control[count - 1];
+				hdr->msg_controllen = sizeof(control[0]);
+				struct cmsghdr *cm = CMSG_FIRSTHDR(hdr);
+				cm->cmsg_level = SOL_SOCKET;
+				cm->cmsg_type = SCM_TXTIME;
+				cm->cmsg_len = CMSG_LEN(sizeof(unsigned long long));
+				*(unsigned long long *)CMSG_DATA(cm) = txtime + shaper_tai_offset;
+			}
+
+			if (shaper_tat < launch)
+				shaper_tat = launch;
+			shaper_tat += (e->len * 1000000000ULL) / shaper_rate;
+			bytes += e->len;
+		}
+
+		/* The ring space stays reserved until the send completes */
+		int skt = ctx ? ctx->skt : -1;
+		pthread_mutex_lock(&shaper_send_mutex);
+		pthread_mutex_unlock(&shaper_mutex);
+
+		unsigned int sent = 0;
+		while (skt != -1 && sent < count) {
+			int ret = sendmmsg(skt, &msgs[sent], count - sent, 0);
+			if (ret < 0) {
+				if (errno == EINTR)
+					continue;
+				ctx->errors++;
+				sent++;
+				continue;
+			}
+			for (int i = 0; i < ret; i++)
+				ctx->bytes += msgs[sent + i].msg_len;
+			ctx->datagrams += ret;
+			sent += ret;
+		}
+
+		pthread_mutex_lock(&shaper_mutex);
+		pthread_mutex_unlock(&shaper_send_mutex);
+		shaper_tail += count;
+		shaper_datagrams += count;
+		if (bytes > shaper_max_burst)
+			shaper_max_burst = bytes;
+	}
+	pthread_mutex_unlock(&shaper_mutex);
+
+	return NULL;
+}
+
+int udpout_shaper_init(unsigned int rate, unsigned int burst, int txtime)
+{
+	pthread_condattr_t attr;
+	struct timespec tai, mono;
+
+	if (shaper_running || rate == 0)
+		return 0;
+
+	shaper_ring = malloc(SHAPER_RING_SIZE);
+	if (!shaper_ring)
+		return -1;
+
+	shaper_rate = rate / 8;
+	shaper_burst = burst;
+	if (shaper_burst == 0) {
+		/* Two milliseconds worth, at least a couple of full sized datagrams */
+		shaper_burst = shaper_rate / 500;
+		if (shaper_burst < 3000)
+			shaper_burst = 3000;
+	}
+	shaper_tau = (shaper_burst * 1000000000ULL) / shaper_rate;
+	shaper_tat = 0;
+
+	/* txtimes are on the TAI clock, we schedule on the monotonic one */
+	shaper_txtime = txtime;
+	clock_gettime(CLOCK_TAI, &tai);
+	clock_gettime(CLOCK_MONOTONIC, &mono);
+	shaper_tai_offset = ((tai.tv_sec - mono.tv_sec) * 1000000000LL) + (tai.tv_nsec - mono.tv_nsec);
+	shaper_head = shaper_tail = shaper_wr = 0;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&shaper_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	shaper_running = 1;
+	if (pthread_create(&shaper_thread, NULL, shaper_thread_func, NULL) != 0) {
+		shaper_running = 0;
+		free(shaper_ring);
+		shaper_ring = NULL;
+		return -1;
+	}
+
+	printf("Network output shaped to %u bps, burst %lld bytes%s\n", rate, shaper_burst,
+		shaper_txtime ? ", kernel timed (SO_TXTIME)" : "");
+
+	return 0;
+}
+
+void udpout_shaper_free()
+{
+	if (!shaper_running)
+		return;
+
+	pthread_mutex_lock(&shaper_mutex);
+	shaper_running = 0;
+	pthread_cond_signal(&shaper_cond);
+	pthread_mutex_unlock(&shaper_mutex);
+	pthread_join(shaper_thread, NULL);
+
+	printf("Shaper: %llu datagrams, largest burst %llu bytes, %llu dropped\n",
+		shaper_datagrams, shaper_max_burst, shaper_drops);
+
+	pthread_cond_destroy(&shaper_cond);
+	free(shaper_ring);
+	shaper_ring = NULL;
+}
+
+/* Multicast settings applied to every context, see udpout_multicast() */
+static int mcast_ttl = -1;
+static struct in_addr mcast_if = { INADDR_ANY };
+
+/* Receiver list changes, see udpout_destinations_file(). The file is parsed
+ * on a helper thread, contexts copy the finished list on their next queue.
+ */
+struct destination_s
+{
+	struct in_addr addr;
+	int port;		/* 0 = that of the context */
+};
+static char *destinations_filename = NULL;
+static pthread_t destinations_thread;
+static int destinations_thread_started = 0;
+static sem_t destinations_sem;
+static pthread_mutex_t destinations_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct destination_s destinations[UDPOUT_DESTINATIONS];
+static int destinations_count = 0;
+static int destinations_generation = 0;
+
+void udpout_multicast(int ttl, char *ifaddress)
+{
+	mcast_ttl = ttl;
+	if (ifaddress && (inet_aton(ifaddress, &mcast_if) == 0))
+		fprintf(stderr, "%s() invalid interface address %s\n", __func__, ifaddress);
+}
+
+static int udpout_parse(struct sockaddr_in *sa, char *ipaddress, int port)
+{
+	memset(sa, 0, sizeof(*sa));
+	sa->sin_family = AF_INET;
+	sa->sin_port = htons(port);
+	if ((port < 1) || (port > 65535) || (inet_aton(ipaddress, &sa->sin_addr) == 0)) {
+		fprintf(stderr, "%s() invalid address %s:%d\n", __func__, ipaddress, port);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Called with dst_mutex held */
+static int udpout_insert_destination(struct udpout_ctx_s *ctx, struct sockaddr_in *sa)
+{
+	for (unsigned int i = 0; i < ctx->dst_count; i++) {
+		if ((ctx->dst[i].sin_addr.s_addr == sa->sin_addr.s_addr) && (ctx->dst[i].sin_port == sa->sin_port))
+			return 0;
+	}
+	if (ctx->dst_count == UDPOUT_DESTINATIONS) {
+		fprintf(stderr, "%s() too many destinations, ignoring %s:%d\n", __func__,
+			inet_ntoa(sa->sin_addr), ntohs(sa->sin_port));
+		return -1;
+	}
+
+	/* Socket wide, they only affect multicast sends */
+	if (IN_MULTICAST(ntohl(sa->sin_addr.s_addr)) && ctx->skt != -1) {
+		if ((mcast_ttl >= 0) &&
+			(setsockopt(ctx->skt, IPPROTO_IP, IP_MULTICAST_TTL, &mcast_ttl, sizeof(mcast_ttl)) < 0))
+			fprintf(stderr, "%s() setting multicast ttl, %s\n", __func__, strerror(errno));
+		if ((mcast_if.s_addr != INADDR_ANY) &&
+			(setsockopt(ctx->skt, IPPROTO_IP, IP_MULTICAST_IF, &mcast_if, sizeof(mcast_if)) < 0))
+			fprintf(stderr, "%s() setting multicast interface, %s\n", __func__, strerror(errno));
+	}
+
+	ctx->dst[ctx->dst_count++] = *sa;
+
+	return 0;
+}
+
+int udpout_destinations_get(struct udpout_ctx_s *ctx, struct sockaddr_in *dst, int max)
+{
+	pthread_mutex_lock(&ctx->dst_mutex);
+	int count = ctx->dst_count < (unsigned int)max ? (int)ctx->dst_count : max;
+	memcpy(dst, ctx->dst, count * sizeof(*dst));
+	pthread_mutex_unlock(&ctx->dst_mutex);
+
+	return count;
+}
+
+/* Parse the receivers file, one "a.b.c.d[:port]" per line, into the shared
+ * list. Runs at startup and then on the helper thread, never on the
+ * encoders.
+ */
+static void udpout_destinations_parse()
+{
+	struct destination_s list[UDPOUT_DESTINATIONS];
+	char line[128], ipaddress[64];
+	struct in_addr addr;
+	int count = 0, port;
+
+	FILE *fh = fopen(destinations_filename, "r");
+	if (!fh) {
+		fprintf(stderr, "%s() unable to open %s\n", __func__, destinations_filename);
+		return;
+	}
+
+	while (fgets(line, sizeof(line), fh)) {
+		if (line[0] == '#')
+			continue;
+
+		port = 0;
+		if (sscanf(line, "%63[0-9.]:%d", ipaddress, &port) < 1)
+			continue;
+		if ((port < 0) || (port > 65535) || (inet_aton(ipaddress, &addr) == 0)) {
+			fprintf(stderr, "%s() invalid address %s\n", __func__, line);
+			continue;
+		}
+		if (count == UDPOUT_DESTINATIONS) {
+			fprintf(stderr, "%s() too many destinations, ignoring %s\n", __func__, ipaddress);
+			continue;
+		}
+		list[count].addr = addr;
+		list[count++].port = port;
+	}
+	fclose(fh);
+
+	/* Swap in the finished list */
+	pthread_mutex_lock(&destinations_mutex);
+	memcpy(destinations, list, count * sizeof(list[0]));
+	destinations_count = count;
+	__sync_add_and_fetch(&destinations_generation, 1);
+	pthread_mutex_unlock(&destinations_mutex);
+}
+
+static void *udpout_destinations_thread(void *arg)
+{
+	for (;;) {
+		if (sem_wait(&destinations_sem) < 0)
+			continue;
+		udpout_destinations_parse();
+	}
+
+	return NULL;
+}
+
+void udpout_destinations_file(char *filename)
+{
+	destinations_filename = filename;
+	udpout_destinations_parse();
+
+	if (destinations_thread_started)
+		return;
+	sem_init(&destinations_sem, 0, 0);
+	if (pthread_create(&destinations_thread, NULL, udpout_destinations_thread, NULL) != 0) {
+		fprintf(stderr, "%s() unable to start the reload thread\n", __func__);
+		return;
+	}
+	pthread_detach(destinations_thread);
+	destinations_thread_started = 1;
+}
+
+void udpout_destinations_reload()
+{
+	/* Signal safe, the helper thread re-reads the file */
+	if (destinations_thread_started)
+		sem_post(&destinations_sem);
+}
+
+/* Replace the additional receivers with the last list parsed, ports
+ * defaulting to that of the context. Called by the thread sending, so
+ * the batch is flushed first, queued datagrams point into dst[].
+ */
+static void udpout_destinations_apply(struct udpout_ctx_s *ctx)
+{
+	if (ctx->count)
+		udpout_flush(ctx);
+
+	pthread_mutex_lock(&destinations_mutex);
+	ctx->generation = destinations_generation;
+	if (!destinations_filename) {
+		pthread_mutex_unlock(&destinations_mutex);
+		return;
+	}
+
+	pthread_mutex_lock(&ctx->dst_mutex);
+	ctx->dst_count = 1;
+	for (int i = 0; i < destinations_count; i++) {
+		struct sockaddr_in sa;
+		memset(&sa, 0, sizeof(sa));
+		sa.sin_family = AF_INET;
+		sa.sin_addr = destinations[i].addr;
+		sa.sin_port = destinations[i].port ? htons(destinations[i].port) : ctx->dst[0].sin_port;
+		udpout_insert_destination(ctx, &sa);
+	}
+	int count = ctx->dst_count;
+	pthread_mutex_unlock(&ctx->dst_mutex);
+	pthread_mutex_unlock(&destinations_mutex);
+
+	printf("%s() port %d, %d destinations\n", __func__, ntohs(ctx->dst[0].sin_port), count);
+}
+
+int udpout_open(struct udpout_ctx_s *ctx, char *ipaddress, int port, int dscp, int sndbuf)
+{
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->skt = -1;
+	pthread_mutex_init(&ctx->dst_mutex, NULL);
+
+	if (!ipaddress || (port < 1) || (port > 65535))
+		return -1;
+
+	ctx->skt = socket(AF_INET, SOCK_DGRAM, 0);
+	if (ctx->skt < 0) {
+		fprintf(stderr, "%s() socket() failed, %s\n", __func__, strerror(errno));
+		return -1;
+	}
+
+	/* The primary destination, the file's receivers follow it */
+	struct sockaddr_in sa;
+	if (udpout_parse(&sa, ipaddress, port) < 0) {
+		udpout_close(ctx);
+		return -1;
+	}
+	pthread_mutex_lock(&ctx->dst_mutex);
+	udpout_insert_destination(ctx, &sa);
+	pthread_mutex_unlock(&ctx->dst_mutex);
+
+	if (sndbuf > 0) {
+		if (setsockopt(ctx->skt, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf)) < 0) {
+			fprintf(stderr, "%s() setting SO_SNDBUF, %s\n", __func__, strerror(errno));
+			udpout_close(ctx);
+			return -1;
+		}
+	}
+
+	if (dscp > 0) {
+		/* DSCP is the upper six bits of the TOS byte */
+		int tos = dscp << 2;
+		if (setsockopt(ctx->skt, IPPROTO_IP, IP_TOS, &tos, sizeof(tos)) < 0) {
+			fprintf(stderr, "%s() setting dscp, %s\n", __func__, strerror(errno));
+			udpout_close(ctx);
+			return -1;
+		}
+	}
+
+	/* Segmentation offload, Linux 4.18 onwards */
+	int seg = 0;
+	if (setsockopt(ctx->skt, SOL_UDP, UDP_SEGMENT, &seg, sizeof(seg)) == 0)
+		ctx->gso = 1;
+
+	/* Timed transmit, Linux 4.19 onwards. The shaper paces in user space without it */
+	if (shaper_running && shaper_txtime) {
+		struct sock_txtime cfg = { .clockid = CLOCK_TAI, .flags = 0 };
+		if (setsockopt(ctx->skt, SOL_SOCKET, SO_TXTIME, &cfg, sizeof(cfg)) == 0)
+			ctx->txtime = 1;
+		else
+			fprintf(stderr, "%s() SO_TXTIME unavailable, %s, pacing in user space\n",
+				__func__, strerror(errno));
+	}
+
+	udpout_destinations_apply(ctx);
+
+	return 0;
+}
+
+int udpout_path_mtu(struct udpout_ctx_s *ctx)
+{
+	int mtu = -1;
+	socklen_t len = sizeof(mtu);
+
+	/* IP_MTU needs a connected socket, our own is not */
+	int skt = socket(AF_INET, SOCK_DGRAM, 0);
+	if (skt < 0)
+		return -1;
+
+	if ((connect(skt, (struct sockaddr *)&ctx->dst[0], sizeof(ctx->dst[0])) < 0) ||
+		(getsockopt(skt, IPPROTO_IP, IP_MTU, &mtu, &len) < 0))
+		mtu = -1;
+
+	close(skt);
+	return mtu;
+}
+
+void udpout_close(struct udpout_ctx_s *ctx)
+{
+	/* Anything still waiting in the shaper is discarded */
+	if (shaper_running) {
+		pthread_mutex_lock(&shaper_mutex);
+		for (unsigned int i = shaper_tail; i != shaper_head; i++) {
+			if (shaper_entries[i % SHAPER_ENTRIES].ctx == ctx)
+				shaper_entries[i % SHAPER_ENTRIES].ctx = NULL;
+		}
+		pthread_mutex_unlock(&shaper_mutex);
+
+		/* Wait out a send that may be using our socket */
+		pthread_mutex_lock(&shaper_send_mutex);
+		pthread_mutex_unlock(&shaper_send_mutex);
+	}
+
+	if (ctx->skt != -1) {
+		close(ctx->skt);
+		ctx->skt = -1;
+	}
+	ctx->count = 0;
+}
+
+/* One message per destination, all sharing the callers iovecs */
+static int udpout_queue_all(struct udpout_ctx_s *ctx, struct iovec *iov, int iovcnt, int segsize)
+{
+	if (ctx->skt == -1)
+		return -1;
+
+	if (ctx->generation != __atomic_load_n(&destinations_generation, __ATOMIC_ACQUIRE))
+		udpout_destinations_apply(ctx);
+
+	for (unsigned int i = 0; i < ctx->dst_count; i++) {
+		if (ctx->count == UDPOUT_BATCH)
+			udpout_flush(ctx);
+
+		struct msghdr *hdr = &ctx->msgs[ctx->count].msg_hdr;
+		memset(hdr, 0, sizeof(*hdr));
+		hdr->msg_name = &ctx->dst[i];
+		hdr->msg_namelen = sizeof(ctx->dst[i]);
+		hdr->msg_iov = iov;
+		hdr->msg_iovlen = iovcnt;
+
+		if (segsize) {
+			hdr->msg_control = ctx->control[ctx->count];
+			hdr->msg_controllen = CMSG_SPACE(sizeof(unsigned short));
+
+			struct cmsghdr *cm = CMSG_FIRSTHDR(hdr);
+			cm->cmsg_level = SOL_UDP;
+			cm->cmsg_type = UDP_SEGMENT;
+			cm->cmsg_len = CMSG_LEN(sizeof(unsigned short));
+			*(unsigned short *)CMSG_DATA(cm) = segsize;
+		}
+
+		ctx->count++;
+	}
+
+	return 0;
+}
+
+int udpout_queue(struct udpout_ctx_s *ctx, struct iovec *iov, int iovcnt)
+{
+	return udpout_queue_all(ctx, iov, iovcnt, 0);
+}
+
+int udpout_queue_segmented(struct udpout_ctx_s *ctx, struct iovec *iov, int iovcnt, int segsize)
+{
+	return udpout_queue_all(ctx, iov, iovcnt, segsize);
+}
+
+int udpout_send(struct udpout_ctx_s *ctx, struct sockaddr_in *dst, void *buf, int len)
+{
+	if (ctx->skt == -1)
+		return -1;
+
+	if (shaper_running) {
+		pthread_mutex_lock(&shaper_mutex);
+		if (shaper_head == shaper_tail)
+			pthread_cond_signal(&shaper_cond);
+		unsigned char *p = shaper_alloc(ctx, dst, len);
+		if (p)
+			memcpy(p, buf, len);
+		else
+			shaper_drops++;
+		pthread_mutex_unlock(&shaper_mutex);
+
+		return p ? len : -1;
+	}
+
+	return sendto(ctx->skt, buf, len, 0, (struct sockaddr *)dst, sizeof(*dst));
+}
+
+int udpout_flush(struct udpout_ctx_s *ctx)
+{
+	unsigned int sent = 0;
+
+	if (shaper_running) {
+		pthread_mutex_lock(&shaper_mutex);
+		if (shaper_head == shaper_tail)
+			pthread_cond_signal(&shaper_cond);
+		for (sent = 0; sent < ctx->count; sent++)
+			shaper_enqueue(ctx, &ctx->msgs[sent].msg_hdr);
+		pthread_mutex_unlock(&shaper_mutex);
+
+		ctx->count = 0;
+		return sent;
+	}
+
+	while (sent < ctx->count) {
+		int ret = sendmmsg(ctx->skt, &ctx->msgs[sent], ctx->count - sent, 0);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+
+			/* Drop the datagram that failed, keep going with the rest */
+			fprintf(stderr, "%s() sendmmsg failed, %s\n", __func__, strerror(errno));
+			ctx->errors++;
+			sent++;
+			continue;
+		}
+
+		for (int i = 0; i < ret; i++)
+			ctx->bytes += ctx->msgs[sent + i].msg_len;
+		ctx->datagrams += ret;
+		sent += ret;
+	}
+
+	ctx->count = 0;
+	return sent;
+}
@@ -0,0 +1,123 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef UDPOUT_H
+#define UDPOUT_H
+
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+
+/* UDP transmit context shared by the network outputs. Datagrams are
+ * described by iovecs pointing at the callers buffers (headers and coded
+ * data), queued, then sent in batches with sendmmsg(). The iovecs and the
+ * memory they describe must remain valid until udpout_flush().
+ */
+
+#define UDPOUT_BATCH 1024	/* Max datagrams per sendmmsg(), UIO_MAXIOV */
+#define UDPOUT_GSO_SEGMENTS 64	/* Kernel limit on segments per GSO send */
+#define UDPOUT_CONTROL 64	/* Ancillary data space per datagram */
+#define UDPOUT_DESTINATIONS 32	/* Receivers per context, each gets every datagram */
+
+struct udpout_ctx_s
+{
+	int skt;
+
+	/* dst[0] is the primary, given at open. Every queued datagram is sent
+	 * to each destination within the same sendmmsg().
+	 */
+	struct sockaddr_in dst[UDPOUT_DESTINATIONS];
+	unsigned int dst_count;
+	int generation;
+	pthread_mutex_t dst_mutex;	/* Held while dst changes, see udpout_destinations_get() */
+
+	int gso;		/* Kernel supports UDP_SEGMENT */
+	int txtime;		/* Shaped datagrams carry an SO_TXTIME launch time */
+
+	struct mmsghdr msgs[UDPOUT_BATCH];
+	unsigned char control[UDPOUT_BATCH][UDPOUT_CONTROL];
+	unsigned int count;
+
+	/* Statistics */
+	unsigned long long datagrams;
+	unsigned long long bytes;
+	unsigned long long errors;
+};
+
+int  udpout_open(struct udpout_ctx_s *ctx, char *ipaddress, int port, int dscp, int sndbuf);
+void udpout_close(struct udpout_ctx_s *ctx);
+
+/* Multicast destinations get this TTL and interface, call before any open. */
+void udpout_multicast(int ttl, char *ifaddress);
+
+/* Copy of the destinations, primary first, for threads other than the one
+ * sending. Returns the count.
+ */
+int  udpout_destinations_get(struct udpout_ctx_s *ctx, struct sockaddr_in *dst, int max);
+
+/* Every context also sends to the receivers listed in filename, one
+ * "a.b.c.d[:port]" per line. Reload is async signal safe, a helper thread
+ * re-reads the file and the contexts pick up the new list before their
+ * next datagram.
+ */
+void udpout_destinations_file(char *filename);
+void udpout_destinations_reload();
+
+/* Add a datagram to the batch (once per destination), flushing first if the
+ * batch is full.
+ */
+int  udpout_queue(struct udpout_ctx_s *ctx, struct iovec *iov, int iovcnt);
+
+/* As above but the kernel splits the payload into segsize byte datagrams
+ * (UDP GSO), at most UDPOUT_GSO_SEGMENTS of them. Only valid when ctx->gso.
+ */
+int  udpout_queue_segmented(struct udpout_ctx_s *ctx, struct iovec *iov, int iovcnt, int segsize);
+
+/* MTU of the route to the destination, or < 0 if unknown. */
+int  udpout_path_mtu(struct udpout_ctx_s *ctx);
+
+/* Transmit everything queued, datagrams that fail are counted and dropped.
+ * With the shaper running the datagrams are copied and sent later.
+ */
+int  udpout_flush(struct udpout_ctx_s *ctx);
+
+/* A single datagram to one destination, from any thread. Goes through the
+ * shaper when it is running, the buffer is copied before returning.
+ * Not counted in the context statistics.
+ */
+int  udpout_send(struct udpout_ctx_s *ctx, struct sockaddr_in *dst, void *buf, int len);
+
+/* Optional token bucket shaper in front of every context, rate in bps,
+ * burst in bytes (0 = 2ms worth). GSO sends are shaped as their segments.
+ * With txtime, contexts opened afterwards stamp each datagram with its
+ * launch time (SO_TXTIME) for an ETF qdisc, for example:
+ *   tc qdisc replace dev eth0 root etf clockid CLOCK_TAI delta 500000
+ */
+int  udpout_shaper_init(unsigned int rate, unsigned int burst, int txtime);
+void udpout_shaper_free();
+
+#endif
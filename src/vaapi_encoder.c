@@ -109,6 +109,7 @@ static unsigned int frame_height_mbaligned;
 static unsigned long long current_frame_encoding = 0;
 static unsigned long long current_frame_display = 0;
 static unsigned long long current_IDR_display = 0;
+static unsigned long long current_GOP_encoding = 0;	/* Encode order of the last forced IDR */
 static unsigned int current_frame_num = 0;
 static int current_frame_type;
 
@@ -117,6 +118,7 @@ static int current_frame_type;
 
 static int misc_priv_type = 0;
 static int misc_priv_value = 0;
+static int rc_update = 0;	/* Bitrate changed, resend rate control with the next frame */
 
 #define MIN(a, b) ((a)>(b)?(b):(a))
 #define MAX(a, b) ((a)>(b)?(a):(b))
@@ -1333,13 +1335,50 @@ static int update_RefPicList(void)
 	return 0;
 }
 
-static int render_sequence(struct encoder_params_s *params)
+/* Rate control parameters, with every sequence and whenever the target
+ * bitrate changes mid sequence.
+ */
+static int render_ratecontrol(struct encoder_params_s *params)
 {
-	VABufferID seq_param_buf, rc_param_buf, misc_param_tmpbuf, render_id[2];
+	VABufferID rc_param_buf;
 	VAStatus va_status;
-	VAEncMiscParameterBuffer *misc_param, *misc_param_tmp;
+	VAEncMiscParameterBuffer *misc_param;
 	VAEncMiscParameterRateControl *misc_rate_ctrl;
 
+	va_status = vaCreateBuffer(va_dpy, context_id,
+				   VAEncMiscParameterBufferType,
+				   sizeof(VAEncMiscParameterBuffer) +
+				   sizeof(VAEncMiscParameterRateControl), 1,
+				   NULL, &rc_param_buf);
+	CHECK_VASTATUS(va_status, "vaCreateBuffer");
+
+	vaMapBuffer(va_dpy, rc_param_buf, (void **)&misc_param);
+	misc_param->type = VAEncMiscParameterTypeRateControl;
+	misc_rate_ctrl = (VAEncMiscParameterRateControl *) misc_param->data;
+	memset(misc_rate_ctrl, 0, sizeof(*misc_rate_ctrl));
+	misc_rate_ctrl->bits_per_second = params->frame_bitrate;
+	misc_rate_ctrl->target_percentage = 66;
+	misc_rate_ctrl->window_size = 1000;
+	misc_rate_ctrl->initial_qp = params->initial_qp;
+	misc_rate_ctrl->min_qp = params->minimal_qp;
+	misc_rate_ctrl->basic_unit_size = 0;
+	vaUnmapBuffer(va_dpy, rc_param_buf);
+
+	va_status = vaRenderPicture(va_dpy, context_id, &rc_param_buf, 1);
+	CHECK_VASTATUS(va_status, "vaRenderPicture");
+
+	vaDestroyBuffer(va_dpy, rc_param_buf);
+	rc_update = 0;
+
+	return 0;
+}
+
+static int render_sequence(struct encoder_params_s *params)
+{
+	VABufferID seq_param_buf, misc_param_tmpbuf;
+	VAStatus va_status;
+	VAEncMiscParameterBuffer *misc_param_tmp;
+
 	seq_param.level_idc = params->level_idc;
 	seq_param.picture_width_in_mbs = frame_width_mbaligned / 16;
 	seq_param.picture_height_in_mbs = frame_height_mbaligned / 16;
@@ -1378,31 +1417,11 @@ static int render_sequence(struct encoder_params_s *params)
 				   &seq_param_buf);
 	CHECK_VASTATUS(va_status, "vaCreateBuffer");
 
-	va_status = vaCreateBuffer(va_dpy, context_id,
-				   VAEncMiscParameterBufferType,
-				   sizeof(VAEncMiscParameterBuffer) +
-				   sizeof(VAEncMiscParameterRateControl), 1,
-				   NULL, &rc_param_buf);
-	CHECK_VASTATUS(va_status, "vaCreateBuffer");
-
-	vaMapBuffer(va_dpy, rc_param_buf, (void **)&misc_param);
-	misc_param->type = VAEncMiscParameterTypeRateControl;
-	misc_rate_ctrl = (VAEncMiscParameterRateControl *) misc_param->data;
-	memset(misc_rate_ctrl, 0, sizeof(*misc_rate_ctrl));
-	misc_rate_ctrl->bits_per_second = params->frame_bitrate;
-	misc_rate_ctrl->target_percentage = 66;
-	misc_rate_ctrl->window_size = 1000;
-	misc_rate_ctrl->initial_qp = params->initial_qp;
-	misc_rate_ctrl->min_qp = params->minimal_qp;
-	misc_rate_ctrl->basic_unit_size = 0;
-	vaUnmapBuffer(va_dpy, rc_param_buf);
-
-	render_id[0] = seq_param_buf;
-	render_id[1] = rc_param_buf;
-
-	va_status = vaRenderPicture(va_dpy, context_id, &render_id[0], 2);
+	va_status = vaRenderPicture(va_dpy, context_id, &seq_param_buf, 1);
 	CHECK_VASTATUS(va_status, "vaRenderPicture");;
 
+	render_ratecontrol(params);
+
 	if (misc_priv_type != 0) {
 		va_status = vaCreateBuffer(va_dpy, context_id,
 					   VAEncMiscParameterBufferType,
@@ -1421,7 +1440,6 @@ static int render_sequence(struct encoder_params_s *params)
 		vaDestroyBuffer(va_dpy, misc_param_tmpbuf);
 	}
 	vaDestroyBuffer(va_dpy, seq_param_buf);
-	vaDestroyBuffer(va_dpy, rc_param_buf);
 
 	return 0;
 }
@@ -1795,6 +1813,7 @@ static int save_codeddata(struct encoder_params_s *params,
 		frame_size = encoder_output_codeddata(params, buf_list->buf, buf_list->size, frame_type);
 		buf_list = (VACodedBufferSegment *) buf_list->next;
 	}
+	encoder_output_frame_complete(params, frame_type, encode_order);
 	vaUnmapBuffer(va_dpy, coded_buf[display_order % SURFACE_NUM]);
 
 	if (params->csv_fp) {
@@ -1911,88 +1930,32 @@ static void *storage_task_thread(void *t)
 	return 0;
 }
 
-/* Map a surface, shift the inbuf pixels into it */
-static void upload_yuv_to_surface(unsigned char *inbuf, VASurfaceID surface_id,
+/* Map a surface, shift the inbuf pixels into it, gathering
+ * statistics along the way if st is not NULL, then add any OSD.
+ */
+static void upload_yuv_to_surface(struct encoder_params_s *params,
+				  unsigned char *inbuf, VASurfaceID surface_id,
 				  int picture_width,
-				  int picture_height)
+				  int picture_height,
+				  struct frame_stats_s *st)
 {
 	VAImage image;
 	VAStatus va_status;
 	void *pbuffer = NULL;
-	unsigned char *psrc = inbuf;
 	unsigned char *pdst = NULL;
-	unsigned char *dst_y, *dst_uv;
-	unsigned char *dst_uv_line = NULL;
-	int i, j, pw;
-	
+
 	va_status = vaDeriveImage(va_dpy, surface_id, &image);
 	va_status = vaMapBuffer(va_dpy, image.buf, &pbuffer);
 	pdst = (unsigned char *)pbuffer;
-	dst_uv_line = pdst + image.offsets[1];
-	dst_uv = dst_uv_line;
-
-	/* For each pair of lines */
-	pw = picture_width / 2;
-	for (i = 0; i < picture_height; i += 2) {
-		dst_y = (pdst + image.offsets[0]) + i * image.pitches[0];
-#if 0
-		/* Switch to single DWORD reads/writes to try and improve
-		 * memory performance. Sadly, the entire code saved < 1%
-		 * and has a few visual glitches. Abandoning this.
-		 */
-		unsigned int *pdst_y = (unsigned int *)dst_y;
-		unsigned int *pdst_uv = (unsigned int *)dst_uv;
-		for (j = 0; j < pw / 2; ++j) {
-			dw1 = *dw++;
-			dw2 = *dw++;
-			dw3 = *dw;
-
-			t  = dw1 & 0xff;
-			t |= ((dw1 & 0x00ff0000) >> 8);
-			t |= (dw2 & 0xff) << 16;
-			t |= (dw2 & 0x00ff0000) << 8;
-
-			z  = ((dw1 & 0xff00) >> 8);
-			z |= ((dw1 & 0xff000000) >> 16);
-			z |= ((dw2 & 0xff00) << 8);
-			z |= (dw2 & 0xff000000);
-
-			*(pdst_y++) = t;
-			*(pdst_uv++) = z;
-		}
-
-		dst_y = (pdst + image.offsets[0]) + (i + 1) * image.pitches[0];
-		pdst_y = (unsigned int *)dst_y;
-		for (j = 0; j < pw / 2; ++j) {
-
-			t  = dw2 & 0xff;
-			t |= ((dw2 & 0x00ff0000) >> 8);
-			t |= (dw3 & 0xff) << 16;
-			t |= (dw3 & 0x00ff0000) << 8;
-
-			*(pdst_y++) = t;
-
-			dw += 2;
-		}
-#endif
-		for (j = 0; j < pw; ++j) {
-			*(dst_y++)  = psrc[0];	// y1;
-			*(dst_uv++) = psrc[1];	// u;
-			*(dst_y++)  = psrc[2];	// y1;
-			*(dst_uv++) = psrc[3];	// v;
-			psrc += 4;
-		}
 
-		dst_y = (pdst + image.offsets[0]) + (i + 1) * image.pitches[0];
-		for (j = 0; j < pw; ++j) {
-			*(dst_y++) = psrc[0];	//y1;
-			*(dst_y++) = psrc[2];	//y2;
-			psrc += 4;
-		}
+	convert_yuy2_to_nv12(inbuf, picture_width * 2,
+		pdst + image.offsets[0], image.pitches[0],
+		pdst + image.offsets[1], image.pitches[1],
+		picture_width, picture_height, st);
 
-		dst_uv_line += image.pitches[1];
-		dst_uv = dst_uv_line;
-	}
+	unsigned char *planes[] = { pdst + image.offsets[0], pdst + image.offsets[1] };
+	unsigned int strides[] = { image.pitches[0], image.pitches[1] };
+	encoder_frame_add_osd(params, EDF_NV12, planes, strides);
 
 	va_status = vaUnmapBuffer(va_dpy, image.buf);
 	CHECK_VASTATUS(va_status, "vaUnmapBuffer");
@@ -2013,16 +1976,17 @@ static int vaapi_encode_frame_helper(struct encoder_params_s *params, unsigned c
 		 */
 		if (IS_YUY2(params)) {
 			for (i = 0; i < SURFACE_NUM; i++)
-				upload_yuv_to_surface(frame, src_surface[i], params->width, params->height);
+				upload_yuv_to_surface(params, frame, src_surface[i], params->width, params->height,
+					i == 0 ? encoder_frame_stats(params) : NULL);
 		}
 		if (IS_BGRX(params)) {
 			for (i = 0; i < SURFACE_NUM; i++)
-				va_status = csc_convert_rgbdata_to_yuv(&params->csc_ctx, frame, src_surface[i]);
+				va_status = csc_convert_rgbdata_to_yuv(&params->csc_ctx, frame, src_surface[i], params);
 		}
 	} else {
 		if (IS_BGRX(params)) {
 			/* CSC convert pincoming BGRX frame to yuv output surface */
-			va_status = csc_convert_rgbdata_to_yuv(&params->csc_ctx, frame, src_surface[current_slot]);
+			va_status = csc_convert_rgbdata_to_yuv(&params->csc_ctx, frame, src_surface[current_slot], params);
 		} else
 		if (IS_YUY2(params)) {
 			/* TODO: We probably don't need to specifically upload non de-interlaced content to the
@@ -2031,9 +1995,11 @@ static int vaapi_encode_frame_helper(struct encoder_params_s *params, unsigned c
 			 * IE. Most likely we should always upload to the prior slot.
 			 */
 			if (vpp_deinterlace_mode > 0)
-				upload_yuv_to_surface(frame, src_surface[prior_slot()], params->width, params->height);
+				upload_yuv_to_surface(params, frame, src_surface[prior_slot()], params->width, params->height,
+					encoder_frame_stats(params));
 			else
-				upload_yuv_to_surface(frame, src_surface[current_slot], params->width, params->height);
+				upload_yuv_to_surface(params, frame, src_surface[current_slot], params->width, params->height,
+					encoder_frame_stats(params));
 		}
 	}
 
@@ -2047,11 +2013,28 @@ static int vaapi_encode_frame_helper(struct encoder_params_s *params, unsigned c
 		vpp_perform_deinterlace(src_surface[prior_slot()], params->width, params->height, src_surface[current_slot]);
 	}
 
-	encoding2display_order(current_frame_encoding,
-			       params->intra_period,
-			       params->intra_idr_period,
-			       params->ip_period,
-			       &current_frame_display, &current_frame_type);
+	/* Frame is in our surfaces, let the core analyze it and make GOP decisions */
+	encoder_frame_converted(params, frame);
+
+	if (params->scenecut_threshold) {
+		/* The encoder core places IDRs (scene cuts, adaptive GOP) at its
+		 * intra_period cadence. Run the frame sequence relative to the last
+		 * forced IDR with no I/IDR period of our own.
+		 * Only valid for ip_period 1, see vaapi_init().
+		 */
+		if (params->force_idr)
+			current_GOP_encoding = current_frame_encoding;
+
+		encoding2display_order(current_frame_encoding - current_GOP_encoding,
+				       0, 0, 1,
+				       &current_frame_display, &current_frame_type);
+		current_frame_display += current_GOP_encoding;
+	} else
+		encoding2display_order(current_frame_encoding,
+				       params->intra_period,
+				       params->intra_idr_period,
+				       params->ip_period,
+				       &current_frame_display, &current_frame_type);
 
 	if (current_frame_type == FRAME_IDR) {
 		numShortTerm = 0;
@@ -2079,6 +2062,8 @@ static int vaapi_encode_frame_helper(struct encoder_params_s *params, unsigned c
 		render_hrd(params);
 	} else {
 		//render_sequence(params);
+		if (rc_update)
+			render_ratecontrol(params);
 		render_picture(params);
 		if (params->rc_mode == VA_RC_CBR)
 		    render_packedsei(params);
@@ -2139,12 +2124,14 @@ static int vaapi_init(struct encoder_params_s *params)
 	params->intra_period = params->frame_rate;
 	params->intra_idr_period = params->frame_rate * 2;
 
-	vpp_deinterlace_mode = params->deinterlacemode;
+	/* The encoder core deinterlaces on the CPU if asked to */
+	vpp_deinterlace_mode = params->deinterlace_cpu ? 0 : params->deinterlacemode;
 	h264_entropy_mode = params->h264_entropy_mode;
 
 	params->frame_count = params->frame_rate * 2;
 
 	current_frame_encoding = 0;
+	current_GOP_encoding = 0;
 	encode_syncmode = 0;
 
 	/* ready for encoding */
@@ -2168,6 +2155,12 @@ static int vaapi_init(struct encoder_params_s *params)
 		exit(1);
 	}
 
+	/* Forcing IDRs mid sequence would orphan pending B frames */
+	if (params->scenecut_threshold && (params->ip_period != 1)) {
+		printf("Scenecut requires ip_period 1, disabling scene change detection\n");
+		params->scenecut_threshold = 0;
+	}
+
 	setup_encode();
 
 	if (IS_BGRX(params))
@@ -2226,6 +2219,18 @@ static enum fourcc_e supportedColorspaces[] = {
 	0, /* terminator */
 };
 
+/* HRD and SEI pick the new rate up with the next frame, the SPS VUI at the next IDR */
+static int vaapi_set_bitrate(struct encoder_params_s *params, unsigned int bps)
+{
+	if (params->rc_mode == VA_RC_CQP)
+		return -1;
+
+	params->frame_bitrate = bps;
+	rc_update = 1;
+
+	return 0;
+}
+
 struct encoder_operations_s vaapi_ops = 
 {
 	.type		= EM_VAAPI,
@@ -2235,5 +2240,6 @@ struct encoder_operations_s vaapi_ops =
         .set_defaults	= vaapi_set_defaults,
         .close		= vaapi_close,
         .encode_frame	= vaapi_encode_frame,
+        .set_bitrate	= vaapi_set_bitrate,
 };
 
@@ -0,0 +1,146 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "workers.h"
+
+static pthread_mutex_t workers_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t workers_start = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t workers_done = PTHREAD_COND_INITIALIZER;
+static pthread_t workers_thread[WORKERS_MAX];
+static int workers_total = 1;		/* Including the caller */
+static int workers_terminate = 0;
+static unsigned int workers_generation = 0;
+static int workers_pending = 0;
+static workers_func_t workers_func;
+static void *workers_arg;
+
+static void *workers_thread_func(void *p)
+{
+	int band = (int)(long)p;
+	unsigned int generation = 0;
+
+	while (1) {
+		pthread_mutex_lock(&workers_mutex);
+		while ((workers_generation == generation) && !workers_terminate)
+			pthread_cond_wait(&workers_start, &workers_mutex);
+		if (workers_terminate) {
+			pthread_mutex_unlock(&workers_mutex);
+			break;
+		}
+		generation = workers_generation;
+		pthread_mutex_unlock(&workers_mutex);
+
+		workers_func(workers_arg, band, workers_total);
+
+		pthread_mutex_lock(&workers_mutex);
+		if (--workers_pending == 0)
+			pthread_cond_signal(&workers_done);
+		pthread_mutex_unlock(&workers_mutex);
+	}
+
+	return 0;
+}
+
+int workers_init(int count)
+{
+	if (workers_total > 1)
+		return 0;	/* Already running, shared by all stages */
+
+	if (count <= 0)
+		count = sysconf(_SC_NPROCESSORS_ONLN);
+	if (count > WORKERS_MAX)
+		count = WORKERS_MAX;
+	if (count < 1)
+		count = 1;
+
+	workers_terminate = 0;
+	workers_total = 1;
+	for (int i = 1; i < count; i++) {
+		if (pthread_create(&workers_thread[i], NULL, workers_thread_func, (void *)(long)i) != 0) {
+			printf("Unable to create worker thread %d\n", i);
+			break;
+		}
+		workers_total++;
+	}
+
+	printf("%s() %d thread(s)\n", __func__, workers_total);
+	return 0;
+}
+
+void workers_free()
+{
+	pthread_mutex_lock(&workers_mutex);
+	workers_terminate = 1;
+	pthread_cond_broadcast(&workers_start);
+	pthread_mutex_unlock(&workers_mutex);
+
+	for (int i = 1; i < workers_total; i++)
+		pthread_join(workers_thread[i], NULL);
+
+	workers_total = 1;
+}
+
+int workers_count()
+{
+	return workers_total;
+}
+
+void workers_run(workers_func_t func, void *arg)
+{
+	if (workers_total == 1) {
+		func(arg, 0, 1);
+		return;
+	}
+
+	pthread_mutex_lock(&workers_mutex);
+	workers_func = func;
+	workers_arg = arg;
+	workers_pending = workers_total - 1;
+	workers_generation++;
+	pthread_cond_broadcast(&workers_start);
+	pthread_mutex_unlock(&workers_mutex);
+
+	func(arg, 0, workers_total);
+
+	pthread_mutex_lock(&workers_mutex);
+	while (workers_pending)
+		pthread_cond_wait(&workers_done, &workers_mutex);
+	pthread_mutex_unlock(&workers_mutex);
+}
+
+void workers_band(int band, int bands, int lines, int align, int *first, int *last)
+{
+	int units = lines / align;
+
+	*first = ((units * band) / bands) * align;
+	*last = ((units * (band + 1)) / bands) * align;
+	if (band == bands - 1)
+		*last = lines;
+}
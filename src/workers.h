@@ -0,0 +1,48 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef WORKERS_H
+#define WORKERS_H
+
+/* A small pool of threads for splitting per frame pixel work into
+ * horizontal bands. The calling thread always processes band 0.
+ */
+
+#define WORKERS_MAX 16
+
+/* Process band 'band' of 'bands' */
+typedef void (*workers_func_t)(void *arg, int band, int bands);
+
+int  workers_init(int count);	/* 0 = one per online cpu */
+void workers_free();
+int  workers_count();
+
+/* Run func across all bands, returns when every band is complete. */
+void workers_run(workers_func_t func, void *arg);
+
+/* Helper, split 'lines' into bands with starts aligned to 'align' lines. */
+void workers_band(int band, int bands, int lines, int align, int *first, int *last);
+
+#endif
@@ -4,11 +4,6 @@ static int x264_init(struct encoder_params_s *params)
 {
 	printf("%s()\n", __func__);
 
-	if (params->deinterlacemode) {
-		printf("%s() deinterlacemode not suppported\n", __func__);
-		exit(1);
-	}
-
 	struct x264_vars_s *x264_vars = &params->x264_vars;
 	x264_param_t *x264Param = &params->x264_vars.x264_params;
 
@@ -24,8 +19,19 @@ static int x264_init(struct encoder_params_s *params)
 	x264Param->rc.f_rf_constant = 25;
 	x264Param->rc.f_rf_constant_max = 35;
 	x264Param->rc.i_bitrate = params->frame_bitrate / 1000; /* Kbps */
+	if (params->bitrate_max) {
+		/* Adaptive, CRF capped by a one second VBV we can move at runtime */
+		x264Param->rc.i_vbv_max_bitrate = params->frame_bitrate / 1000;
+		x264Param->rc.i_vbv_buffer_size = params->frame_bitrate / 1000;
+	}
 	x264Param->b_repeat_headers = 1;
 	x264Param->b_annexb = 1;
+	if (params->scenecut_threshold) {
+		/* The encoder core places IDRs, see encoder_frame_gop_decide() */
+		x264Param->b_intra_refresh = 0;
+		x264Param->i_keyint_max = X264_KEYINT_MAX_INFINITE;
+		x264Param->i_scenecut_threshold = 0;
+	}
 	x264_param_apply_profile(x264Param, "baseline");
 	/* Level idc, bitrate multiplier not supported. */
 	/* h264_profile is intentially being ignored and we're useing baseline for load CPU usage. */
@@ -61,6 +67,42 @@ static int x264_set_defaults(struct encoder_params_s *p)
 	return 0;
 }
 
+static int x264_set_bitrate(struct encoder_params_s *params, unsigned int bps)
+{
+	x264_param_t *x264Param = &params->x264_vars.x264_params;
+
+	/* x264 only accepts VBV changes when it was opened with VBV */
+	if (x264Param->rc.i_vbv_max_bitrate == 0)
+		return -1;
+
+	x264Param->rc.i_bitrate = bps / 1000;
+	x264Param->rc.i_vbv_max_bitrate = bps / 1000;
+	x264Param->rc.i_vbv_buffer_size = bps / 1000;
+	if (x264_encoder_reconfig(params->x264_vars.encoder, x264Param) < 0) {
+		printf("x264 rejected bitrate %d\n", bps);
+		return -1;
+	}
+	params->frame_bitrate = bps;
+
+	return 0;
+}
+
+/* Convert x264 slice types into our own frame types */
+static int x264_frame_type(x264_picture_t *pic)
+{
+	switch (pic->i_type) {
+	case X264_TYPE_IDR:
+		return FRAME_IDR;
+	case X264_TYPE_I:
+		return FRAME_I;
+	case X264_TYPE_B:
+	case X264_TYPE_BREF:
+		return FRAME_B;
+	default:
+		return FRAME_P;
+	}
+}
+
 static int x264_encode_frame(struct encoder_params_s *params, unsigned char *inbuf)
 {
 	/* Colorspace convert the frame and encode it */
@@ -76,12 +118,12 @@ static int x264_encode_frame(struct encoder_params_s *params, unsigned char *inb
 	unsigned char *z = x264_vars->img->plane[2];
 
 	if (IS_YUY2(params)) {
-		/* Convert YUY2 to I420. */
-		YUY2ToI420(inbuf, params->width * 2,
+		/* Convert YUY2 to I420, gathering statistics in the same pass. */
+		convert_yuy2_to_i420(inbuf, params->width * 2,
 			x264_vars->img->plane[0], x264_vars->img->i_stride[0],
 			x264_vars->img->plane[1], x264_vars->img->i_stride[1],
 			x264_vars->img->plane[2], x264_vars->img->i_stride[2],
-			params->width, params->height);
+			params->width, params->height, encoder_frame_stats(params));
 	} else
 	if (IS_BGRX(params)) {
 		/* Convert ARGB to I420. */
@@ -96,11 +138,33 @@ static int x264_encode_frame(struct encoder_params_s *params, unsigned char *inb
 		unsigned char *b = a + (params->width * params->height);
 		unsigned char *c = b + (params->width * params->height / 4);
 
-		x264_vars->img->plane[0] = a;
-		x264_vars->img->plane[1] = b;
-		x264_vars->img->plane[2] = c;
+		if (params->enable_osd) {
+			/* The OSD needs a copy of its own, the input is treated as read-only */
+			I420Copy(a, params->width, b, params->width / 2, c, params->width / 2,
+				x264_vars->img->plane[0], x264_vars->img->i_stride[0],
+				x264_vars->img->plane[1], x264_vars->img->i_stride[1],
+				x264_vars->img->plane[2], x264_vars->img->i_stride[2],
+				params->width, params->height);
+		} else {
+			x264_vars->img->plane[0] = a;
+			x264_vars->img->plane[1] = b;
+			x264_vars->img->plane[2] = c;
+		}
 	}
 
+	/* Only the YUY2 conversion is ours, analyze the luma of the others separately. */
+	if (!IS_YUY2(params) && encoder_frame_stats(params))
+		convert_analyze_luma(x264_vars->img->plane[0], x264_vars->img->i_stride[0],
+			params->width, params->height, encoder_frame_stats(params));
+
+	encoder_frame_converted(params, inbuf);
+
+	unsigned int strides[] = { x264_vars->img->i_stride[0], x264_vars->img->i_stride[1], x264_vars->img->i_stride[2] };
+	encoder_frame_add_osd(params, EDF_I420, x264_vars->img->plane, strides);
+
+	x264_vars->pic_in.i_type = params->force_idr ? X264_TYPE_IDR : X264_TYPE_AUTO;
+	x264_vars->pic_in.i_pts = params->frames_processed;
+
 	/* Encode image */
 	x264_nal_t *nals = 0;
 	int i_nals = 0;
@@ -118,10 +182,13 @@ static int x264_encode_frame(struct encoder_params_s *params, unsigned char *inb
 		x264_vars->nalcount, x264_vars->bytecount, elapsedMS,
 		frame_size);
 #endif
+	int frame_type = x264_frame_type(&x264_vars->pic_out);
 	for (int i = 0; i < i_nals; i++) {
 		x264_nal_t *nal = nals + i;
-		encoder_output_codeddata(params, nal->p_payload, nal->i_payload, 0);
+		encoder_output_codeddata(params, nal->p_payload, nal->i_payload, frame_type);
 	}
+	if (i_nals)
+		encoder_output_frame_complete(params, frame_type, x264_vars->pic_out.i_pts);
 
 	x264_vars->img->plane[0] = x;
 	x264_vars->img->plane[1] = y;
@@ -146,4 +213,5 @@ struct encoder_operations_s x264_ops =
         .set_defaults	= x264_set_defaults,
         .close		= x264_close,
         .encode_frame	= x264_encode_frame,
+        .set_bitrate	= x264_set_bitrate,
 };